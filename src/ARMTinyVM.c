@@ -1,5 +1,11 @@
 ﻿#include "ARMTinyVM.h"
 #include "instruction_set.h"
+#ifdef ARMTINYVM_HISTOGRAM
+#include "histogram.h"
+#endif // ARMTINYVM_HISTOGRAM
+#ifdef ARMTINYVM_HEATMAP
+#include "heatmap.h"
+#endif // ARMTINYVM_HEATMAP
 #include <string.h>
 #include <stdio.h>
 
@@ -31,18 +37,147 @@ void store(VM_instance* vm, uint32_t addr, uint32_t value, uint8_t bytes);
 void compareSetCV(VM_instance* vm, uint32_t a, uint32_t b);
 void compareSetC(VM_instance* vm, uint32_t a, uint32_t b);
 void compareSetNZ(VM_instance* vm, uint32_t value);
+void endBlock(VM_instance* vm);
+void enterInterrupt(VM_instance* vm, uint8_t number);
+void returnFromInterrupt(VM_instance* vm);
 
 
+// The interrupt queue's accesses, which fall back to plain loads and stores without atomics
+#ifdef ARMTINYVM_NO_ATOMICS
+#define queue_init(obj, value)          (*(obj) = (value))
+#define queue_load(obj, order)          (*(obj))
+#define queue_store(obj, value, order)  (*(obj) = (value))
+#define queue_claim(obj, expected)      ((*(obj) = *(expected) + 1), true)
+#else
+#define queue_init(obj, value)          atomic_init((obj), (value))
+#define queue_load(obj, order)          atomic_load_explicit((obj), (order))
+#define queue_store(obj, value, order)  atomic_store_explicit((obj), (value), (order))
+#define queue_claim(obj, expected)      atomic_compare_exchange_weak_explicit((obj), (expected), *(expected) + 1, \
+                                                                              memory_order_relaxed, memory_order_relaxed)
+#endif // ARMTINYVM_NO_ATOMICS
+
 #define i32_sign(n) (((n) & 0x80000000) >> 31)
 #define i16_sign(n) (((n) & 0x8000) >> 15)
 #define i8_sign(n)  (((n) & 0x80) >> 7)
 
-#if __has_include(<avr/version.h>)
+// The size profile (ARMTINYVM_SIZE_PROFILE) is for small microcontrollers: it leaves the trace out completely, decodes
+// with a table kept in program memory rather than a chain of comparisons, and shares the operand field extraction
+// between handlers
+#ifndef ARMTINYVM_TRACE_LEVEL
+#ifdef ARMTINYVM_SIZE_PROFILE
+#define ARMTINYVM_TRACE_LEVEL VM_TRACE_OFF
+#else
+#define ARMTINYVM_TRACE_LEVEL VM_TRACE_FULL
+#endif // ARMTINYVM_SIZE_PROFILE
+#endif // ARMTINYVM_TRACE_LEVEL
+
+// The trace: printf__ for each instruction executed, printf_error__ for invalid instructions, and printf_full__ for the
+// detail of what an instruction did to the stack and flags. Each is compiled out completely if its level is above
+// ARMTINYVM_TRACE_LEVEL, and otherwise only printed while the level set by VM_setTraceLevel is high enough. Off the
+// microcontroller, the trace goes through the log writer, so that it doesn't hold up the VM if one is running.
+#if (ARMTINYVM_TRACE_LEVEL > VM_TRACE_OFF) && __has_include(<avr/version.h>)
 #include <serial_io.h>
-#define printf__(format, ...) printf_P_(SIO_LOG_DEBUG, PSTR(format), ##__VA_ARGS__)
+#define trace_output(format, ...) printf_P_(SIO_LOG_DEBUG, PSTR(format), ##__VA_ARGS__)
+#elif ARMTINYVM_TRACE_LEVEL > VM_TRACE_OFF
+#include "logwriter.h"
+#define trace_output(format, ...) LogWriter_printf(format, ##__VA_ARGS__)
+#else
+#define trace_output(format, ...) printf(format, ##__VA_ARGS__)
+#endif
+#define trace_at(level, format, ...) \
+        do { if (vmTraceLevel >= (level)) { trace_output(format, ##__VA_ARGS__); } } while (0)
+// The arguments of a trace which has been compiled out are never evaluated, but still count as used
+#define trace_none(format, ...) ((void) sizeof(printf(format, ##__VA_ARGS__)))
+
+#if ARMTINYVM_TRACE_LEVEL >= VM_TRACE_ERRORS
+#define printf_error__(format, ...) trace_at(VM_TRACE_ERRORS, format, ##__VA_ARGS__)
+#else
+#define printf_error__ trace_none
+#endif
+#if ARMTINYVM_TRACE_LEVEL >= VM_TRACE_INSTRUCTIONS
+#define printf__(format, ...) trace_at(VM_TRACE_INSTRUCTIONS, format, ##__VA_ARGS__)
+#else
+#define printf__ trace_none
+#endif
+#if ARMTINYVM_TRACE_LEVEL >= VM_TRACE_FULL
+#define printf_full__(format, ...) trace_at(VM_TRACE_FULL, format, ##__VA_ARGS__)
+#else
+#define printf_full__ trace_none
+#endif
+
+uint8_t vmTraceLevel = ARMTINYVM_TRACE_LEVEL;
+
+// The instruction histogram: count__ adds one to sub-operation `subOp` of instruction format `format`, if the VM has a
+// histogram attached. Without ARMTINYVM_HISTOGRAM it's compiled out completely.
+#ifdef ARMTINYVM_HISTOGRAM
+#define count__(vm, format, subOp) \
+        do { if ((vm)->histogram) { (vm)->histogram->counts[format][subOp]++; } } while (0)
 #else
-#define printf__ printf
-#endif // __has_include(<avr/version.h>)
+#define count__(vm, format, subOp) ((void) 0)
+#endif // ARMTINYVM_HISTOGRAM
+
+// The memory heatmap: heat__ counts an access of `kind` to `address`, and stack__ notes how low the stack pointer has
+// got after it has moved down, if the VM has a heatmap attached. Without ARMTINYVM_HEATMAP they're compiled out.
+#ifdef ARMTINYVM_HEATMAP
+#define heat__(vm, address, kind) \
+        do { if ((vm)->heatmap) { Heatmap_count((vm)->heatmap, (address), (kind)); } } while (0)
+#define stack__(vm) \
+        do { \
+            if ((vm)->heatmap && (vm_stack_pointer(vm) < (vm)->heatmap->lowestStackPointer)) { \
+                (vm)->heatmap->lowestStackPointer = vm_stack_pointer(vm); \
+            } \
+        } while (0)
+#else
+#define heat__(vm, address, kind) ((void) 0)
+#define stack__(vm) ((void) 0)
+#endif // ARMTINYVM_HEATMAP
+
+// Reports a branch from the instruction at `from` to wherever the PC now is, if anything has asked to be told
+#define branch__(vm, from, kind) \
+        do { if ((vm)->branched) { (vm)->branched((vm), (from), vm_program_counter(vm), (kind)); } } while (0)
+
+#ifdef ARMTINYVM_SIZE_PROFILE
+typedef void (*tliHandler)(VM_instance* vm, uint16_t instruction);
+
+#if __has_include(<avr/pgmspace.h>)
+#include <avr/pgmspace.h>
+#define read_decode_byte(addr)    pgm_read_byte(addr)
+#define read_decode_handler(addr) ((tliHandler) pgm_read_word(addr))
+#else
+#define PROGMEM
+#define read_decode_byte(addr)    (*(addr))
+#define read_decode_handler(addr) (*(addr))
+#endif // __has_include(<avr/pgmspace.h>)
+
+// The handler for each first byte, numbered as in instruction_set.h, or 0 if there isn't one. The conditions are
+// tested in the same order as in VM_executeSingleInstruction, so the same special cases win.
+#define decode_class(b) (istl_move_shifted_reg(b) ? 1 : istl_add_subtract(b) ? 2 : istl_mov_cmp_add_sub_imm(b) ? 3 : \
+        istl_alu_operations(b) ? 4 : istl_hi_reg_operations(b) ? 5 : istl_pc_relative_load(b) ? 6 :                 \
+        istl_load_with_reg_offset(b) ? 7 : istl_load_sgn_ext_byte(b) ? 8 : istl_load_imm_offset(b) ? 9 :             \
+        istl_load_halfword(b) ? 10 : istl_sp_relative_load(b) ? 11 : istl_load_address(b) ? 12 :                     \
+        istl_add_offset_to_sp(b) ? 13 : istl_push_pop_registers(b) ? 14 : istl_multiple_load_store(b) ? 15 :         \
+        istl_conditional_branch(b) ? 16 : istl_software_interrupt(b) ? 17 : istl_unconditional_branch(b) ? 18 :      \
+        istl_long_branch_w_link(b) ? 19 : 0)
+#define decode_row(b) decode_class((b) + 0),  decode_class((b) + 1),  decode_class((b) + 2),  decode_class((b) + 3),  \
+                      decode_class((b) + 4),  decode_class((b) + 5),  decode_class((b) + 6),  decode_class((b) + 7),  \
+                      decode_class((b) + 8),  decode_class((b) + 9),  decode_class((b) + 10), decode_class((b) + 11), \
+                      decode_class((b) + 12), decode_class((b) + 13), decode_class((b) + 14), decode_class((b) + 15)
+
+const uint8_t decodeTable[256] PROGMEM = {
+        decode_row(0x00), decode_row(0x10), decode_row(0x20), decode_row(0x30),
+        decode_row(0x40), decode_row(0x50), decode_row(0x60), decode_row(0x70),
+        decode_row(0x80), decode_row(0x90), decode_row(0xA0), decode_row(0xB0),
+        decode_row(0xC0), decode_row(0xD0), decode_row(0xE0), decode_row(0xF0)
+};
+
+const tliHandler decodeHandlers[20] PROGMEM = {
+        NULL, tliMoveShiftedRegister, tliAddSubtract, tliMovCmpAddSubImmediate, tliALUOperations,
+        tliHighRegOperations, tliPCRelativeLoad, tliLoadWithRegOffset, tliLoadStoreSignExtendedByte,
+        tliLoadStoreWithImmediateOffset, tliLoadStoreHalfWord, tliSPRelativeLoad, tliLoadAddress, tliAddOffsetToSP,
+        tliPushPopRegisters, tliMultipleLoadStore, tliConditionalBranch, tliSoftwareInterrupt, tliUnconditionalBranch,
+        tliLongBranchWithLink
+};
+#endif // ARMTINYVM_SIZE_PROFILE
 
 // PUBLIC FUNCTIONS
 
@@ -55,9 +190,9 @@ void compareSetNZ(VM_instance* vm, uint32_t value);
  * @param initialProgramCounter
  * @return
  */
-VM_instance VM_new(uint8_t (*readByte)(uint32_t addr),
-                   void (*writeByte)(uint32_t addr, uint8_t value),
-                   void (*softwareInterrupt)(VM_instance* vm, uint8_t number),
+VM_instance VM_new(uint8_t (*readByte)(VM_instance* vm, uint32_t addr),
+                   void (*writeByte)(VM_instance* vm, uint32_t addr, uint8_t value),
+                   VM_swiResult (*softwareInterrupt)(VM_instance* vm, uint8_t number),
                    uint32_t initialStackPointer,
                    uint32_t initialProgramCounter)
 {
@@ -70,6 +205,23 @@ VM_instance VM_new(uint8_t (*readByte)(uint32_t addr),
     ret.writeByte = writeByte;
     ret.softwareInterrupt = softwareInterrupt;
     ret.finished = false;
+    ret.waiting = false;
+    ret.context = NULL;
+    ret.interrupts = NULL;
+    ret.instructionCount = 0;
+    ret.deadline = VM_NO_DEADLINE;
+    ret.runUntil = 0;
+    ret.deadlineReached = NULL;
+    ret.instructionExecuted = NULL;
+    ret.instrumentation = NULL;
+    ret.branched = NULL;
+    ret.branchInstrumentation = NULL;
+#ifdef ARMTINYVM_HEATMAP
+    ret.heatmap = NULL;
+#endif // ARMTINYVM_HEATMAP
+#ifdef ARMTINYVM_HISTOGRAM
+    ret.histogram = NULL;
+#endif // ARMTINYVM_HISTOGRAM
 
     return ret;
 }
@@ -83,21 +235,33 @@ VM_instance VM_new(uint8_t (*readByte)(uint32_t addr),
 void VM_executeSingleInstruction(VM_instance* vm)
 {
     // Cache the readByte function
-    uint8_t (*const readByte)(uint32_t addr) = vm->readByte;
+    uint8_t (*const readByte)(VM_instance* vm, uint32_t addr) = vm->readByte;
 
     // Get the 16-bit instruction
     // They're stored little-endian, so the lowest byte is the least significant bit
-    uint16_t instruction = readByte(vm_program_counter(vm));
-    instruction += readByte(vm_program_counter(vm)+1UL) << 8UL;
+    uint32_t address = vm_program_counter(vm);
+    uint16_t instruction = readByte(vm, address);
+    instruction += readByte(vm, address+1UL) << 8UL;
+    heat__(vm, address, HEATMAP_FETCH);
 
-    printf__("0x%04x@0x%08lx : ", instruction, (unsigned long) vm_program_counter(vm));
+    printf__("0x%04x@0x%08lx : ", instruction, (unsigned long) address);
 
     // Now we have the instruction, we increment the program counter by 2 to go to the next instruction
     vm_program_counter(vm) += 2;
+    vm->instructionCount++;
 
     // Decode the instruction and act accordingly
     uint8_t instrFirstByte = (instruction & 0xFF00) >> 8;
     void (*func)(VM_instance*, uint16_t);
+#ifdef ARMTINYVM_SIZE_PROFILE
+    uint8_t instrClass = read_decode_byte(&decodeTable[instrFirstByte]);
+    if (instrClass == 0) {
+        count__(vm, 0, 0);
+        vm->finished = true;
+        return;
+    }
+    func = read_decode_handler(&decodeHandlers[instrClass]);
+#else
     if (istl_move_shifted_reg(instrFirstByte)) {
         func = tliMoveShiftedRegister;
     } else if (istl_add_subtract(instrFirstByte)) {
@@ -138,43 +302,84 @@ void VM_executeSingleInstruction(VM_instance* vm)
         func = tliLongBranchWithLink;
     } else {
         // No matching operation
-        printf__("UNKNOWN INSTRUCTION %x\n", instruction);
+        printf_error__("UNKNOWN INSTRUCTION %x\n", instruction);
+        count__(vm, 0, 0);
         vm->finished = true;
         return;
     }
+#endif // ARMTINYVM_SIZE_PROFILE
 
     // Call the chosen function
     func(vm, instruction);
+
+    if (vm->instructionExecuted) {
+        vm->instructionExecuted(vm, address, instruction);
+    }
 }
 
 
 /**
  * Executes up to `maxInstructions` instructions, and returns the number which were actually executed. It will be
- * smaller than `maxInstructions` if the program finishes before then.
+ * smaller than `maxInstructions` if the program finishes before then, or if the host asks it to wait.
+ *
+ * If the VM reaches its deadline, `deadlineReached` is called in between instructions. The deadline is only compared
+ * against when the run stops, so it costs nothing per instruction.
  * @param vm
  * @param maxInstructions
  * @return
  */
 uint32_t VM_executeNInstructions(VM_instance* vm, uint32_t maxInstructions)
 {
-    uint32_t i;
-    for (i = 0; i < maxInstructions; i++) {
-        // Has the program completed?
-        if (vm->finished) {
-            return i;
+    uint64_t start = vm->instructionCount;
+    uint64_t end = start + maxInstructions;
+
+    while (vm->instructionCount < end) {
+        // Run until the deadline or the end, whichever is sooner
+        // The deadline can be brought forward while running, by VM_setDeadline
+        vm->runUntil = (vm->deadline < end) ? vm->deadline : end;
+        while (vm->instructionCount < vm->runUntil) {
+            // Has the program completed, or is it waiting on the host?
+            if (vm->finished || vm->waiting) {
+                return (uint32_t) (vm->instructionCount - start);
+            }
+
+            // It hasn't completed
+            // Run a single instruction
+            VM_executeSingleInstruction(vm);
         }
 
-        // It hasn't completed
-        // Run a single instruction
-        VM_executeSingleInstruction(vm);
+        if (vm->instructionCount >= vm->deadline) {
+            // Clear the deadline first, so that the handler can set the next one
+            vm->deadline = VM_NO_DEADLINE;
+            if (vm->deadlineReached) {
+                vm->deadlineReached(vm);
+            }
+        }
     }
 
-    return i;
+    // The host may have moved the count on while the VM was idle (see VM_setDeadline)
+    return (vm->instructionCount - start < maxInstructions) ? (uint32_t) (vm->instructionCount - start)
+                                                             : maxInstructions;
+}
+
+
+/**
+ * Sets the instruction count at which `deadlineReached` will next be called. Can be called from inside a callback
+ * (e.g. a memory-mapped peripheral) while the VM is running, and takes effect before the next instruction.
+ * @param vm
+ * @param deadline
+ */
+void VM_setDeadline(VM_instance* vm, uint64_t deadline)
+{
+    vm->deadline = deadline;
+    if (deadline < vm->runUntil) {
+        vm->runUntil = deadline;
+    }
 }
 
 
 /**
- * Prints out the current state of a virtual machine's Zephyrs
+ * Prints out the current state of a virtual machine's Zephyrs, as part of the instruction trace
  * @param vm
  */
 void VM_print(VM_instance* vm)
@@ -198,6 +403,114 @@ void VM_print(VM_instance* vm)
 }
 
 
+/**
+ * Sets how much of the trace is printed, from VM_TRACE_OFF to VM_TRACE_FULL, for every VM. Levels above the one the VM
+ * was compiled with (ARMTINYVM_TRACE_LEVEL) are never printed.
+ * @param level
+ */
+void VM_setTraceLevel(uint8_t level)
+{
+    vmTraceLevel = level;
+}
+
+
+/**
+ * Returns the trace level which is actually printed: the one set by VM_setTraceLevel, or ARMTINYVM_TRACE_LEVEL if that
+ * is lower.
+ * @return
+ */
+uint8_t VM_getTraceLevel(void)
+{
+#if ARMTINYVM_TRACE_LEVEL == VM_TRACE_OFF
+    // Nothing is lower, and comparing against it would only draw a warning
+    return VM_TRACE_OFF;
+#else
+    return (vmTraceLevel < ARMTINYVM_TRACE_LEVEL) ? vmTraceLevel : ARMTINYVM_TRACE_LEVEL;
+#endif // ARMTINYVM_TRACE_LEVEL
+}
+
+
+/**
+ * Sets up an empty interrupt controller, whose handler addresses will be read from the table at guest address
+ * `vectorTable`. To use it, point the `interrupts` field of a VM at it.
+ * @param controller
+ * @param vectorTable
+ */
+void VM_initInterruptController(VM_interruptController* controller, uint32_t vectorTable)
+{
+    controller->vectorTable = vectorTable;
+    controller->interruptTaken = NULL;
+    controller->latched = 0;
+    controller->head = 0;
+    queue_init(&(controller->tail), 0);
+    for (uint32_t i = 0; i < VM_INTERRUPT_QUEUE_SIZE; i++) {
+        queue_init(&(controller->sequence[i]), i);
+        controller->numbers[i] = 0;
+    }
+}
+
+
+/**
+ * Raises interrupt `number`, to be delivered at the end of the VM's current block of instructions. Safe to call from
+ * any number of threads at once without locking. Returns false if the number is out of range or the queue is full.
+ * A VM which is waiting isn't resumed by this; the host must do that itself.
+ * @param controller
+ * @param number
+ * @return
+ */
+bool VM_raiseInterrupt(VM_interruptController* controller, uint8_t number)
+{
+    if (number >= VM_MAX_INTERRUPTS) {
+        return false;
+    }
+
+    // Each slot's sequence number says whose turn it is: a writer may claim queue position `pos` when the sequence
+    // number of its slot is `pos`, and the reader may take it once it becomes `pos + 1`
+    uint32_t pos = queue_load(&(controller->tail), memory_order_relaxed);
+    while (true) {
+        VM_ATOMIC uint32_t* sequence = &(controller->sequence[pos % VM_INTERRUPT_QUEUE_SIZE]);
+        int32_t difference = (int32_t) (queue_load(sequence, memory_order_acquire) - pos);
+        if (difference == 0) {
+            if (queue_claim(&(controller->tail), &pos)) {
+                controller->numbers[pos % VM_INTERRUPT_QUEUE_SIZE] = number;
+                queue_store(sequence, pos + 1, memory_order_release);
+                return true;
+            }
+        } else if (difference < 0) {
+            // The reader hasn't caught up with this slot yet
+            return false;
+        } else {
+            pos = queue_load(&(controller->tail), memory_order_relaxed);
+        }
+    }
+}
+
+
+/**
+ * Returns whether an interrupt has been raised but not yet delivered. Should only be called from the thread running
+ * the VM, or while it isn't running.
+ * @param controller
+ * @return
+ */
+bool VM_interruptPending(VM_interruptController* controller)
+{
+    return (controller->latched != 0) ||
+           (queue_load(&(controller->tail), memory_order_acquire) != controller->head);
+}
+
+
+/**
+ * Delivers interrupt `number` straight away, whether or not interrupts are enabled, bypassing the queue. The VM must
+ * have an interrupt controller. Meant for hosts which need exact control over delivery, such as replaying a recording.
+ * @param vm
+ * @param number
+ */
+void VM_takeInterrupt(VM_instance* vm, uint8_t number)
+{
+    enterInterrupt(vm, number);
+}
+
+
 /***********************************************************************************************************************
  * COMPARISONS
  **********************************************************************************************************************/
@@ -283,20 +596,21 @@ void compareSetCV(VM_instance* vm, uint32_t a, uint32_t b)
 
 uint32_t load(VM_instance* vm, uint32_t addr, uint8_t bytes)
 {
+    heat__(vm, addr, HEATMAP_READ);
     if (bytes == 1) {
         // Single byte
-        return vm->readByte(addr);
+        return vm->readByte(vm, addr);
     } else if (bytes == 2) {
         // Half word
-        uint32_t value = (uint32_t) vm->readByte(addr);
-        value += (uint32_t) (vm->readByte(addr+1)) << 8;
+        uint32_t value = (uint32_t) vm->readByte(vm, addr);
+        value += (uint32_t) (vm->readByte(vm, addr+1)) << 8;
         return value;
     } else {
         // Full word
-        uint32_t value = (uint32_t) vm->readByte(addr);
-        value += (uint32_t) (vm->readByte(addr+1)) << 8;
-        value += (uint32_t) (vm->readByte(addr+2)) << 16;
-        value += (uint32_t) (vm->readByte(addr+3)) << 24;
+        uint32_t value = (uint32_t) vm->readByte(vm, addr);
+        value += (uint32_t) (vm->readByte(vm, addr+1)) << 8;
+        value += (uint32_t) (vm->readByte(vm, addr+2)) << 16;
+        value += (uint32_t) (vm->readByte(vm, addr+3)) << 24;
         return value;
     }
 }
@@ -304,21 +618,133 @@ uint32_t load(VM_instance* vm, uint32_t addr, uint8_t bytes)
 
 void store(VM_instance* vm, uint32_t addr, uint32_t value, uint8_t bytes)
 {
+    heat__(vm, addr, HEATMAP_WRITE);
     if (bytes == 1) {
         // Single byte
-        vm->writeByte(addr, (uint8_t) (value & 0x000000FFUL));
+        vm->writeByte(vm, addr, (uint8_t) (value & 0x000000FFUL));
     } else if (bytes == 2) {
         // Half word
-        vm->writeByte(addr,   (uint8_t)  (value & 0x000000FFUL));
-        vm->writeByte(addr+1, (uint8_t) ((value & 0x0000FF00UL) >> 8));
+        vm->writeByte(vm, addr,   (uint8_t)  (value & 0x000000FFUL));
+        vm->writeByte(vm, addr+1, (uint8_t) ((value & 0x0000FF00UL) >> 8));
     } else {
         // Full word
-        vm->writeByte(addr,   (uint8_t)  (value & 0x000000FFUL));
-        vm->writeByte(addr+1, (uint8_t) ((value & 0x0000FF00UL) >> 8));
-        vm->writeByte(addr+2, (uint8_t) ((value & 0x00FF0000UL) >> 16));
-        vm->writeByte(addr+3, (uint8_t) ((value & 0xFF000000UL) >> 24));
+        vm->writeByte(vm, addr,   (uint8_t)  (value & 0x000000FFUL));
+        vm->writeByte(vm, addr+1, (uint8_t) ((value & 0x0000FF00UL) >> 8));
+        vm->writeByte(vm, addr+2, (uint8_t) ((value & 0x00FF0000UL) >> 16));
+        vm->writeByte(vm, addr+3, (uint8_t) ((value & 0xFF000000UL) >> 24));
+    }
+}
+
+
+/***********************************************************************************************************************
+ * INTERRUPTS
+ **********************************************************************************************************************/
+
+
+/**
+ * Called after every instruction which may branch. Delivers the highest priority (lowest numbered) pending interrupt,
+ * if there is one and interrupts are enabled. When no interrupt controller is attached, or nothing has been raised,
+ * this is just a couple of comparisons.
+ * @param vm
+ */
+void endBlock(VM_instance* vm)
+{
+    VM_interruptController* controller = vm->interrupts;
+    if ((controller == NULL) ||
+        ((controller->latched == 0) &&
+         (queue_load(&(controller->tail), memory_order_relaxed) == controller->head))) {
+        return;
+    }
+
+    // Move anything new from the queue into the latched set
+    // A slot whose writer hasn't quite finished is left for the next block
+    while (controller->head != queue_load(&(controller->tail), memory_order_acquire)) {
+        uint32_t slot = controller->head % VM_INTERRUPT_QUEUE_SIZE;
+        if (queue_load(&(controller->sequence[slot]), memory_order_acquire) != controller->head + 1) {
+            break;
+        }
+        controller->latched |= 1UL << controller->numbers[slot];
+        queue_store(&(controller->sequence[slot]), controller->head + VM_INTERRUPT_QUEUE_SIZE, memory_order_release);
+        controller->head++;
+    }
+
+    if ((controller->latched == 0) || (vm->cpsr & VM_CPSR_IRQ_DISABLE) || vm->finished || vm->waiting) {
+        return;
+    }
+
+    uint8_t number = 0;
+    while (!(controller->latched & (1UL << number))) {
+        number++;
+    }
+    controller->latched &= ~(1UL << number);
+    enterInterrupt(vm, number);
+}
+
+
+/**
+ * Saves the state which the interrupted code can't save for itself onto the stack, and jumps to the handler for
+ * interrupt `number`. Interrupts are disabled until the handler returns.
+ * @param vm
+ * @param number
+ */
+void enterInterrupt(VM_instance* vm, uint8_t number)
+{
+    printf_full__("<Interrupt %u>\n", number);
+
+    // The frame holds r0-r3, r12, LR, PC and CPSR, from the lowest address up
+    static const uint8_t stackedRegisters[7] = {0, 1, 2, 3, 12, 14, 15};
+    vm_stack_pointer(vm) -= 32;
+    stack__(vm);
+    for (uint8_t i = 0; i < 7; i++) {
+        store(vm, vm_stack_pointer(vm) + (4 * i), vm->registers[stackedRegisters[i]], 4);
+    }
+    store(vm, vm_stack_pointer(vm) + 28, vm->cpsr, 4);
+
+    vm->cpsr |= VM_CPSR_IRQ_DISABLE;
+    vm_link_register(vm) = VM_EXCEPTION_RETURN | 1;
+    uint32_t from = vm_program_counter(vm);
+    vm_program_counter(vm) = load(vm, vm->interrupts->vectorTable + (4 * number), 4) & 0xFFFFFFFE;
+    branch__(vm, from, VM_BRANCH_INTERRUPT);
+
+    if (vm->interrupts->interruptTaken) {
+        vm->interrupts->interruptTaken(vm, number);
+    }
+}
+
+
+/**
+ * Called when a handler branches to VM_EXCEPTION_RETURN. Restores the state saved by enterInterrupt, which also
+ * re-enables interrupts.
+ * @param vm
+ */
+void returnFromInterrupt(VM_instance* vm)
+{
+    printf_full__("<Return from interrupt>\n");
+
+    static const uint8_t stackedRegisters[7] = {0, 1, 2, 3, 12, 14, 15};
+    for (uint8_t i = 0; i < 7; i++) {
+        vm->registers[stackedRegisters[i]] = load(vm, vm_stack_pointer(vm) + (4 * i), 4);
     }
+    vm->cpsr = load(vm, vm_stack_pointer(vm) + 28, 4);
+    vm_stack_pointer(vm) += 32;
+    branch__(vm, VM_EXCEPTION_RETURN, VM_BRANCH_INTERRUPT_RETURN);
+}
+
+
+#ifdef ARMTINYVM_SIZE_PROFILE
+/**
+ * Returns the operand field which is `mask` wide and starts `shift` bits up the instruction. Only the size profile
+ * uses this, through instr_field; otherwise the extraction is inlined into each handler.
+ * @param instruction
+ * @param shift
+ * @param mask
+ * @return
+ */
+uint8_t instructionField(uint16_t instruction, uint8_t shift, uint8_t mask)
+{
+    return (uint8_t) ((instruction >> shift) & mask);
 }
+#endif // ARMTINYVM_SIZE_PROFILE
 
 
 /***********************************************************************************************************************
@@ -342,10 +768,11 @@ void tliMoveShiftedRegister(VM_instance* vm, uint16_t instruction)
     // 0 <= offset5 <= 31
     // 0 <= rs <= 7
     // 0 <= rd <= 7
-    uint8_t op =      (uint8_t) ((instruction & 0b0001100000000000) >> 11);
-    uint8_t offset5 = (uint8_t) ((instruction & 0b0000011111000000) >> 6);
-    uint8_t rs =      (uint8_t) ((instruction & 0b0000000000111000) >> 3);
-    uint8_t rd =      (uint8_t)  (instruction & 0b0000000000000111);
+    uint8_t op =      instr_field(instruction, 11, 0b11);
+    uint8_t offset5 = instr_field(instruction, 6, 0b11111);
+    uint8_t rs =      instr_field(instruction, 3, 0b111);
+    uint8_t rd =      instr_field(instruction, 0, 0b111);
+    count__(vm, 1, op);
 
     if (op == 0) {
         // LSL Rd, Rs, #Offset5
@@ -411,7 +838,7 @@ void tliMoveShiftedRegister(VM_instance* vm, uint16_t instruction)
         compareSetNZ(vm, vm->registers[rd]);
     } else {
         // We should never get here
-        printf__("Invalid instruction 0x%x", instruction);
+        printf_error__("Invalid instruction 0x%x", instruction);
         vm->finished = true;
     }
 }
@@ -434,11 +861,12 @@ void tliAddSubtract(VM_instance* vm, uint16_t instruction)
     // 0 <= rn <= 7
     // 0 <= rs <= 7
     // 0 <= rd <= 7
-    uint8_t i =  (uint8_t) ((instruction & 0b0000010000000000) >> 10);
-    uint8_t op = (uint8_t) ((instruction & 0b0000001000000000) >> 9);
-    uint8_t rn = (uint8_t) ((instruction & 0b0000000111000000) >> 6);
-    uint8_t rs = (uint8_t) ((instruction & 0b0000000000111000) >> 3);
-    uint8_t rd = (uint8_t)  (instruction & 0b0000000000000111);
+    uint8_t i =  instr_field(instruction, 10, 0b1);
+    uint8_t op = instr_field(instruction, 9, 0b1);
+    uint8_t rn = instr_field(instruction, 6, 0b111);
+    uint8_t rs = instr_field(instruction, 3, 0b111);
+    uint8_t rd = instr_field(instruction, 0, 0b111);
+    count__(vm, 2, (op << 1) | i);
 
     if (op == 0) {
         if (i == 0) {
@@ -497,9 +925,10 @@ void tliMovCmpAddSubImmediate(VM_instance* vm, uint16_t instruction)
     // 0 <= op <= 3
     // 0 <= rd <= 7
     // 0 <= offset <= 255
-    uint8_t op =     (uint8_t) ((instruction & 0b0001100000000000) >> 11);
-    uint8_t rd =     (uint8_t) ((instruction & 0b0000011100000000) >> 8);
-    uint8_t offset = (uint8_t)  (instruction & 0b0000000011111111);
+    uint8_t op =     instr_field(instruction, 11, 0b11);
+    uint8_t rd =     instr_field(instruction, 8, 0b111);
+    uint8_t offset = instr_field(instruction, 0, 0b11111111);
+    count__(vm, 3, op);
 
     if (op == 0b00) {
         // MOV Rd, #Offset
@@ -544,9 +973,10 @@ void tliALUOperations(VM_instance* vm, uint16_t instruction)
     printf__("I04 : ");
 
     // Decode the operation
-    uint8_t op = (instruction & 0b0000001111000000) >> 6;
-    uint8_t rs = (instruction & 0b0000000000111000) >> 3;
-    uint8_t rd = (instruction & 0b0000000000000111);
+    uint8_t op = instr_field(instruction, 6, 0b1111);
+    uint8_t rs = instr_field(instruction, 3, 0b111);
+    uint8_t rd = instr_field(instruction, 0, 0b111);
+    count__(vm, 4, op);
 
     if (op == 0b0000) {
         // AND Rd, Rs
@@ -753,10 +1183,12 @@ void tliHighRegOperations(VM_instance* vm, uint16_t instruction)
     // 0 <= h1_and_2 <= 3
     // 0 <= rs <= 7
     // 0 <= rd <= 7
-    uint8_t op =       (uint8_t) ((instruction & 0b0000001100000000) >> 8);
-    uint8_t h1_and_2 = (uint8_t) ((instruction & 0b0000000011000000) >> 6);
-    uint8_t rs =       (uint8_t) ((instruction & 0b0000000000111000) >> 3);
-    uint8_t rd =       (uint8_t)  (instruction & 0b0000000000000111);
+    uint8_t op =       instr_field(instruction, 8, 0b11);
+    uint8_t h1_and_2 = instr_field(instruction, 6, 0b11);
+    uint8_t rs =       instr_field(instruction, 3, 0b111);
+    uint8_t rd =       instr_field(instruction, 0, 0b111);
+    count__(vm, 5, op);
+    uint32_t from = vm_program_counter(vm) - 2;
 
     if (op == 0b00) {
         if (h1_and_2 == 0b01) {
@@ -784,7 +1216,7 @@ void tliHighRegOperations(VM_instance* vm, uint16_t instruction)
             vm->registers[8+rd] = vm->registers[8+rd] + vm->registers[8+rs];
 			printf__("ADD h%u, h%u (h%u := %lu)\n", 8+rd, 8+rs, 8+rd, (unsigned long) vm->registers[8+rd]);
         } else {
-            printf__("Invalid instruction %x\n", instruction);
+            printf_error__("Invalid instruction %x\n", instruction);
             vm->finished = true;
         }
     } else if (op == 0b01) {
@@ -806,7 +1238,7 @@ void tliHighRegOperations(VM_instance* vm, uint16_t instruction)
             compareSetNZ(vm, vm->registers[8+rd] - vm->registers[8+rs]);
             compareSetCV(vm, vm->registers[8+rd], vm->registers[8+rs]);
         } else {
-            printf__("Invalid command %x\n", instruction);
+            printf_error__("Invalid command %x\n", instruction);
             vm->finished = true;
         }
     } else if (op == 0b10) {
@@ -825,7 +1257,7 @@ void tliHighRegOperations(VM_instance* vm, uint16_t instruction)
             printf__("MOV h%u, h%u (h%u := %lu)\n", 8+rd, 8+rs, 8+rd, (unsigned long) vm->registers[8+rd]);
             vm->registers[8+rd] = vm->registers[8+rs];
         } else {
-            printf__("Invalid command %x\n", instruction);
+            printf_error__("Invalid command %x\n", instruction);
             vm->finished = true;
         }
     } else {
@@ -833,15 +1265,45 @@ void tliHighRegOperations(VM_instance* vm, uint16_t instruction)
             // BX Rs
             printf__("BX r%u (0x%lx)\n", rs, (unsigned long) (vm->registers[rs] & 0xFFFFFFFE));
             vm_program_counter(vm) = vm->registers[rs] & 0xFFFFFFFE;
+            if (vm_program_counter(vm) == VM_EXCEPTION_RETURN) {
+                returnFromInterrupt(vm);
+            } else {
+                branch__(vm, from, VM_BRANCH_INDIRECT);
+            }
+            endBlock(vm);
         } else if (h1_and_2 == 0b01) {
             // BX Hs
             printf__("BX h%u (0x%lx)\n", 8+rs, (unsigned long) (vm->registers[8+rs] & 0xFFFFFFFE));
             vm_program_counter(vm) = vm->registers[8+rs] & 0xFFFFFFFE;
+            if (vm_program_counter(vm) == VM_EXCEPTION_RETURN) {
+                returnFromInterrupt(vm);
+            } else {
+                branch__(vm, from, (8+rs == 14) ? VM_BRANCH_RETURN : VM_BRANCH_INDIRECT);
+            }
+            endBlock(vm);
         } else {
-            printf__("Invalid command %x\n", instruction);
+            printf_error__("Invalid command %x\n", instruction);
             vm->finished = true;
         }
     }
+
+    // ADD or MOV to SP, such as to make room for a large stack frame
+    if (((op == 0b00) || (op == 0b10)) && (h1_and_2 & 0b10) && (rd == 5)) {
+        stack__(vm);
+    }
+
+    // ADD or MOV to the PC, which like BX leaves the Thumb bit (such as from MOV pc, lr) out of the PC, and can return
+    // from an interrupt handler
+    if (((op == 0b00) || (op == 0b10)) && (h1_and_2 & 0b10) && (rd == 7)) {
+        vm_program_counter(vm) &= 0xFFFFFFFE;
+        if (vm_program_counter(vm) == VM_EXCEPTION_RETURN) {
+            returnFromInterrupt(vm);
+        } else {
+            branch__(vm, from, ((op == 0b10) && (h1_and_2 == 0b11) && (rs == 6)) ? VM_BRANCH_RETURN
+                                                                                   : VM_BRANCH_INDIRECT);
+        }
+        endBlock(vm);
+    }
 }
 
 
@@ -857,8 +1319,9 @@ void tliPCRelativeLoad(VM_instance* vm, uint16_t instruction)
     printf__("I06 : ");
 
     // Find the destination register and the (shifted) offset
-    uint8_t rd =   (instruction & 0b0000011100000000) >> 8;
-    uint8_t word8 = instruction & 0b0000000011111111;
+    uint8_t rd =   instr_field(instruction, 8, 0b111);
+    uint8_t word8 = instr_field(instruction, 0, 0b11111111);
+    count__(vm, 6, 0);
 
     // Calculate the offset by multiplying word8 by 4
     uint16_t offset = ((uint16_t) word8) << 2;
@@ -888,11 +1351,12 @@ void tliLoadWithRegOffset(VM_instance* vm, uint16_t instruction)
 {
     printf__("I07 : ");
 
-    uint8_t load_or_store = (instruction & 0b0000100000000000) >> 11;
-    uint8_t byte_or_word =  (instruction & 0b0000010000000000) >> 10;
-    uint8_t ro =            (instruction & 0b0000000111000000) >> 6;
-    uint8_t rb =            (instruction & 0b0000000000111000) >> 3;
-    uint8_t rd =            (instruction & 0b0000000000000111);
+    uint8_t load_or_store = instr_field(instruction, 11, 0b1);
+    uint8_t byte_or_word =  instr_field(instruction, 10, 0b1);
+    uint8_t ro =            instr_field(instruction, 6, 0b111);
+    uint8_t rb =            instr_field(instruction, 3, 0b111);
+    uint8_t rd =            instr_field(instruction, 0, 0b111);
+    count__(vm, 7, (load_or_store << 1) | byte_or_word);
 
     // The address for all instructions is Rb + Ro
     uint32_t addr = vm->registers[rb] + vm->registers[ro];
@@ -939,11 +1403,12 @@ void tliLoadStoreSignExtendedByte(VM_instance* vm, uint16_t instruction)
 {
     printf__("I08 : ");
 
-    uint8_t h =       (instruction & 0b0000100000000000) >> 11;
-    uint8_t sgn_ext = (instruction & 0b0000010000000000) >> 10;
-    uint8_t ro =      (instruction & 0b0000000111000000) >> 6;
-    uint8_t rb =      (instruction & 0b0000000000111000) >> 3;
-    uint8_t rd =      (instruction & 0b0000000000000111);
+    uint8_t h =       instr_field(instruction, 11, 0b1);
+    uint8_t sgn_ext = instr_field(instruction, 10, 0b1);
+    uint8_t ro =      instr_field(instruction, 6, 0b111);
+    uint8_t rb =      instr_field(instruction, 3, 0b111);
+    uint8_t rd =      instr_field(instruction, 0, 0b111);
+    count__(vm, 8, (h << 1) | sgn_ext);
 
     // The address for all instructions is Rb + Ro
     uint32_t addr = vm->registers[rb] + vm->registers[ro];
@@ -992,11 +1457,12 @@ void tliLoadStoreWithImmediateOffset(VM_instance* vm, uint16_t instruction)
 {
     printf__("I09 : ");
 
-    uint8_t byte_or_word =  (instruction & 0b0001000000000000) >> 12;
-    uint8_t load_or_store = (instruction & 0b0000100000000000) >> 11;
-    uint8_t offset5 =       (instruction & 0b0000011111000000) >> 6;
-    uint8_t rb =            (instruction & 0b0000000000111000) >> 3;
-    uint8_t rd =            (instruction & 0b0000000000000111);
+    uint8_t byte_or_word =  instr_field(instruction, 12, 0b1);
+    uint8_t load_or_store = instr_field(instruction, 11, 0b1);
+    uint8_t offset5 =       instr_field(instruction, 6, 0b11111);
+    uint8_t rb =            instr_field(instruction, 3, 0b111);
+    uint8_t rd =            instr_field(instruction, 0, 0b111);
+    count__(vm, 9, (byte_or_word << 1) | load_or_store);
 
     if (byte_or_word == 0) {
         uint32_t addr = vm->registers[rb] + (offset5 << 2);
@@ -1043,10 +1509,11 @@ void tliLoadStoreHalfWord(VM_instance* vm, uint16_t instruction)
 {
     printf__("I10 : ");
 
-    uint8_t load_or_store = (instruction & 0b0000100000000000) >> 11;
-    uint8_t offset5 =       (instruction & 0b0000011111000000) >> 6;
-    uint8_t rb =            (instruction & 0b0000000000111000) >> 3;
-    uint8_t rd =            (instruction & 0b0000000000000111);
+    uint8_t load_or_store = instr_field(instruction, 11, 0b1);
+    uint8_t offset5 =       instr_field(instruction, 6, 0b11111);
+    uint8_t rb =            instr_field(instruction, 3, 0b111);
+    uint8_t rd =            instr_field(instruction, 0, 0b111);
+    count__(vm, 10, load_or_store);
 
     uint32_t addr = vm->registers[rb] + (((uint32_t) offset5) << 1);
 
@@ -1075,9 +1542,10 @@ void tliSPRelativeLoad(VM_instance* vm, uint16_t instruction)
 {
     printf__("I11 : ");
 
-    uint8_t load_or_store = (instruction & 0b0000100000000000) >> 11;
-    uint8_t rd =            (instruction & 0b0000011100000000) >> 8;
-    uint8_t word8 =         (instruction & 0b0000000011111111);
+    uint8_t load_or_store = instr_field(instruction, 11, 0b1);
+    uint8_t rd =            instr_field(instruction, 8, 0b111);
+    uint8_t word8 =         instr_field(instruction, 0, 0b11111111);
+    count__(vm, 11, load_or_store);
 
     uint32_t addr = vm_stack_pointer(vm) + (((uint32_t) word8) << 2);
 
@@ -1106,9 +1574,10 @@ void tliLoadAddress(VM_instance* vm, uint16_t instruction)
 {
     printf__("I12 : ");
 
-    uint8_t sp =    (instruction & 0b0000100000000000) >> 11;
-    uint8_t rd =    (instruction & 0b0000011100000000) >> 8;
-    uint8_t word8 = (instruction & 0b0000000011111111);
+    uint8_t sp =    instr_field(instruction, 11, 0b1);
+    uint8_t rd =    instr_field(instruction, 8, 0b111);
+    uint8_t word8 = instr_field(instruction, 0, 0b11111111);
+    count__(vm, 12, sp);
 
     uint16_t lmm = ((uint16_t) word8) << 2;
 
@@ -1137,8 +1606,9 @@ void tliAddOffsetToSP(VM_instance* vm, uint16_t instruction)
 {
     printf__("I13 : ");
 
-    uint8_t sign =   (instruction & 0b0000000010000000) >> 7;
-    uint8_t sword7 = (instruction & 0b0000000001111111);
+    uint8_t sign =   instr_field(instruction, 7, 0b1);
+    uint8_t sword7 = instr_field(instruction, 0, 0b1111111);
+    count__(vm, 13, sign);
 
     uint16_t lmm = ((uint16_t) sword7) << 2;
 
@@ -1152,6 +1622,7 @@ void tliAddOffsetToSP(VM_instance* vm, uint16_t instruction)
         // Decrease the stack pointer by lmm
         printf__("ADD SP, #-%u\n", lmm);
         vm_stack_pointer(vm) = vm_stack_pointer(vm) - lmm;
+        stack__(vm);
     }
 }
 
@@ -1167,9 +1638,10 @@ void tliPushPopRegisters(VM_instance* vm, uint16_t instruction)
 {
     printf__("I14 : ");
 
-    uint8_t load_or_store = (instruction & 0b0000100000000000) >> 10;
-    uint8_t pc_lr =         (instruction & 0b0000000100000000) >> 8;
-    uint8_t rlist =         (instruction & 0b0000000011111111);
+    uint8_t load_or_store = instr_field(instruction, 11, 0b1);
+    uint8_t pc_lr =         instr_field(instruction, 8, 0b1);
+    uint8_t rlist =         instr_field(instruction, 0, 0b11111111);
+    count__(vm, 14, (load_or_store << 1) | pc_lr);
 
     // Calculate which registers are included in the register list
     uint8_t numRegistersInvolved = 0;
@@ -1201,21 +1673,35 @@ void tliPushPopRegisters(VM_instance* vm, uint16_t instruction)
             if (use_registers[i]) {
                 vm_stack_pointer(vm) -= 4;
                 store(vm, vm_stack_pointer(vm), vm->registers[i], 4);
-                printf__("<Pushing r%u (%lu) to 0x%lx>\n", i, (unsigned long) vm->registers[i],
-                         (unsigned long) vm_stack_pointer(vm));
+                printf_full__("<Pushing r%u (%lu) to 0x%lx>\n", i, (unsigned long) vm->registers[i],
+                              (unsigned long) vm_stack_pointer(vm));
             }
         }
+        stack__(vm);
     } else {
         // Pop
         printf__("pop {...*%u}\n", numRegistersInvolved);
+        uint32_t from = vm_program_counter(vm) - 2;
         for (int8_t i = 0; i < 16; i++) {
             if (use_registers[i]) {
                 vm->registers[i] = load(vm, vm_stack_pointer(vm), 4);
-                printf__("<Popping 0x%lx (%lu) to r%u>\n", (unsigned long) vm_stack_pointer(vm),
-                         (unsigned long) vm->registers[i], i);
+                printf_full__("<Popping 0x%lx (%lu) to r%u>\n", (unsigned long) vm_stack_pointer(vm),
+                              (unsigned long) vm->registers[i], i);
                 vm_stack_pointer(vm) += 4;
             }
         }
+
+        if (use_registers[15]) {
+            // The popped address normally has the Thumb bit set, as BL sets it in LR, but there's no ARM state to
+            // switch to
+            vm_program_counter(vm) &= 0xFFFFFFFE;
+            if (vm_program_counter(vm) == VM_EXCEPTION_RETURN) {
+                returnFromInterrupt(vm);
+            } else {
+                branch__(vm, from, VM_BRANCH_RETURN);
+            }
+            endBlock(vm);
+        }
     }
 }
 
@@ -1231,9 +1717,10 @@ void tliMultipleLoadStore(VM_instance* vm, uint16_t instruction)
 {
     printf__("I15 : ");
 
-    uint8_t load_or_store = (instruction & 0b0000100000000000) >> 11;
-    uint8_t rb =            (instruction & 0b0000011100000000) >> 8;
-    uint8_t rlist =         (instruction & 0b0000000011111111);
+    uint8_t load_or_store = instr_field(instruction, 11, 0b1);
+    uint8_t rb =            instr_field(instruction, 8, 0b111);
+    uint8_t rlist =         instr_field(instruction, 0, 0b11111111);
+    count__(vm, 15, load_or_store);
 
     uint32_t baseAddress = vm->registers[rb];
 
@@ -1286,7 +1773,7 @@ void tliConditionalBranch(VM_instance* vm, uint16_t instruction)
 {
     printf__("I16 : ");
 
-    uint8_t cond =    (instruction & 0b0000111100000000) >> 8;
+    uint8_t cond =    instr_field(instruction, 8, 0b1111);
     uint32_t soffset8 = instruction & 0b0000000011111111;
 
     // soffset8 is unsigned but should actually be treated as signed
@@ -1312,7 +1799,7 @@ void tliConditionalBranch(VM_instance* vm, uint16_t instruction)
         // Branch if C set (unsigned higher or same)
         instructionName = "BCS";
         condition = vm_get_cpsr_c(vm);
-        printf__("Carry: %d\n", vm_get_cpsr_c(vm));
+        printf_full__("Carry: %d\n", vm_get_cpsr_c(vm));
     } else if (cond == 0b0011) {
         // BCC label
         // Branch if C clear (unsigned lower)
@@ -1369,14 +1856,17 @@ void tliConditionalBranch(VM_instance* vm, uint16_t instruction)
         instructionName = "BLE";
         condition = vm_get_cpsr_z(vm) || (vm_get_cpsr_n(vm) && !vm_get_cpsr_v(vm)) || (!vm_get_cpsr_n(vm) && vm_get_cpsr_v(vm));
     } else {
-        printf__("Invalid command %x", instruction);
+        printf_error__("Invalid command %x", instruction);
         vm->finished = true;
         return;
     }
     printf__("%s %u\n", instructionName, targetAddress);
+    count__(vm, 16, (cond << 1) | condition);
     if (condition) {
         vm_program_counter(vm) = targetAddress;
     }
+    branch__(vm, targetAddress - 4 - offset, VM_BRANCH_JUMP);
+    endBlock(vm);
 }
 
 
@@ -1392,8 +1882,9 @@ void tliSoftwareInterrupt(VM_instance* vm, uint16_t instruction)
     printf__("I17 : ");
 
     // Decode the instruction
-    uint8_t value = instruction & 0x00FF;
+    uint8_t value = instr_field(instruction, 0, 0b11111111);
     printf__("SWI #%u\n", value);
+    count__(vm, 17, 0);
 
     // Move the address of the next instruction into the link register
     // In principle, we should do this, but because this is a virtual machine, we already know where to jump back to,
@@ -1402,7 +1893,12 @@ void tliSoftwareInterrupt(VM_instance* vm, uint16_t instruction)
     // vm_link_register(vm) = vm_program_counter(vm);
 
     // Trigger the interrupt
-    vm->softwareInterrupt(vm, value);
+    // If the host can't finish it straight away, the VM waits here until the host resumes it, with the PC already
+    // pointing at the next instruction
+    if (vm->softwareInterrupt(vm, value) == SWI_PENDING) {
+        vm->waiting = true;
+    }
+    endBlock(vm);
 }
 
 
@@ -1418,6 +1914,7 @@ void tliUnconditionalBranch(VM_instance* vm, uint16_t instruction)
     printf__("I18 : ");
 
     uint16_t offset11 = instruction & 0b0000011111111111;
+    count__(vm, 18, 0);
 
     // Calculate how to jump; we shift offset11 by 1, leading to a 12-bit number, then sign-extend it to 32 bits
     uint32_t relJump = offset11 << 1;
@@ -1432,6 +1929,8 @@ void tliUnconditionalBranch(VM_instance* vm, uint16_t instruction)
 
     // Jump to the new address
     vm_program_counter(vm) = addr;
+    branch__(vm, addr - 4 - relJump, VM_BRANCH_JUMP);
+    endBlock(vm);
 }
 
 
@@ -1448,14 +1947,15 @@ void tliLongBranchWithLink(VM_instance* vm, uint16_t instruction)
 
     // This instruction actually always comes in pairs
     // The offset of the first half is stored in the LR for use by the second
-    uint8_t high_or_low = (instruction & 0b0000100000000000) >> 11;
+    uint8_t high_or_low = instr_field(instruction, 11, 0b1);
     uint16_t offset =     (instruction & 0b0000011111111111);
+    count__(vm, 19, high_or_low);
 
     if (high_or_low == 0) {
         // The first instruction; shift left by 12 bits, add it to the current PC (+2 because of prefetch), and store
         // the result in LR
         vm_link_register(vm) = (((uint32_t) offset) << 12);
-        printf__("BL(0) %u (lr = %lu)\n", offset, vm_link_register(vm));
+        printf__("BL(0) %u (lr = %lu)\n", offset, (unsigned long) vm_link_register(vm));
     } else {
         // At the start of the second instruction, we should already have the first bit in the link register
         // Add this offset, shifted by 1, to it
@@ -1476,6 +1976,8 @@ void tliLongBranchWithLink(VM_instance* vm, uint16_t instruction)
         printf__("BL(1) %u (lr = %lu, pc = %lu)\n", offset,
                  (unsigned long) vm_link_register(vm),
                  (unsigned long) vm_program_counter(vm));
+        branch__(vm, vm_link_register(vm) - 3, VM_BRANCH_CALL);
+        endBlock(vm);
     }
 }
 
@@ -8,6 +8,85 @@
 #include <stdint.h>
 #include <stdbool.h>
 
+// Single-threaded builds can define ARMTINYVM_NO_ATOMICS to make the interrupt queue use plain loads and stores, in
+// which case interrupts may only be raised from the thread running the VM. AVR builds always do, as avr-libc has none
+// of the 32-bit atomic operations.
+#if defined(__AVR__) && !defined(ARMTINYVM_NO_ATOMICS)
+#define ARMTINYVM_NO_ATOMICS
+#endif
+#ifdef ARMTINYVM_NO_ATOMICS
+#define VM_ATOMIC
+#else
+#include <stdatomic.h>
+#define VM_ATOMIC _Atomic
+#endif // ARMTINYVM_NO_ATOMICS
+
+// Interrupt numbers run from 0 to VM_MAX_INTERRUPTS - 1
+#define VM_MAX_INTERRUPTS 32
+#define VM_INTERRUPT_QUEUE_SIZE 64
+
+// LR is set to this when an interrupt handler is entered, so that branching to it (BX LR or POP {PC}) returns
+#define VM_EXCEPTION_RETURN 0xFFFFFFF8
+
+// The deadline of a VM when nothing is due to happen
+#define VM_NO_DEADLINE UINT64_MAX
+
+// While this CPSR bit is set, interrupts stay pending rather than being taken
+#define VM_CPSR_IRQ_DISABLE 0x00000080
+
+// Trace levels, each including everything below it. The highest level built in is chosen at compile time with
+// ARMTINYVM_TRACE_LEVEL, which defaults to VM_TRACE_FULL (or VM_TRACE_OFF for ARMTINYVM_SIZE_PROFILE).
+#define VM_TRACE_OFF 0
+#define VM_TRACE_ERRORS 1       // Invalid instructions
+#define VM_TRACE_INSTRUCTIONS 2 // Each instruction, with its result
+#define VM_TRACE_FULL 3         // What each instruction did to the stack and flags, and interrupt entry and exit
+
+
+/**
+ * What a software interrupt handler has done with the request it was given.
+ */
+typedef enum VM_swiResult {
+    SWI_COMPLETE, // The request has been dealt with, and execution can carry on
+    SWI_PENDING   // The host will finish the request later, and then clear `waiting` to resume the VM
+} VM_swiResult;
+
+
+struct VM_instance;
+
+
+/**
+ * Interrupts waiting to be delivered to a VM. Any host thread may raise an interrupt by adding it to the lock-free
+ * queue, which the VM only reads at the end of each block of instructions (i.e. after a branch). Interrupts taken off
+ * the queue are latched in `latched` until they can be delivered, so raising the same interrupt twice before it is
+ * handled only delivers it once, as with real hardware.
+ *
+ * On delivery, r0-r3, r12, LR, the return address and the CPSR are pushed onto the stack, interrupts are disabled,
+ * LR is set to VM_EXCEPTION_RETURN, and execution continues from the address held in word `number` of the vector
+ * table. The handler can therefore be an ordinary function, and returning from it restores everything.
+ */
+typedef struct VM_interruptController {
+    uint32_t vectorTable;
+    void (*interruptTaken)(struct VM_instance* vm, uint8_t number); // Called on delivery if not NULL
+    uint32_t latched;
+    uint32_t head; // Only used by the thread running the VM
+    VM_ATOMIC uint32_t tail; // Claimed by the threads raising interrupts
+    VM_ATOMIC uint32_t sequence[VM_INTERRUPT_QUEUE_SIZE];
+    uint8_t numbers[VM_INTERRUPT_QUEUE_SIZE];
+} VM_interruptController;
+
+
+/**
+ * The kinds of branch reported to `branched`.
+ */
+typedef enum VM_branchKind {
+    VM_BRANCH_JUMP,            // B, or a conditional branch whether or not it was taken
+    VM_BRANCH_CALL,            // BL
+    VM_BRANCH_RETURN,          // BX LR, MOV PC, LR or POP {PC}
+    VM_BRANCH_INDIRECT,        // BX, MOV or ADD to the PC from any other register
+    VM_BRANCH_INTERRUPT,       // Taking an interrupt, from wherever the VM had got to
+    VM_BRANCH_INTERRUPT_RETURN // Returning from an interrupt handler, to where the VM had got to
+} VM_branchKind;
+
 
 /**
  * Holds the registers and other information necessary to represent the state of the VM.
@@ -15,10 +94,30 @@
 typedef struct VM_instance {
     uint32_t registers[16];
     uint32_t cpsr;
-    uint8_t (*readByte)(uint32_t addr);
-    void (*writeByte)(uint32_t addr, uint8_t value);
-    void (*softwareInterrupt)(struct VM_instance* vm, uint8_t number);
+    uint8_t (*readByte)(struct VM_instance* vm, uint32_t addr);
+    void (*writeByte)(struct VM_instance* vm, uint32_t addr, uint8_t value);
+    VM_swiResult (*softwareInterrupt)(struct VM_instance* vm, uint8_t number);
     bool finished;
+    bool waiting; // Set while a software interrupt is pending, or by the host, to pause execution until cleared again
+    void* context; // For use by the host, e.g. to find the memory belonging to this VM. NULL by default.
+    VM_interruptController* interrupts; // NULL unless the host has attached an interrupt controller
+    uint64_t instructionCount; // The number of instructions the VM has executed so far
+    uint64_t deadline; // When instructionCount reaches this, deadlineReached is called. Set with VM_setDeadline.
+    uint64_t runUntil; // Where VM_executeNInstructions will next stop to check the deadline
+    void (*deadlineReached)(struct VM_instance* vm); // NULL by default
+    // Called after each instruction has executed, with its address, for tracing and profiling. NULL by default.
+    void (*instructionExecuted)(struct VM_instance* vm, uint32_t address, uint16_t instruction);
+    void* instrumentation; // For use by instructionExecuted. NULL by default.
+    // Called after each branch, with the address of the branch instruction (or where an interrupt was taken or returned
+    // from) and where it went, for profiling and coverage. NULL by default.
+    void (*branched)(struct VM_instance* vm, uint32_t from, uint32_t to, VM_branchKind kind);
+    void* branchInstrumentation; // For use by branched. NULL by default.
+#ifdef ARMTINYVM_HISTOGRAM
+    struct VM_histogram* histogram; // Counts the instructions executed (see histogram.h). NULL by default.
+#endif // ARMTINYVM_HISTOGRAM
+#ifdef ARMTINYVM_HEATMAP
+    struct VM_heatmap* heatmap; // Counts memory accesses and tracks the lowest SP (see heatmap.h). NULL by default.
+#endif // ARMTINYVM_HEATMAP
 } VM_instance;
 
 // The following functions are used to access the special purpose registers, since they're
@@ -41,14 +140,21 @@ typedef struct VM_instance {
 
 
 
-VM_instance VM_new(uint8_t (*readByte)(uint32_t addr),
-                   void (*writeByte)(uint32_t addr, uint8_t value),
-                   void (*softwareInterrupt)(VM_instance* vm, uint8_t number),
+VM_instance VM_new(uint8_t (*readByte)(VM_instance* vm, uint32_t addr),
+                   void (*writeByte)(VM_instance* vm, uint32_t addr, uint8_t value),
+                   VM_swiResult (*softwareInterrupt)(VM_instance* vm, uint8_t number),
                    uint32_t initialStackPointer,
                    uint32_t initialProgramCounter);
 void VM_executeSingleInstruction(VM_instance* vm);
 uint32_t VM_executeNInstructions(VM_instance* vm, uint32_t maxInstructions);
 void VM_print(VM_instance* vm);
+void VM_setTraceLevel(uint8_t level);
+uint8_t VM_getTraceLevel(void);
+void VM_setDeadline(VM_instance* vm, uint64_t deadline);
+void VM_initInterruptController(VM_interruptController* controller, uint32_t vectorTable);
+bool VM_raiseInterrupt(VM_interruptController* controller, uint8_t number);
+bool VM_interruptPending(VM_interruptController* controller);
+void VM_takeInterrupt(VM_instance* vm, uint8_t number);
 
 
 #endif // ARMTINYVM_H
@@ -0,0 +1,142 @@
+#include "asyncio.h"
+#include <stddef.h>
+
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#define MAX_EVENTS_PER_WAIT 64
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+void* asyncIOThreadMain(void* arg);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Creates the epoll instance and starts the I/O thread. Returns false if either couldn't be created.
+ * @param io
+ * @return
+ */
+bool AsyncIO_init(VM_asyncIO* io)
+{
+    io->epollFd = epoll_create1(EPOLL_CLOEXEC);
+    if (io->epollFd < 0) {
+        return false;
+    }
+
+    // Writing to this wakes the I/O thread up so that it can stop
+    io->stopFd = eventfd(0, EFD_CLOEXEC);
+    if (io->stopFd < 0) {
+        close(io->epollFd);
+        return false;
+    }
+
+    struct epoll_event event = {.events = EPOLLIN, .data.ptr = NULL};
+    if ((epoll_ctl(io->epollFd, EPOLL_CTL_ADD, io->stopFd, &event) != 0) ||
+        (pthread_create(&(io->thread), NULL, asyncIOThreadMain, io) != 0)) {
+        close(io->stopFd);
+        close(io->epollFd);
+        return false;
+    }
+
+    return true;
+}
+
+
+/**
+ * Asks for `request->onReady` to be called on the I/O thread once `request->fd` is ready. Each file descriptor can only
+ * have one request waiting on it at a time. Returns false if the request couldn't be submitted (for example because
+ * the file descriptor is a regular file, which epoll doesn't support), in which case the caller should just block.
+ * @param io
+ * @param request
+ * @return
+ */
+bool AsyncIO_submit(VM_asyncIO* io, VM_asyncRequest* request)
+{
+    struct epoll_event event = {.events = EPOLLONESHOT, .data.ptr = request};
+    if (request->events & ASYNCIO_READABLE) {
+        event.events |= EPOLLIN;
+    }
+    if (request->events & ASYNCIO_WRITABLE) {
+        event.events |= EPOLLOUT;
+    }
+
+    return epoll_ctl(io->epollFd, EPOLL_CTL_ADD, request->fd, &event) == 0;
+}
+
+
+/**
+ * Stops the I/O thread and closes the epoll instance. Requests still waiting will never have their callbacks called.
+ * @param io
+ */
+void AsyncIO_free(VM_asyncIO* io)
+{
+    uint64_t one = 1;
+    if (write(io->stopFd, &one, sizeof(one)) == sizeof(one)) {
+        pthread_join(io->thread, NULL);
+    }
+
+    close(io->stopFd);
+    close(io->epollFd);
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Waits for file descriptors to become ready, and calls the callbacks of their requests, until told to stop.
+ * @param arg
+ * @return
+ */
+void* asyncIOThreadMain(void* arg)
+{
+    VM_asyncIO* io = (VM_asyncIO*) arg;
+    struct epoll_event events[MAX_EVENTS_PER_WAIT];
+
+    while (true) {
+        int numEvents = epoll_wait(io->epollFd, events, MAX_EVENTS_PER_WAIT, -1);
+        for (int i = 0; i < numEvents; i++) {
+            VM_asyncRequest* request = (VM_asyncRequest*) events[i].data.ptr;
+            if (!request) {
+                return NULL;
+            }
+
+            // Remove the file descriptor first, so that the callback (or the VM it resumes) can submit it again
+            epoll_ctl(io->epollFd, EPOLL_CTL_DEL, request->fd, NULL);
+            request->onReady(request);
+        }
+    }
+}
+
+
+#else
+
+
+bool AsyncIO_init(VM_asyncIO* io)
+{
+    (void) io;
+    return false;
+}
+
+
+bool AsyncIO_submit(VM_asyncIO* io, VM_asyncRequest* request)
+{
+    (void) io;
+    (void) request;
+    return false;
+}
+
+
+void AsyncIO_free(VM_asyncIO* io)
+{
+    (void) io;
+}
+
+
+#endif // __linux__
@@ -0,0 +1,44 @@
+/*
+ * A background I/O thread which waits (using epoll) for host file descriptors to become ready, so that a software
+ * interrupt which would block can return SWI_PENDING instead of stalling the thread running the VM. When the file
+ * descriptor is ready, the request's callback is run on the I/O thread to finish the request and resume the VM.
+ *
+ * Only available on Linux; elsewhere AsyncIO_init fails, and hosts fall back to blocking system calls.
+*/
+
+#ifndef ASYNCIO_H
+#define ASYNCIO_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define ASYNCIO_READABLE 0x1
+#define ASYNCIO_WRITABLE 0x4
+
+
+/**
+ * A request to be told when `fd` is ready for `events` (ASYNCIO_READABLE and/or ASYNCIO_WRITABLE). The storage belongs
+ * to the caller, and must stay valid until `onReady` has been called.
+ */
+typedef struct VM_asyncRequest {
+    int fd;
+    uint32_t events;
+    void (*onReady)(struct VM_asyncRequest* request);
+    void* context;
+} VM_asyncRequest;
+
+
+typedef struct VM_asyncIO {
+    int epollFd;
+    int stopFd;
+    pthread_t thread;
+} VM_asyncIO;
+
+
+bool AsyncIO_init(VM_asyncIO* io);
+bool AsyncIO_submit(VM_asyncIO* io, VM_asyncRequest* request);
+void AsyncIO_free(VM_asyncIO* io);
+
+
+#endif // ASYNCIO_H
@@ -0,0 +1,28 @@
+/*
+ * Generated by ARMTinyVM_mkimage from sample.elf. Do not edit.
+*/
+
+#include "flatimage.h"
+
+#define IMAGE_NUM_SEGMENTS 2UL
+#define IMAGE_ENTRY_ADDRESS 0x0000800cUL
+#define IMAGE_FLASH_SIZE 32UL
+#define IMAGE_DATA_SIZE 4UL
+#define IMAGE_BSS_SIZE 0UL
+
+const imageSegment imageSegments[IMAGE_NUM_SEGMENTS + 1] = {
+        {0x00008000UL, 0x00000020UL, 0x00000000UL, IMAGE_REGION_FLASH},
+        {0x00018020UL, 0x00000004UL, 0x00000000UL, IMAGE_REGION_DATA},
+};
+
+const uint8_t imageFlash[IMAGE_FLASH_SIZE + 1] PROGMEM = {
+        0x01, 0x4b, 0x18, 0x68, 0x70, 0x47, 0xc0, 0x46, 0x20, 0x80, 0x01, 0x00, 0x01, 0x48, 0x02, 0x49,
+        0x8e, 0x46, 0x00, 0x47, 0x01, 0x80, 0x00, 0x00, 0x1d, 0x80, 0x00, 0x00, 0x01, 0x27, 0x00, 0xdf,
+        0x00
+};
+
+uint8_t imageData[IMAGE_DATA_SIZE + 1] = {
+        0x49, 0x00, 0x00, 0x00, 0x00
+};
+
+uint8_t imageBss[IMAGE_BSS_SIZE + 1];
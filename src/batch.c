@@ -0,0 +1,533 @@
+/*
+ * Batch runner: executes many independent guest ELF programs across a pool of worker threads, and reports the result
+ * of each one as a line of JSON.
+ *
+ * Usage: ARMTinyVM_batch [-j threads] [-n maxInstructions] [-m manifest] [-o output] [--trace level] [file.elf ...]
+ *
+ * The manifest is a text file containing one ELF filename per line. Blank lines and lines starting with '#' are
+ * ignored. Results are written in the order the programs were given, once they have all finished. The VM core's
+ * instruction trace is off by default, as the workers' traces would only interleave on stdout and slow them down;
+ * --trace off|errors|instructions|full turns it back on, which is mostly useful with -j 1.
+ *
+ * Each distinct file is only loaded once, by whichever worker gets to it first, and every job running that file shares
+ * the same read-only image.
+*/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "ARMTinyVM.h"
+#include "host.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <time.h>
+#include <unistd.h>
+
+#define DEFAULT_MAX_INSTRUCTIONS 1000000UL
+#define INSTRUCTIONS_PER_SLICE 4096UL
+
+
+typedef enum jobStatus {
+    JOB_NOT_RUN,
+    JOB_FINISHED,
+    JOB_LOAD_FAILED,
+    JOB_INSTRUCTION_LIMIT
+} jobStatus;
+
+
+/**
+ * One distinct ELF file, shared by every job which runs it. The image is loaded lazily and released once the last of
+ * those jobs has finished.
+ */
+typedef struct batchImage {
+    const char* filename;
+    VM_image* image;
+    bool loadAttempted;
+    pthread_mutex_t lock;
+    atomic_uint remainingJobs;
+} batchImage;
+
+
+typedef struct batchJob {
+    char* filename;
+    batchImage* image;
+    jobStatus status;
+    int32_t exitCode;
+    uint64_t instructions;
+    uint64_t elapsedNanoseconds;
+    uint32_t worker;
+} batchJob;
+
+
+/**
+ * Each worker owns a contiguous range of jobs [head, tail), packed into one word so that the owner (taking from the
+ * tail) and thieves (taking from the head) can claim jobs with a single compare-and-swap.
+ */
+typedef struct batchWorker {
+    _Atomic uint64_t range;
+    uint32_t index;
+    uint32_t rngState;
+    struct batchRunner* runner;
+    pthread_t thread;
+} batchWorker;
+
+
+typedef struct batchRunner {
+    batchJob* jobs;
+    uint32_t numJobs;
+    batchImage* images;
+    uint32_t numImages;
+    batchWorker* workers;
+    uint32_t numWorkers;
+    uint64_t maxInstructions;
+} batchRunner;
+
+
+#define range_pack(head, tail) ((((uint64_t) (head)) << 32) | (uint64_t) (tail))
+#define range_head(range)      ((uint32_t) ((range) >> 32))
+#define range_tail(range)      ((uint32_t) ((range) & 0xFFFFFFFFUL))
+
+
+// FUNCTION DECLARATIONS
+int main(int argc, char* argv[]);
+bool takeOwnJob(batchWorker* worker, uint32_t* jobIndex);
+bool stealJob(batchWorker* thief, uint32_t* jobIndex);
+void* workerMain(void* arg);
+void runJob(batchRunner* runner, batchJob* job);
+void groupJobsByImage(batchRunner* runner);
+int compareJobFilenames(const void* a, const void* b);
+VM_image* acquireImage(batchImage* image);
+uint64_t monotonicNanoseconds(void);
+bool readManifest(const char* filename, char*** files, uint32_t* numFiles, uint32_t* capacity);
+void appendFile(char*** files, uint32_t* numFiles, uint32_t* capacity, const char* filename, size_t length);
+void writeJsonString(FILE* out, const char* str);
+void writeResult(FILE* out, const batchJob* job);
+void printUsage(const char* programName);
+
+
+// FUNCTION DEFINITIONS
+
+int main(int argc, char* argv[])
+{
+    uint32_t numWorkers = 0;
+    uint64_t maxInstructions = DEFAULT_MAX_INSTRUCTIONS;
+    const char* outputFilename = NULL;
+
+    char** files = NULL;
+    uint32_t numFiles = 0;
+    uint32_t capacity = 0;
+
+    VM_setTraceLevel(VM_TRACE_OFF);
+
+    // Parse the command line
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "-j") == 0) && (i + 1 < argc)) {
+            numWorkers = (uint32_t) strtoul(argv[++i], NULL, 0);
+        } else if ((strcmp(argv[i], "-n") == 0) && (i + 1 < argc)) {
+            maxInstructions = strtoull(argv[++i], NULL, 0);
+        } else if ((strcmp(argv[i], "-o") == 0) && (i + 1 < argc)) {
+            outputFilename = argv[++i];
+        } else if ((strcmp(argv[i], "-m") == 0) && (i + 1 < argc)) {
+            if (!readManifest(argv[++i], &files, &numFiles, &capacity)) {
+                fprintf(stderr, "Unable to read manifest %s\n", argv[i]);
+                return 1;
+            }
+        } else if ((strcmp(argv[i], "--trace") == 0) && (i + 1 < argc)) {
+            static const char* const levelNames[] = {"off", "errors", "instructions", "full"};
+            const char* levelName = argv[++i];
+            uint8_t level = 0;
+            while ((level < 4) && (strcmp(levelName, levelNames[level]) != 0)) {
+                level++;
+            }
+            if (level == 4) {
+                fprintf(stderr, "Unknown trace level %s\n", levelName);
+                return 1;
+            }
+            VM_setTraceLevel(level);
+        } else if (argv[i][0] == '-') {
+            printUsage(argv[0]);
+            return 1;
+        } else {
+            appendFile(&files, &numFiles, &capacity, argv[i], strlen(argv[i]));
+        }
+    }
+
+    if (numFiles == 0) {
+        printUsage(argv[0]);
+        return 1;
+    }
+
+    // Default to one worker per online core
+    if (numWorkers == 0) {
+        long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        numWorkers = (cores > 0) ? (uint32_t) cores : 1;
+    }
+    if (numWorkers > numFiles) {
+        numWorkers = numFiles;
+    }
+
+    batchRunner runner;
+    runner.numJobs = numFiles;
+    runner.jobs = calloc(numFiles, sizeof(batchJob));
+    runner.numWorkers = numWorkers;
+    runner.workers = calloc(numWorkers, sizeof(batchWorker));
+    runner.maxInstructions = maxInstructions;
+    for (uint32_t i = 0; i < numFiles; i++) {
+        runner.jobs[i].filename = files[i];
+        runner.jobs[i].status = JOB_NOT_RUN;
+    }
+    groupJobsByImage(&runner);
+
+    // Deal the jobs out in contiguous blocks, one per worker. Stealing evens out any imbalance.
+    for (uint32_t w = 0; w < numWorkers; w++) {
+        uint32_t head = (uint32_t) (((uint64_t) numFiles * w) / numWorkers);
+        uint32_t tail = (uint32_t) (((uint64_t) numFiles * (w + 1)) / numWorkers);
+        atomic_init(&(runner.workers[w].range), range_pack(head, tail));
+        runner.workers[w].index = w;
+        runner.workers[w].rngState = 2463534242UL ^ (w * 0x9E3779B9UL);
+        runner.workers[w].runner = &runner;
+    }
+
+    uint64_t startTime = monotonicNanoseconds();
+    for (uint32_t w = 1; w < numWorkers; w++) {
+        pthread_create(&(runner.workers[w].thread), NULL, workerMain, &(runner.workers[w]));
+    }
+    workerMain(&(runner.workers[0]));
+    for (uint32_t w = 1; w < numWorkers; w++) {
+        pthread_join(runner.workers[w].thread, NULL);
+    }
+    uint64_t totalTime = monotonicNanoseconds() - startTime;
+
+    // Report the results in the order they were given
+    FILE* out = stdout;
+    if (outputFilename) {
+        out = fopen(outputFilename, "w");
+        if (!out) {
+            fprintf(stderr, "Unable to open %s\n", outputFilename);
+            return 1;
+        }
+    }
+
+    uint32_t numFailed = 0;
+    uint64_t totalInstructions = 0;
+    for (uint32_t i = 0; i < numFiles; i++) {
+        writeResult(out, &(runner.jobs[i]));
+        totalInstructions += runner.jobs[i].instructions;
+        if (runner.jobs[i].status != JOB_FINISHED) {
+            numFailed++;
+        }
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    fprintf(stderr, "{\"jobs\": %u, \"failed\": %u, \"workers\": %u, \"instructions\": %llu, \"time_us\": %.1f}\n",
+            numFiles, numFailed, numWorkers, (unsigned long long) totalInstructions, totalTime / 1000.0);
+
+    for (uint32_t i = 0; i < runner.numImages; i++) {
+        pthread_mutex_destroy(&(runner.images[i].lock));
+    }
+    free(runner.images);
+    free(runner.jobs);
+    free(runner.workers);
+    for (uint32_t i = 0; i < numFiles; i++) {
+        free(files[i]);
+    }
+    free(files);
+    return (numFailed == 0) ? 0 : 2;
+}
+
+
+/**
+ * Takes the job at the tail of the worker's own range. Returns false if the range is empty.
+ * @param worker
+ * @param jobIndex
+ * @return
+ */
+bool takeOwnJob(batchWorker* worker, uint32_t* jobIndex)
+{
+    uint64_t range = atomic_load(&(worker->range));
+    while (range_head(range) < range_tail(range)) {
+        uint64_t newRange = range_pack(range_head(range), range_tail(range) - 1);
+        if (atomic_compare_exchange_weak(&(worker->range), &range, newRange)) {
+            *jobIndex = range_tail(range) - 1;
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Takes the job at the head of another worker's range, starting from a random victim. Returns false once every other
+ * worker has run out of jobs.
+ * @param thief
+ * @param jobIndex
+ * @return
+ */
+bool stealJob(batchWorker* thief, uint32_t* jobIndex)
+{
+    batchRunner* runner = thief->runner;
+
+    // xorshift32 to pick where to start looking, so that thieves don't all pile onto the same victim
+    thief->rngState ^= thief->rngState << 13;
+    thief->rngState ^= thief->rngState >> 17;
+    thief->rngState ^= thief->rngState << 5;
+    uint32_t start = thief->rngState % runner->numWorkers;
+
+    for (uint32_t i = 0; i < runner->numWorkers; i++) {
+        batchWorker* victim = &(runner->workers[(start + i) % runner->numWorkers]);
+        if (victim == thief) {
+            continue;
+        }
+
+        uint64_t range = atomic_load(&(victim->range));
+        while (range_head(range) < range_tail(range)) {
+            uint64_t newRange = range_pack(range_head(range) + 1, range_tail(range));
+            if (atomic_compare_exchange_weak(&(victim->range), &range, newRange)) {
+                *jobIndex = range_head(range);
+                return true;
+            }
+        }
+    }
+
+    return false;
+}
+
+
+/**
+ * Runs jobs from the worker's own range, then steals from the others until there is nothing left.
+ * @param arg
+ * @return
+ */
+void* workerMain(void* arg)
+{
+    batchWorker* worker = (batchWorker*) arg;
+    uint32_t jobIndex;
+
+    while (takeOwnJob(worker, &jobIndex) || stealJob(worker, &jobIndex)) {
+        batchJob* job = &(worker->runner->jobs[jobIndex]);
+        job->worker = worker->index;
+        runJob(worker->runner, job);
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Loads and executes a single guest program, recording how it went in `job`.
+ * @param runner
+ * @param job
+ */
+void runJob(batchRunner* runner, batchJob* job)
+{
+    uint64_t startTime = monotonicNanoseconds();
+
+    VM_image* image = acquireImage(job->image);
+    VM_host host;
+    bool loaded = image && Host_init(&host, image, false);
+
+    // The host holds its own reference, so the image can be let go of as soon as the last job using it has started
+    if (atomic_fetch_sub(&(job->image->remainingJobs), 1) == 1) {
+        if (image) {
+            Image_release(image);
+        }
+    }
+
+    if (!loaded) {
+        job->status = JOB_LOAD_FAILED;
+        job->elapsedNanoseconds = monotonicNanoseconds() - startTime;
+        return;
+    }
+
+    // Execute in slices so that the 32-bit budget of VM_executeNInstructions isn't a limit
+    VM_instance vm = Host_newVM(&host);
+    uint64_t executed = 0;
+    while (!vm.finished && (executed < runner->maxInstructions)) {
+        uint64_t remaining = runner->maxInstructions - executed;
+        uint32_t slice = (remaining < INSTRUCTIONS_PER_SLICE) ? (uint32_t) remaining : INSTRUCTIONS_PER_SLICE;
+        executed += VM_executeNInstructions(&vm, slice);
+    }
+
+    job->status = vm.finished ? JOB_FINISHED : JOB_INSTRUCTION_LIMIT;
+    job->exitCode = host.exitCode;
+    job->instructions = executed;
+    Host_free(&host);
+    job->elapsedNanoseconds = monotonicNanoseconds() - startTime;
+}
+
+
+/**
+ * Finds the distinct filenames among the jobs, and points every job at the batchImage for its file.
+ * @param runner
+ */
+void groupJobsByImage(batchRunner* runner)
+{
+    batchJob** sorted = malloc(runner->numJobs * sizeof(batchJob*));
+    for (uint32_t i = 0; i < runner->numJobs; i++) {
+        sorted[i] = &(runner->jobs[i]);
+    }
+    qsort(sorted, runner->numJobs, sizeof(batchJob*), compareJobFilenames);
+
+    // There can be no more images than jobs
+    runner->images = calloc(runner->numJobs, sizeof(batchImage));
+    runner->numImages = 0;
+    batchImage* current = NULL;
+    for (uint32_t i = 0; i < runner->numJobs; i++) {
+        if (!current || (strcmp(current->filename, sorted[i]->filename) != 0)) {
+            current = &(runner->images[runner->numImages++]);
+            current->filename = sorted[i]->filename;
+            current->image = NULL;
+            current->loadAttempted = false;
+            pthread_mutex_init(&(current->lock), NULL);
+            atomic_init(&(current->remainingJobs), 0);
+        }
+        atomic_fetch_add(&(current->remainingJobs), 1);
+        sorted[i]->image = current;
+    }
+
+    free(sorted);
+}
+
+
+int compareJobFilenames(const void* a, const void* b)
+{
+    return strcmp((*(batchJob* const*) a)->filename, (*(batchJob* const*) b)->filename);
+}
+
+
+/**
+ * Returns the loaded image for a file, loading it if this is the first job to need it. Returns NULL if the file
+ * couldn't be loaded.
+ * @param image
+ * @return
+ */
+VM_image* acquireImage(batchImage* image)
+{
+    pthread_mutex_lock(&(image->lock));
+    if (!image->loadAttempted) {
+        image->image = Image_loadElf(image->filename, false);
+        image->loadAttempted = true;
+    }
+    VM_image* loaded = image->image;
+    pthread_mutex_unlock(&(image->lock));
+    return loaded;
+}
+
+
+uint64_t monotonicNanoseconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+
+/**
+ * Adds every filename listed in the manifest to `files`.
+ * @param filename
+ * @param files
+ * @param numFiles
+ * @param capacity
+ * @return
+ */
+bool readManifest(const char* filename, char*** files, uint32_t* numFiles, uint32_t* capacity)
+{
+    FILE* manifest = fopen(filename, "r");
+    if (!manifest) {
+        return false;
+    }
+
+    char line[4096];
+    while (fgets(line, sizeof(line), manifest)) {
+        // Strip the line ending and any trailing whitespace
+        size_t length = strlen(line);
+        while ((length > 0) && ((line[length-1] == '\n') || (line[length-1] == '\r') ||
+                                (line[length-1] == ' ') || (line[length-1] == '\t'))) {
+            line[--length] = '\0';
+        }
+
+        if ((length == 0) || (line[0] == '#')) {
+            continue;
+        }
+
+        appendFile(files, numFiles, capacity, line, length);
+    }
+
+    fclose(manifest);
+    return true;
+}
+
+
+/**
+ * Adds a copy of the first `length` characters of `filename` to the end of `files`.
+ * @param files
+ * @param numFiles
+ * @param capacity
+ * @param filename
+ * @param length
+ */
+void appendFile(char*** files, uint32_t* numFiles, uint32_t* capacity, const char* filename, size_t length)
+{
+    if (*numFiles == *capacity) {
+        *capacity = (*capacity == 0) ? 64 : (*capacity * 2);
+        *files = realloc(*files, *capacity * sizeof(char*));
+    }
+
+    char* copy = malloc(length + 1);
+    memcpy(copy, filename, length);
+    copy[length] = '\0';
+    (*files)[(*numFiles)++] = copy;
+}
+
+
+void writeJsonString(FILE* out, const char* str)
+{
+    fputc('"', out);
+    for (; *str; str++) {
+        unsigned char c = (unsigned char) *str;
+        if ((c == '"') || (c == '\\')) {
+            fputc('\\', out);
+            fputc(c, out);
+        } else if (c < 0x20) {
+            fprintf(out, "\\u%04x", c);
+        } else {
+            fputc(c, out);
+        }
+    }
+    fputc('"', out);
+}
+
+
+/**
+ * Writes the outcome of a job as a single line of JSON. The exit code is reported as the process exit status that
+ * ARMTinyVM itself would have returned.
+ * @param out
+ * @param job
+ */
+void writeResult(FILE* out, const batchJob* job)
+{
+    static const char* const statusNames[] = {"not_run", "finished", "load_failed", "instruction_limit"};
+
+    fputs("{\"file\": ", out);
+    writeJsonString(out, job->filename);
+    fprintf(out, ", \"status\": \"%s\"", statusNames[job->status]);
+    if (job->status == JOB_FINISHED) {
+        fprintf(out, ", \"exit_code\": %u", (uint8_t) job->exitCode);
+    } else {
+        fputs(", \"exit_code\": null", out);
+    }
+    fprintf(out, ", \"instructions\": %llu, \"time_us\": %.1f, \"worker\": %u}\n",
+            (unsigned long long) job->instructions, job->elapsedNanoseconds / 1000.0, job->worker);
+}
+
+
+void printUsage(const char* programName)
+{
+    fprintf(stderr,
+            "Usage: %s [-j threads] [-n maxInstructions] [-m manifest] [-o output] [--trace level] [file.elf ...]\n",
+            programName);
+}
@@ -0,0 +1,622 @@
+#include "bintrace.h"
+#include "lz.h"
+#include <stdlib.h>
+#include <string.h>
+
+// Zigzag encoding maps small distances of either sign to small unsigned numbers: 0, -1, 1, -2, ... to 0, 1, 2, 3, ...
+#define bintrace_zigzag(delta) (((uint32_t) (delta) << 1) ^ (uint32_t) ((int32_t) (delta) >> 31))
+#define bintrace_unzigzag(value) (((value) >> 1) ^ (0UL - ((value) & 1)))
+
+// The largest chunk a reader will accept, so that a corrupt header can't make it allocate without limit
+#define BINTRACE_MAX_CHUNK_SIZE (64UL * 1024 * 1024)
+
+
+// PRIVATE FUNCTION DECLARATIONS
+void startChunk(VM_binaryTrace* trace, uint16_t index, uint64_t firstInstruction);
+void nextChunk(VM_binaryTrace* trace, uint64_t firstInstruction);
+void sealChunk(VM_binaryTrace* trace);
+uint8_t* putVarint(uint8_t* out, uint32_t value);
+bool writeHeader(FILE* file, bool compress);
+bool writeChunk(FILE* file, const binTraceChunkHeader* chunk, const uint8_t* records, bool compress);
+bool readChunk(VM_binaryTraceReader* reader);
+bool takeBytes(VM_binaryTraceReader* reader, uint8_t* bytes, uint8_t length);
+bool takeVarint(VM_binaryTraceReader* reader, uint32_t* value);
+uint8_t readStoredByte(uint32_t offset);
+
+
+// The stored chunk being decompressed by readChunk, for readStoredByte
+static const uint8_t* decompressSource = NULL;
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Sets up a trace which keeps the most recent `numChunks` chunks of `chunkSize` bytes of records in memory. Returns
+ * false if a chunk is too small to hold a record, or there isn't enough memory.
+ * @param trace
+ * @param chunkSize
+ * @param numChunks
+ * @return
+ */
+bool BinTrace_init(VM_binaryTrace* trace, uint32_t chunkSize, uint16_t numChunks)
+{
+    memset(trace, 0, sizeof(VM_binaryTrace));
+    if ((chunkSize <= BINTRACE_MAX_RECORD_SIZE) || (chunkSize > BINTRACE_MAX_CHUNK_SIZE) || (numChunks == 0)) {
+        return false;
+    }
+
+    trace->chunkSize = chunkSize;
+    trace->numChunks = numChunks;
+    trace->chunks = calloc(numChunks, sizeof(binTraceChunkHeader));
+    trace->chunkData = malloc((size_t) chunkSize * numChunks);
+    if (!trace->chunks || !trace->chunkData) {
+        BinTrace_free(trace);
+        return false;
+    }
+
+    startChunk(trace, 0, 0);
+    return true;
+}
+
+
+/**
+ * Makes the trace write each chunk to a new file at `filename` as it fills up, as well as keeping it in memory, with
+ * the records compressed if `compress` is set. Returns false if the file couldn't be created.
+ * @param trace
+ * @param filename
+ * @param compress
+ * @return
+ */
+bool BinTrace_streamTo(VM_binaryTrace* trace, const char* filename, bool compress)
+{
+    trace->stream = fopen(filename, "wb");
+    if (!trace->stream) {
+        return false;
+    }
+
+    trace->compress = compress;
+    trace->streamFailed = !writeHeader(trace->stream, compress);
+    return true;
+}
+
+
+/**
+ * Starts tracing every instruction `vm` executes, from its current state, in a new chunk. The trace must stay where it
+ * is until it is stopped.
+ * @param trace
+ * @param vm
+ */
+void BinTrace_attach(VM_binaryTrace* trace, VM_instance* vm)
+{
+    trace->vm = vm;
+    memcpy(trace->registers, vm->registers, sizeof(trace->registers));
+    trace->cpsr = vm->cpsr;
+    if (trace->chunks[trace->current].numRecords > 0) {
+        nextChunk(trace, vm->instructionCount + 1);
+    } else {
+        startChunk(trace, trace->current, vm->instructionCount + 1);
+    }
+
+    vm->instrumentation = trace;
+    vm->instructionExecuted = &BinTrace_record;
+}
+
+
+/**
+ * Installed as the `instructionExecuted` hook of the VM by BinTrace_attach. Appends a record of the instruction just
+ * executed to the current chunk, moving on to the next chunk first if it might not fit.
+ * @param vm
+ * @param address
+ * @param instruction
+ */
+void BinTrace_record(VM_instance* vm, uint32_t address, uint16_t instruction)
+{
+    VM_binaryTrace* trace = (VM_binaryTrace*) vm->instrumentation;
+    if (trace->write > trace->limit) {
+        nextChunk(trace, vm->instructionCount);
+    }
+
+    uint8_t* out = trace->write + 1;
+    uint8_t flags = 0;
+    if (address != trace->registers[15]) {
+        flags |= BINTRACE_JUMP;
+        out = putVarint(out, bintrace_zigzag(address - trace->registers[15]));
+    }
+    out[0] = (uint8_t) instruction;
+    out[1] = (uint8_t) (instruction >> 8);
+    out += 2;
+
+    // The PC only counts as changed if the instruction didn't just move on to the next one
+    trace->registers[15] = address + 2;
+    // Unrolled, this is a short run of compares with no branches
+    uint16_t changedRegisters = 0;
+#pragma GCC unroll 16
+    for (uint8_t i = 0; i < 16; i++) {
+        changedRegisters |= (uint16_t) ((vm->registers[i] != trace->registers[i]) << i);
+    }
+    if (changedRegisters) {
+        flags |= BINTRACE_REGISTERS;
+        out[0] = (uint8_t) changedRegisters;
+        out[1] = (uint8_t) (changedRegisters >> 8);
+        out += 2;
+        for (uint16_t remaining = changedRegisters; remaining != 0; remaining &= remaining - 1) {
+            uint8_t i = (uint8_t) __builtin_ctz(remaining);
+            out = putVarint(out, bintrace_zigzag(vm->registers[i] - trace->registers[i]));
+            trace->registers[i] = vm->registers[i];
+        }
+    }
+
+    uint32_t cpsrChanges = vm->cpsr ^ trace->cpsr;
+    if (cpsrChanges & 0x0FFFFFFF) {
+        flags |= BINTRACE_CPSR;
+        memcpy(out, &vm->cpsr, sizeof(uint32_t));
+        out += sizeof(uint32_t);
+    } else if (cpsrChanges) {
+        flags |= BINTRACE_FLAGS | (uint8_t) ((vm->cpsr >> 24) & 0xF0);
+    }
+    trace->cpsr = vm->cpsr;
+
+    trace->write[0] = flags;
+    trace->write = out;
+    trace->chunks[trace->current].numRecords++;
+}
+
+
+/**
+ * Stops tracing the VM. If the trace is being streamed, the chunk being filled is written out and the file is closed.
+ * The records stay in memory until the trace is freed. Returns false if any of the file couldn't be written.
+ * @param trace
+ * @return
+ */
+bool BinTrace_stop(VM_binaryTrace* trace)
+{
+    if (trace->vm) {
+        trace->vm->instructionExecuted = NULL;
+        trace->vm->instrumentation = NULL;
+        trace->vm = NULL;
+    }
+
+    sealChunk(trace);
+    if (!trace->stream) {
+        return true;
+    }
+
+    binTraceChunkHeader* chunk = &trace->chunks[trace->current];
+    bool success = !trace->streamFailed;
+    if (chunk->numRecords > 0) {
+        success = writeChunk(trace->stream, chunk, &trace->chunkData[(size_t) trace->current * trace->chunkSize],
+                             trace->compress) && success;
+    }
+    success = (fclose(trace->stream) == 0) && success;
+    trace->stream = NULL;
+    return success;
+}
+
+
+/**
+ * Writes the chunks held in memory, i.e. the most recent part of the trace, to a new file at `filename`. Returns false
+ * if it couldn't be written.
+ * @param trace
+ * @param filename
+ * @param compress
+ * @return
+ */
+bool BinTrace_save(VM_binaryTrace* trace, const char* filename, bool compress)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+
+    sealChunk(trace);
+    bool success = writeHeader(file, compress);
+    for (uint16_t i = trace->numFilled + 1; (i > 0) && success; i--) {
+        uint16_t index = (trace->current + trace->numChunks - (i - 1)) % trace->numChunks;
+        if (trace->chunks[index].numRecords > 0) {
+            success = writeChunk(file, &trace->chunks[index], &trace->chunkData[(size_t) index * trace->chunkSize],
+                                 compress);
+        }
+    }
+    return (fclose(file) == 0) && success;
+}
+
+
+/**
+ * Stops the trace if it hasn't been already, and frees its chunks.
+ * @param trace
+ */
+void BinTrace_free(VM_binaryTrace* trace)
+{
+    if (trace->vm || trace->stream) {
+        BinTrace_stop(trace);
+    }
+
+    free(trace->chunks);
+    free(trace->chunkData);
+    trace->chunks = NULL;
+    trace->chunkData = NULL;
+}
+
+
+/**
+ * Opens the trace file at `filename` for reading. Returns false if it couldn't be opened, or isn't a trace.
+ * @param reader
+ * @param filename
+ * @return
+ */
+bool BinTrace_openReader(VM_binaryTraceReader* reader, const char* filename)
+{
+    memset(reader, 0, sizeof(VM_binaryTraceReader));
+    reader->file = fopen(filename, "rb");
+    if (!reader->file) {
+        return false;
+    }
+
+    binTraceHeader header;
+    if ((fread(&header, sizeof(header), 1, reader->file) != 1) ||
+        (memcmp(header.magic, BINTRACE_MAGIC, sizeof(header.magic)) != 0) || (header.version != BINTRACE_VERSION)) {
+        BinTrace_closeReader(reader);
+        return false;
+    }
+    reader->compressed = (header.flags & BINTRACE_FLAG_COMPRESSED) != 0;
+    return true;
+}
+
+
+/**
+ * Reads the next instruction from the trace into `entry`. Returns false at the end of the trace, and also sets
+ * `corrupt` if the trace didn't end cleanly.
+ * @param reader
+ * @param entry
+ * @return
+ */
+bool BinTrace_read(VM_binaryTraceReader* reader, binTraceEntry* entry)
+{
+    while (reader->recordsLeft == 0) {
+        if (!readChunk(reader)) {
+            return false;
+        }
+    }
+
+    uint8_t flags;
+    uint8_t bytes[4];
+    uint32_t value;
+    if (!takeBytes(reader, &flags, 1)) {
+        return false;
+    }
+
+    entry->address = reader->registers[15];
+    if (flags & BINTRACE_JUMP) {
+        if (!takeVarint(reader, &value)) {
+            return false;
+        }
+        entry->address += bintrace_unzigzag(value);
+    }
+    if (!takeBytes(reader, bytes, 2)) {
+        return false;
+    }
+    entry->instruction = (uint16_t) (bytes[0] | (bytes[1] << 8));
+
+    reader->registers[15] = entry->address + 2;
+    entry->changedRegisters = 0;
+    if (flags & BINTRACE_REGISTERS) {
+        if (!takeBytes(reader, bytes, 2)) {
+            return false;
+        }
+        entry->changedRegisters = (uint16_t) (bytes[0] | (bytes[1] << 8));
+        for (uint8_t i = 0; i < 16; i++) {
+            if (entry->changedRegisters & (1U << i)) {
+                if (!takeVarint(reader, &value)) {
+                    return false;
+                }
+                reader->registers[i] += bintrace_unzigzag(value);
+            }
+        }
+    }
+
+    if (flags & BINTRACE_CPSR) {
+        if (!takeBytes(reader, bytes, 4)) {
+            return false;
+        }
+        memcpy(&reader->cpsr, bytes, sizeof(uint32_t));
+    } else if (flags & BINTRACE_FLAGS) {
+        reader->cpsr = (reader->cpsr & 0x0FFFFFFF) | ((uint32_t) (flags & 0xF0) << 24);
+    }
+
+    entry->instructionCount = reader->instructionCount++;
+    entry->jumped = (flags & BINTRACE_JUMP) != 0;
+    entry->flagsChanged = (flags & (BINTRACE_FLAGS | BINTRACE_CPSR)) != 0;
+    memcpy(entry->registers, reader->registers, sizeof(entry->registers));
+    entry->cpsr = reader->cpsr;
+    reader->recordsLeft--;
+    return true;
+}
+
+
+/**
+ * Closes a trace file opened by BinTrace_openReader.
+ * @param reader
+ */
+void BinTrace_closeReader(VM_binaryTraceReader* reader)
+{
+    if (reader->file) {
+        fclose(reader->file);
+    }
+    free(reader->records);
+    free(reader->stored);
+    reader->file = NULL;
+    reader->records = NULL;
+    reader->stored = NULL;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Makes chunk `index` the current one, empty, starting from the trace's copy of the VM's state.
+ * @param trace
+ * @param index
+ * @param firstInstruction
+ */
+void startChunk(VM_binaryTrace* trace, uint16_t index, uint64_t firstInstruction)
+{
+    binTraceChunkHeader* chunk = &trace->chunks[index];
+    chunk->firstInstruction = firstInstruction;
+    memcpy(chunk->registers, trace->registers, sizeof(chunk->registers));
+    chunk->cpsr = trace->cpsr;
+    chunk->numRecords = 0;
+    chunk->length = 0;
+
+    trace->current = index;
+    trace->write = &trace->chunkData[(size_t) index * trace->chunkSize];
+    trace->limit = trace->write + trace->chunkSize - BINTRACE_MAX_RECORD_SIZE;
+}
+
+
+/**
+ * Finishes the current chunk, writing it out if the trace is being streamed, and starts the next one, which replaces
+ * the oldest chunk once they are all in use.
+ * @param trace
+ * @param firstInstruction
+ */
+void nextChunk(VM_binaryTrace* trace, uint64_t firstInstruction)
+{
+    sealChunk(trace);
+    if (trace->stream && !writeChunk(trace->stream, &trace->chunks[trace->current],
+                                     &trace->chunkData[(size_t) trace->current * trace->chunkSize], trace->compress)) {
+        trace->streamFailed = true;
+    }
+
+    if (trace->numFilled < trace->numChunks - 1) {
+        trace->numFilled++;
+    }
+    startChunk(trace, (trace->current + 1) % trace->numChunks, firstInstruction);
+}
+
+
+/**
+ * Brings the length of the current chunk up to date with the records written to it.
+ * @param trace
+ */
+void sealChunk(VM_binaryTrace* trace)
+{
+    trace->chunks[trace->current].length =
+            (uint32_t) (trace->write - &trace->chunkData[(size_t) trace->current * trace->chunkSize]);
+}
+
+
+/**
+ * Writes `value` as a varint (LEB128), and returns where the next byte goes.
+ * @param out
+ * @param value
+ * @return
+ */
+uint8_t* putVarint(uint8_t* out, uint32_t value)
+{
+    while (value >= 0x80) {
+        *out++ = (uint8_t) (value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (uint8_t) value;
+    return out;
+}
+
+
+/**
+ * Writes the header at the start of a trace file.
+ * @param file
+ * @param compress
+ * @return
+ */
+bool writeHeader(FILE* file, bool compress)
+{
+    binTraceHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, BINTRACE_MAGIC, sizeof(header.magic));
+    header.version = BINTRACE_VERSION;
+    header.flags = compress ? BINTRACE_FLAG_COMPRESSED : 0;
+    return fwrite(&header, sizeof(header), 1, file) == 1;
+}
+
+
+/**
+ * Writes a chunk to a trace file, compressing its records a block at a time if `compress` is set.
+ * @param file
+ * @param chunk
+ * @param records
+ * @param compress
+ * @return
+ */
+bool writeChunk(FILE* file, const binTraceChunkHeader* chunk, const uint8_t* records, bool compress)
+{
+    binTraceChunkHeader header = *chunk;
+    if (!compress) {
+        header.storedLength = header.length;
+        return (fwrite(&header, sizeof(header), 1, file) == 1) &&
+               (fwrite(records, 1, header.length, file) == header.length);
+    }
+
+    uint32_t numBlocks = (header.length + LZ_MAX_BLOCK_SIZE - 1) / LZ_MAX_BLOCK_SIZE;
+    uint8_t* stored = malloc((size_t) numBlocks * (sizeof(uint16_t) + lz_max_compressed_size(LZ_MAX_BLOCK_SIZE)));
+    if (!stored) {
+        return false;
+    }
+
+    header.storedLength = 0;
+    for (uint32_t offset = 0; offset < header.length; offset += LZ_MAX_BLOCK_SIZE) {
+        uint16_t blockLength = (header.length - offset < LZ_MAX_BLOCK_SIZE) ? (uint16_t) (header.length - offset)
+                                                                            : LZ_MAX_BLOCK_SIZE;
+        uint8_t* block = &stored[header.storedLength + sizeof(uint16_t)];
+        uint16_t storedLength = LZ_compress(&records[offset], blockLength, block);
+        if (storedLength >= blockLength) {
+            // It didn't compress, so store it as it is
+            memcpy(block, &records[offset], blockLength);
+            storedLength = blockLength;
+        }
+        memcpy(&stored[header.storedLength], &storedLength, sizeof(uint16_t));
+        header.storedLength += sizeof(uint16_t) + storedLength;
+    }
+
+    bool success = (fwrite(&header, sizeof(header), 1, file) == 1) &&
+                   (fwrite(stored, 1, header.storedLength, file) == header.storedLength);
+    free(stored);
+    return success;
+}
+
+
+/**
+ * Reads the next chunk of the file, decompressing its records if necessary. Returns false at the end of the file, and
+ * also sets `corrupt` if the chunk couldn't be read.
+ * @param reader
+ * @return
+ */
+bool readChunk(VM_binaryTraceReader* reader)
+{
+    if (fread(&reader->chunk, sizeof(binTraceChunkHeader), 1, reader->file) != 1) {
+        reader->corrupt = !feof(reader->file);
+        return false;
+    }
+
+    binTraceChunkHeader* chunk = &reader->chunk;
+    if (chunk->length > BINTRACE_MAX_CHUNK_SIZE) {
+        reader->corrupt = true;
+        return false;
+    }
+    uint32_t maxStoredLength = chunk->length + (chunk->length / LZ_MAX_BLOCK_SIZE + 1) * sizeof(uint16_t);
+    if (chunk->storedLength > (reader->compressed ? maxStoredLength : chunk->length)) {
+        reader->corrupt = true;
+        return false;
+    }
+
+    if (maxStoredLength > reader->capacity) {
+        free(reader->records);
+        free(reader->stored);
+        reader->records = malloc(maxStoredLength);
+        reader->stored = malloc(maxStoredLength);
+        reader->capacity = (reader->records && reader->stored) ? maxStoredLength : 0;
+        if (reader->capacity == 0) {
+            reader->corrupt = true;
+            return false;
+        }
+    }
+
+    uint8_t* destination = reader->compressed ? reader->stored : reader->records;
+    if ((fread(destination, 1, chunk->storedLength, reader->file) != chunk->storedLength) ||
+        (!reader->compressed && (chunk->storedLength != chunk->length))) {
+        reader->corrupt = true;
+        return false;
+    }
+
+    if (reader->compressed) {
+        uint32_t position = 0;
+        decompressSource = reader->stored;
+        for (uint32_t offset = 0; offset < chunk->length; offset += LZ_MAX_BLOCK_SIZE) {
+            uint16_t blockLength = (chunk->length - offset < LZ_MAX_BLOCK_SIZE) ? (uint16_t) (chunk->length - offset)
+                                                                               : LZ_MAX_BLOCK_SIZE;
+            uint16_t storedLength;
+            if (position + sizeof(uint16_t) > chunk->storedLength) {
+                reader->corrupt = true;
+                return false;
+            }
+            memcpy(&storedLength, &reader->stored[position], sizeof(uint16_t));
+            position += sizeof(uint16_t);
+            if ((storedLength > blockLength) || (position + storedLength > chunk->storedLength)) {
+                reader->corrupt = true;
+                return false;
+            }
+
+            if (storedLength == blockLength) {
+                memcpy(&reader->records[offset], &reader->stored[position], blockLength);
+            } else if (LZ_decompress(readStoredByte, position, storedLength, &reader->records[offset], blockLength) !=
+                       blockLength) {
+                reader->corrupt = true;
+                return false;
+            }
+            position += storedLength;
+        }
+    }
+
+    memcpy(reader->registers, chunk->registers, sizeof(reader->registers));
+    reader->cpsr = chunk->cpsr;
+    reader->instructionCount = chunk->firstInstruction;
+    reader->position = 0;
+    reader->recordsLeft = chunk->numRecords;
+    return true;
+}
+
+
+/**
+ * Takes the next `length` bytes of the current chunk's records. Returns false, and sets `corrupt`, if there aren't
+ * that many left.
+ * @param reader
+ * @param bytes
+ * @param length
+ * @return
+ */
+bool takeBytes(VM_binaryTraceReader* reader, uint8_t* bytes, uint8_t length)
+{
+    if (reader->position + length > reader->chunk.length) {
+        reader->corrupt = true;
+        return false;
+    }
+    memcpy(bytes, &reader->records[reader->position], length);
+    reader->position += length;
+    return true;
+}
+
+
+/**
+ * Takes a varint (LEB128) of up to 32 bits from the current chunk's records.
+ * @param reader
+ * @param value
+ * @return
+ */
+bool takeVarint(VM_binaryTraceReader* reader, uint32_t* value)
+{
+    *value = 0;
+    for (uint8_t shift = 0; shift < 35; shift += 7) {
+        uint8_t byte;
+        if (!takeBytes(reader, &byte, 1)) {
+            return false;
+        }
+        *value |= (uint32_t) (byte & 0x7F) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    reader->corrupt = true;
+    return false;
+}
+
+
+/**
+ * Reads a byte of the stored chunk being decompressed, for LZ_decompress.
+ * @param offset
+ * @return
+ */
+uint8_t readStoredByte(uint32_t offset)
+{
+    return decompressSource[offset];
+}
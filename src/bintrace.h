@@ -0,0 +1,145 @@
+/*
+ * A binary instruction trace: a record of the address, opcode and changed registers of every instruction a VM
+ * executes, compact and fast enough to leave on while a program runs at speed. The decoder (ARMTinyVM_tracedump)
+ * turns it back into the trace's mnemonics, with the result of each instruction.
+ *
+ * The trace is kept in memory as a ring of `numChunks` chunks of `chunkSize` bytes, so the most recent instructions are
+ * always there to be saved (BinTrace_save), e.g. after a crash. Each chunk starts from the full state of the registers,
+ * followed by one record per instruction holding only what changed since the previous one:
+ *   a flags byte: BINTRACE_JUMP, BINTRACE_FLAGS, BINTRACE_CPSR and BINTRACE_REGISTERS, with N, Z, C and V in the top
+ *                 four bits
+ *   if BINTRACE_JUMP, the distance from where the previous instruction left the PC to this instruction's address
+ *   the opcode, as two bytes
+ *   if BINTRACE_REGISTERS, a 16-bit mask of the registers changed, then the change to each of them. The PC is only
+ *                 included if it didn't move on to the next instruction, and is relative to that.
+ *   if BINTRACE_CPSR, the whole CPSR, as four bytes. Otherwise BINTRACE_FLAGS means only N, Z, C and V changed.
+ * Distances and changes are zigzag-encoded varints (LEB128), so small ones of either sign take a single byte. An interrupt
+ * taken at the end of a branch shows up in that branch's record, and anything which changes the registers in between
+ * instructions (such as the host) shows up in the next record, which is marked as a jump if it moved the PC.
+ *
+ * Chunks can also be streamed to a file as they fill up (BinTrace_streamTo), so that the whole run is kept. In a file,
+ * each chunk is a binTraceChunkHeader followed by its records, which may be compressed: if BINTRACE_FLAG_COMPRESSED is
+ * set, every LZ_MAX_BLOCK_SIZE bytes of them are a 16-bit stored length and a block compressed with LZ_compress, or
+ * stored as it is if it didn't get any smaller. The file starts with a binTraceHeader.
+*/
+
+#ifndef BINTRACE_H
+#define BINTRACE_H
+
+#include "ARMTinyVM.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define BINTRACE_MAGIC "ATVMTRCE"
+#define BINTRACE_VERSION 1
+#define BINTRACE_DEFAULT_CHUNK_SIZE 65536
+#define BINTRACE_DEFAULT_NUM_CHUNKS 16
+
+// Bits of binTraceHeader.flags
+#define BINTRACE_FLAG_COMPRESSED 0x1
+
+// Bits of the flags byte of a record
+#define BINTRACE_JUMP 0x1
+#define BINTRACE_FLAGS 0x2
+#define BINTRACE_CPSR 0x4
+#define BINTRACE_REGISTERS 0x8
+
+// The longest a record can be: the flags byte, a jump, the opcode, the register mask, every register and the CPSR
+#define BINTRACE_MAX_RECORD_SIZE (1 + 5 + 2 + 2 + (16 * 5) + 4)
+
+
+/**
+ * The start of a trace file.
+ */
+typedef struct binTraceHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+} binTraceHeader;
+
+
+/**
+ * The state of the VM before the first record of a chunk, and the size of its records. `firstInstruction` is the
+ * instruction count of the first record, and the rest follow on from it.
+ */
+typedef struct binTraceChunkHeader {
+    uint64_t firstInstruction;
+    uint32_t registers[16];
+    uint32_t cpsr;
+    uint32_t numRecords;
+    uint32_t length; // Of the records, uncompressed
+    uint32_t storedLength; // Of what follows this header in a file
+} binTraceChunkHeader;
+
+
+/**
+ * A ring of `numChunks` chunks, of which `current` is being filled. `registers` and `cpsr` are the VM's state as of
+ * the last record, with the PC moved on to the next instruction.
+ */
+typedef struct VM_binaryTrace {
+    uint32_t chunkSize;
+    uint16_t numChunks;
+    uint16_t current;
+    uint16_t numFilled; // The number of chunks before `current` which hold records
+    binTraceChunkHeader* chunks;
+    uint8_t* chunkData;
+    uint8_t* write; // Where the next record goes
+    uint8_t* limit; // Past this, the next record might not fit
+    uint32_t registers[16];
+    uint32_t cpsr;
+    VM_instance* vm;
+    FILE* stream;
+    bool compress;
+    bool streamFailed;
+} VM_binaryTrace;
+
+
+/**
+ * One instruction read back from a trace file: its registers and CPSR are as they were after it executed.
+ */
+typedef struct binTraceEntry {
+    uint64_t instructionCount;
+    uint32_t address;
+    uint16_t instruction;
+    bool jumped; // Something other than the previous instruction moved the PC here
+    bool flagsChanged;
+    uint16_t changedRegisters;
+    uint32_t registers[16];
+    uint32_t cpsr;
+} binTraceEntry;
+
+
+/**
+ * Reads a trace file a chunk at a time.
+ */
+typedef struct VM_binaryTraceReader {
+    FILE* file;
+    bool compressed;
+    bool corrupt; // Set if the file ended part way through a chunk, or a record didn't make sense
+    binTraceChunkHeader chunk;
+    uint8_t* records;
+    uint8_t* stored;
+    uint32_t capacity; // Of `records` and `stored`
+    uint32_t position; // In `records`
+    uint32_t recordsLeft;
+    uint64_t instructionCount;
+    uint32_t registers[16];
+    uint32_t cpsr;
+} VM_binaryTraceReader;
+
+
+bool BinTrace_init(VM_binaryTrace* trace, uint32_t chunkSize, uint16_t numChunks);
+bool BinTrace_streamTo(VM_binaryTrace* trace, const char* filename, bool compress);
+void BinTrace_attach(VM_binaryTrace* trace, VM_instance* vm);
+void BinTrace_record(VM_instance* vm, uint32_t address, uint16_t instruction);
+bool BinTrace_stop(VM_binaryTrace* trace);
+bool BinTrace_save(VM_binaryTrace* trace, const char* filename, bool compress);
+void BinTrace_free(VM_binaryTrace* trace);
+
+bool BinTrace_openReader(VM_binaryTraceReader* reader, const char* filename);
+bool BinTrace_read(VM_binaryTraceReader* reader, binTraceEntry* entry);
+void BinTrace_closeReader(VM_binaryTraceReader* reader);
+
+
+#endif // BINTRACE_H
@@ -0,0 +1,229 @@
+#define _DEFAULT_SOURCE
+#include "coverage.h"
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <sys/shm.h>
+#endif // _WIN32
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+void coverageBranched(VM_instance* vm, uint32_t from, uint32_t to, VM_branchKind kind);
+bool setMapSize(VM_coverage* coverage, uint32_t mapSize);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Sets up coverage into a zeroed map of `mapSize` counters, which must be a power of two from COVERAGE_MIN_MAP_SIZE to
+ * COVERAGE_MAX_MAP_SIZE. Returns false if it isn't, or there isn't the memory for the map.
+ * @param coverage
+ * @param mapSize
+ * @return
+ */
+bool Coverage_init(VM_coverage* coverage, uint32_t mapSize)
+{
+    if (!setMapSize(coverage, mapSize)) {
+        return false;
+    }
+
+    coverage->map = calloc(mapSize, 1);
+    coverage->ownsMap = true;
+    coverage->sharedMap = false;
+    coverage->previous = 0;
+    return coverage->map != NULL;
+}
+
+
+/**
+ * Sets up coverage into `map`, of `mapSize` counters, which the caller owns and must outlive the coverage. The map is
+ * used as it is, without being cleared. Returns false if `mapSize` isn't a power of two in range.
+ * @param coverage
+ * @param map
+ * @param mapSize
+ * @return
+ */
+bool Coverage_initWithMap(VM_coverage* coverage, uint8_t* map, uint32_t mapSize)
+{
+    if (!setMapSize(coverage, mapSize)) {
+        return false;
+    }
+
+    coverage->map = map;
+    coverage->ownsMap = false;
+    coverage->sharedMap = false;
+    coverage->previous = 0;
+    return true;
+}
+
+
+/**
+ * Sets up coverage into the shared memory AFL has created for this run, whose ID it passes in COVERAGE_AFL_SHM_ENV,
+ * and whose size it passes in COVERAGE_AFL_MAP_SIZE_ENV if it isn't COVERAGE_DEFAULT_MAP_SIZE. Returns false if the
+ * program isn't being run by AFL, or the memory couldn't be attached.
+ * @param coverage
+ * @return
+ */
+bool Coverage_initAFL(VM_coverage* coverage)
+{
+#ifdef _WIN32
+    (void) coverage;
+    return false;
+#else
+    const char* shmID = getenv(COVERAGE_AFL_SHM_ENV);
+    const char* mapSizeText = getenv(COVERAGE_AFL_MAP_SIZE_ENV);
+    uint32_t mapSize = mapSizeText ? (uint32_t) strtoul(mapSizeText, NULL, 0) : COVERAGE_DEFAULT_MAP_SIZE;
+    if (!shmID || !setMapSize(coverage, mapSize)) {
+        return false;
+    }
+
+    void* map = shmat((int) strtol(shmID, NULL, 10), NULL, 0);
+    if (map == (void*) -1) {
+        return false;
+    }
+
+    coverage->map = (uint8_t*) map;
+    coverage->ownsMap = false;
+    coverage->sharedMap = true;
+    coverage->previous = 0;
+    return true;
+#endif // _WIN32
+}
+
+
+/**
+ * Starts recording the edges `vm` takes, by taking over its `branched` hook.
+ * @param coverage
+ * @param vm
+ */
+void Coverage_attach(VM_coverage* coverage, VM_instance* vm)
+{
+    vm->branchInstrumentation = coverage;
+    vm->branched = coverageBranched;
+}
+
+
+/**
+ * Stops recording the edges `vm` takes.
+ * @param coverage
+ * @param vm
+ */
+void Coverage_detach(VM_coverage* coverage, VM_instance* vm)
+{
+    (void) coverage;
+    vm->branched = NULL;
+    vm->branchInstrumentation = NULL;
+}
+
+
+/**
+ * Clears the map, and forgets the previous block, ready for the next input.
+ * @param coverage
+ */
+void Coverage_reset(VM_coverage* coverage)
+{
+    memset(coverage->map, 0, coverage->mapSize);
+    coverage->previous = 0;
+}
+
+
+/**
+ * Returns the number of counters which aren't zero: roughly, the number of distinct edges taken since the last reset.
+ * @param coverage
+ * @return
+ */
+uint32_t Coverage_countEdges(const VM_coverage* coverage)
+{
+    uint32_t edges = 0;
+    for (uint32_t i = 0; i < coverage->mapSize; i++) {
+        edges += (coverage->map[i] != 0);
+    }
+    return edges;
+}
+
+
+/**
+ * Writes the map to the file `filename` as it is, one byte per counter. Returns false if it couldn't be written.
+ * @param coverage
+ * @param filename
+ * @return
+ */
+bool Coverage_save(const VM_coverage* coverage, const char* filename)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+
+    bool written = fwrite(coverage->map, 1, coverage->mapSize, file) == coverage->mapSize;
+    return (fclose(file) == 0) && written;
+}
+
+
+/**
+ * Frees the map if the coverage allocated it, or detaches it if it is AFL's shared memory. The coverage must have been
+ * detached from its VMs first.
+ * @param coverage
+ */
+void Coverage_free(VM_coverage* coverage)
+{
+    if (coverage->ownsMap) {
+        free(coverage->map);
+    }
+#ifndef _WIN32
+    if (coverage->sharedMap) {
+        shmdt(coverage->map);
+    }
+#endif // _WIN32
+    coverage->map = NULL;
+    coverage->mapSize = 0;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * The `branched` hook: counts the edge from the previous block to the one the branch went to.
+ * @param vm
+ * @param from
+ * @param to
+ * @param kind
+ */
+void coverageBranched(VM_instance* vm, uint32_t from, uint32_t to, VM_branchKind kind)
+{
+    (void) from;
+    if ((kind == VM_BRANCH_INTERRUPT) || (kind == VM_BRANCH_INTERRUPT_RETURN)) {
+        return;
+    }
+
+    VM_coverage* coverage = (VM_coverage*) vm->branchInstrumentation;
+    uint32_t current = ((uint32_t) ((to >> 1) * 0x9E3779B1UL)) >> coverage->shift;
+    coverage->map[current ^ coverage->previous]++;
+    coverage->previous = current >> 1;
+}
+
+
+/**
+ * Sets the size of the map and the shift which goes with it. Returns false if `mapSize` isn't a power of two in range.
+ * @param coverage
+ * @param mapSize
+ * @return
+ */
+bool setMapSize(VM_coverage* coverage, uint32_t mapSize)
+{
+    if ((mapSize < COVERAGE_MIN_MAP_SIZE) || (mapSize > COVERAGE_MAX_MAP_SIZE) || (mapSize & (mapSize - 1))) {
+        return false;
+    }
+
+    coverage->mapSize = mapSize;
+    coverage->shift = 32;
+    while (mapSize > 1) {
+        coverage->shift--;
+        mapSize >>= 1;
+    }
+    return true;
+}
@@ -0,0 +1,55 @@
+/*
+ * Edge coverage of programs running on the VM, in the form fuzzers such as AFL and libFuzzer expect: a bitmap of
+ * 8-bit counters, one for each (previous block, current block) pair, hashed as AFL does (`map[current ^ previous]++`,
+ * then `previous = current >> 1`), so that the fuzzer's own classification of the counts works unchanged.
+ *
+ * Blocks are numbered by hashing the address a branch goes to, and the map is only updated through the VM's `branched`
+ * hook, so nothing is done for instructions other than branches. Conditional branches count whether or not they are
+ * taken, since either way a new block starts. Taking and returning from interrupts aren't counted, as when they
+ * happen depends on the host rather than the input.
+ *
+ * The map is either owned by the coverage, or memory the caller supplies, such as the shared memory AFL passes in
+ * __AFL_SHM_ID (see Coverage_initAFL) or libFuzzer's extra counters. Coverage_reset clears it between inputs; together
+ * with restoring a warm-start snapshot, that's all it takes to run the next input.
+*/
+
+#ifndef COVERAGE_H
+#define COVERAGE_H
+
+#include "ARMTinyVM.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The size of the map AFL uses unless told otherwise
+#define COVERAGE_DEFAULT_MAP_SIZE 65536
+#define COVERAGE_MIN_MAP_SIZE 256
+#define COVERAGE_MAX_MAP_SIZE 0x1000000
+
+// The environment variables through which AFL passes its shared memory, and the size of it
+#define COVERAGE_AFL_SHM_ENV "__AFL_SHM_ID"
+#define COVERAGE_AFL_MAP_SIZE_ENV "AFL_MAP_SIZE"
+
+
+typedef struct VM_coverage {
+    uint8_t* map;
+    uint32_t mapSize; // A power of two
+    uint8_t shift; // Takes a 32-bit hash down to an index into the map
+    uint32_t previous; // The previous block, shifted right by one
+    bool ownsMap; // Whether the map was allocated by Coverage_init, rather than given to it
+    bool sharedMap; // Whether the map is shared memory, to be detached by Coverage_free
+} VM_coverage;
+
+
+bool Coverage_init(VM_coverage* coverage, uint32_t mapSize);
+bool Coverage_initWithMap(VM_coverage* coverage, uint8_t* map, uint32_t mapSize);
+bool Coverage_initAFL(VM_coverage* coverage);
+void Coverage_attach(VM_coverage* coverage, VM_instance* vm);
+void Coverage_detach(VM_coverage* coverage, VM_instance* vm);
+void Coverage_reset(VM_coverage* coverage);
+uint32_t Coverage_countEdges(const VM_coverage* coverage);
+bool Coverage_save(const VM_coverage* coverage, const char* filename);
+void Coverage_free(VM_coverage* coverage);
+
+
+#endif // COVERAGE_H
@@ -0,0 +1,177 @@
+#include "disasm.h"
+#include "instruction_set.h"
+#include <stdio.h>
+
+
+// PRIVATE FUNCTION DECLARATIONS
+void formatRegisterList(char* buffer, size_t size, uint8_t rlist, const char* extra);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Writes the mnemonic for `instruction`, found at `address`, into `buffer`, in the form the instruction trace prints
+ * it, but without the result. Returns the number of the instruction format it belongs to (1 to 19, as in
+ * instruction_set.h), or 0 if it isn't a valid instruction.
+ * @param instruction
+ * @param address
+ * @param buffer
+ * @param size
+ * @return
+ */
+uint8_t Disasm_instruction(uint16_t instruction, uint32_t address, char* buffer, size_t size)
+{
+    static const char* const aluNames[16] = {"AND", "EOR", "LSL", "LSR", "ASR", "ADC", "SBC", "ROR",
+                                             "TST", "NEG", "CMP", "CMN", "ORR", "MUL", "BIC", "MVN"};
+    static const char* const conditionNames[14] = {"BEQ", "BNE", "BCS", "BCC", "BMI", "BPL", "BVS",
+                                                   "BVC", "BHI", "BLS", "BGE", "BLT", "BGT", "BLE"};
+
+    uint8_t instrFirstByte = (instruction & 0xFF00) >> 8;
+    if (istl_move_shifted_reg(instrFirstByte)) {
+        static const char* const names[3] = {"LSL", "LSR", "ASR"};
+        snprintf(buffer, size, "%s R%u, R%u, #%u", names[instr_field(instruction, 11, 0b11)],
+                 instr_field(instruction, 0, 0b111), instr_field(instruction, 3, 0b111),
+                 instr_field(instruction, 6, 0b11111));
+        return 1;
+    } else if (istl_add_subtract(instrFirstByte)) {
+        snprintf(buffer, size, instr_field(instruction, 10, 0b1) ? "%s r%u, r%u, #%u" : "%s r%u, r%u, r%u",
+                 instr_field(instruction, 9, 0b1) ? "SUB" : "ADD", instr_field(instruction, 0, 0b111),
+                 instr_field(instruction, 3, 0b111), instr_field(instruction, 6, 0b111));
+        return 2;
+    } else if (istl_mov_cmp_add_sub_imm(instrFirstByte)) {
+        static const char* const names[4] = {"MOV", "CMP", "ADD", "SUB"};
+        snprintf(buffer, size, "%s r%u, #%u", names[instr_field(instruction, 11, 0b11)],
+                 instr_field(instruction, 8, 0b111), instr_field(instruction, 0, 0b11111111));
+        return 3;
+    } else if (istl_alu_operations(instrFirstByte)) {
+        snprintf(buffer, size, "%s r%u, r%u", aluNames[instr_field(instruction, 6, 0b1111)],
+                 instr_field(instruction, 0, 0b111), instr_field(instruction, 3, 0b111));
+        return 4;
+    } else if (istl_hi_reg_operations(instrFirstByte)) {
+        static const char* const names[3] = {"ADD", "CMP", "MOV"};
+        uint8_t op = instr_field(instruction, 8, 0b11);
+        uint8_t h1 = instr_field(instruction, 7, 0b1);
+        uint8_t h2 = instr_field(instruction, 6, 0b1);
+        uint8_t rs = instr_field(instruction, 3, 0b111);
+        uint8_t rd = instr_field(instruction, 0, 0b111);
+        if ((op == 0b11) && !h1) {
+            snprintf(buffer, size, h2 ? "BX h%u" : "BX r%u", h2 ? 8 + rs : rs);
+            return 5;
+        } else if ((op != 0b11) && (h1 || h2)) {
+            snprintf(buffer, size, "%s %s%u, %s%u", names[op], h1 ? "h" : "r", h1 ? 8 + rd : rd, h2 ? "h" : "r",
+                     h2 ? 8 + rs : rs);
+            return 5;
+        }
+    } else if (istl_pc_relative_load(instrFirstByte)) {
+        snprintf(buffer, size, "LDR r%u, [PC, #%u]", instr_field(instruction, 8, 0b111),
+                 instr_field(instruction, 0, 0b11111111) << 2);
+        return 6;
+    } else if (istl_load_with_reg_offset(instrFirstByte)) {
+        static const char* const names[4] = {"STR", "STRB", "LDR", "LDRB"};
+        snprintf(buffer, size, "%s r%u, [r%u, r%u]", names[instr_field(instruction, 10, 0b11)],
+                 instr_field(instruction, 0, 0b111), instr_field(instruction, 3, 0b111),
+                 instr_field(instruction, 6, 0b111));
+        return 7;
+    } else if (istl_load_sgn_ext_byte(instrFirstByte)) {
+        static const char* const names[4] = {"STRH", "LDSB", "LDRH", "LDSH"};
+        snprintf(buffer, size, "%s r%u, [r%u, r%u]", names[instr_field(instruction, 10, 0b11)],
+                 instr_field(instruction, 0, 0b111), instr_field(instruction, 3, 0b111),
+                 instr_field(instruction, 6, 0b111));
+        return 8;
+    } else if (istl_load_imm_offset(instrFirstByte)) {
+        static const char* const names[4] = {"STR", "LDR", "STRB", "LDRB"};
+        uint8_t byte_or_word = instr_field(instruction, 12, 0b1);
+        snprintf(buffer, size, "%s r%u, [r%u, #%u]", names[instr_field(instruction, 11, 0b11)],
+                 instr_field(instruction, 0, 0b111), instr_field(instruction, 3, 0b111),
+                 instr_field(instruction, 6, 0b11111) << (byte_or_word ? 0 : 2));
+        return 9;
+    } else if (istl_load_halfword(instrFirstByte)) {
+        snprintf(buffer, size, "%s r%u, [r%u, #%u]", instr_field(instruction, 11, 0b1) ? "LDRH" : "STRH",
+                 instr_field(instruction, 0, 0b111), instr_field(instruction, 3, 0b111),
+                 instr_field(instruction, 6, 0b11111) << 1);
+        return 10;
+    } else if (istl_sp_relative_load(instrFirstByte)) {
+        snprintf(buffer, size, "%s r%u, [SP, #%u]", instr_field(instruction, 11, 0b1) ? "LDR" : "STR",
+                 instr_field(instruction, 8, 0b111), instr_field(instruction, 0, 0b11111111) << 2);
+        return 11;
+    } else if (istl_load_address(instrFirstByte)) {
+        snprintf(buffer, size, "ADD r%u, %s, #%u", instr_field(instruction, 8, 0b111),
+                 instr_field(instruction, 11, 0b1) ? "SP" : "PC", instr_field(instruction, 0, 0b11111111) << 2);
+        return 12;
+    } else if (istl_add_offset_to_sp(instrFirstByte)) {
+        snprintf(buffer, size, "ADD SP, #%s%u", instr_field(instruction, 7, 0b1) ? "-" : "",
+                 instr_field(instruction, 0, 0b1111111) << 2);
+        return 13;
+    } else if (istl_push_pop_registers(instrFirstByte)) {
+        uint8_t load_or_store = instr_field(instruction, 11, 0b1);
+        uint8_t pc_lr = instr_field(instruction, 8, 0b1);
+        int length = snprintf(buffer, size, load_or_store ? "pop " : "push ");
+        if ((length > 0) && ((size_t) length < size)) {
+            formatRegisterList(&buffer[length], size - length, instr_field(instruction, 0, 0b11111111),
+                               pc_lr ? (load_or_store ? "pc" : "lr") : NULL);
+        }
+        return 14;
+    } else if (istl_multiple_load_store(instrFirstByte)) {
+        int length = snprintf(buffer, size, "%s r%u!, ", instr_field(instruction, 11, 0b1) ? "LDMIA" : "STMIA",
+                              instr_field(instruction, 8, 0b111));
+        if ((length > 0) && ((size_t) length < size)) {
+            formatRegisterList(&buffer[length], size - length, instr_field(instruction, 0, 0b11111111), NULL);
+        }
+        return 15;
+    } else if (istl_conditional_branch(instrFirstByte)) {
+        uint8_t cond = instr_field(instruction, 8, 0b1111);
+        uint32_t soffset8 = instruction & 0b0000000011111111;
+        uint32_t offset = ((soffset8 & 0x80UL) ? (soffset8 | 0xFFFFFF00UL) : soffset8) << 1;
+        if (cond < 14) {
+            // The target is relative to the address of the instruction after next, as in tliConditionalBranch
+            snprintf(buffer, size, "%s %lu", conditionNames[cond], (unsigned long) (address + 4 + offset));
+            return 16;
+        }
+    } else if (istl_software_interrupt(instrFirstByte)) {
+        snprintf(buffer, size, "SWI #%u", instr_field(instruction, 0, 0b11111111));
+        return 17;
+    } else if (istl_unconditional_branch(instrFirstByte)) {
+        uint32_t relJump = (uint32_t) (instruction & 0b0000011111111111) << 1;
+        relJump = (relJump & 0x00000FFFUL) | ((relJump & 0x0800UL) ? 0xFFFFF000UL : 0UL);
+        snprintf(buffer, size, "B %ld", (long) (int32_t) relJump);
+        return 18;
+    } else if (istl_long_branch_w_link(instrFirstByte)) {
+        snprintf(buffer, size, "BL(%u) %u", instr_field(instruction, 11, 0b1), instruction & 0b0000011111111111);
+        return 19;
+    }
+
+    snprintf(buffer, size, "UNKNOWN INSTRUCTION %x", instruction);
+    return 0;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Writes a register list such as "{r0, r4, lr}" into `buffer`, from the low registers in `rlist` followed by `extra`
+ * if it isn't NULL.
+ * @param buffer
+ * @param size
+ * @param rlist
+ * @param extra
+ */
+void formatRegisterList(char* buffer, size_t size, uint8_t rlist, const char* extra)
+{
+    size_t length = 0;
+    const char* separator = "";
+    length += snprintf(&buffer[length], size - length, "{");
+    for (uint8_t i = 0; (i < 8) && (length < size); i++) {
+        if (rlist & (1 << i)) {
+            length += snprintf(&buffer[length], size - length, "%sr%u", separator, i);
+            separator = ", ";
+        }
+    }
+    if (extra && (length < size)) {
+        length += snprintf(&buffer[length], size - length, "%s%s", separator, extra);
+    }
+    if (length < size) {
+        snprintf(&buffer[length], size - length, "}");
+    }
+}
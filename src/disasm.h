@@ -0,0 +1,16 @@
+/*
+ * A disassembler for the Thumb instructions the VM executes, giving the same mnemonics as the instruction trace, for
+ * tools which show what a program did without running it again (such as the binary trace decoder).
+*/
+
+#ifndef DISASM_H
+#define DISASM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+
+uint8_t Disasm_instruction(uint16_t instruction, uint32_t address, char* buffer, size_t size);
+
+
+#endif // DISASM_H
@@ -0,0 +1,577 @@
+#include "elfloader.h"
+#include "logwriter.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) || defined(WIN64) || defined(_WIN64) || defined(__WIN64)
+#include "win_elf.h"
+#else
+#include <elf.h>
+#endif
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+VM_elfStatus loadElf(FILE* file, bool verbose, VM_memoryMap* map);
+VM_elfStatus checkElfHeader(Elf32_Ehdr* header, uint64_t fileSize);
+VM_elfStatus loadSections(FILE* file, uint64_t fileSize, Elf32_Ehdr* header, Elf32_Shdr* sections, bool verbose,
+                          const char* names, uint32_t namesLength, VM_memoryMap* map);
+VM_elfStatus loadSymbols(FILE* file, VM_symbolTable* table);
+int compareSymbols(const void* a, const void* b);
+bool readFromFile(FILE* file, uint64_t fileSize, uint64_t offset, void* buffer, uint64_t length);
+char* readSectionNames(FILE* file, uint64_t fileSize, Elf32_Ehdr* header, Elf32_Shdr* sections, uint32_t* length);
+const char* sectionName(const char* names, uint32_t namesLength, uint32_t offset);
+void printElfHeader(Elf32_Ehdr* header);
+void printProgramHeaders(FILE* file, uint64_t fileSize, Elf32_Ehdr* header);
+void printSectionHeader(Elf32_Shdr* sectionHeader, Elf32_Half sectionNum, const char* name);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Reads the ELF file at `filename`, and loads every allocatable section of it into a segment of `map`, which the
+ * caller owns and must free with ElfLoader_freeMemoryMap (or hand on, e.g. to Image_fromMemoryMap). Sections with no
+ * content in the file (such as .bss) are zeroed. If `verbose` is set, the headers of the ELF are printed as they are
+ * read. On failure, `map` is left empty and the reason is returned.
+ * @param filename
+ * @param verbose
+ * @param map
+ * @return
+ */
+VM_elfStatus ElfLoader_load(const char* filename, bool verbose, VM_memoryMap* map)
+{
+    map->segments = NULL;
+    map->numSegments = 0;
+    map->entryAddress = 0;
+
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return ELF_CANNOT_READ;
+    }
+
+    VM_elfStatus status = loadElf(file, verbose, map);
+    fclose(file);
+    if (status != ELF_LOADED) {
+        ElfLoader_freeMemoryMap(map);
+    }
+    return status;
+}
+
+
+/**
+ * Returns a description of `status`, suitable for showing to a user.
+ * @param status
+ * @return
+ */
+const char* ElfLoader_statusMessage(VM_elfStatus status)
+{
+    switch (status) {
+        case ELF_LOADED:
+            return "Loaded successfully";
+        case ELF_CANNOT_READ:
+            return "Unable to load file";
+        case ELF_NOT_ELF:
+            return "Not an ELF file";
+        case ELF_WRONG_CLASS:
+            return "Not a 32-bit little-endian ELF";
+        case ELF_WRONG_MACHINE:
+            return "Not an ARM ELF";
+        case ELF_OUT_OF_BOUNDS:
+            return "ELF is truncated or malformed";
+        case ELF_OUT_OF_MEMORY:
+            return "Out of memory";
+        default:
+            return "Unknown error";
+    }
+}
+
+
+/**
+ * Frees every segment of `map`, leaving it empty.
+ * @param map
+ */
+void ElfLoader_freeMemoryMap(VM_memoryMap* map)
+{
+    for (uint32_t i = 0; i < map->numSegments; i++) {
+        free(map->segments[i].content);
+    }
+    free(map->segments);
+    map->segments = NULL;
+    map->numSegments = 0;
+}
+
+
+/**
+ * Reads the function symbols from the symbol table of the ELF file at `filename` into `table`, which the caller owns
+ * and must free with ElfLoader_freeSymbols. An executable which has been stripped loads as an empty table. On failure,
+ * `table` is left empty and the reason is returned.
+ * @param filename
+ * @param table
+ * @return
+ */
+VM_elfStatus ElfLoader_loadSymbols(const char* filename, VM_symbolTable* table)
+{
+    table->symbols = NULL;
+    table->numSymbols = 0;
+    table->names = NULL;
+
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return ELF_CANNOT_READ;
+    }
+
+    VM_elfStatus status = loadSymbols(file, table);
+    fclose(file);
+    if (status != ELF_LOADED) {
+        ElfLoader_freeSymbols(table);
+    }
+    return status;
+}
+
+
+/**
+ * Returns the function in `table` which `address` lies in, or NULL if there isn't one. A function whose size isn't
+ * known is taken to run up to the next.
+ * @param table
+ * @param address
+ * @return
+ */
+const VM_symbol* ElfLoader_findSymbol(const VM_symbolTable* table, uint32_t address)
+{
+    // Find the last function starting at or before the address
+    uint32_t low = 0;
+    uint32_t high = table->numSymbols;
+    while (low < high) {
+        uint32_t middle = low + ((high - low) / 2);
+        if (table->symbols[middle].address <= address) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    if (low == 0) {
+        return NULL;
+    }
+
+    const VM_symbol* symbol = &(table->symbols[low - 1]);
+    if ((symbol->size > 0) && (address - symbol->address >= symbol->size)) {
+        return NULL;
+    }
+    return symbol;
+}
+
+
+/**
+ * Frees the symbols and names of `table`, leaving it empty.
+ * @param table
+ */
+void ElfLoader_freeSymbols(VM_symbolTable* table)
+{
+    free(table->symbols);
+    free(table->names);
+    table->symbols = NULL;
+    table->numSymbols = 0;
+    table->names = NULL;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Does the work of ElfLoader_load on the open `file`.
+ * @param file
+ * @param verbose
+ * @param map
+ * @return
+ */
+VM_elfStatus loadElf(FILE* file, bool verbose, VM_memoryMap* map)
+{
+    // Find the size of the file, so that every offset in it can be checked
+    long elfSize = -1;
+    if (fseek(file, 0L, SEEK_END) == 0) {
+        elfSize = ftell(file);
+    }
+    if (elfSize < 0) {
+        return ELF_CANNOT_READ;
+    }
+    uint64_t fileSize = (uint64_t) elfSize;
+
+    Elf32_Ehdr header;
+    if (!readFromFile(file, fileSize, 0, &header, sizeof(header))) {
+        return ELF_NOT_ELF;
+    }
+
+    VM_elfStatus status = checkElfHeader(&header, fileSize);
+    if (status != ELF_LOADED) {
+        return status;
+    }
+
+    if (verbose) {
+        printElfHeader(&header);
+        printProgramHeaders(file, fileSize, &header);
+    }
+
+    // Only the section header table is read, then the content of the sections which are loaded
+    Elf32_Shdr* sections = malloc(((size_t) header.e_shnum + 1) * sizeof(Elf32_Shdr));
+    if (!sections) {
+        return ELF_OUT_OF_MEMORY;
+    }
+    if (!readFromFile(file, fileSize, header.e_shoff, sections, (uint64_t) header.e_shnum * sizeof(Elf32_Shdr))) {
+        free(sections);
+        return ELF_OUT_OF_BOUNDS;
+    }
+
+    uint32_t namesLength = 0;
+    char* names = verbose ? readSectionNames(file, fileSize, &header, sections, &namesLength) : NULL;
+    status = loadSections(file, fileSize, &header, sections, verbose, names, namesLength, map);
+    free(names);
+    free(sections);
+
+    map->entryAddress = header.e_entry & 0xFFFFFFFE;
+    return status;
+}
+
+
+/**
+ * Checks that `header` belongs to a 32-bit little-endian ARM ELF, whose section header table lies within the file.
+ * @param header
+ * @param fileSize
+ * @return
+ */
+VM_elfStatus checkElfHeader(Elf32_Ehdr* header, uint64_t fileSize)
+{
+    if (memcmp(header->e_ident, ELFMAG, SELFMAG) != 0) {
+        return ELF_NOT_ELF;
+    } else if ((header->e_ident[EI_CLASS] != ELFCLASS32) || (header->e_ident[EI_DATA] != ELFDATA2LSB)) {
+        return ELF_WRONG_CLASS;
+    } else if (header->e_machine != EM_ARM) {
+        return ELF_WRONG_MACHINE;
+    } else if ((header->e_shnum > 0) && (header->e_shentsize != sizeof(Elf32_Shdr))) {
+        return ELF_OUT_OF_BOUNDS;
+    } else if ((uint64_t) header->e_shoff + ((uint64_t) header->e_shnum * sizeof(Elf32_Shdr)) > fileSize) {
+        return ELF_OUT_OF_BOUNDS;
+    }
+    return ELF_LOADED;
+}
+
+
+/**
+ * Adds a segment to `map` for each allocatable section, and reads its content from the file.
+ * @param file
+ * @param fileSize
+ * @param header
+ * @param sections
+ * @param verbose
+ * @param names The section name string table, or NULL if the names aren't needed
+ * @param namesLength
+ * @param map
+ * @return
+ */
+VM_elfStatus loadSections(FILE* file, uint64_t fileSize, Elf32_Ehdr* header, Elf32_Shdr* sections, bool verbose,
+                          const char* names, uint32_t namesLength, VM_memoryMap* map)
+{
+    uint32_t numToLoad = 0;
+    for (Elf32_Half i = 0; i < header->e_shnum; i++) {
+        if ((sections[i].sh_flags & SHF_ALLOC) && (sections[i].sh_size > 0)) {
+            numToLoad++;
+        }
+    }
+
+    map->segments = malloc(((size_t) numToLoad + 1) * sizeof(runtimeSegment));
+    if (!map->segments) {
+        return ELF_OUT_OF_MEMORY;
+    }
+
+    for (Elf32_Half sectionNum = 0; sectionNum < header->e_shnum; sectionNum++) {
+        Elf32_Shdr* sectionHeader = &(sections[sectionNum]);
+        if (verbose) {
+            printSectionHeader(sectionHeader, sectionNum, sectionName(names, namesLength, sectionHeader->sh_name));
+        }
+
+        if (!(sectionHeader->sh_flags & SHF_ALLOC) || (sectionHeader->sh_size == 0)) {
+            if (verbose) {
+                LogWriter_printf("Not to be loaded\n\n");
+            }
+            continue;
+        }
+
+        // Needs to actually be loaded at runtime, and must fit in the address space
+        bool inFile = sectionHeader->sh_type != SHT_NOBITS;
+        if ((uint64_t) sectionHeader->sh_addr + sectionHeader->sh_size > 0x100000000ULL) {
+            return ELF_OUT_OF_BOUNDS;
+        }
+
+        runtimeSegment* segment = &(map->segments[map->numSegments]);
+        segment->virtualStartAddress = sectionHeader->sh_addr;
+        segment->length = sectionHeader->sh_size;
+        segment->writable = (sectionHeader->sh_flags & SHF_WRITE) != 0;
+        segment->content = inFile ? malloc(sectionHeader->sh_size) : calloc(sectionHeader->sh_size, 1);
+        if (!segment->content) {
+            return ELF_OUT_OF_MEMORY;
+        }
+        map->numSegments++;
+
+        // Load the content of the section from the ELF file straight into the newly allocated memory
+        if (inFile && !readFromFile(file, fileSize, sectionHeader->sh_offset, segment->content,
+                                    sectionHeader->sh_size)) {
+            return ELF_OUT_OF_BOUNDS;
+        }
+
+        if (verbose) {
+            LogWriter_printf("Allocated and loaded virtual memory segment starting at 0x%x, with size %u\n\n",
+                             sectionHeader->sh_addr, sectionHeader->sh_size);
+        }
+    }
+
+    return ELF_LOADED;
+}
+
+
+/**
+ * Does the work of ElfLoader_loadSymbols on the open `file`. Only the first symbol table is read, with the string table
+ * it links to; its entries are decoded a field at a time, as the names of the fields of Elf32_Sym vary between systems.
+ * @param file
+ * @param table
+ * @return
+ */
+VM_elfStatus loadSymbols(FILE* file, VM_symbolTable* table)
+{
+    long elfSize = -1;
+    if (fseek(file, 0L, SEEK_END) == 0) {
+        elfSize = ftell(file);
+    }
+    if (elfSize < 0) {
+        return ELF_CANNOT_READ;
+    }
+    uint64_t fileSize = (uint64_t) elfSize;
+
+    Elf32_Ehdr header;
+    if (!readFromFile(file, fileSize, 0, &header, sizeof(header))) {
+        return ELF_NOT_ELF;
+    }
+    VM_elfStatus status = checkElfHeader(&header, fileSize);
+    if (status != ELF_LOADED) {
+        return status;
+    }
+
+    Elf32_Shdr* sections = malloc(((size_t) header.e_shnum + 1) * sizeof(Elf32_Shdr));
+    if (!sections) {
+        return ELF_OUT_OF_MEMORY;
+    }
+    if (!readFromFile(file, fileSize, header.e_shoff, sections, (uint64_t) header.e_shnum * sizeof(Elf32_Shdr))) {
+        free(sections);
+        return ELF_OUT_OF_BOUNDS;
+    }
+
+    Elf32_Half symbolSection = 0;
+    while ((symbolSection < header.e_shnum) && (sections[symbolSection].sh_type != SHT_SYMTAB)) {
+        symbolSection++;
+    }
+    if (symbolSection == header.e_shnum) {
+        free(sections);
+        return ELF_LOADED;
+    }
+    Elf32_Shdr symbolHeader = sections[symbolSection];
+    Elf32_Shdr stringHeader = (symbolHeader.sh_link < header.e_shnum) ? sections[symbolHeader.sh_link] : symbolHeader;
+    free(sections);
+    if ((symbolHeader.sh_link >= header.e_shnum) || (stringHeader.sh_type == SHT_NOBITS)) {
+        return ELF_OUT_OF_BOUNDS;
+    }
+
+    // Each entry is st_name, st_value, st_size (4 bytes each), then st_info, st_other and st_shndx
+    uint32_t numEntries = symbolHeader.sh_size / 16;
+    uint8_t* entries = malloc(((size_t) numEntries * 16) + 1);
+    table->names = malloc((size_t) stringHeader.sh_size + 1);
+    table->symbols = malloc(((size_t) numEntries + 1) * sizeof(VM_symbol));
+    if (!entries || !table->names || !table->symbols) {
+        free(entries);
+        return ELF_OUT_OF_MEMORY;
+    }
+    if (!readFromFile(file, fileSize, symbolHeader.sh_offset, entries, (uint64_t) numEntries * 16) ||
+        !readFromFile(file, fileSize, stringHeader.sh_offset, table->names, stringHeader.sh_size)) {
+        free(entries);
+        return ELF_OUT_OF_BOUNDS;
+    }
+    table->names[stringHeader.sh_size] = '\0';
+
+    for (uint32_t i = 0; i < numEntries; i++) {
+        const uint8_t* entry = &(entries[i * 16]);
+        uint32_t fields[3];
+        for (uint8_t field = 0; field < 3; field++) {
+            fields[field] = (uint32_t) entry[field * 4] | ((uint32_t) entry[(field * 4) + 1] << 8) |
+                            ((uint32_t) entry[(field * 4) + 2] << 16) | ((uint32_t) entry[(field * 4) + 3] << 24);
+        }
+        if ((ELF32_ST_TYPE(entry[12]) != STT_FUNC) || (fields[0] >= stringHeader.sh_size)) {
+            continue;
+        }
+
+        VM_symbol* symbol = &(table->symbols[table->numSymbols++]);
+        symbol->address = fields[1] & 0xFFFFFFFE;
+        symbol->size = fields[2];
+        symbol->name = &(table->names[fields[0]]);
+    }
+    free(entries);
+
+    qsort(table->symbols, table->numSymbols, sizeof(VM_symbol), compareSymbols);
+    return ELF_LOADED;
+}
+
+
+/**
+ * Orders symbols by address, for qsort.
+ * @param a
+ * @param b
+ * @return
+ */
+int compareSymbols(const void* a, const void* b)
+{
+    uint32_t first = ((const VM_symbol*) a)->address;
+    uint32_t second = ((const VM_symbol*) b)->address;
+    return (first > second) - (first < second);
+}
+
+
+/**
+ * Reads `length` bytes at `offset` in `file` into `buffer`. Returns false if they don't all lie within the file, or
+ * couldn't be read.
+ * @param file
+ * @param fileSize
+ * @param offset
+ * @param buffer
+ * @param length
+ * @return
+ */
+bool readFromFile(FILE* file, uint64_t fileSize, uint64_t offset, void* buffer, uint64_t length)
+{
+    if ((offset > fileSize) || (length > fileSize - offset)) {
+        return false;
+    }
+    if (length == 0) {
+        return true;
+    }
+    return (fseek(file, (long) offset, SEEK_SET) == 0) && (fread(buffer, (size_t) length, 1, file) == 1);
+}
+
+
+/**
+ * Reads the string table holding the names of the sections, with a terminator added in case the last is missing one.
+ * Returns NULL if there isn't a valid one.
+ * @param file
+ * @param fileSize
+ * @param header
+ * @param sections
+ * @param length Set to the length of the table
+ * @return
+ */
+char* readSectionNames(FILE* file, uint64_t fileSize, Elf32_Ehdr* header, Elf32_Shdr* sections, uint32_t* length)
+{
+    if ((header->e_shstrndx >= header->e_shnum) || (sections[header->e_shstrndx].sh_type == SHT_NOBITS)) {
+        return NULL;
+    }
+
+    Elf32_Shdr* stringSectionHeader = &(sections[header->e_shstrndx]);
+    char* names = malloc((size_t) stringSectionHeader->sh_size + 1);
+    if (!names || !readFromFile(file, fileSize, stringSectionHeader->sh_offset, names, stringSectionHeader->sh_size)) {
+        free(names);
+        return NULL;
+    }
+
+    names[stringSectionHeader->sh_size] = '\0';
+    *length = stringSectionHeader->sh_size;
+    return names;
+}
+
+
+/**
+ * Returns the name at `offset` in the section name table, or an empty string if there isn't one.
+ * @param names
+ * @param namesLength
+ * @param offset
+ * @return
+ */
+const char* sectionName(const char* names, uint32_t namesLength, uint32_t offset)
+{
+    return (names && (offset < namesLength)) ? &(names[offset]) : "";
+}
+
+
+/**
+ * Prints every field of the ELF header.
+ * @param header
+ */
+void printElfHeader(Elf32_Ehdr* header)
+{
+    LogWriter_printf("Read file successfully\n");
+    LogWriter_printf("ELF Identifier: %.4s\n", header->e_ident);
+    LogWriter_printf("ELF Type: 0x%x\n", header->e_type);
+    LogWriter_printf("Architecture: %u\n", header->e_machine);
+    LogWriter_printf("ELF Version: %u\n", header->e_version);
+    LogWriter_printf("Entry point: %u\n", header->e_entry);
+    LogWriter_printf("Offset in ELF of program header table: %u\n", header->e_phoff);
+    LogWriter_printf("Offset in ELF of section header table: %u\n", header->e_shoff);
+    LogWriter_printf("Flags: 0x%x\n", header->e_flags);
+    LogWriter_printf("Size of this header: %u\n", header->e_ehsize);
+    LogWriter_printf("Size of a program header table entry: %u\n", header->e_phentsize);
+    LogWriter_printf("Number of program headers: %u\n", header->e_phnum);
+    LogWriter_printf("Size of a section header table entry: %u\n", header->e_shentsize);
+    LogWriter_printf("Number of section headers: %u\n", header->e_shnum);
+    LogWriter_printf("Index of section header table which contains section names: %u\n\n", header->e_shstrndx);
+}
+
+
+/**
+ * Prints every program header, if the table is valid. These aren't needed for loading, so are only read for this.
+ * @param file
+ * @param fileSize
+ * @param header
+ */
+void printProgramHeaders(FILE* file, uint64_t fileSize, Elf32_Ehdr* header)
+{
+    if ((header->e_phnum > 0) && (header->e_phentsize != sizeof(Elf32_Phdr))) {
+        return;
+    }
+
+    for (Elf32_Half programNum = 0; programNum < header->e_phnum; programNum++) {
+        Elf32_Phdr programHeader;
+        if (!readFromFile(file, fileSize, header->e_phoff + ((uint64_t) programNum * sizeof(Elf32_Phdr)),
+                          &programHeader, sizeof(programHeader))) {
+            return;
+        }
+
+        LogWriter_printf("============ Program header %u ============\n", programNum);
+        LogWriter_printf("Segment type: %u\n", programHeader.p_type);
+        LogWriter_printf("Offset of segment in ELF file: %u\n", programHeader.p_offset);
+        LogWriter_printf("Virtual address of segment in memory: 0x%x\n", programHeader.p_vaddr);
+        LogWriter_printf("Physical address of segment in memory: 0x%x\n", programHeader.p_paddr);
+        LogWriter_printf("Size of segment in ELF file: %u\n", programHeader.p_filesz);
+        LogWriter_printf("Size of segment in memory: %u\n", programHeader.p_memsz);
+        LogWriter_printf("Flags: 0x%x\n", programHeader.p_flags);
+        LogWriter_printf("Alignment: %u\n\n", programHeader.p_align);
+    }
+}
+
+
+/**
+ * Prints every field of one section header.
+ * @param sectionHeader
+ * @param sectionNum
+ * @param name
+ */
+void printSectionHeader(Elf32_Shdr* sectionHeader, Elf32_Half sectionNum, const char* name)
+{
+    LogWriter_printf("============ Section header %u ============\n", sectionNum);
+    LogWriter_printf("Name is at .shstrtab offset: %u\n", sectionHeader->sh_name);
+    LogWriter_printf("Section name: %s\n", name);
+    LogWriter_printf("Type: 0x%x\n", sectionHeader->sh_type);
+    LogWriter_printf("Flags: 0x%x\n", sectionHeader->sh_flags);
+    LogWriter_printf("Virtual address (if loaded): 0x%x\n", sectionHeader->sh_addr);
+    LogWriter_printf("Offset of section in ELF: 0x%x\n", sectionHeader->sh_offset);
+    LogWriter_printf("Size of section in ELF: %u\n", sectionHeader->sh_size);
+    LogWriter_printf("Section index link (meanings differ): %u\n", sectionHeader->sh_link);
+    LogWriter_printf("Extra info (meanings differ): %u\n", sectionHeader->sh_info);
+    LogWriter_printf("Alignment: %u\n", sectionHeader->sh_addralign);
+    LogWriter_printf("Entry size (if applicable): %u\n", sectionHeader->sh_entsize);
+}
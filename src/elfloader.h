@@ -0,0 +1,77 @@
+/*
+ * Loading Thumb ELF executables into memory, ready to be run by the Tiny ARM Virtual Machine.
+ *
+ * Every allocatable section becomes one segment of a memory map. Only the headers and the sections which are loaded
+ * are read from the file, each straight into its segment, and every offset and size is checked against the file
+ * before it is used, so a truncated or malformed file is rejected rather than read out of bounds. Nothing is printed
+ * unless `verbose` is set.
+ *
+ * The function symbols of an executable which hasn't been stripped can be read separately, to name the addresses a
+ * profile or a trace refers to.
+*/
+
+#ifndef ELFLOADER_H
+#define ELFLOADER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+
+typedef struct runtimeSegment {
+    uint32_t virtualStartAddress;
+    uint32_t length;
+    uint8_t* content;
+    bool writable;
+} runtimeSegment;
+
+
+/**
+ * The memory a program needs: one segment for each allocatable section, plus where execution starts.
+ */
+typedef struct VM_memoryMap {
+    runtimeSegment* segments;
+    uint32_t numSegments;
+    uint32_t entryAddress;
+} VM_memoryMap;
+
+
+/**
+ * A function, at `address` (without the Thumb bit) and `size` bytes long. A size of 0 means it isn't known.
+ */
+typedef struct VM_symbol {
+    uint32_t address;
+    uint32_t size;
+    const char* name;
+} VM_symbol;
+
+
+/**
+ * The function symbols of an executable, in order of address. Every name points into `names`.
+ */
+typedef struct VM_symbolTable {
+    VM_symbol* symbols;
+    uint32_t numSymbols;
+    char* names;
+} VM_symbolTable;
+
+
+typedef enum VM_elfStatus {
+    ELF_LOADED,
+    ELF_CANNOT_READ,     // The file couldn't be opened or read
+    ELF_NOT_ELF,         // The file doesn't start with the ELF magic number
+    ELF_WRONG_CLASS,     // Not a 32-bit little-endian ELF
+    ELF_WRONG_MACHINE,   // Not an ARM ELF
+    ELF_OUT_OF_BOUNDS,   // A header, table or section lies outside the file or the address space
+    ELF_OUT_OF_MEMORY
+} VM_elfStatus;
+
+
+VM_elfStatus ElfLoader_load(const char* filename, bool verbose, VM_memoryMap* map);
+const char* ElfLoader_statusMessage(VM_elfStatus status);
+void ElfLoader_freeMemoryMap(VM_memoryMap* map);
+VM_elfStatus ElfLoader_loadSymbols(const char* filename, VM_symbolTable* table);
+const VM_symbol* ElfLoader_findSymbol(const VM_symbolTable* table, uint32_t address);
+void ElfLoader_freeSymbols(VM_symbolTable* table);
+
+
+#endif // ELFLOADER_H
@@ -0,0 +1,42 @@
+/*
+ * The flat program image used by builds which can't load ELF files, such as the AVR build (see main_avr.c). An image
+ * is generated from an ELF by ARMTinyVM_mkimage as a C header, which defines:
+ *   IMAGE_NUM_SEGMENTS, IMAGE_ENTRY_ADDRESS, and the sizes IMAGE_FLASH_SIZE, IMAGE_DATA_SIZE and IMAGE_BSS_SIZE
+ *   imageSegments - The segment table, in the order the ELF's sections were in
+ *   imageFlash - The packed contents of the read-only segments, placed in program memory with PROGMEM
+ *   imageData - The packed initial contents of the writable segments
+ *   imageBss - Room for the writable segments which start out as zeroes, so take up no space in the program
+ * Each array has one spare byte, so that none of them is ever empty.
+ *
+ * A compressed image also defines IMAGE_COMPRESSED, and the read-only content is split into IMAGE_NUM_PAGES pages of
+ * IMAGE_PAGE_SIZE bytes, each compressed on its own (see lz.h). imageFlash then holds IMAGE_COMPRESSED_SIZE bytes of
+ * compressed pages, and page `n` starts at imagePageOffsets[n] and ends at imagePageOffsets[n + 1]. A page which is
+ * as long as it would be uncompressed is stored as it is.
+*/
+
+#ifndef FLATIMAGE_H
+#define FLATIMAGE_H
+
+#include <stdint.h>
+
+// Where the content of a segment lives
+#define IMAGE_REGION_FLASH 0
+#define IMAGE_REGION_DATA 1
+#define IMAGE_REGION_BSS 2
+
+// The size of the pages of a compressed image, which limits how much has to be decompressed at once
+#define IMAGE_PAGE_SIZE 256UL
+
+
+/**
+ * One segment of guest memory, whose content starts `offset` bytes into the array for its region.
+ */
+typedef struct imageSegment {
+    uint32_t virtualStartAddress;
+    uint32_t length;
+    uint32_t offset;
+    uint8_t region;
+} imageSegment;
+
+
+#endif // FLATIMAGE_H
@@ -0,0 +1,145 @@
+#include "heatmap.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Sets up an empty heatmap, with the stack pointer never having been anywhere.
+ * @param heatmap
+ */
+void Heatmap_init(VM_heatmap* heatmap)
+{
+    memset(heatmap->regions, 0, sizeof(heatmap->regions));
+    heatmap->lowestStackPointer = 0xFFFFFFFF;
+    heatmap->outOfMemory = false;
+}
+
+
+/**
+ * Starts counting the memory accesses of `vm` into `heatmap`, with its stack pointer as it is now. Returns false if
+ * the VM was built without ARMTINYVM_HEATMAP, so can't count them.
+ * @param heatmap
+ * @param vm
+ * @return
+ */
+bool Heatmap_attach(VM_heatmap* heatmap, VM_instance* vm)
+{
+#ifdef ARMTINYVM_HEATMAP
+    if (vm_stack_pointer(vm) < heatmap->lowestStackPointer) {
+        heatmap->lowestStackPointer = vm_stack_pointer(vm);
+    }
+    vm->heatmap = heatmap;
+    return true;
+#else
+    (void) heatmap;
+    (void) vm;
+    return false;
+#endif // ARMTINYVM_HEATMAP
+}
+
+
+/**
+ * Counts one access of `kind` to the page holding `address`, allocating the counters for its region the first time.
+ * @param heatmap
+ * @param address
+ * @param kind
+ */
+void Heatmap_count(VM_heatmap* heatmap, uint32_t address, VM_accessKind kind)
+{
+    VM_heatmapRegion* region = heatmap->regions[address / HEATMAP_REGION_SIZE];
+    if (!region) {
+        region = calloc(1, sizeof(VM_heatmapRegion));
+        if (!region) {
+            heatmap->outOfMemory = true;
+            return;
+        }
+        heatmap->regions[address / HEATMAP_REGION_SIZE] = region;
+    }
+    region->counts[(address % HEATMAP_REGION_SIZE) / HEATMAP_PAGE_SIZE][kind]++;
+}
+
+
+/**
+ * Returns the number of accesses of `kind` to the page holding `address`.
+ * @param heatmap
+ * @param address
+ * @param kind
+ * @return
+ */
+uint64_t Heatmap_pageCount(const VM_heatmap* heatmap, uint32_t address, VM_accessKind kind)
+{
+    const VM_heatmapRegion* region = heatmap->regions[address / HEATMAP_REGION_SIZE];
+    return region ? region->counts[(address % HEATMAP_REGION_SIZE) / HEATMAP_PAGE_SIZE][kind] : 0;
+}
+
+
+/**
+ * Writes the heatmap to `file` as a JSON object: the page size, the lowest stack pointer, and the counts of every page
+ * which was accessed at all, in order of address. Returns false if it couldn't be written.
+ * @param heatmap
+ * @param file
+ * @return
+ */
+bool Heatmap_writeJSON(const VM_heatmap* heatmap, FILE* file)
+{
+    fprintf(file, "{\n  \"pageSize\": %u,\n  \"lowestStackPointer\": %lu,\n  \"complete\": %s,\n  \"pages\": [",
+            HEATMAP_PAGE_SIZE, (unsigned long) heatmap->lowestStackPointer, heatmap->outOfMemory ? "false" : "true");
+
+    bool first = true;
+    for (uint32_t regionNum = 0; regionNum < HEATMAP_NUM_REGIONS; regionNum++) {
+        const VM_heatmapRegion* region = heatmap->regions[regionNum];
+        if (!region) {
+            continue;
+        }
+
+        for (uint32_t page = 0; page < HEATMAP_PAGES_PER_REGION; page++) {
+            const uint64_t* counts = region->counts[page];
+            if ((counts[HEATMAP_READ] == 0) && (counts[HEATMAP_WRITE] == 0) && (counts[HEATMAP_FETCH] == 0)) {
+                continue;
+            }
+            fprintf(file, "%s\n    {\"address\": %lu, \"reads\": %llu, \"writes\": %llu, \"fetches\": %llu}",
+                    first ? "" : ",", (unsigned long) ((regionNum * HEATMAP_REGION_SIZE) + (page * HEATMAP_PAGE_SIZE)),
+                    (unsigned long long) counts[HEATMAP_READ], (unsigned long long) counts[HEATMAP_WRITE],
+                    (unsigned long long) counts[HEATMAP_FETCH]);
+            first = false;
+        }
+    }
+    fprintf(file, "\n  ]\n}\n");
+
+    return !ferror(file);
+}
+
+
+/**
+ * Writes the heatmap to the file `filename` as JSON (see Heatmap_writeJSON). Returns false if it couldn't be written.
+ * @param heatmap
+ * @param filename
+ * @return
+ */
+bool Heatmap_saveJSON(const VM_heatmap* heatmap, const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        return false;
+    }
+
+    bool written = Heatmap_writeJSON(heatmap, file);
+    return (fclose(file) == 0) && written;
+}
+
+
+/**
+ * Frees the counters of every region. No VM may be counting into it any more; it can be used again once Heatmap_init
+ * has been called.
+ * @param heatmap
+ */
+void Heatmap_free(VM_heatmap* heatmap)
+{
+    for (uint32_t regionNum = 0; regionNum < HEATMAP_NUM_REGIONS; regionNum++) {
+        free(heatmap->regions[regionNum]);
+        heatmap->regions[regionNum] = NULL;
+    }
+}
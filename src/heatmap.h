@@ -0,0 +1,59 @@
+/*
+ * A heatmap of the memory a VM uses: how many times each HEATMAP_PAGE_SIZE page of the address space is read, written
+ * and fetched from, and the lowest the stack pointer has been. Each load, store or instruction fetch counts once,
+ * whatever its size. The stack pointer is checked wherever it can move down: pushes, `ADD SP, #-n`, ADD or MOV to SP,
+ * and taking an interrupt.
+ *
+ * The counters for a megabyte of the address space are only allocated once that megabyte is touched, so a program
+ * costs around 100KB for each region it uses. Pages are the size the pager uses by default, so a heatmap of a run
+ * shows directly which pages of a paged backend it keeps coming back to.
+ *
+ * Like the histogram, the counting is only built into the VM with ARMTINYVM_HEATMAP; otherwise it costs nothing, and
+ * Heatmap_attach fails.
+*/
+
+#ifndef HEATMAP_H
+#define HEATMAP_H
+
+#include "ARMTinyVM.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+// The same as PAGER_DEFAULT_PAGE_SIZE
+#define HEATMAP_PAGE_SIZE 256
+#define HEATMAP_REGION_SIZE 0x100000
+#define HEATMAP_PAGES_PER_REGION (HEATMAP_REGION_SIZE / HEATMAP_PAGE_SIZE)
+#define HEATMAP_NUM_REGIONS (0x100000000ULL / HEATMAP_REGION_SIZE)
+
+
+typedef enum VM_accessKind {
+    HEATMAP_READ,
+    HEATMAP_WRITE,
+    HEATMAP_FETCH,
+    HEATMAP_NUM_ACCESS_KINDS
+} VM_accessKind;
+
+
+typedef struct VM_heatmapRegion {
+    uint64_t counts[HEATMAP_PAGES_PER_REGION][HEATMAP_NUM_ACCESS_KINDS];
+} VM_heatmapRegion;
+
+
+typedef struct VM_heatmap {
+    VM_heatmapRegion* regions[HEATMAP_NUM_REGIONS]; // NULL until something in the region is accessed
+    uint32_t lowestStackPointer;
+    bool outOfMemory; // Set if a region couldn't be allocated, so that accesses to it weren't counted
+} VM_heatmap;
+
+
+void Heatmap_init(VM_heatmap* heatmap);
+bool Heatmap_attach(VM_heatmap* heatmap, VM_instance* vm);
+void Heatmap_count(VM_heatmap* heatmap, uint32_t address, VM_accessKind kind);
+uint64_t Heatmap_pageCount(const VM_heatmap* heatmap, uint32_t address, VM_accessKind kind);
+bool Heatmap_writeJSON(const VM_heatmap* heatmap, FILE* file);
+bool Heatmap_saveJSON(const VM_heatmap* heatmap, const char* filename);
+void Heatmap_free(VM_heatmap* heatmap);
+
+
+#endif // HEATMAP_H
@@ -0,0 +1,162 @@
+#include "histogram.h"
+#include <string.h>
+
+
+// The name of each format, as in the manual
+static const char* const formatNames[HISTOGRAM_NUM_FORMATS] = {
+        "unknown instruction", "move shifted register", "add/subtract", "move/compare/add/subtract immediate",
+        "ALU operations", "hi register operations/branch exchange", "PC-relative load",
+        "load/store with register offset", "load/store sign-extended byte/halfword", "load/store with immediate offset",
+        "load/store halfword", "SP-relative load/store", "load address", "add offset to stack pointer",
+        "push/pop registers", "multiple load/store", "conditional branch", "software interrupt",
+        "unconditional branch", "long branch with link"
+};
+
+// The name of each sub-operation, numbered as the handlers in ARMTinyVM.c count them, ending at the first NULL
+static const char* const subOpNames[HISTOGRAM_NUM_FORMATS][HISTOGRAM_MAX_SUB_OPS] = {
+        {"UNKNOWN"},
+        {"LSL", "LSR", "ASR"},
+        {"ADD", "ADD #", "SUB", "SUB #"},
+        {"MOV", "CMP", "ADD", "SUB"},
+        {"AND", "EOR", "LSL", "LSR", "ASR", "ADC", "SBC", "ROR", "TST", "NEG", "CMP", "CMN", "ORR", "MUL", "BIC", "MVN"},
+        {"ADD", "CMP", "MOV", "BX"},
+        {"LDR"},
+        {"STR", "STRB", "LDR", "LDRB"},
+        {"STRH", "LDSB", "LDRH", "LDSH"},
+        {"STR", "LDR", "STRB", "LDRB"},
+        {"STRH", "LDRH"},
+        {"STR", "LDR"},
+        {"ADD PC", "ADD SP"},
+        {"ADD SP, #", "ADD SP, #-"},
+        {"PUSH", "PUSH LR", "POP", "POP PC"},
+        {"STMIA", "LDMIA"},
+        {"BEQ not taken", "BEQ taken", "BNE not taken", "BNE taken", "BCS not taken", "BCS taken",
+         "BCC not taken", "BCC taken", "BMI not taken", "BMI taken", "BPL not taken", "BPL taken",
+         "BVS not taken", "BVS taken", "BVC not taken", "BVC taken", "BHI not taken", "BHI taken",
+         "BLS not taken", "BLS taken", "BGE not taken", "BGE taken", "BLT not taken", "BLT taken",
+         "BGT not taken", "BGT taken", "BLE not taken", "BLE taken"},
+        {"SWI"},
+        {"B"},
+        {"BL(0)", "BL(1)"}
+};
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Sets every count to zero.
+ * @param histogram
+ */
+void Histogram_init(VM_histogram* histogram)
+{
+    memset(histogram->counts, 0, sizeof(histogram->counts));
+}
+
+
+/**
+ * Starts counting the instructions `vm` executes into `histogram`. Returns false if the VM was built without
+ * ARMTINYVM_HISTOGRAM, so can't count them.
+ * @param histogram
+ * @param vm
+ * @return
+ */
+bool Histogram_attach(VM_histogram* histogram, VM_instance* vm)
+{
+#ifdef ARMTINYVM_HISTOGRAM
+    vm->histogram = histogram;
+    return true;
+#else
+    (void) histogram;
+    (void) vm;
+    return false;
+#endif // ARMTINYVM_HISTOGRAM
+}
+
+
+/**
+ * Returns the number of instructions of `format` executed, over all its sub-operations.
+ * @param histogram
+ * @param format
+ * @return
+ */
+uint64_t Histogram_formatCount(const VM_histogram* histogram, uint8_t format)
+{
+    uint64_t total = 0;
+    for (uint8_t subOp = 0; subOp < HISTOGRAM_MAX_SUB_OPS; subOp++) {
+        total += histogram->counts[format][subOp];
+    }
+    return total;
+}
+
+
+/**
+ * Returns the name of `format`, such as "ALU operations".
+ * @param format
+ * @return
+ */
+const char* Histogram_formatName(uint8_t format)
+{
+    return (format < HISTOGRAM_NUM_FORMATS) ? formatNames[format] : NULL;
+}
+
+
+/**
+ * Returns the name of sub-operation `subOp` of `format`, such as "BNE taken", or NULL if the format doesn't have it.
+ * @param format
+ * @param subOp
+ * @return
+ */
+const char* Histogram_subOpName(uint8_t format, uint8_t subOp)
+{
+    return ((format < HISTOGRAM_NUM_FORMATS) && (subOp < HISTOGRAM_MAX_SUB_OPS)) ? subOpNames[format][subOp] : NULL;
+}
+
+
+/**
+ * Writes the histogram to `file` as a JSON object: the total number of instructions, and an array with the count of
+ * each format and each of its sub-operations. Returns false if it couldn't be written.
+ * @param histogram
+ * @param file
+ * @return
+ */
+bool Histogram_writeJSON(const VM_histogram* histogram, FILE* file)
+{
+    uint64_t total = 0;
+    for (uint8_t format = 0; format < HISTOGRAM_NUM_FORMATS; format++) {
+        total += Histogram_formatCount(histogram, format);
+    }
+
+    fprintf(file, "{\n  \"instructions\": %llu,\n  \"formats\": [\n", (unsigned long long) total);
+    for (uint8_t format = 0; format < HISTOGRAM_NUM_FORMATS; format++) {
+        fprintf(file, "    {\"format\": %u, \"name\": \"%s\", \"count\": %llu, \"subOps\": {", format,
+                formatNames[format], (unsigned long long) Histogram_formatCount(histogram, format));
+        for (uint8_t subOp = 0; (subOp < HISTOGRAM_MAX_SUB_OPS) && subOpNames[format][subOp]; subOp++) {
+            fprintf(file, "%s\"%s\": %llu", (subOp == 0) ? "" : ", ", subOpNames[format][subOp],
+                    (unsigned long long) histogram->counts[format][subOp]);
+        }
+        fprintf(file, "}}%s\n", (format + 1 < HISTOGRAM_NUM_FORMATS) ? "," : "");
+    }
+    fprintf(file, "  ]\n}\n");
+
+    return !ferror(file);
+}
+
+
+/**
+ * Writes the histogram to the file `filename` as JSON (see Histogram_writeJSON). Returns false if it couldn't be
+ * written.
+ * @param histogram
+ * @param filename
+ * @return
+ */
+bool Histogram_saveJSON(const VM_histogram* histogram, const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        return false;
+    }
+
+    bool written = Histogram_writeJSON(histogram, file);
+    return (fclose(file) == 0) && written;
+}
@@ -0,0 +1,42 @@
+/*
+ * A histogram of the instructions a VM executes, by instruction format (numbered 1 to 19 as in instruction_set.h) and
+ * by the sub-operation within the format, such as which of the 16 ALU operations it was, or which condition a
+ * conditional branch tested and whether it was taken. Format 0 counts instructions which couldn't be decoded.
+ *
+ * The counting is only built into the VM with ARMTINYVM_HISTOGRAM; otherwise it costs nothing, and Histogram_attach
+ * fails. One histogram can be shared by several VMs, as long as they run on the same thread.
+*/
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "ARMTinyVM.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define HISTOGRAM_NUM_FORMATS 20
+
+// The most sub-operations a format has: the 14 conditions of a conditional branch, each taken or not
+#define HISTOGRAM_MAX_SUB_OPS 28
+
+
+/**
+ * `counts[format][subOp]` is the number of times that sub-operation has been executed. The sub-operations of each
+ * format are numbered by the bits of the instruction which choose them (see Histogram_subOpName).
+ */
+typedef struct VM_histogram {
+    uint64_t counts[HISTOGRAM_NUM_FORMATS][HISTOGRAM_MAX_SUB_OPS];
+} VM_histogram;
+
+
+void Histogram_init(VM_histogram* histogram);
+bool Histogram_attach(VM_histogram* histogram, VM_instance* vm);
+uint64_t Histogram_formatCount(const VM_histogram* histogram, uint8_t format);
+const char* Histogram_formatName(uint8_t format);
+const char* Histogram_subOpName(uint8_t format, uint8_t subOp);
+bool Histogram_writeJSON(const VM_histogram* histogram, FILE* file);
+bool Histogram_saveJSON(const VM_histogram* histogram, const char* filename);
+
+
+#endif // HISTOGRAM_H
@@ -0,0 +1,697 @@
+#define _POSIX_C_SOURCE 200809L
+#include "host.h"
+#include "replay.h"
+#include "logwriter.h"
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <errno.h>
+
+#ifdef _WIN32
+#include <io.h>
+#include <windows.h>
+#define read _read
+#define write _write
+#else
+#include <unistd.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/mman.h>
+#endif // _WIN32
+
+#ifdef __linux__
+#include <sys/timerfd.h>
+#endif // __linux__
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+VM_swiResult handleSoftwareInterrupt(VM_host* host, VM_instance* vm, uint8_t number);
+VM_swiResult startReadWrite(VM_host* host, VM_instance* vm);
+void finishPendingReadWrite(VM_asyncRequest* request);
+int32_t prepareReadWrite(VM_host* host, VM_instance* vm);
+int32_t performReadWrite(VM_host* host);
+void completeReadWrite(VM_host* host, VM_instance* vm);
+bool fileDescriptorReady(int fd, bool forReading);
+VM_swiResult waitForInterrupt(VM_host* host, VM_instance* vm);
+bool startTimerWait(VM_host* host, VM_instance* vm, uint64_t wakeTime);
+void finishTimerWait(VM_asyncRequest* request);
+void sleepUntil(uint64_t wakeTime);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Sets up `host` to run the program in `image`. The host takes its own reference to the image, shares its read-only
+ * segments, and gets private copies of its writable segments plus an empty stack. If `verbose` is set, system calls
+ * are reported as they happen. Returns false if memory couldn't be allocated.
+ * @param host
+ * @param image
+ * @param verbose
+ * @return
+ */
+bool Host_init(VM_host* host, VM_image* image, bool verbose)
+{
+    Host_initEmpty(host, verbose);
+    host->image = Image_retain(image);
+    host->entryAddress = image->entryAddress;
+
+    // One segment for each of the image's, plus the stack
+    host->segments = malloc(((size_t) image->numSegments + 1) * sizeof(runtimeSegment));
+    if (!host->segments) {
+        Host_free(host);
+        return false;
+    }
+
+    for (uint32_t i = 0; i < image->numSegments; i++) {
+        runtimeSegment* segment = &(host->segments[host->numAllocatedSegments]);
+        *segment = image->segments[i];
+
+        if (segment->writable) {
+            // Each VM needs its own copy of anything it can write to
+            segment->content = malloc(segment->length);
+            if (!segment->content) {
+                Host_free(host);
+                return false;
+            }
+            memcpy(segment->content, image->segments[i].content, segment->length);
+        }
+        host->numAllocatedSegments++;
+    }
+
+    // One last segment to allocate is for the stack to live in, which will be full of zeroes
+    runtimeSegment* stack = &(host->segments[host->numAllocatedSegments]);
+    stack->virtualStartAddress = STACK_START_ADDR - MAX_STACK_SIZE;
+    stack->length = MAX_STACK_SIZE;
+    stack->content = (uint8_t*) calloc(MAX_STACK_SIZE, 1);
+    stack->writable = true;
+    if (!stack->content) {
+        Host_free(host);
+        return false;
+    }
+    host->numAllocatedSegments++;
+
+    return true;
+}
+
+
+/**
+ * Sets up `host` with no memory at all, ready for segments to be added by something other than an image (e.g. a
+ * snapshot). If `verbose` is set, system calls are reported as they happen.
+ * @param host
+ * @param verbose
+ */
+void Host_initEmpty(VM_host* host, bool verbose)
+{
+    host->image = NULL;
+    host->segments = NULL;
+    host->numAllocatedSegments = 0;
+    host->memoryMapped = false;
+    host->entryAddress = 0;
+    host->exitCode = -0x40000000;
+    host->verbose = verbose;
+    host->asyncIO = NULL;
+    host->resume = NULL;
+    host->resumeContext = NULL;
+    host->pendingVM = NULL;
+    host->pendingFinished = false;
+    host->sysTick = NULL;
+    host->timerFd = -1;
+    host->stopAtWarmStart = false;
+    host->reachedWarmStart = false;
+    host->recorder = NULL;
+    host->pager = NULL;
+}
+
+
+/**
+ * Convenience function to load the ELF file at `filename` into a new image which is used only by `host`. If
+ * `verbose` is set, the headers of the ELF are printed as they are read. Returns false if the file couldn't be loaded.
+ * @param host
+ * @param filename
+ * @param verbose
+ * @return
+ */
+bool Host_loadElf(VM_host* host, const char* filename, bool verbose)
+{
+    VM_image* image = Image_loadElf(filename, verbose);
+    if (!image) {
+        return false;
+    }
+
+    bool success = Host_init(host, image, verbose);
+    Image_release(image);
+    return success;
+}
+
+
+/**
+ * Lets read and write system calls which would block be finished on the I/O thread of `asyncIO`, rather than blocking
+ * the thread running the VM. `resume` is called with `resumeContext` from the I/O thread once such a call completes.
+ * @param host
+ * @param asyncIO
+ * @param resume
+ * @param resumeContext
+ */
+void Host_enableAsyncIO(VM_host* host, VM_asyncIO* asyncIO, void (*resume)(VM_instance* vm, void* resumeContext),
+                        void* resumeContext)
+{
+    host->asyncIO = asyncIO;
+    host->resume = resume;
+    host->resumeContext = resumeContext;
+}
+
+
+/**
+ * Maps `sysTick` into the guest's memory at SYSTICK_BASE. It should be set up with SysTick_init first, and can only
+ * be used by one VM.
+ * @param host
+ * @param sysTick
+ */
+void Host_attachSysTick(VM_host* host, VM_sysTick* sysTick)
+{
+    host->sysTick = sysTick;
+}
+
+
+/**
+ * Maps the paged region of `pager` into the guest's memory, wherever it isn't covered by a segment. It should be set
+ * up with Pager_init or Pager_initFile first, and remains owned by the caller.
+ * @param host
+ * @param pager
+ */
+void Host_attachPager(VM_host* host, VM_pager* pager)
+{
+    host->pager = pager;
+}
+
+
+/**
+ * Creates a new VM which will execute the program loaded into `host`, using `host` for its memory and system calls.
+ * @param host
+ * @return
+ */
+VM_instance Host_newVM(VM_host* host)
+{
+    VM_instance vm = VM_new(&Host_readByte, &Host_writeByte, &Host_softwareInterrupt,
+                            STACK_START_ADDR, host->entryAddress);
+    vm.context = host;
+    vm.deadlineReached = &Host_deadlineReached;
+    return vm;
+}
+
+
+/**
+ * Finishes a read or write system call which was completed on the I/O thread, by copying what was read into the
+ * guest's memory and putting the result in r0. Must be called on the thread which runs the VM, before it runs again
+ * after being resumed. Does nothing if there's nothing to finish.
+ * @param vm
+ */
+void Host_resumed(VM_instance* vm)
+{
+    VM_host* host = (VM_host*) vm->context;
+    if (host->pendingFinished) {
+        host->pendingFinished = false;
+        completeReadWrite(host, vm);
+    }
+}
+
+
+/**
+ * Frees all of the virtual memory segments belonging to `host`, and gives up its reference to the image.
+ * @param host
+ */
+void Host_free(VM_host* host)
+{
+    for (uint32_t i = 0; i < host->numAllocatedSegments; i++) {
+        if (host->memoryMapped) {
+#ifndef _WIN32
+            // Every segment was mapped separately, in whole pages (see snapshot.c)
+            if (host->segments[i].content) {
+                long pageSize = sysconf(_SC_PAGESIZE);
+                munmap(host->segments[i].content, ((host->segments[i].length + pageSize - 1) / pageSize) * pageSize);
+            }
+#endif // _WIN32
+        } else if (host->segments[i].writable) {
+            free(host->segments[i].content);
+        }
+    }
+    free(host->segments);
+    host->segments = NULL;
+    host->numAllocatedSegments = 0;
+    host->memoryMapped = false;
+
+    if (host->image) {
+        Image_release(host->image);
+        host->image = NULL;
+    }
+
+#ifdef __linux__
+    if (host->timerFd >= 0) {
+        close(host->timerFd);
+        host->timerFd = -1;
+    }
+#endif // __linux__
+}
+
+
+/**
+ * Reads a byte from the given virtual address. Returns 0xFF if the address is invalid.
+ * @param vm
+ * @param addr
+ * @return
+ */
+uint8_t Host_readByte(VM_instance* vm, uint32_t addr)
+{
+    VM_host* host = (VM_host*) vm->context;
+    uint8_t* bytePtr = Host_getVirtualMemoryByte(host, addr, NULL);
+    if (bytePtr != NULL) {
+        return *bytePtr;
+    }
+
+    uint8_t value = 0xFF;
+    if (host->sysTick && (addr - SYSTICK_BASE < SYSTICK_SIZE)) {
+        value = SysTick_readByte(host->sysTick, vm, addr - SYSTICK_BASE);
+    }
+    if (host->recorder) {
+        Recorder_mmioRead(host->recorder, vm, addr, value);
+    }
+    return value;
+}
+
+
+/**
+ * Writes a byte to the given virtual address. Does nothing if the address is invalid or read-only, since read-only
+ * memory is shared with every other VM using the same image.
+ * @param vm
+ * @param addr
+ * @param value
+ */
+void Host_writeByte(VM_instance* vm, uint32_t addr, uint8_t value)
+{
+    VM_host* host = (VM_host*) vm->context;
+    bool byteWritable;
+    uint8_t* bytePtr = Host_getVirtualMemoryByte(host, addr, &byteWritable);
+    if (bytePtr != NULL) {
+        if (byteWritable) {
+            *bytePtr = value;
+        }
+    } else if (host->sysTick && (addr - SYSTICK_BASE < SYSTICK_SIZE)) {
+        SysTick_writeByte(host->sysTick, vm, addr - SYSTICK_BASE, value);
+    }
+}
+
+
+/**
+ * Handles the software interrupts made by the guest (see handleSoftwareInterrupt), recording their effects if the VM
+ * is being recorded.
+ * @param vm
+ * @param number
+ * @return
+ */
+VM_swiResult Host_softwareInterrupt(VM_instance* vm, uint8_t number)
+{
+    VM_host* host = (VM_host*) vm->context;
+    if (!host->recorder) {
+        return handleSoftwareInterrupt(host, vm, number);
+    }
+
+    Recorder_beginSoftwareInterrupt(host->recorder, vm, host->exitCode);
+    VM_swiResult result = handleSoftwareInterrupt(host, vm, number);
+    Recorder_endSoftwareInterrupt(host->recorder, vm, number, host->exitCode, result);
+    return result;
+}
+
+
+/**
+ * Called when a VM created by Host_newVM reaches its deadline, which is only set by the SysTick timer.
+ * @param vm
+ */
+void Host_deadlineReached(VM_instance* vm)
+{
+    VM_host* host = (VM_host*) vm->context;
+    if (host->sysTick) {
+        SysTick_update(host->sysTick, vm);
+    }
+}
+
+
+/**
+ * Tries to find the byte pointed to by this virtual memory address, by searching in the segments of `host`, and then
+ * its paged memory. Returns NULL if none found. If `byteWritable` is not NULL, it is set to whether the byte may be
+ * written to. A caller which asks that is taken to be about to write the byte, so a paged byte's page is made dirty;
+ * a pointer into paged memory is only valid until the next call.
+ * @param host
+ * @param addr
+ * @param byteWritable
+ * @return
+ */
+uint8_t* Host_getVirtualMemoryByte(VM_host* host, uint32_t addr, bool* byteWritable)
+{
+    for (uint32_t i = 0; i < host->numAllocatedSegments; i++) {
+        // Is this address included in this segment?
+        runtimeSegment* segment = &(host->segments[i]);
+        if ((addr >= segment->virtualStartAddress) && (addr < (segment->virtualStartAddress + segment->length))) {
+            // The byte is in this segment
+            // Calculate its offset and find a pointer to that byte
+            uint32_t offset = addr - segment->virtualStartAddress;
+            if (byteWritable) {
+                *byteWritable = segment->writable;
+            }
+            return &(segment->content[offset]);
+        }
+    }
+
+    if (host->pager && pager_contains(host->pager, addr)) {
+        if (byteWritable) {
+            *byteWritable = true;
+        }
+        return Pager_getByte(host->pager, addr, byteWritable != NULL);
+    }
+
+    // No matches found
+    return NULL;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Handles the system calls made by the guest with `swi #0`: exit, and reading or writing a host file descriptor. Also
+ * handles `swi #1`, which waits for an interrupt, and `swi #2`, which marks the end of the program's start-up. Any
+ * other software interrupt finishes the program.
+ * @param host
+ * @param vm
+ * @param number
+ * @return
+ */
+VM_swiResult handleSoftwareInterrupt(VM_host* host, VM_instance* vm, uint8_t number)
+{
+    if (host->verbose) {
+        LogWriter_printf("Software interrupt: %u\n", number);
+    }
+
+    if (number == SWI_WAIT_FOR_INTERRUPT) {
+        return waitForInterrupt(host, vm);
+    } else if (number == SWI_WARM_START) {
+        // Only does anything while a warm start snapshot is being made
+        if (host->stopAtWarmStart) {
+            host->reachedWarmStart = true;
+            return SWI_PENDING;
+        }
+        return SWI_COMPLETE;
+    } else if (number == 0) {
+        // This is intended as a system call
+        // Check in r7 to see which system call
+        switch (vm->registers[7]) {
+            case SYSCALL_EXIT:
+                // The exit code will be in r0
+                host->exitCode = (int32_t) vm->registers[0];
+                break;
+            case SYSCALL_READ:
+            case SYSCALL_WRITE:
+                return startReadWrite(host, vm);
+            default:
+                break;
+        }
+    }
+
+    vm->finished = true;
+    return SWI_COMPLETE;
+}
+
+
+/**
+ * Starts a read or write system call. If it would block and asynchronous I/O is enabled, it is handed to the I/O
+ * thread and SWI_PENDING is returned; otherwise it is done straight away.
+ * @param host
+ * @param vm
+ * @return
+ */
+VM_swiResult startReadWrite(VM_host* host, VM_instance* vm)
+{
+    host->pendingResult = prepareReadWrite(host, vm);
+    if (host->pendingResult < 0) {
+        vm->registers[0] = (uint32_t) host->pendingResult;
+        return SWI_COMPLETE;
+    }
+
+    // Writes to the log writer's output never block, as they're only queued
+    int fd = host->pendingFd;
+    bool forReading = host->pendingForReading;
+    if (host->asyncIO && host->resume && !host->recorder && (forReading || !LogWriter_isOutput(fd)) &&
+        !fileDescriptorReady(fd, forReading)) {
+        host->pendingVM = vm;
+        host->pendingRequest.fd = fd;
+        host->pendingRequest.events = forReading ? ASYNCIO_READABLE : ASYNCIO_WRITABLE;
+        host->pendingRequest.onReady = finishPendingReadWrite;
+        host->pendingRequest.context = host;
+        if (AsyncIO_submit(host->asyncIO, &(host->pendingRequest))) {
+            return SWI_PENDING;
+        }
+    }
+
+    host->pendingResult = performReadWrite(host);
+    completeReadWrite(host, vm);
+    return SWI_COMPLETE;
+}
+
+
+/**
+ * Called on the I/O thread once the file descriptor of a pending read or write is ready. Does the transfer on the host
+ * side only, since the VM's thread may still be on its way out of the software interrupt, and asks for the VM to be
+ * resumed. Host_resumed gives the guest the result.
+ * @param request
+ */
+void finishPendingReadWrite(VM_asyncRequest* request)
+{
+    VM_host* host = (VM_host*) request->context;
+    VM_instance* vm = host->pendingVM;
+
+    host->pendingVM = NULL;
+    host->pendingResult = performReadWrite(host);
+    host->pendingFinished = true;
+    host->resume(vm, host->resumeContext);
+}
+
+
+/**
+ * Sets up the read or write (depending on r7) of up to r2 bytes between host file descriptor r0 and the guest buffer
+ * at r1, as the read() and write() system calls do. What is to be written is copied out of the guest's memory into
+ * `pendingData` now, so that the transfer doesn't need the VM. Returns 0, or -EFAULT if the buffer isn't mapped.
+ * @param host
+ * @param vm
+ * @return
+ */
+int32_t prepareReadWrite(VM_host* host, VM_instance* vm)
+{
+    host->pendingFd = (int) vm->registers[0];
+    host->pendingForReading = (vm->registers[7] == SYSCALL_READ);
+    host->pendingLength = vm->registers[2];
+    if (host->pendingLength > MAX_SYSCALL_TRANSFER) {
+        host->pendingLength = MAX_SYSCALL_TRANSFER;
+    }
+
+    if (!host->pendingForReading) {
+        uint32_t guestBuffer = vm->registers[1];
+        for (uint32_t i = 0; i < host->pendingLength; i++) {
+            uint8_t* bytePtr = Host_getVirtualMemoryByte(host, guestBuffer + i, NULL);
+            if (!bytePtr) {
+                return -EFAULT;
+            }
+            host->pendingData[i] = *bytePtr;
+        }
+    }
+    return 0;
+}
+
+
+/**
+ * Does the host side of the read or write set up by prepareReadWrite, between its file descriptor and `pendingData`.
+ * Returns the number of bytes transferred, or minus the error number.
+ * @param host
+ * @return
+ */
+int32_t performReadWrite(VM_host* host)
+{
+    int fd = host->pendingFd;
+    uint32_t length = host->pendingLength;
+    if (host->pendingForReading) {
+        int32_t numRead = (int32_t) read(fd, host->pendingData, length);
+        return (numRead < 0) ? -errno : numRead;
+    }
+
+    // Keep the guest's output in order with anything the host has printed: by queueing it after that if there's a log
+    // writer, and otherwise by making sure that's been written first
+    if (LogWriter_write(fd, host->pendingData, length)) {
+        return (int32_t) length;
+    } else if (!LogWriter_isActive()) {
+        fflush(stdout);
+    }
+    int32_t numWritten = (int32_t) write(fd, host->pendingData, length);
+    return (numWritten < 0) ? -errno : numWritten;
+}
+
+
+/**
+ * Gives the guest the result of a read or write done by performReadWrite: copies what was read into the guest buffer
+ * at r1, and puts the number of bytes transferred (or minus the error number) in r0. Must be called on the thread
+ * which runs the VM.
+ * @param host
+ * @param vm
+ */
+void completeReadWrite(VM_host* host, VM_instance* vm)
+{
+    int32_t result = host->pendingResult;
+    if (host->pendingForReading && (result > 0)) {
+        uint32_t guestBuffer = vm->registers[1];
+        bool writable;
+        for (int32_t i = 0; i < result; i++) {
+            uint8_t* bytePtr = Host_getVirtualMemoryByte(host, guestBuffer + i, &writable);
+            if (!bytePtr || !writable) {
+                result = -EFAULT;
+                break;
+            }
+            *bytePtr = host->pendingData[i];
+        }
+
+        if (host->recorder && (result > 0)) {
+            Recorder_memoryWritten(host->recorder, vm, guestBuffer, host->pendingData, (uint32_t) result);
+        }
+    }
+    vm->registers[0] = (uint32_t) result;
+}
+
+
+/**
+ * Returns whether reading or writing `fd` would go ahead without blocking.
+ * @param fd
+ * @param forReading
+ * @return
+ */
+bool fileDescriptorReady(int fd, bool forReading)
+{
+#ifdef _WIN32
+    (void) fd;
+    (void) forReading;
+    return true;
+#else
+    struct pollfd pfd = {.fd = fd, .events = forReading ? POLLIN : POLLOUT, .revents = 0};
+    return poll(&pfd, 1, 0) != 0;
+#endif // _WIN32
+}
+
+
+/**
+ * Lets the guest idle until its next interrupt, rather than spinning. With the instruction clock nothing can happen
+ * in between, so the instruction count skips straight to the timer's expiry. With host time, the I/O thread wakes the
+ * VM when the timer expires if asynchronous I/O is enabled; otherwise this thread sleeps until then. If an interrupt
+ * is already pending, or there's no timer interrupt to wait for, this returns straight away.
+ * @param host
+ * @param vm
+ * @return
+ */
+VM_swiResult waitForInterrupt(VM_host* host, VM_instance* vm)
+{
+    VM_sysTick* sysTick = host->sysTick;
+    if (!vm->interrupts || VM_interruptPending(vm->interrupts) || !sysTick || !SysTick_running(sysTick) ||
+        !(sysTick->control & SYSTICK_CSR_TICKINT)) {
+        return SWI_COMPLETE;
+    }
+
+    if (sysTick->clock == SYSTICK_CLOCK_INSTRUCTIONS) {
+        // The deadline is the expiry, so it will be reached as soon as this instruction has finished
+        if (vm->instructionCount < sysTick->nextExpiry) {
+            vm->instructionCount = sysTick->nextExpiry;
+        }
+        return SWI_COMPLETE;
+    }
+
+    // Look at the timer again as soon as the VM carries on
+    VM_setDeadline(vm, vm->instructionCount);
+    if (host->asyncIO && host->resume && !host->recorder && startTimerWait(host, vm, sysTick->nextExpiry)) {
+        return SWI_PENDING;
+    }
+    sleepUntil(sysTick->nextExpiry);
+    return SWI_COMPLETE;
+}
+
+
+/**
+ * Asks the I/O thread to resume the VM at host time `wakeTime`. Returns false if that isn't possible.
+ * @param host
+ * @param vm
+ * @param wakeTime
+ * @return
+ */
+bool startTimerWait(VM_host* host, VM_instance* vm, uint64_t wakeTime)
+{
+#ifdef __linux__
+    if (host->timerFd < 0) {
+        host->timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+        if (host->timerFd < 0) {
+            return false;
+        }
+    }
+
+    struct itimerspec expiry = {{0, 0}, {(time_t) (wakeTime / 1000000000ULL), (long) (wakeTime % 1000000000ULL)}};
+    if (timerfd_settime(host->timerFd, TFD_TIMER_ABSTIME, &expiry, NULL) != 0) {
+        return false;
+    }
+
+    host->pendingVM = vm;
+    host->pendingRequest.fd = host->timerFd;
+    host->pendingRequest.events = ASYNCIO_READABLE;
+    host->pendingRequest.onReady = finishTimerWait;
+    host->pendingRequest.context = host;
+    return AsyncIO_submit(host->asyncIO, &(host->pendingRequest));
+#else
+    (void) host;
+    (void) vm;
+    (void) wakeTime;
+    return false;
+#endif // __linux__
+}
+
+
+/**
+ * Called on the I/O thread when the timer of a waiting VM has expired.
+ * @param request
+ */
+void finishTimerWait(VM_asyncRequest* request)
+{
+    VM_host* host = (VM_host*) request->context;
+    VM_instance* vm = host->pendingVM;
+
+    uint64_t expirations;
+    if (read(host->timerFd, &expirations, sizeof(expirations)) < 0) {
+        // Nothing to do; the timer is re-armed before it is next used
+    }
+
+    host->pendingVM = NULL;
+    host->resume(vm, host->resumeContext);
+}
+
+
+/**
+ * Blocks the calling thread until host time `wakeTime`, as given by SysTick_hostTime.
+ * @param wakeTime
+ */
+void sleepUntil(uint64_t wakeTime)
+{
+    uint64_t now = SysTick_hostTime();
+    if (wakeTime <= now) {
+        return;
+    }
+
+#ifdef _WIN32
+    Sleep((DWORD) ((wakeTime - now + 999999) / 1000000));
+#else
+    struct timespec wake = {(time_t) (wakeTime / 1000000000ULL), (long) (wakeTime % 1000000000ULL)};
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &wake, NULL) == EINTR) {
+        // Keep sleeping
+    }
+#endif // _WIN32
+}
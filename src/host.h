@@ -0,0 +1,97 @@
+/*
+ * A standard host environment for running Thumb ELF programs in the Tiny ARM Virtual Machine on a desktop machine.
+ * Each VM_host owns the writable memory of one guest program, so several of them can be executed independently, even
+ * from different threads. Read-only memory is shared with the VM_image the host was created from.
+*/
+
+#ifndef HOST_H
+#define HOST_H
+
+#include "ARMTinyVM.h"
+#include "image.h"
+#include "asyncio.h"
+#include "systick.h"
+#include "pager.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define STACK_START_ADDR 0xFFFFFFFC
+#define MAX_STACK_SIZE 0x10000
+
+// System call numbers, passed in r7 with `swi #0`, as on ARM Linux
+#define SYSCALL_EXIT 1
+#define SYSCALL_READ 3
+#define SYSCALL_WRITE 4
+
+// The most that will be transferred by a single read or write system call
+#define MAX_SYSCALL_TRANSFER 4096
+
+// Software interrupt which makes the guest sleep until an interrupt arrives
+#define SWI_WAIT_FOR_INTERRUPT 1
+
+// Software interrupt marking the point where a warm-start snapshot should be taken (see Snapshot_saveWarmStart)
+#define SWI_WARM_START 2
+
+
+/**
+ * Everything the host knows about a single guest program: its virtual memory, where it starts, and how it exited.
+ * Read-only segments point into the image; writable segments (including the stack) are owned by the host.
+ *
+ * If asynchronous I/O has been enabled, a read or write system call which would block is handed to the I/O thread and
+ * the VM is left waiting. The I/O thread only transfers the data to or from `pendingData`; once it has, `resume` is
+ * called from the I/O thread, and must let the VM run again (for example with Scheduler_wake). Host_resumed must then
+ * be called on the thread which runs the VM before it does (for example from the task's `onResume`), to copy what was
+ * read into the guest's memory and give the guest the result in r0.
+ *
+ * If a SysTick timer has been attached, it is mapped at SYSTICK_BASE, and `swi #1` waits for its next interrupt.
+ *
+ * If a pager has been attached, its region of paged memory is mapped too. It isn't included in snapshots.
+ *
+ * While `recorder` is set, asynchronous I/O isn't used, and everything the host does for the guest is recorded.
+ */
+typedef struct VM_host {
+    VM_image* image;
+    runtimeSegment* segments;
+    uint32_t numAllocatedSegments;
+    bool memoryMapped; // Set if every segment is a separate memory mapping rather than being allocated
+    uint32_t entryAddress;
+    int32_t exitCode;
+    bool verbose;
+    VM_asyncIO* asyncIO;
+    void (*resume)(VM_instance* vm, void* resumeContext);
+    void* resumeContext;
+    VM_asyncRequest pendingRequest;
+    VM_instance* pendingVM;
+    int pendingFd;
+    bool pendingForReading;
+    uint32_t pendingLength;
+    int32_t pendingResult;
+    bool pendingFinished; // Set by the I/O thread once a read or write is done, until Host_resumed
+    uint8_t pendingData[MAX_SYSCALL_TRANSFER];
+    VM_sysTick* sysTick;
+    int timerFd;
+    bool stopAtWarmStart; // Set to make SWI_WARM_START pause the VM rather than being ignored
+    bool reachedWarmStart;
+    struct VM_recorder* recorder; // Set while the VM is being recorded (see replay.h)
+    VM_pager* pager;
+} VM_host;
+
+
+bool Host_init(VM_host* host, VM_image* image, bool verbose);
+void Host_initEmpty(VM_host* host, bool verbose);
+bool Host_loadElf(VM_host* host, const char* filename, bool verbose);
+void Host_enableAsyncIO(VM_host* host, VM_asyncIO* asyncIO, void (*resume)(VM_instance* vm, void* resumeContext),
+                        void* resumeContext);
+void Host_attachSysTick(VM_host* host, VM_sysTick* sysTick);
+void Host_attachPager(VM_host* host, VM_pager* pager);
+VM_instance Host_newVM(VM_host* host);
+void Host_resumed(VM_instance* vm);
+void Host_free(VM_host* host);
+uint8_t Host_readByte(VM_instance* vm, uint32_t addr);
+void Host_writeByte(VM_instance* vm, uint32_t addr, uint8_t value);
+VM_swiResult Host_softwareInterrupt(VM_instance* vm, uint8_t number);
+void Host_deadlineReached(VM_instance* vm);
+uint8_t* Host_getVirtualMemoryByte(VM_host* host, uint32_t addr, bool* byteWritable);
+
+
+#endif // HOST_H
@@ -0,0 +1,88 @@
+#include "image.h"
+#include "logwriter.h"
+#include <stdio.h>
+#include <stdlib.h>
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Loads the ELF file at `filename` into a new image, with a single reference owned by the caller. If `verbose` is set,
+ * the headers of the ELF are printed as they are read, along with the reason for any failure. Returns NULL if the file
+ * couldn't be loaded.
+ * @param filename
+ * @param verbose
+ * @return
+ */
+VM_image* Image_loadElf(const char* filename, bool verbose)
+{
+    VM_memoryMap map;
+    VM_elfStatus status = ElfLoader_load(filename, verbose, &map);
+    if (status != ELF_LOADED) {
+        if (verbose) {
+            LogWriter_printf("%s\n", ElfLoader_statusMessage(status));
+        }
+        return NULL;
+    }
+
+    VM_image* image = Image_fromMemoryMap(&map);
+    if (!image) {
+        ElfLoader_freeMemoryMap(&map);
+    }
+    return image;
+}
+
+
+/**
+ * Creates an image holding the segments of `map`, with a single reference owned by the caller. The image takes over
+ * the segments, leaving `map` empty. Returns NULL, leaving `map` alone, if memory couldn't be allocated.
+ * @param map
+ * @return
+ */
+VM_image* Image_fromMemoryMap(VM_memoryMap* map)
+{
+    VM_image* image = malloc(sizeof(VM_image));
+    if (!image) {
+        return NULL;
+    }
+
+    atomic_init(&(image->refCount), 1);
+    image->segments = map->segments;
+    image->numSegments = map->numSegments;
+    image->entryAddress = map->entryAddress;
+
+    map->segments = NULL;
+    map->numSegments = 0;
+    return image;
+}
+
+
+/**
+ * Adds a reference to `image`, which must later be given up with Image_release. Safe to call from any thread.
+ * @param image
+ * @return
+ */
+VM_image* Image_retain(VM_image* image)
+{
+    atomic_fetch_add_explicit(&(image->refCount), 1, memory_order_relaxed);
+    return image;
+}
+
+
+/**
+ * Gives up a reference to `image`, freeing it when the last reference goes. Safe to call from any thread.
+ * @param image
+ */
+void Image_release(VM_image* image)
+{
+    if (atomic_fetch_sub_explicit(&(image->refCount), 1, memory_order_acq_rel) != 1) {
+        return;
+    }
+
+    for (uint32_t i = 0; i < image->numSegments; i++) {
+        free(image->segments[i].content);
+    }
+    free(image->segments);
+    free(image);
+}
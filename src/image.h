@@ -0,0 +1,33 @@
+/*
+ * A program image: an ELF which has been parsed and loaded into memory once, so that any number of VMs can be created
+ * from it. The read-only segments of an image are shared by every VM using it, and are only freed once the last
+ * reference to the image has been released. Each VM gets its own copy of the writable segments (see host.h).
+*/
+
+#ifndef IMAGE_H
+#define IMAGE_H
+
+#include "elfloader.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+
+
+/**
+ * A loaded program. Writable segments hold the initial content, which is copied into each VM created from the image.
+ */
+typedef struct VM_image {
+    atomic_uint refCount;
+    runtimeSegment* segments;
+    uint32_t numSegments;
+    uint32_t entryAddress;
+} VM_image;
+
+
+VM_image* Image_loadElf(const char* filename, bool verbose);
+VM_image* Image_fromMemoryMap(VM_memoryMap* map);
+VM_image* Image_retain(VM_image* image);
+void Image_release(VM_image* image);
+
+
+#endif // IMAGE_H
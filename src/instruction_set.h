@@ -24,6 +24,15 @@
 #define istl_unconditional_branch(instr)  (((instr) & 0b11111000) == 0b11100000)
 #define istl_long_branch_w_link(instr)    (((instr) & 0b11110000) == 0b11110000)
 
+// Extracts the operand field which is `mask` wide and starts `shift` bits up the instruction. The size profile shares
+// one out-of-line copy of this between every handler, rather than having a shift-and-mask sequence in each.
+#ifdef ARMTINYVM_SIZE_PROFILE
+uint8_t instructionField(uint16_t instruction, uint8_t shift, uint8_t mask);
+#define instr_field(instr, shift, mask)   instructionField((instr), (shift), (mask))
+#else
+#define instr_field(instr, shift, mask)   ((uint8_t) (((instr) >> (shift)) & (mask)))
+#endif // ARMTINYVM_SIZE_PROFILE
+
 // The definitions of these different instructions are, more plainly:
 //  1: istl_move_shifted_reg         000XXXXX XXXXXXXX
 //  2: istl_add_subtract             00011XXX XXXXXXXX
@@ -0,0 +1,482 @@
+#include "lockstep.h"
+#include "instruction_set.h"
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) || defined(WIN64) || defined(_WIN64) || defined(__WIN64)
+#include <malloc.h>
+#define lockstep_alloc(size) _aligned_malloc((size), 32)
+#define lockstep_free(ptr)   _aligned_free(ptr)
+#else
+#define lockstep_alloc(size) aligned_alloc(32, (size))
+#define lockstep_free(ptr)   free(ptr)
+#endif
+
+// The kernels are written with GCC vector extensions, which compile to one AVX2 instruction per operation when built
+// with -mavx2, or pairs of SSE2 instructions otherwise
+#if defined(__AVX2__)
+#define LOCKSTEP_VECTOR_BYTES 32
+#else
+#define LOCKSTEP_VECTOR_BYTES 16
+#endif
+#define LOCKSTEP_VECTOR_WIDTH (LOCKSTEP_VECTOR_BYTES / 4)
+
+typedef uint32_t lsVector __attribute__((vector_size(LOCKSTEP_VECTOR_BYTES)));
+
+#define ls_load(ptr)         (*(const lsVector*) (ptr))
+#define ls_store(ptr, value) (*(lsVector*) (ptr) = (value))
+#define ls_broadcast(value)  (((lsVector) {0}) + (uint32_t) (value))
+#define ls_blend(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+
+#define CPSR_N 0x80000000UL
+#define CPSR_Z 0x40000000UL
+#define CPSR_C 0x20000000UL
+#define CPSR_V 0x10000000UL
+
+
+// The operations which the kernel knows how to perform across all lanes at once
+typedef enum lsOperation {
+    LS_MOV,
+    LS_ADD,
+    LS_ADC,
+    LS_SBC,
+    LS_NEG,
+    LS_AND,
+    LS_EOR,
+    LS_ORR,
+    LS_BIC,
+    LS_MVN,
+    LS_MUL
+} lsOperation;
+
+
+/**
+ * A decoded instruction, ready to be applied to every active lane. Operand `b` comes from a register if `b` is not
+ * NULL, or `immediate` otherwise, and is negated first if `negateB` is set (as the scalar interpreter does for
+ * subtraction). If `dest` is NULL the result is only used to set the flags.
+ */
+typedef struct lsKernel {
+    lsOperation op;
+    const uint32_t* a;
+    const uint32_t* b;
+    uint32_t immediate;
+    bool negateB;
+    uint32_t* dest;
+    uint32_t flagsAffected;
+} lsKernel;
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+bool decodeKernel(VM_lockstep* ls, uint16_t instruction, lsKernel* kernel);
+void runKernel(VM_lockstep* ls, const lsKernel* kernel);
+bool needsScalar(VM_lockstep* ls);
+void executeLanesScalar(VM_lockstep* ls);
+void deliverDeadlines(VM_lockstep* ls);
+void copyLaneIn(VM_lockstep* ls, uint32_t lane);
+void copyLaneOut(VM_lockstep* ls, uint32_t lane);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Prepares to execute `lanes` in lockstep. The lanes should all have been created from the same program, and keep
+ * their own memory and interaction functions. Their registers are copied in now, and copied back out at the end of
+ * each call to Lockstep_executeNInstructions. Returns false if memory couldn't be allocated.
+ * @param ls
+ * @param lanes
+ * @param numLanes
+ * @return
+ */
+bool Lockstep_init(VM_lockstep* ls, VM_instance* lanes, uint32_t numLanes)
+{
+    memset(ls, 0, sizeof(VM_lockstep));
+    ls->lanes = lanes;
+    ls->numLanes = numLanes;
+    ls->paddedLanes = (numLanes + LOCKSTEP_LANE_ALIGNMENT - 1) & ~(uint32_t) (LOCKSTEP_LANE_ALIGNMENT - 1);
+
+    size_t arraySize = ls->paddedLanes * sizeof(uint32_t);
+    for (uint8_t r = 0; r < 16; r++) {
+        ls->registers[r] = lockstep_alloc(arraySize);
+    }
+    ls->cpsr = lockstep_alloc(arraySize);
+    ls->activeMask = lockstep_alloc(arraySize);
+
+    for (uint8_t r = 0; r < 16; r++) {
+        if (!ls->registers[r]) {
+            Lockstep_free(ls);
+            return false;
+        }
+        memset(ls->registers[r], 0, arraySize);
+    }
+    if (!ls->cpsr || !ls->activeMask) {
+        Lockstep_free(ls);
+        return false;
+    }
+    memset(ls->cpsr, 0, arraySize);
+    memset(ls->activeMask, 0, arraySize);
+
+    for (uint32_t lane = 0; lane < numLanes; lane++) {
+        copyLaneIn(ls, lane);
+    }
+    return true;
+}
+
+
+/**
+ * Executes up to `maxSteps` steps and returns the total number of instructions executed across all lanes. In each
+ * step, the lanes with the lowest PC execute one instruction together. Always advancing the lowest PC lets lanes which
+ * have diverged at a branch catch up with each other and reconverge, at the cost that a lane which loops forever will
+ * hold back any lanes which are further ahead. Each lane's instruction count is kept up to date, and a lane whose
+ * deadline is reached has it delivered at the end of that step. Steps where any lane has a hook attached or an
+ * interrupt pending, or the trace is on, go through the normal interpreter, so that nothing is skipped.
+ * @param ls
+ * @param maxSteps
+ * @return
+ */
+uint64_t Lockstep_executeNInstructions(VM_lockstep* ls, uint32_t maxSteps)
+{
+    uint64_t executed = 0;
+    uint32_t* const pc = ls->registers[15];
+
+    for (uint32_t step = 0; step < maxSteps; step++) {
+        // Find the lowest PC of any lane which is still running
+        bool anyRunning = false;
+        uint32_t lowestPC = 0xFFFFFFFFUL;
+        uint32_t leader = 0;
+        for (uint32_t lane = 0; lane < ls->numLanes; lane++) {
+            if (!ls->lanes[lane].finished && !ls->lanes[lane].waiting && (!anyRunning || (pc[lane] < lowestPC))) {
+                anyRunning = true;
+                lowestPC = pc[lane];
+                leader = lane;
+            }
+        }
+        if (!anyRunning) {
+            break;
+        }
+
+        // Every lane at that PC takes part in this step
+        for (uint32_t lane = 0; lane < ls->numLanes; lane++) {
+            bool active = !ls->lanes[lane].finished && !ls->lanes[lane].waiting && (pc[lane] == lowestPC);
+            ls->activeMask[lane] = active ? 0xFFFFFFFFUL : 0;
+            executed += active;
+        }
+
+        // All of the lanes are running the same program, so the leader's memory has the same code as the others
+        VM_instance* vm = &(ls->lanes[leader]);
+        uint16_t instruction = vm->readByte(vm, lowestPC);
+        instruction += vm->readByte(vm, lowestPC + 1UL) << 8UL;
+
+        lsKernel kernel;
+        if (!needsScalar(ls) && decodeKernel(ls, instruction, &kernel)) {
+            runKernel(ls, &kernel);
+            ls->vectorInstructions++;
+            for (uint32_t lane = 0; lane < ls->numLanes; lane++) {
+                ls->lanes[lane].instructionCount += ls->activeMask[lane] & 1;
+            }
+        } else {
+            executeLanesScalar(ls);
+            ls->scalarInstructions++;
+        }
+        deliverDeadlines(ls);
+    }
+
+    for (uint32_t lane = 0; lane < ls->numLanes; lane++) {
+        copyLaneOut(ls, lane);
+    }
+    return executed;
+}
+
+
+/**
+ * Frees the register arrays. The lanes themselves belong to the caller.
+ * @param ls
+ */
+void Lockstep_free(VM_lockstep* ls)
+{
+    for (uint8_t r = 0; r < 16; r++) {
+        lockstep_free(ls->registers[r]);
+        ls->registers[r] = NULL;
+    }
+    lockstep_free(ls->cpsr);
+    lockstep_free(ls->activeMask);
+    ls->cpsr = NULL;
+    ls->activeMask = NULL;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Works out whether `instruction` can be run by the vector kernel, and if so fills in `kernel`. This mirrors
+ * tliAddSubtract, tliMovCmpAddSubImmediate and tliALUOperations exactly, including the way they set the flags. The
+ * shifts and rotates in tliALUOperations are left to the scalar interpreter, since their results for shift amounts of
+ * 32 or more depend on how the host CPU treats oversized shifts.
+ * @param ls
+ * @param instruction
+ * @param kernel
+ * @return
+ */
+bool decodeKernel(VM_lockstep* ls, uint16_t instruction, lsKernel* kernel)
+{
+    uint8_t instrFirstByte = (instruction & 0xFF00) >> 8;
+    uint32_t** registers = ls->registers;
+
+    kernel->b = NULL;
+    kernel->immediate = 0;
+    kernel->negateB = false;
+    kernel->flagsAffected = CPSR_N | CPSR_Z | CPSR_C | CPSR_V;
+
+    if (istl_add_subtract(instrFirstByte)) {
+        // ADD/SUB Rd, Rs, Rn or #Offset3
+        uint8_t i =  (uint8_t) ((instruction & 0b0000010000000000) >> 10);
+        uint8_t op = (uint8_t) ((instruction & 0b0000001000000000) >> 9);
+        uint8_t rn = (uint8_t) ((instruction & 0b0000000111000000) >> 6);
+        uint8_t rs = (uint8_t) ((instruction & 0b0000000000111000) >> 3);
+        uint8_t rd = (uint8_t)  (instruction & 0b0000000000000111);
+
+        kernel->op = LS_ADD;
+        kernel->a = registers[rs];
+        if (i == 0) {
+            kernel->b = registers[rn];
+        } else {
+            kernel->immediate = rn;
+        }
+        kernel->negateB = (op == 1);
+        kernel->dest = registers[rd];
+        return true;
+    } else if (istl_mov_cmp_add_sub_imm(instrFirstByte)) {
+        // MOV/CMP/ADD/SUB Rd, #Offset8
+        uint8_t op =     (uint8_t) ((instruction & 0b0001100000000000) >> 11);
+        uint8_t rd =     (uint8_t) ((instruction & 0b0000011100000000) >> 8);
+        uint8_t offset = (uint8_t)  (instruction & 0b0000000011111111);
+
+        kernel->a = registers[rd];
+        kernel->immediate = offset;
+        kernel->dest = registers[rd];
+        if (op == 0b00) {
+            kernel->op = LS_MOV;
+            kernel->flagsAffected = CPSR_N | CPSR_Z;
+        } else {
+            kernel->op = LS_ADD;
+            kernel->negateB = (op != 0b10);
+            if (op == 0b01) {
+                kernel->dest = NULL;
+            }
+        }
+        return true;
+    } else if (istl_alu_operations(instrFirstByte)) {
+        uint8_t op = (instruction & 0b0000001111000000) >> 6;
+        uint8_t rs = (instruction & 0b0000000000111000) >> 3;
+        uint8_t rd = (instruction & 0b0000000000000111);
+
+        kernel->a = registers[rd];
+        kernel->b = registers[rs];
+        kernel->dest = registers[rd];
+        kernel->flagsAffected = CPSR_N | CPSR_Z;
+
+        switch (op) {
+            case 0b0000: kernel->op = LS_AND; break;
+            case 0b0001: kernel->op = LS_EOR; break;
+            case 0b0101: kernel->op = LS_ADC; kernel->flagsAffected |= CPSR_C | CPSR_V; break;
+            case 0b0110: kernel->op = LS_SBC; kernel->flagsAffected |= CPSR_C | CPSR_V; break;
+            case 0b1000: kernel->op = LS_AND; kernel->dest = NULL; break;                  // TST
+            case 0b1001: kernel->op = LS_NEG; kernel->flagsAffected |= CPSR_C; break;
+            case 0b1010: kernel->op = LS_ADD; kernel->negateB = true; kernel->dest = NULL; // CMP
+                         kernel->flagsAffected |= CPSR_C | CPSR_V; break;
+            case 0b1011: kernel->op = LS_ADD; kernel->dest = NULL;                         // CMN
+                         kernel->flagsAffected |= CPSR_C | CPSR_V; break;
+            case 0b1100: kernel->op = LS_ORR; break;
+            case 0b1101: kernel->op = LS_MUL; break;
+            case 0b1110: kernel->op = LS_BIC; break;
+            case 0b1111: kernel->op = LS_MVN; break;
+            default:
+                // LSL, LSR, ASR and ROR
+                return false;
+        }
+        return true;
+    }
+
+    return false;
+}
+
+
+/**
+ * Applies a decoded instruction to every active lane, then moves their PCs on to the next instruction.
+ * @param ls
+ * @param kernel
+ */
+void runKernel(VM_lockstep* ls, const lsKernel* kernel)
+{
+    const lsVector zero = ls_broadcast(0);
+    const lsVector flagsAffected = ls_broadcast(kernel->flagsAffected);
+    uint32_t* const pc = ls->registers[15];
+
+    for (uint32_t i = 0; i < ls->paddedLanes; i += LOCKSTEP_VECTOR_WIDTH) {
+        lsVector mask = ls_load(&(ls->activeMask[i]));
+        lsVector cpsr = ls_load(&(ls->cpsr[i]));
+        lsVector a = ls_load(&(kernel->a[i]));
+        lsVector b = kernel->b ? ls_load(&(kernel->b[i])) : ls_broadcast(kernel->immediate);
+        if (kernel->negateB) {
+            b = zero - b;
+        }
+
+        lsVector result;
+        lsVector carry = zero;
+        lsVector overflow = zero;
+        switch (kernel->op) {
+            case LS_MOV:
+                result = b;
+                break;
+            case LS_ADD:
+                // Same as compareSetCV: carry if the sum wrapped, overflow if the operands have the same sign as each
+                // other but not as the result
+                result = a + b;
+                carry = (lsVector) ((result < a) | (result < b));
+                overflow = ~(a ^ b) & (a ^ result);
+                break;
+            case LS_ADC:
+            case LS_SBC: {
+                // SBC adds ~Rs, but the scalar interpreter works out the overflow from the sign of Rs itself
+                lsVector addend = (kernel->op == LS_SBC) ? ~b : b;
+                lsVector carryIn = (cpsr & CPSR_C) >> 29;
+                lsVector partial = a + addend;
+                result = partial + carryIn;
+                carry = (lsVector) ((partial < a) | (result < partial));
+                overflow = ~(a ^ b) & (a ^ result);
+                break;
+            }
+            case LS_NEG:
+                result = zero - b;
+                carry = (lsVector) (b == zero);
+                break;
+            case LS_AND:
+                result = a & b;
+                break;
+            case LS_EOR:
+                result = a ^ b;
+                break;
+            case LS_ORR:
+                result = a | b;
+                break;
+            case LS_BIC:
+                result = a & ~b;
+                break;
+            case LS_MVN:
+                result = ~b;
+                break;
+            default:
+                result = a * b;
+                break;
+        }
+
+        // Build the new flags, and only change the ones this instruction is meant to affect
+        // The sign bit of `overflow` is set if there was an overflow, which shifts down to V
+        lsVector flags = (result & CPSR_N) |
+                         ((lsVector) (result == zero) & CPSR_Z) |
+                         (carry & CPSR_C) |
+                         ((overflow >> 3) & CPSR_V);
+        lsVector newCpsr = (cpsr & ~flagsAffected) | (flags & flagsAffected);
+        ls_store(&(ls->cpsr[i]), ls_blend(mask, newCpsr, cpsr));
+
+        if (kernel->dest) {
+            lsVector old = ls_load(&(kernel->dest[i]));
+            ls_store(&(kernel->dest[i]), ls_blend(mask, result, old));
+        }
+
+        lsVector oldPC = ls_load(&(pc[i]));
+        ls_store(&(pc[i]), oldPC + (mask & 2));
+    }
+}
+
+
+/**
+ * Returns whether any lane taking part in this step has to go through the normal interpreter, because the vector kernel
+ * would skip something it does: the trace, the instrumentation hooks, or taking a pending interrupt.
+ * @param ls
+ * @return
+ */
+bool needsScalar(VM_lockstep* ls)
+{
+    if (VM_getTraceLevel() > VM_TRACE_OFF) {
+        return true;
+    }
+    for (uint32_t lane = 0; lane < ls->numLanes; lane++) {
+        VM_instance* vm = &(ls->lanes[lane]);
+        if (!ls->activeMask[lane]) {
+            continue;
+        }
+        if (vm->instructionExecuted || vm->branched || (vm->interrupts && VM_interruptPending(vm->interrupts))) {
+            return true;
+        }
+#ifdef ARMTINYVM_HISTOGRAM
+        if (vm->histogram) {
+            return true;
+        }
+#endif // ARMTINYVM_HISTOGRAM
+#ifdef ARMTINYVM_HEATMAP
+        if (vm->heatmap) {
+            return true;
+        }
+#endif // ARMTINYVM_HEATMAP
+    }
+    return false;
+}
+
+
+/**
+ * Executes the current instruction through the normal interpreter, one active lane at a time.
+ * @param ls
+ */
+void executeLanesScalar(VM_lockstep* ls)
+{
+    for (uint32_t lane = 0; lane < ls->numLanes; lane++) {
+        if (ls->activeMask[lane]) {
+            copyLaneOut(ls, lane);
+            VM_executeSingleInstruction(&(ls->lanes[lane]));
+            copyLaneIn(ls, lane);
+        }
+    }
+}
+
+
+/**
+ * Calls deadlineReached for each lane which took part in this step and has reached its deadline, as
+ * VM_executeNInstructions would. The handler sees the lane's registers, and may change them.
+ * @param ls
+ */
+void deliverDeadlines(VM_lockstep* ls)
+{
+    for (uint32_t lane = 0; lane < ls->numLanes; lane++) {
+        VM_instance* vm = &(ls->lanes[lane]);
+        if (ls->activeMask[lane] && (vm->instructionCount >= vm->deadline)) {
+            // Clear the deadline first, so that the handler can set the next one
+            vm->deadline = VM_NO_DEADLINE;
+            if (vm->deadlineReached) {
+                copyLaneOut(ls, lane);
+                vm->deadlineReached(vm);
+                copyLaneIn(ls, lane);
+            }
+        }
+    }
+}
+
+
+void copyLaneIn(VM_lockstep* ls, uint32_t lane)
+{
+    for (uint8_t r = 0; r < 16; r++) {
+        ls->registers[r][lane] = ls->lanes[lane].registers[r];
+    }
+    ls->cpsr[lane] = ls->lanes[lane].cpsr;
+}
+
+
+void copyLaneOut(VM_lockstep* ls, uint32_t lane)
+{
+    for (uint8_t r = 0; r < 16; r++) {
+        ls->lanes[lane].registers[r] = ls->registers[r][lane];
+    }
+    ls->lanes[lane].cpsr = ls->cpsr[lane];
+}
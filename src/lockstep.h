@@ -0,0 +1,40 @@
+/*
+ * Lockstep execution of many VMs running the same program over different inputs. The registers of all the lanes are
+ * kept in a struct-of-arrays layout, so that lanes sitting at the same PC can execute the arithmetic instructions
+ * (formats 2, 3 and 4 in the manual) together using SIMD. Every other instruction, and any lane which has diverged,
+ * is executed one lane at a time through the normal interpreter.
+*/
+
+#ifndef LOCKSTEP_H
+#define LOCKSTEP_H
+
+#include "ARMTinyVM.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+// The number of lanes is always rounded up to a multiple of this, so that the kernels never need a scalar tail
+#define LOCKSTEP_LANE_ALIGNMENT 8
+
+
+/**
+ * The lanes being executed in lockstep. registers[r][lane] holds register r of each lane, and cpsr[lane] its CPSR.
+ * activeMask[lane] is all ones for the lanes taking part in the current instruction.
+ */
+typedef struct VM_lockstep {
+    VM_instance* lanes;
+    uint32_t numLanes;
+    uint32_t paddedLanes;
+    uint32_t* registers[16];
+    uint32_t* cpsr;
+    uint32_t* activeMask;
+    uint64_t vectorInstructions;
+    uint64_t scalarInstructions;
+} VM_lockstep;
+
+
+bool Lockstep_init(VM_lockstep* ls, VM_instance* lanes, uint32_t numLanes);
+uint64_t Lockstep_executeNInstructions(VM_lockstep* ls, uint32_t maxSteps);
+void Lockstep_free(VM_lockstep* ls);
+
+
+#endif // LOCKSTEP_H
@@ -0,0 +1,316 @@
+#define _POSIX_C_SOURCE 200809L
+#include "logwriter.h"
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include <time.h>
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+void* logWriterThreadMain(void* arg);
+VM_logQueue* threadQueueFor(VM_logWriter* writer);
+bool enqueue(VM_logWriter* writer, const void* data, uint32_t length, VM_logPolicy policy);
+bool drainQueues(VM_logWriter* writer);
+
+
+// The writer messages are queued for, or NULL to print them straight away
+static _Atomic(VM_logWriter*) activeWriter = NULL;
+static uint32_t lastGeneration = 0;
+
+// The calling thread's queue, and the generation of the writer it was made for
+static _Thread_local VM_logQueue* threadQueue = NULL;
+static _Thread_local uint32_t threadQueueGeneration = 0;
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Starts the writer thread, writing to `output`, and makes `writer` the one LogWriter_printf queues messages for.
+ * `queueSize` is rounded up to a power of two, and is at least LOGWRITER_MIN_QUEUE_SIZE. Returns false if another
+ * writer is already running, or the thread couldn't be started.
+ * @param writer
+ * @param output
+ * @param queueSize
+ * @param policy
+ * @return
+ */
+bool LogWriter_start(VM_logWriter* writer, FILE* output, uint32_t queueSize, VM_logPolicy policy)
+{
+    if (atomic_load(&activeWriter)) {
+        return false;
+    }
+
+    writer->output = output;
+    writer->policy = policy;
+    writer->queueSize = LOGWRITER_MIN_QUEUE_SIZE;
+    while ((writer->queueSize < queueSize) && (writer->queueSize < 0x80000000UL)) {
+        writer->queueSize <<= 1;
+    }
+    writer->generation = ++lastGeneration;
+    writer->bytesDropped = 0;
+    atomic_init(&(writer->queues), NULL);
+    atomic_init(&(writer->stopping), false);
+
+    if (pthread_create(&(writer->thread), NULL, logWriterThreadMain, writer) != 0) {
+        return false;
+    }
+
+    atomic_store(&activeWriter, writer);
+    return true;
+}
+
+
+/**
+ * Writes out everything queued so far, stops the writer thread and frees the queues, totalling what was dropped in
+ * `writer->bytesDropped`. Anything printed from now on goes straight to stdout. Nothing else may be printing while the
+ * writer is stopped.
+ * @param writer
+ */
+void LogWriter_stop(VM_logWriter* writer)
+{
+    atomic_store(&activeWriter, NULL);
+    atomic_store(&(writer->stopping), true);
+    pthread_join(writer->thread, NULL);
+
+    VM_logQueue* queue = atomic_load(&(writer->queues));
+    while (queue) {
+        VM_logQueue* next = queue->next;
+        writer->bytesDropped += queue->bytesDropped;
+        free(queue->buffer);
+        free(queue);
+        queue = next;
+    }
+    atomic_store(&(writer->queues), NULL);
+}
+
+
+/**
+ * Prints a message, as printf would: queued for the writer thread if one is running, and otherwise straight to stdout.
+ * @param format
+ * @param ...
+ */
+void LogWriter_printf(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    LogWriter_vprintf(format, args);
+    va_end(args);
+}
+
+
+/**
+ * As LogWriter_printf, with the arguments in a va_list.
+ * @param format
+ * @param args
+ */
+void LogWriter_vprintf(const char* format, va_list args)
+{
+    VM_logWriter* writer = atomic_load_explicit(&activeWriter, memory_order_acquire);
+    if (!writer) {
+        vprintf(format, args);
+        return;
+    }
+
+    char message[LOGWRITER_MAX_MESSAGE_LENGTH];
+    int length = vsnprintf(message, sizeof(message), format, args);
+    if (length > 0) {
+        enqueue(writer, message, ((size_t) length < sizeof(message)) ? (uint32_t) length : sizeof(message) - 1,
+                writer->policy);
+    }
+}
+
+
+/**
+ * Returns whether a writer is running.
+ * @return
+ */
+bool LogWriter_isActive(void)
+{
+    return atomic_load_explicit(&activeWriter, memory_order_acquire) != NULL;
+}
+
+
+/**
+ * Returns whether a writer is running and writing to the file descriptor `fd`, so that LogWriter_write would take
+ * what was written to it.
+ * @param fd
+ * @return
+ */
+bool LogWriter_isOutput(int fd)
+{
+    VM_logWriter* writer = atomic_load_explicit(&activeWriter, memory_order_acquire);
+    return writer && (fileno(writer->output) == fd);
+}
+
+
+/**
+ * Queues `length` bytes which were to be written to the file descriptor `fd` (for example by the guest), if it's the
+ * one the writer is writing to, so that they come out in order with what has been printed. These are never dropped:
+ * whatever the writer's policy, this waits for room. Returns false, having done nothing, if `fd` isn't the writer's
+ * or the calling thread's queue couldn't be allocated.
+ * @param fd
+ * @param data
+ * @param length
+ * @return
+ */
+bool LogWriter_write(int fd, const void* data, uint32_t length)
+{
+    VM_logWriter* writer = atomic_load_explicit(&activeWriter, memory_order_acquire);
+    if (!writer || (fileno(writer->output) != fd)) {
+        return false;
+    }
+
+    return enqueue(writer, data, length, LOG_BLOCK_WHEN_FULL);
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Writes out the queues whenever there's anything in them, and sleeps for a while when there isn't, until told to stop.
+ * The sleep gets longer the longer the queues stay empty.
+ * @param arg
+ * @return
+ */
+void* logWriterThreadMain(void* arg)
+{
+    VM_logWriter* writer = (VM_logWriter*) arg;
+    long idleSleep = LOGWRITER_MIN_IDLE_SLEEP;
+
+    while (true) {
+        // Read before draining, so that everything queued before LogWriter_stop is written
+        bool stopping = atomic_load(&(writer->stopping));
+        if (drainQueues(writer)) {
+            idleSleep = LOGWRITER_MIN_IDLE_SLEEP;
+            continue;
+        }
+        fflush(writer->output);
+        if (stopping) {
+            return NULL;
+        }
+
+        struct timespec sleepTime = {.tv_sec = 0, .tv_nsec = idleSleep};
+        nanosleep(&sleepTime, NULL);
+        if (idleSleep < LOGWRITER_MAX_IDLE_SLEEP) {
+            idleSleep *= 2;
+        }
+    }
+}
+
+
+/**
+ * Returns the calling thread's queue for `writer`, creating it if need be. Returns NULL if it couldn't be allocated.
+ * @param writer
+ * @return
+ */
+VM_logQueue* threadQueueFor(VM_logWriter* writer)
+{
+    if (threadQueue && (threadQueueGeneration == writer->generation)) {
+        return threadQueue;
+    }
+
+    VM_logQueue* queue = malloc(sizeof(VM_logQueue));
+    if (!queue) {
+        return NULL;
+    }
+    queue->buffer = malloc(writer->queueSize);
+    if (!queue->buffer) {
+        free(queue);
+        return NULL;
+    }
+    atomic_init(&(queue->head), 0);
+    atomic_init(&(queue->tail), 0);
+    queue->cachedHead = 0;
+    queue->size = writer->queueSize;
+    queue->bytesDropped = 0;
+
+    // Other threads may be adding their queues at the same time
+    queue->next = atomic_load(&(writer->queues));
+    while (!atomic_compare_exchange_weak(&(writer->queues), &(queue->next), queue)) {
+    }
+
+    threadQueue = queue;
+    threadQueueGeneration = writer->generation;
+    return queue;
+}
+
+
+/**
+ * Copies `length` bytes into the calling thread's queue. If the queue is full, either drops them all or waits for room,
+ * depending on `policy`. Returns false if they were dropped.
+ * @param writer
+ * @param data
+ * @param length
+ * @param policy
+ * @return
+ */
+bool enqueue(VM_logWriter* writer, const void* data, uint32_t length, VM_logPolicy policy)
+{
+    VM_logQueue* queue = threadQueueFor(writer);
+    if (!queue) {
+        return false;
+    }
+
+    const uint8_t* bytes = (const uint8_t*) data;
+    uint32_t tail = atomic_load_explicit(&(queue->tail), memory_order_relaxed);
+    while (length > 0) {
+        uint32_t space = queue->size - (tail - queue->cachedHead);
+        if (space < length) {
+            queue->cachedHead = atomic_load_explicit(&(queue->head), memory_order_acquire);
+            space = queue->size - (tail - queue->cachedHead);
+        }
+
+        if (space < length) {
+            if (policy == LOG_DROP_WHEN_FULL) {
+                queue->bytesDropped += length;
+                return false;
+            } else if (space == 0) {
+                sched_yield();
+                continue;
+            }
+        }
+
+        // Whatever fits, in up to two pieces if it wraps around the end of the buffer
+        uint32_t amount = (space < length) ? space : length;
+        uint32_t start = tail & (queue->size - 1);
+        uint32_t first = (amount < queue->size - start) ? amount : queue->size - start;
+        memcpy(&(queue->buffer[start]), bytes, first);
+        memcpy(queue->buffer, &(bytes[first]), amount - first);
+        tail += amount;
+        bytes += amount;
+        length -= amount;
+        atomic_store_explicit(&(queue->tail), tail, memory_order_release);
+    }
+
+    return true;
+}
+
+
+/**
+ * Writes out everything in the queues, and returns whether there was anything.
+ * @param writer
+ * @return
+ */
+bool drainQueues(VM_logWriter* writer)
+{
+    bool wroteAny = false;
+    for (VM_logQueue* queue = atomic_load(&(writer->queues)); queue; queue = queue->next) {
+        uint32_t head = atomic_load_explicit(&(queue->head), memory_order_relaxed);
+        uint32_t tail = atomic_load_explicit(&(queue->tail), memory_order_acquire);
+        if (head == tail) {
+            continue;
+        }
+
+        uint32_t start = head & (queue->size - 1);
+        uint32_t amount = tail - head;
+        uint32_t first = (amount < queue->size - start) ? amount : queue->size - start;
+        fwrite(&(queue->buffer[start]), 1, first, writer->output);
+        fwrite(queue->buffer, 1, amount - first, writer->output);
+        atomic_store_explicit(&(queue->head), tail, memory_order_release);
+        wroteAny = true;
+    }
+    return wroteAny;
+}
@@ -0,0 +1,78 @@
+/*
+ * An asynchronous writer for the VM's diagnostic output (the instruction trace, VM_print, the ELF loader's messages)
+ * and the guest's output to the same stream, so that the threads running VMs never wait on a terminal or a file.
+ *
+ * Each thread which prints gets its own single-producer, single-consumer ring of `queueSize` bytes, created the first
+ * time it prints; the text is formatted on that thread and copied into its ring, and a background thread writes the
+ * rings out. Nothing is signalled when a message is queued: while the rings are empty, the writer thread checks them
+ * again after a sleep which grows from LOGWRITER_MIN_IDLE_SLEEP to LOGWRITER_MAX_IDLE_SLEEP nanoseconds. Output from
+ * one thread stays in order, but output from different threads may be interleaved at any point.
+ * When a thread's ring is full, LOG_DROP_WHEN_FULL throws the message away (counting it in `bytesDropped`), and
+ * LOG_BLOCK_WHEN_FULL waits for the writer thread to make room. The guest's output always waits, as it's not the
+ * VM's to lose.
+ *
+ * Only one writer can be started at a time. While none is, LogWriter_printf prints straight to stdout.
+*/
+
+#ifndef LOGWRITER_H
+#define LOGWRITER_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+#define LOGWRITER_DEFAULT_QUEUE_SIZE 65536
+#define LOGWRITER_MIN_QUEUE_SIZE 4096
+#define LOGWRITER_MIN_IDLE_SLEEP 50000
+#define LOGWRITER_MAX_IDLE_SLEEP 10000000
+
+// The longest a single LogWriter_printf can be: anything after this is cut off
+#define LOGWRITER_MAX_MESSAGE_LENGTH 512
+
+
+typedef enum VM_logPolicy {
+    LOG_DROP_WHEN_FULL,
+    LOG_BLOCK_WHEN_FULL
+} VM_logPolicy;
+
+
+/**
+ * One thread's ring. Only that thread moves `tail`, and only the writer thread moves `head`; both count bytes from the
+ * start, and wrap around `size`, which is a power of two.
+ */
+typedef struct VM_logQueue {
+    _Atomic uint32_t head;
+    _Atomic uint32_t tail;
+    uint32_t cachedHead; // The producer's last look at `head`, to save reading it for every message
+    uint32_t size;
+    uint8_t* buffer;
+    uint64_t bytesDropped;
+    struct VM_logQueue* next;
+} VM_logQueue;
+
+
+typedef struct VM_logWriter {
+    FILE* output;
+    VM_logPolicy policy;
+    uint32_t queueSize;
+    uint32_t generation; // Tells threads whether the queue they made last belongs to this writer
+    _Atomic(VM_logQueue*) queues;
+    atomic_bool stopping;
+    pthread_t thread;
+    uint64_t bytesDropped; // Over all the queues, once the writer has stopped
+} VM_logWriter;
+
+
+bool LogWriter_start(VM_logWriter* writer, FILE* output, uint32_t queueSize, VM_logPolicy policy);
+void LogWriter_stop(VM_logWriter* writer);
+void LogWriter_printf(const char* format, ...) __attribute__((format(printf, 1, 2)));
+void LogWriter_vprintf(const char* format, va_list args);
+bool LogWriter_isActive(void);
+bool LogWriter_isOutput(int fd);
+bool LogWriter_write(int fd, const void* data, uint32_t length);
+
+
+#endif // LOGWRITER_H
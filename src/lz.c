@@ -0,0 +1,155 @@
+#include "lz.h"
+#include <string.h>
+
+// Positions in a block are chained together by a hash of the LZ_MIN_MATCH bytes starting there, so that only the
+// positions which could start a match are tried
+#define LZ_HASH_SIZE 256
+#define lz_hash(p) ((uint8_t) (((((uint32_t) (p)[0] << 16) | ((uint32_t) (p)[1] << 8) | (p)[2]) * 2654435761UL) >> 24))
+
+
+// PRIVATE FUNCTION DECLARATIONS
+uint16_t flushLiterals(const uint8_t* src, uint16_t start, uint16_t end, uint8_t* dst, uint16_t written);
+void insertPosition(const uint8_t* src, uint16_t position, uint16_t length, int16_t* head, int16_t* previous);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Compresses the block of `length` bytes (at most LZ_MAX_BLOCK_SIZE) at `src` into `dst`, which must have room for
+ * lz_max_compressed_size(length) bytes. Returns the compressed length. Matches are found greedily, trying every
+ * earlier position with the same hash, so the longest match is always found.
+ * @param src
+ * @param length
+ * @param dst
+ * @return
+ */
+uint16_t LZ_compress(const uint8_t* src, uint16_t length, uint8_t* dst)
+{
+    int16_t head[LZ_HASH_SIZE]; // The latest position with each hash, or -1
+    int16_t previous[LZ_MAX_BLOCK_SIZE]; // The position before each one with the same hash, or -1
+    memset(head, 0xFF, sizeof(head));
+
+    uint16_t written = 0;
+    uint16_t literalStart = 0;
+    uint16_t position = 0;
+    while (position < length) {
+        // Find the longest match for what comes next, stopping early if it can't get any longer
+        uint16_t bestLength = 0;
+        uint16_t bestOffset = 0;
+        if (position + LZ_MIN_MATCH <= length) {
+            int16_t candidate = head[lz_hash(&src[position])];
+            for (; (candidate >= 0) && (bestLength < LZ_MAX_MATCH); candidate = previous[candidate]) {
+                uint16_t matchLength = 0;
+                while ((position + matchLength < length) && (matchLength < LZ_MAX_MATCH) &&
+                       (src[candidate + matchLength] == src[position + matchLength])) {
+                    matchLength++;
+                }
+                if (matchLength > bestLength) {
+                    bestLength = matchLength;
+                    bestOffset = position - candidate;
+                }
+            }
+        }
+
+        if (bestLength < LZ_MIN_MATCH) {
+            insertPosition(src, position++, length, head, previous);
+            continue;
+        }
+
+        written = flushLiterals(src, literalStart, position, dst, written);
+        dst[written++] = (uint8_t) (0x80 | (bestLength - LZ_MIN_MATCH));
+        dst[written++] = (uint8_t) (bestOffset - 1);
+        for (uint16_t end = position + bestLength; position < end; position++) {
+            insertPosition(src, position, length, head, previous);
+        }
+        literalStart = position;
+    }
+
+    return flushLiterals(src, literalStart, length, dst, written);
+}
+
+
+/**
+ * Decompresses the block of `srcLength` bytes starting at `srcOffset` into `dst`, which has room for `dstLength`
+ * bytes. Each byte of the compressed block is read with `readSource`, so it can be kept anywhere, such as in program
+ * memory. Returns the decompressed length, which stops short at `dstLength` if the block is corrupt.
+ * @param readSource
+ * @param srcOffset
+ * @param srcLength
+ * @param dst
+ * @param dstLength
+ * @return
+ */
+uint16_t LZ_decompress(uint8_t (*readSource)(uint32_t offset), uint32_t srcOffset, uint16_t srcLength, uint8_t* dst,
+                       uint16_t dstLength)
+{
+    uint32_t srcEnd = srcOffset + srcLength;
+    uint16_t written = 0;
+    while ((srcOffset < srcEnd) && (written < dstLength)) {
+        uint8_t control = readSource(srcOffset++);
+        if (control & 0x80) {
+            // Copy from earlier in the output, a byte at a time since the match can overlap what it produces
+            if (srcOffset == srcEnd) {
+                break;
+            }
+            uint16_t matchLength = (control & 0x7F) + LZ_MIN_MATCH;
+            uint16_t distance = (uint16_t) readSource(srcOffset++) + 1;
+            if (distance > written) {
+                break;
+            }
+            for (; (matchLength > 0) && (written < dstLength); matchLength--, written++) {
+                dst[written] = dst[written - distance];
+            }
+        } else {
+            uint16_t numLiterals = (uint16_t) control + 1;
+            for (; (numLiterals > 0) && (written < dstLength) && (srcOffset < srcEnd); numLiterals--) {
+                dst[written++] = readSource(srcOffset++);
+            }
+        }
+    }
+    return written;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Writes out the literals from `start` to `end` as as few runs as possible, and returns the new output length.
+ * @param src
+ * @param start
+ * @param end
+ * @param dst
+ * @param written
+ * @return
+ */
+uint16_t flushLiterals(const uint8_t* src, uint16_t start, uint16_t end, uint8_t* dst, uint16_t written)
+{
+    while (start < end) {
+        uint16_t runLength = ((end - start) < LZ_MAX_LITERALS) ? (end - start) : LZ_MAX_LITERALS;
+        dst[written++] = (uint8_t) (runLength - 1);
+        for (uint16_t i = 0; i < runLength; i++) {
+            dst[written++] = src[start++];
+        }
+    }
+    return written;
+}
+
+
+/**
+ * Adds `position` to the front of the chain for its hash, if there are enough bytes left to start a match there.
+ * @param src
+ * @param position
+ * @param length
+ * @param head
+ * @param previous
+ */
+void insertPosition(const uint8_t* src, uint16_t position, uint16_t length, int16_t* head, int16_t* previous)
+{
+    if (position + LZ_MIN_MATCH <= length) {
+        uint8_t hash = lz_hash(&src[position]);
+        previous[position] = head[hash];
+        head[hash] = (int16_t) position;
+    }
+}
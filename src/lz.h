@@ -0,0 +1,27 @@
+/*
+ * A small LZ77 codec for compressing program images page by page, with a decompressor small and simple enough for a
+ * microcontroller. Each block of at most LZ_MAX_BLOCK_SIZE bytes is compressed independently, as a sequence of:
+ *   0LLLLLLL followed by L+1 literal bytes
+ *   1LLLLLLL OOOOOOOO, which copies L+LZ_MIN_MATCH bytes from O+1 bytes back in the output
+*/
+
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+
+#define LZ_MAX_BLOCK_SIZE 256
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (0x7F + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS 0x80
+
+// The most a block can grow by when compressed: one control byte for every run of literals
+#define lz_max_compressed_size(length) ((length) + (((length) + LZ_MAX_LITERALS - 1) / LZ_MAX_LITERALS))
+
+
+uint16_t LZ_compress(const uint8_t* src, uint16_t length, uint8_t* dst);
+uint16_t LZ_decompress(uint8_t (*readSource)(uint32_t offset), uint32_t srcOffset, uint16_t srcLength, uint8_t* dst,
+                       uint16_t dstLength);
+
+
+#endif // LZ_H
@@ -1,243 +1,389 @@
 #include "ARMTinyVM.h"
+#include "host.h"
+#include "snapshot.h"
+#include "replay.h"
+#include "bintrace.h"
+#include "logwriter.h"
+#include "histogram.h"
+#include "profiler.h"
+#include "coverage.h"
+#include "heatmap.h"
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <malloc.h>
 
-#if defined(WIN32) || defined(_WIN32) || defined(__WIN32) || defined(WIN64) || defined(_WIN64) || defined(__WIN64)
-#include "win_elf.h"
-#else
-#include <elf.h>
-#endif
+// The most instructions which will be executed while looking for the end of the start-up code
+#define MAX_WARM_START_INSTRUCTIONS 100000000
 
-#define MAX_NUM_SEGMENTS 10
-#define STACK_START_ADDR 0xFFFFFFFC
-#define MAX_STACK_SIZE 0x10000
-
-// FUNCTION AND STRUCT DECLARATIONS
+// FUNCTION DECLARATIONS
 int main(int argc, char* argv[]);
-uint8_t readByte(uint32_t addr);
-void writeByte(uint32_t addr, uint8_t value);
-void softwareInterrupt(VM_instance* vm, uint8_t number);
-
-
-typedef struct runtimeSegment {
-    uint32_t virtualStartAddress;
-    uint32_t length;
-    uint8_t* content;
-} runtimeSegment;
+int saveWarmStart(const char* elfFilename, const char* snapshotFilename, uint32_t stopAddress);
+void stopLogWriter(void);
 
 
-// VARIABLES FOR EXECUTION
-
-runtimeSegment segments[MAX_NUM_SEGMENTS];
-uint8_t numAllocatedSegments = 0;
-int32_t exitCode = -0x40000000;
+// Everything printed while the program runs, including its own output, is written by this writer's thread
+static VM_logWriter logWriter;
 
 
 // FUNCTION DEFINITIONS
 
+/**
+ * Usage:
+ *   ARMTinyVM program.elf
+ *   ARMTinyVM --save-warm-start snapshot [--stop-at address] program.elf
+ *   ARMTinyVM --warm-start snapshot
+ * The second form runs the program until it executes `swi #2` (or reaches the given address) and saves a snapshot
+ * there. The third runs the program on from that snapshot, skipping its start-up code.
+ *
+ * Adding `--record log` to the first or third form records everything the host does for the program to `log`, and
+ * adding `--replay log` instead replays such a recording without doing any I/O. Adding `--verbose` prints the headers
+ * of the ELF as it is loaded, and each system call as it is made.
+ *
+ * Adding `--paged-memory file base size` maps `size` bytes of memory at address `base`, kept in `file` with only a few
+ * pages resident at a time. `--page-cache frames` sets how many, and the cache's hit rate is printed at the end.
+ *
+ * `--trace off|errors|instructions|full` sets how much of the instruction trace is printed, up to the level the VM
+ * was built with. `--binary-trace file` records every instruction to `file` instead, compressed, to be read back with
+ * ARMTinyVM_tracedump. `--histogram file` writes how many of each kind of instruction were executed to `file`, as
+ * JSON, if the VM was built with ARMTINYVM_HISTOGRAM. `--heatmap file` writes how many times each page of memory was
+ * read, written and fetched from to `file`, as JSON, and prints how much of the stack was used, if the VM was built
+ * with ARMTINYVM_HEATMAP. `--profile file` samples the program's call stack every 1000
+ * instructions, or every `--sample-period` instructions, and writes the folded stacks to `file` for a flame graph,
+ * with the functions named from the ELF's symbol table. `--call-graph file` writes exactly how many instructions each
+ * function executed, and how many times it called each other, to `file` in the callgrind format.
+ *
+ * `--coverage file` writes an AFL-style edge coverage bitmap to `file`. When run by AFL, `--afl` records the coverage
+ * into AFL's shared memory instead. Coverage can't be combined with profiling, as both follow the program's branches.
+ *
+ * What's printed (the trace, the program's own output and these messages) is written out by a separate thread, so the
+ * program never waits for the terminal. `--log-when-full drop|block` says whether to throw the VM's own output away or
+ * to wait when it gets too far behind; the default is to wait. The program's output is never thrown away.
+ */
 int main(int argc, char* argv[])
 {
-    // argv[1] should contain the filename of the ELF we're interested in
+    // argv[1] should contain the filename of the ELF we're interested in, unless an option is given
     if (argc < 2) {
         return 1;
     }
-    char* elf_filename = argv[1];
 
-    // Read the ELF
-    FILE* file = fopen(elf_filename, "rb");
-    if (!file) {
-        printf("Unable to load file\n");
+    const char* warmStartFilename = NULL;
+    const char* saveFilename = NULL;
+    uint32_t stopAddress = 0;
+    const char* recordFilename = NULL;
+    const char* replayFilename = NULL;
+    const char* elf_filename = NULL;
+    const char* pagedFilename = NULL;
+    const char* binaryTraceFilename = NULL;
+    const char* histogramFilename = NULL;
+    const char* heatmapFilename = NULL;
+    const char* profileFilename = NULL;
+    const char* callGraphFilename = NULL;
+    const char* coverageFilename = NULL;
+    bool aflCoverage = false;
+    uint64_t samplePeriod = PROFILER_DEFAULT_SAMPLE_PERIOD;
+    uint32_t pagedBase = 0;
+    uint32_t pagedSize = 0;
+    uint16_t pageFrames = PAGER_DEFAULT_NUM_FRAMES;
+    VM_logPolicy logPolicy = LOG_BLOCK_WHEN_FULL;
+    bool verbose = false;
+    for (int i = 1; i < argc; i++) {
+        if ((strcmp(argv[i], "--warm-start") == 0) && (i + 1 < argc)) {
+            warmStartFilename = argv[++i];
+        } else if ((strcmp(argv[i], "--save-warm-start") == 0) && (i + 1 < argc)) {
+            saveFilename = argv[++i];
+        } else if ((strcmp(argv[i], "--stop-at") == 0) && (i + 1 < argc)) {
+            stopAddress = (uint32_t) strtoul(argv[++i], NULL, 0);
+        } else if ((strcmp(argv[i], "--record") == 0) && (i + 1 < argc)) {
+            recordFilename = argv[++i];
+        } else if ((strcmp(argv[i], "--replay") == 0) && (i + 1 < argc)) {
+            replayFilename = argv[++i];
+        } else if ((strcmp(argv[i], "--paged-memory") == 0) && (i + 3 < argc)) {
+            pagedFilename = argv[++i];
+            pagedBase = (uint32_t) strtoul(argv[++i], NULL, 0);
+            pagedSize = (uint32_t) strtoul(argv[++i], NULL, 0);
+        } else if ((strcmp(argv[i], "--page-cache") == 0) && (i + 1 < argc)) {
+            pageFrames = (uint16_t) strtoul(argv[++i], NULL, 0);
+        } else if ((strcmp(argv[i], "--trace") == 0) && (i + 1 < argc)) {
+            static const char* const levelNames[] = {"off", "errors", "instructions", "full"};
+            const char* levelName = argv[++i];
+            uint8_t level = 0;
+            while ((level < 4) && (strcmp(levelName, levelNames[level]) != 0)) {
+                level++;
+            }
+            if (level == 4) {
+                LogWriter_printf("Unknown trace level %s\n", levelName);
+                return 1;
+            }
+            VM_setTraceLevel(level);
+        } else if ((strcmp(argv[i], "--binary-trace") == 0) && (i + 1 < argc)) {
+            binaryTraceFilename = argv[++i];
+        } else if ((strcmp(argv[i], "--histogram") == 0) && (i + 1 < argc)) {
+            histogramFilename = argv[++i];
+        } else if ((strcmp(argv[i], "--heatmap") == 0) && (i + 1 < argc)) {
+            heatmapFilename = argv[++i];
+        } else if ((strcmp(argv[i], "--profile") == 0) && (i + 1 < argc)) {
+            profileFilename = argv[++i];
+        } else if ((strcmp(argv[i], "--call-graph") == 0) && (i + 1 < argc)) {
+            callGraphFilename = argv[++i];
+        } else if ((strcmp(argv[i], "--coverage") == 0) && (i + 1 < argc)) {
+            coverageFilename = argv[++i];
+        } else if (strcmp(argv[i], "--afl") == 0) {
+            aflCoverage = true;
+        } else if ((strcmp(argv[i], "--sample-period") == 0) && (i + 1 < argc)) {
+            samplePeriod = strtoull(argv[++i], NULL, 0);
+        } else if ((strcmp(argv[i], "--log-when-full") == 0) && (i + 1 < argc)) {
+            const char* policyName = argv[++i];
+            if (strcmp(policyName, "drop") == 0) {
+                logPolicy = LOG_DROP_WHEN_FULL;
+            } else if (strcmp(policyName, "block") != 0) {
+                LogWriter_printf("Unknown log policy %s\n", policyName);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--verbose") == 0) {
+            verbose = true;
+        } else {
+            elf_filename = argv[i];
+        }
+    }
+
+    if ((coverageFilename || aflCoverage) && (profileFilename || callGraphFilename)) {
+        LogWriter_printf("Coverage can't be recorded while profiling\n");
+        return 1;
+    }
+
+    // Without the writer thread, everything is just printed as it was before
+    if (LogWriter_start(&logWriter, stdout, LOGWRITER_DEFAULT_QUEUE_SIZE, logPolicy)) {
+        atexit(stopLogWriter);
+    }
+
+    if (saveFilename) {
+        return elf_filename ? saveWarmStart(elf_filename, saveFilename, stopAddress) : 1;
+    }
+
+    VM_host host;
+    VM_instance vm;
+    if (warmStartFilename) {
+        // Carry on from where the snapshot was taken
+        if (!Snapshot_restore(&host, &vm, warmStartFilename, verbose)) {
+            Host_free(&host);
+            return 1;
+        }
+    } else {
+        // Read the ELF into a fresh memory space
+        if (!elf_filename || !Host_loadElf(&host, elf_filename, verbose)) {
+            return 1;
+        }
+
+        // Now we have set up the memory space and can begin to execute the code
+        vm = Host_newVM(&host);
+    }
+
+    VM_pager pager;
+    if (pagedFilename) {
+        if (!Pager_initFile(&pager, pagedFilename, pagedBase, pagedSize, PAGER_DEFAULT_PAGE_SIZE, pageFrames)) {
+            LogWriter_printf("Couldn't open the paged memory %s\n", pagedFilename);
+            Host_free(&host);
+            return 1;
+        }
+        Host_attachPager(&host, &pager);
+    }
+
+    VM_recorder recorder;
+    VM_replayer replayer;
+    if (recordFilename && !Recorder_start(&recorder, &host, &vm, recordFilename)) {
+        LogWriter_printf("Couldn't create the recording %s\n", recordFilename);
+        Host_free(&host);
+        if (pagedFilename) {
+            Pager_free(&pager);
+        }
         return 1;
+    } else if (replayFilename && !Replay_start(&replayer, &host, &vm, replayFilename)) {
+        LogWriter_printf("Couldn't replay the recording %s\n", replayFilename);
+        Host_free(&host);
+        if (pagedFilename) {
+            Pager_free(&pager);
+        }
+        return 1;
+    }
+
+    VM_binaryTrace binaryTrace;
+    bool binaryTracing = false;
+    if (binaryTraceFilename) {
+        binaryTracing = BinTrace_init(&binaryTrace, BINTRACE_DEFAULT_CHUNK_SIZE, BINTRACE_DEFAULT_NUM_CHUNKS) &&
+                        BinTrace_streamTo(&binaryTrace, binaryTraceFilename, true);
+        if (binaryTracing) {
+            BinTrace_attach(&binaryTrace, &vm);
+        } else {
+            LogWriter_printf("Couldn't create the binary trace %s, so running without it\n", binaryTraceFilename);
+            BinTrace_free(&binaryTrace);
+        }
+    }
+
+    VM_histogram histogram;
+    Histogram_init(&histogram);
+    if (histogramFilename && !Histogram_attach(&histogram, &vm)) {
+        LogWriter_printf("The VM was built without ARMTINYVM_HISTOGRAM, so can't count instructions\n");
+        histogramFilename = NULL;
     }
 
-    // Find the size of the file by going to the end, seeing where we are, and going back to the beginning
-    fseek(file, 0L, SEEK_END);
-    long elfSize = ftell(file);
-    rewind(file);
-
-    // Allocate memory big enough for the full file
-    char* elfContent = malloc(elfSize);
-
-    // Read the whole file into that buffer, then close the file
-    fread(elfContent, elfSize, 1, file);
-    fclose(file);
-
-    // We can now address elfContent however we want
-    Elf32_Ehdr* header = (Elf32_Ehdr*) &(elfContent[0]);
-    printf("Read file successfully\n");
-    printf("ELF Identifier: %s\n", header->e_ident);
-    printf("ELF Type: 0x%x\n", header->e_type);
-    printf("Architecture: %u\n", header->e_machine);
-    printf("ELF Version: %u\n", header->e_version);
-    printf("Entry point: %u\n", header->e_entry);
-    printf("Offset in ELF of program header table: %u\n", header->e_phoff);
-    printf("Offset in ELF of section header table: %u\n", header->e_shoff);
-    printf("Flags: 0x%x\n", header->e_flags);
-    printf("Size of this header: %u\n", header->e_ehsize);
-    printf("Size of a program header table entry: %u\n", header->e_phentsize);
-    printf("Number of program headers: %u\n", header->e_phnum);
-    printf("Size of a section header table entry: %u\n", header->e_shentsize);
-    printf("Number of section headers: %u\n", header->e_shnum);
-    printf("Index of section header table which contains section names: %u\n\n", header->e_shstrndx);
-
-
-    // The program headers, containing the loading information, begin at offset e_phoff. There are e_phnum entries,
-    // each of size e_phentsize.
-    Elf32_Half programNum = 0;
-    Elf32_Phdr* programHeader;
-    do {
-        // Find the current header based on the header num, the starting offset, and the size of each one
-        programHeader = (Elf32_Phdr*) &(elfContent[header->e_phoff + (programNum * header->e_phentsize)]);
-
-        // Print out its information
-        printf("============ Program header %u ============\n", programNum);
-        printf("Segment type: %u\n", programHeader->p_type);
-        printf("Offset of segment in ELF file: %u\n", programHeader->p_offset);
-        printf("Virtual address of segment in memory: 0x%x\n", programHeader->p_vaddr);
-        printf("Physical address of segment in memory: 0x%x\n", programHeader->p_paddr);
-        printf("Size of segment in ELF file: %u\n", programHeader->p_filesz);
-        printf("Size of segment in memory: %u\n", programHeader->p_memsz);
-        printf("Flags: 0x%x\n", programHeader->p_flags);
-        printf("Alignment: %u\n\n", programHeader->p_align);
-
-        // Move on to the next header
-        ++programNum;
-    } while (programNum < header->e_phnum);
-
-
-    // Before we process the sections, we need to find a pointer to the section containing the names
-    // The header for this section begins at index e_shstrndx in the section header table
-    // This section header's sh_offset field then gives the index in the file at which the content of the section begins
-    // From then on, each section will give an index (in bytes) into this field for where their own name begins (stored
-    // as a null-terminated string)
-    Elf32_Shdr* stringSectionHeader = (Elf32_Shdr*) &(elfContent[header->e_shoff + (header->e_shstrndx * header->e_shentsize)]);
-    char* sectionNameList = &(elfContent[stringSectionHeader->sh_offset]);
-
-
-    // Now go through the section headers in a similar manner
-    Elf32_Half sectionNum = 0;
-    Elf32_Shdr* sectionHeader;
-    do {
-        // Find the section header based on the offset of the first one, the size of each one and the number so far
-        sectionHeader = (Elf32_Shdr*) &(elfContent[header->e_shoff + (sectionNum * header->e_shentsize)]);
-
-        // Print its information
-        printf("============ Section header %u ============\n", sectionNum);
-        printf("Name is at .shstrtab offset: %u\n", sectionHeader->sh_name);
-        printf("Section name: %s\n", &(sectionNameList[sectionHeader->sh_name]));
-        printf("Type: 0x%x\n", sectionHeader->sh_type);
-        printf("Flags: 0x%x\n", sectionHeader->sh_flags);
-        printf("Virtual address (if loaded): 0x%x\n", sectionHeader->sh_addr);
-        printf("Offset of section in ELF: 0x%x\n", sectionHeader->sh_offset);
-        printf("Size of section in ELF: %u\n", sectionHeader->sh_size);
-        printf("Section index link (meanings differ): %u\n", sectionHeader->sh_link);
-        printf("Extra info (meanings differ): %u\n", sectionHeader->sh_info);
-        printf("Alignment: %u\n", sectionHeader->sh_addralign);
-        printf("Entry size (if applicable): %u\n", sectionHeader->sh_entsize);
-
-        if (sectionHeader->sh_flags & SHF_ALLOC) {
-            // Needs to actually be loaded at runtime
-            segments[numAllocatedSegments].virtualStartAddress = sectionHeader->sh_addr;
-            segments[numAllocatedSegments].length = sectionHeader->sh_size;
-            segments[numAllocatedSegments].content = malloc(sectionHeader->sh_size);
-
-            // Load the content of the section from the ELF file into the newly allocated memory
-            memcpy(
-                    segments[numAllocatedSegments].content,
-                    &(elfContent[sectionHeader->sh_offset]),
-                    sectionHeader->sh_size
-            );
-            numAllocatedSegments++;
-
-            printf("Allocated and loaded virtual memory segment starting at 0x%x, with size %u\n\n", sectionHeader->sh_addr, sectionHeader->sh_size);
+    VM_heatmap* heatmap = NULL;
+    if (heatmapFilename) {
+        // Too big for the stack
+        heatmap = malloc(sizeof(VM_heatmap));
+        if (!heatmap) {
+            LogWriter_printf("Couldn't allocate the heatmap, so running without it\n");
         } else {
-            printf("Not to be loaded\n\n");
+            Heatmap_init(heatmap);
+            if (!Heatmap_attach(heatmap, &vm)) {
+                LogWriter_printf("The VM was built without ARMTINYVM_HEATMAP, so can't count memory accesses\n");
+                free(heatmap);
+                heatmap = NULL;
+            }
         }
+    }
 
-        ++sectionNum;
-    } while (sectionNum < header->e_shnum);
+    // Without an ELF (after a warm start) or its symbols, functions are named by address
+    VM_symbolTable symbols = {NULL, 0, NULL};
+    VM_profiler profiler;
+    bool profiling = profileFilename || callGraphFilename;
+    if (profiling) {
+        if (elf_filename && (ElfLoader_loadSymbols(elf_filename, &symbols) != ELF_LOADED)) {
+            LogWriter_printf("Couldn't read the symbols of %s, so naming functions by address\n", elf_filename);
+        }
+        if (Profiler_init(&profiler, &symbols, samplePeriod)) {
+            Profiler_attach(&profiler, &vm);
+        } else {
+            LogWriter_printf("Couldn't start the profiler, so running without it\n");
+            profiling = false;
+        }
+    }
 
-    // One last segment to allocate is for the stack to live in, which will be full of zeroes
-    segments[numAllocatedSegments].virtualStartAddress = STACK_START_ADDR - MAX_STACK_SIZE;
-    segments[numAllocatedSegments].length = MAX_STACK_SIZE;
-    segments[numAllocatedSegments].content = (uint8_t*) calloc(MAX_STACK_SIZE, 1);
-    numAllocatedSegments++;
+    VM_coverage coverage;
+    bool covering = false;
+    if (aflCoverage) {
+        covering = Coverage_initAFL(&coverage);
+        if (!covering) {
+            LogWriter_printf("Couldn't attach to AFL's shared memory, so running without coverage\n");
+        }
+    } else if (coverageFilename) {
+        covering = Coverage_init(&coverage, COVERAGE_DEFAULT_MAP_SIZE);
+        if (!covering) {
+            LogWriter_printf("Couldn't allocate the coverage map, so running without it\n");
+        }
+    }
+    if (covering) {
+        Coverage_attach(&coverage, &vm);
+    }
 
-    // Now we have set up the memory space and can begin to execute the code
-    VM_instance vm = VM_new(&readByte, &writeByte, &softwareInterrupt, STACK_START_ADDR, header->e_entry & 0xFFFFFFFE);
     uint32_t instrsExecuted = VM_executeNInstructions(&vm, 1000);
-    printf("\n\n\n\nExecuted %u instructions\n", instrsExecuted);
+    LogWriter_printf("\n\n\n\nExecuted %u instructions\n", instrsExecuted);
     VM_print(&vm);
 
-    return (int8_t) exitCode;
-}
+    if (histogramFilename && !Histogram_saveJSON(&histogram, histogramFilename)) {
+        LogWriter_printf("Couldn't write the histogram %s\n", histogramFilename);
+    }
 
-/**
- * Tries to find the byte pointed to by this virtual memory address, by searching in the `segments` array. Returns NULL
- * if none found.
- * @param addr
- * @return
- */
-uint8_t* getVirtualMemoryByte(uint32_t addr)
-{
-    for (uint8_t i = 0; i < numAllocatedSegments; i++) {
-        // Is this address included in this segment?
-        if ((addr >= segments[i].virtualStartAddress) && (addr < (segments[i].virtualStartAddress + segments[i].length))) {
-            // The byte is in this segment
-            // Calculate its offset and find a pointer to that byte
-            uint32_t offset = addr - segments[i].virtualStartAddress;
-            return &(segments[i].content[offset]);
+    if (heatmap) {
+        // The SP starts at STACK_START_ADDR, so it never went below that if the guest didn't use the stack
+        if (heatmap->lowestStackPointer < STACK_START_ADDR) {
+            LogWriter_printf("Lowest SP 0x%08lx: %lu of %u bytes of stack used\n",
+                             (unsigned long) heatmap->lowestStackPointer,
+                             (unsigned long) (STACK_START_ADDR - heatmap->lowestStackPointer), MAX_STACK_SIZE);
+        } else {
+            LogWriter_printf("Lowest SP n/a: the stack wasn't used\n");
+        }
+        if (!Heatmap_saveJSON(heatmap, heatmapFilename)) {
+            LogWriter_printf("Couldn't write the heatmap %s\n", heatmapFilename);
+        }
+        Heatmap_free(heatmap);
+        free(heatmap);
+    }
+
+    if (profiling) {
+        Profiler_detach(&profiler, &vm);
+        if (profileFilename && !Profiler_saveFolded(&profiler, profileFilename)) {
+            LogWriter_printf("Couldn't write the profile %s\n", profileFilename);
+        }
+        if (callGraphFilename && !Profiler_saveCallgrind(&profiler, callGraphFilename, elf_filename)) {
+            LogWriter_printf("Couldn't write the call graph %s\n", callGraphFilename);
+        }
+        Profiler_free(&profiler);
+    }
+    ElfLoader_freeSymbols(&symbols);
+
+    if (covering) {
+        Coverage_detach(&coverage, &vm);
+        if (coverageFilename && !Coverage_save(&coverage, coverageFilename)) {
+            LogWriter_printf("Couldn't write the coverage %s\n", coverageFilename);
+        }
+        Coverage_free(&coverage);
+    }
+
+    if (binaryTracing) {
+        if (!BinTrace_stop(&binaryTrace)) {
+            LogWriter_printf("Couldn't write the binary trace %s\n", binaryTraceFilename);
+        }
+        BinTrace_free(&binaryTrace);
+    }
+
+    if (recordFilename && !Recorder_stop(&recorder)) {
+        LogWriter_printf("Couldn't write the recording %s\n", recordFilename);
+    } else if (replayFilename) {
+        if (replayer.diverged) {
+            LogWriter_printf("The program diverged from the recording\n");
         }
+        Replay_free(&replayer);
     }
 
-    // No matches found
-    return NULL;
+    if (pagedFilename) {
+        if (!Pager_flush(&pager)) {
+            LogWriter_printf("Couldn't write back the paged memory %s\n", pagedFilename);
+        }
+        LogWriter_printf("Paged memory: %llu hits, %llu misses, %llu write-backs\n",
+                         (unsigned long long) pager.hits, (unsigned long long) pager.misses,
+                         (unsigned long long) pager.writeBacks);
+        Pager_free(&pager);
+    }
+
+    Host_free(&host);
+    return (int8_t) host.exitCode;
 }
 
 
 /**
- * Reads a byte from the given virtual address. Returns 0xFF if the address is invalid.
- * @param addr
+ * Runs the program in `elfFilename` to the end of its start-up code, and saves a snapshot there. Returns 0 on success.
+ * @param elfFilename
+ * @param snapshotFilename
+ * @param stopAddress
  * @return
  */
-uint8_t readByte(uint32_t addr)
+int saveWarmStart(const char* elfFilename, const char* snapshotFilename, uint32_t stopAddress)
 {
-    uint8_t* bytePtr = getVirtualMemoryByte(addr);
-    if (bytePtr == NULL) {
-        return 0xFF;
+    VM_host host;
+    if (!Host_loadElf(&host, elfFilename, false)) {
+        return 1;
+    }
+
+    VM_instance vm = Host_newVM(&host);
+    bool saved = Snapshot_saveWarmStart(&host, &vm, snapshotFilename, stopAddress, MAX_WARM_START_INSTRUCTIONS);
+    if (saved) {
+        LogWriter_printf("Saved warm start after %llu instructions\n", (unsigned long long) vm.instructionCount);
     } else {
-        return *bytePtr;
+        LogWriter_printf("The program didn't reach its warm start point\n");
     }
+
+    Host_free(&host);
+    return saved ? 0 : 1;
 }
 
 
 /**
- * Writes a byte to the given virtual address. Does nothing if the address is invalid.
- * @param addr
- * @param value
+ * Writes out whatever is still queued when the program exits, and says if anything had to be dropped.
  */
-void writeByte(uint32_t addr, uint8_t value)
-{
-    uint8_t* bytePtr = getVirtualMemoryByte(addr);
-    if (bytePtr != NULL) {
-        *bytePtr = value;
-    }
-}
-
-
-void softwareInterrupt(VM_instance* vm, uint8_t number)
+void stopLogWriter(void)
 {
-    printf("Software interrupt: %u\n", number);
-
-    if (number == 0) {
-        // This is intended as a system call
-        // Check in r7 to see which system call
-        if (vm->registers[7] == 1) {
-            // We're being asked for the exit() syscall, and the exit code will be in r0
-            exitCode = (int32_t) vm->registers[0];
-        }
+    LogWriter_stop(&logWriter);
+    if (logWriter.bytesDropped > 0) {
+        fprintf(stderr, "%llu bytes of output were dropped\n", (unsigned long long) logWriter.bytesDropped);
     }
-
-    vm->finished = true;
 }
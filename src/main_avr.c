@@ -1,22 +1,63 @@
 #include "ARMTinyVM.h"
+#include "flatimage.h"
+#include "lz.h"
 #include <stdbool.h>
-#define NULL ((void*) 0)
-
-uint8_t readByte(uint32_t addr);
-void writeByte(uint32_t addr, uint8_t value);
-void softwareInterrupt(VM_instance* vm, uint8_t number);
-
-
-// Terrible practice, but I'm going to include a text file, which actually contains C code
-// This text file will contain a hard-coded copy of the content of each section, written as array. In addition, it
-// will define:
-//  A preprocessor directive called NUM_SEGMENTS, defining the number of virtual memory segments
-//  uint32_t startPositions[NUM_SEGMENTS] - An array of the start positions in virtual memory of each segment
-//  uint32_t lengths[NUM_SEGMENTS] - An array containing the length of each segment
-//  _Bool writable[NUM_SEGMENTS] - An array containing whether each segment is writable
-//  uint8_t* segments[NUM_SEGMENTS] - An array of pointers to the predefined segments
-//  uint32_t entryAddress - The virtual address to start the PC with
-#include "avr_program.txt"
+#include <stddef.h>
+
+#if __has_include(<avr/pgmspace.h>)
+#include <avr/pgmspace.h>
+#else
+// Not an AVR, so the image's read-only segments can be read like anything else. This lets the AVR build be tried out
+// on the desktop.
+#define PROGMEM
+#define pgm_read_byte(addr) (*(const uint8_t*) (addr))
+#define pgm_read_word(addr) ((uint16_t) (((const uint8_t*) (addr))[0] | (((const uint8_t*) (addr))[1] << 8)))
+#define pgm_read_dword(addr) (*(const uint32_t*) (addr))
+#endif
+
+uint8_t readByte(VM_instance* vm, uint32_t addr);
+void writeByte(VM_instance* vm, uint32_t addr, uint8_t value);
+VM_swiResult softwareInterrupt(VM_instance* vm, uint8_t number);
+const imageSegment* findSegment(uint32_t vaddr);
+uint8_t* getStackByte(uint32_t vaddr);
+uint8_t readFlashByte(uint32_t offset);
+uint8_t readStoredFlashByte(uint32_t offset);
+
+
+// The program to run, as a flat image generated from its ELF by ARMTinyVM_mkimage (see flatimage.h):
+//   ARMTinyVM_mkimage [-c] program.elf avr_image.h
+#include "avr_image.h"
+
+#ifdef IMAGE_COMPRESSED
+#define IMAGE_STORED_FLASH_SIZE IMAGE_COMPRESSED_SIZE
+#else
+#define IMAGE_STORED_FLASH_SIZE IMAGE_FLASH_SIZE
+#endif // IMAGE_COMPRESSED
+
+// Reads the little-endian byte or word `offset` bytes into imageFlash. An image too big to sit in the bottom 64KB of
+// flash has to be read through its 32-bit far address.
+#if defined(pgm_get_far_address) && (IMAGE_STORED_FLASH_SIZE > 0x8000UL)
+#define read_flash_byte(offset) pgm_read_byte_far(pgm_get_far_address(imageFlash) + (offset))
+#define read_flash_word(offset) pgm_read_word_far(pgm_get_far_address(imageFlash) + (offset))
+#else
+#define read_flash_byte(offset) pgm_read_byte(&imageFlash[offset])
+#define read_flash_word(offset) pgm_read_word(&imageFlash[offset])
+#endif
+
+#ifdef IMAGE_COMPRESSED
+// The read-only segments stay compressed in flash, and each page is decompressed into one of these frames when it is
+// first read from, so fetching an instruction usually just reads the frame. The frames are replaced in turn.
+#define PAGE_CACHE_FRAMES 2
+uint8_t pageCache[PAGE_CACHE_FRAMES][IMAGE_PAGE_SIZE];
+uint32_t cachedPages[PAGE_CACHE_FRAMES]; // One more than the page in each frame, or 0 if it's empty
+uint8_t nextFrame = 0;
+#else
+// The read-only segments stay in flash, and the aligned window of them around the program counter is copied into this
+// buffer, so fetching an instruction usually doesn't need to go to flash at all
+#define FETCH_BUFFER_SIZE 16UL
+uint8_t fetchBuffer[FETCH_BUFFER_SIZE];
+uint32_t fetchBufferOffset = UINT32_MAX; // Offset into imageFlash of the window in fetchBuffer
+#endif // IMAGE_COMPRESSED
 
 #define STACK_SIZE 1024UL
 #define INITIAL_STACK_POINTER 0xFFFFFFF8UL
@@ -27,57 +68,139 @@ int exitCode = 0;
 
 int main()
 {
-    VM_interaction_instructions instrs = {
-            .readByte = readByte,
-            .writeByte = writeByte,
-            .softwareInterrupt = softwareInterrupt
-    };
-    VM_instance vm = VM_new(&instrs, INITIAL_STACK_POINTER, 0);
+    VM_instance vm = VM_new(&readByte, &writeByte, &softwareInterrupt, INITIAL_STACK_POINTER, IMAGE_ENTRY_ADDRESS);
+    while (!vm.finished) {
+        VM_executeNInstructions(&vm, 1000);
+    }
     return exitCode;
 }
 
 
 /**
- * Translates a virtual memory byte into a pointer to where that byte really lives. Returns
+ * Finds the image segment containing the given virtual address. Returns NULL if it isn't in any of them.
  * @param vaddr
  * @return
  */
-uint8_t* getVirtualMemoryByte(uint32_t vaddr, bool* byteWritable)
+const imageSegment* findSegment(uint32_t vaddr)
 {
-    // Go through each of the predefined segments to see if this is in there
-    for (uint8_t i = 0; i < NUM_SEGMENTS; i++) {
-        if (vaddr > startPositions[i] && vaddr < (startPositions[i] + lengths[i])) {
-            // It's in this segment
-            if (byteWritable) {
-                // If not null, report whether this is a writable segment
-                *byteWritable = writable[i];
-            }
-            return &(segments[i][vaddr - startPositions[i]]);
+    for (uint8_t i = 0; i < IMAGE_NUM_SEGMENTS; i++) {
+        if ((vaddr >= imageSegments[i].virtualStartAddress) &&
+            (vaddr - imageSegments[i].virtualStartAddress < imageSegments[i].length)) {
+            return &imageSegments[i];
         }
     }
+    return NULL;
+}
 
-    // If it wasn't in one of those, was it in the stack?
-    // Ignore the CLion message telling me that the second condition is always false
-    if ((vaddr > (INITIAL_STACK_POINTER - STACK_SIZE)) && (vaddr < INITIAL_STACK_POINTER)) {
-        // It's in the stack
-        if (byteWritable) {
-            *byteWritable = true;
-        }
+
+/**
+ * Translates a virtual address in the stack into a pointer to where that byte really lives. Returns NULL if the
+ * address isn't in the stack.
+ * @param vaddr
+ * @return
+ */
+uint8_t* getStackByte(uint32_t vaddr)
+{
+    if ((vaddr >= (INITIAL_STACK_POINTER - STACK_SIZE)) && (vaddr < INITIAL_STACK_POINTER)) {
         return &stack[vaddr - (INITIAL_STACK_POINTER - STACK_SIZE)];
     }
-
     return NULL;
 }
 
 
+#ifdef IMAGE_COMPRESSED
+/**
+ * Reads the byte `offset` bytes into the image's uncompressed read-only content, via the page cache. On a miss, the
+ * page containing the byte is decompressed into the next frame.
+ * @param offset
+ * @return
+ */
+uint8_t readFlashByte(uint32_t offset)
+{
+    uint32_t page = offset / IMAGE_PAGE_SIZE;
+    uint8_t frame = 0;
+    while ((frame < PAGE_CACHE_FRAMES) && (cachedPages[frame] != page + 1)) {
+        frame++;
+    }
+
+    if (frame == PAGE_CACHE_FRAMES) {
+        // Not cached, so decompress it into the next frame
+        frame = nextFrame;
+        nextFrame = (nextFrame + 1) % PAGE_CACHE_FRAMES;
+
+        uint32_t start = pgm_read_dword(&imagePageOffsets[page]);
+        uint16_t storedLength = (uint16_t) (pgm_read_dword(&imagePageOffsets[page + 1]) - start);
+        uint32_t remaining = IMAGE_FLASH_SIZE - (page * IMAGE_PAGE_SIZE);
+        uint16_t pageLength = (remaining < IMAGE_PAGE_SIZE) ? (uint16_t) remaining : IMAGE_PAGE_SIZE;
+        if (storedLength == pageLength) {
+            // It didn't compress, so was stored as it is
+            for (uint16_t i = 0; i < pageLength; i++) {
+                pageCache[frame][i] = read_flash_byte(start + i);
+            }
+        } else {
+            LZ_decompress(readStoredFlashByte, start, storedLength, pageCache[frame], pageLength);
+        }
+        cachedPages[frame] = page + 1;
+    }
+    return pageCache[frame][offset % IMAGE_PAGE_SIZE];
+}
+
+
+/**
+ * Reads the byte `offset` bytes into the compressed content of imageFlash, for the decompressor.
+ * @param offset
+ * @return
+ */
+uint8_t readStoredFlashByte(uint32_t offset)
+{
+    return read_flash_byte(offset);
+}
+#else
+/**
+ * Reads the byte `offset` bytes into imageFlash, via the fetch buffer. On a miss, the buffer is refilled with the
+ * whole window containing the byte, a word at a time.
+ * @param offset
+ * @return
+ */
+uint8_t readFlashByte(uint32_t offset)
+{
+    uint32_t window = offset & ~(FETCH_BUFFER_SIZE - 1);
+    if (window != fetchBufferOffset) {
+        // imageFlash has a spare byte on the end, so the last word read never goes past it
+        for (uint8_t i = 0; (i < FETCH_BUFFER_SIZE) && (window + i < IMAGE_FLASH_SIZE); i += 2) {
+            uint16_t word = read_flash_word(window + i);
+            fetchBuffer[i] = (uint8_t) word;
+            fetchBuffer[i + 1] = (uint8_t) (word >> 8);
+        }
+        fetchBufferOffset = window;
+    }
+    return fetchBuffer[offset - window];
+}
+#endif // IMAGE_COMPRESSED
+
+
 /**
  * Reads a byte from the given virtual address. Returns 0xFF if the address is invalid.
+ * @param vm
  * @param addr
  * @return
  */
-uint8_t readByte(uint32_t addr)
+uint8_t readByte(VM_instance* vm, uint32_t addr)
 {
-    uint8_t* bytePtr = getVirtualMemoryByte(addr, NULL);
+    const imageSegment* segment = findSegment(addr);
+    if (segment != NULL) {
+        uint32_t offset = segment->offset + (addr - segment->virtualStartAddress);
+        switch (segment->region) {
+            case IMAGE_REGION_FLASH:
+                return readFlashByte(offset);
+            case IMAGE_REGION_DATA:
+                return imageData[offset];
+            default:
+                return imageBss[offset];
+        }
+    }
+
+    uint8_t* bytePtr = getStackByte(addr);
     if (bytePtr == NULL) {
         return 0xFF;
     } else {
@@ -87,21 +210,32 @@ uint8_t readByte(uint32_t addr)
 
 
 /**
- * Writes a byte to the given virtual address. Does nothing if the address is invalid.
+ * Writes a byte to the given virtual address. Does nothing if the address is invalid or read-only.
+ * @param vm
  * @param addr
  * @param value
  */
-void writeByte(uint32_t addr, uint8_t value)
+void writeByte(VM_instance* vm, uint32_t addr, uint8_t value)
 {
-    bool byteWritable;
-    uint8_t* bytePtr = getVirtualMemoryByte(addr, &byteWritable);
-    if ((bytePtr != NULL) && byteWritable) {
+    const imageSegment* segment = findSegment(addr);
+    if (segment != NULL) {
+        uint32_t offset = segment->offset + (addr - segment->virtualStartAddress);
+        if (segment->region == IMAGE_REGION_DATA) {
+            imageData[offset] = value;
+        } else if (segment->region == IMAGE_REGION_BSS) {
+            imageBss[offset] = value;
+        }
+        return;
+    }
+
+    uint8_t* bytePtr = getStackByte(addr);
+    if (bytePtr != NULL) {
         *bytePtr = value;
     }
 }
 
 
-void softwareInterrupt(VM_instance* vm, uint8_t number)
+VM_swiResult softwareInterrupt(VM_instance* vm, uint8_t number)
 {
     if (number == 0) {
         // This is intended as a system call
@@ -113,5 +247,5 @@ void softwareInterrupt(VM_instance* vm, uint8_t number)
     }
 
     vm->finished = true;
+    return SWI_COMPLETE;
 }
-
@@ -0,0 +1,272 @@
+/*
+ * Image generator: converts a guest ELF program into a flat image (see flatimage.h), written as a C header which a
+ * build without an ELF loader, such as the AVR build, compiles straight in.
+ *
+ * Usage: ARMTinyVM_mkimage [-c] program.elf output.h
+ *
+ * Read-only segments are packed into one array which is kept in program memory, so only the writable segments take
+ * up RAM, and writable segments which start out as zeroes (such as .bss) don't take up any space in the program.
+ *
+ * With -c, the read-only segments are compressed a page at a time (see lz.h), so that the host only has to decompress
+ * the page it is reading from.
+*/
+
+#include "elfloader.h"
+#include "flatimage.h"
+#include "lz.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+
+#define BYTES_PER_LINE 16
+
+
+// FUNCTION DECLARATIONS
+int main(int argc, char* argv[]);
+uint8_t segmentRegion(const runtimeSegment* segment);
+bool writeImage(FILE* out, const char* elfFilename, const VM_memoryMap* map, bool compress);
+void writeCompressedFlash(FILE* out, const uint8_t* flash, uint32_t length);
+uint8_t* gatherRegion(const VM_memoryMap* map, uint8_t region);
+void writeBytes(FILE* out, const uint8_t* bytes, uint32_t length);
+uint32_t regionSize(const VM_memoryMap* map, uint8_t region);
+
+
+// FUNCTION DEFINITIONS
+
+int main(int argc, char* argv[])
+{
+    bool compress = (argc == 4) && (strcmp(argv[1], "-c") == 0);
+    if (argc != (compress ? 4 : 3)) {
+        fprintf(stderr, "Usage: %s [-c] program.elf output.h\n", argv[0]);
+        return 1;
+    }
+    const char* elfFilename = argv[argc - 2];
+    const char* outputFilename = argv[argc - 1];
+
+    VM_memoryMap map;
+    VM_elfStatus status = ElfLoader_load(elfFilename, false, &map);
+    if (status != ELF_LOADED) {
+        fprintf(stderr, "Unable to load %s: %s\n", elfFilename, ElfLoader_statusMessage(status));
+        return 1;
+    }
+
+    FILE* out = fopen(outputFilename, "w");
+    if (out == NULL) {
+        fprintf(stderr, "Unable to open %s\n", outputFilename);
+        ElfLoader_freeMemoryMap(&map);
+        return 1;
+    }
+
+    bool written = writeImage(out, elfFilename, &map, compress);
+    written = (fclose(out) == 0) && written;
+    ElfLoader_freeMemoryMap(&map);
+
+    if (!written) {
+        fprintf(stderr, "Unable to write %s\n", outputFilename);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Decides which region of the image the given segment's content belongs in.
+ * @param segment
+ * @return
+ */
+uint8_t segmentRegion(const runtimeSegment* segment)
+{
+    if (!segment->writable) {
+        return IMAGE_REGION_FLASH;
+    }
+
+    for (uint32_t i = 0; i < segment->length; i++) {
+        if (segment->content[i] != 0) {
+            return IMAGE_REGION_DATA;
+        }
+    }
+    return IMAGE_REGION_BSS;
+}
+
+
+/**
+ * Writes the whole image as a C header, compressing its read-only segments if `compress` is set. Returns false if the
+ * output couldn't be written.
+ * @param out
+ * @param elfFilename
+ * @param map
+ * @param compress
+ * @return
+ */
+bool writeImage(FILE* out, const char* elfFilename, const VM_memoryMap* map, bool compress)
+{
+    fprintf(out, "/*\n * Generated by ARMTinyVM_mkimage from %s. Do not edit.\n*/\n\n", elfFilename);
+    fputs("#include \"flatimage.h\"\n\n", out);
+
+    fprintf(out, "#define IMAGE_NUM_SEGMENTS %luUL\n", (unsigned long) map->numSegments);
+    fprintf(out, "#define IMAGE_ENTRY_ADDRESS 0x%08lxUL\n", (unsigned long) map->entryAddress);
+    fprintf(out, "#define IMAGE_FLASH_SIZE %luUL\n", (unsigned long) regionSize(map, IMAGE_REGION_FLASH));
+    fprintf(out, "#define IMAGE_DATA_SIZE %luUL\n", (unsigned long) regionSize(map, IMAGE_REGION_DATA));
+    fprintf(out, "#define IMAGE_BSS_SIZE %luUL\n\n", (unsigned long) regionSize(map, IMAGE_REGION_BSS));
+
+    // The segment table, which is small and read on every access, so lives in RAM
+    fputs("const imageSegment imageSegments[IMAGE_NUM_SEGMENTS + 1] = {\n", out);
+    uint32_t offsets[3] = {0, 0, 0};
+    static const char* const regionNames[3] = {"IMAGE_REGION_FLASH", "IMAGE_REGION_DATA", "IMAGE_REGION_BSS"};
+    for (uint32_t i = 0; i < map->numSegments; i++) {
+        const runtimeSegment* segment = &map->segments[i];
+        uint8_t region = segmentRegion(segment);
+        fprintf(out, "        {0x%08lxUL, 0x%08lxUL, 0x%08lxUL, %s},\n", (unsigned long) segment->virtualStartAddress,
+                (unsigned long) segment->length, (unsigned long) offsets[region], regionNames[region]);
+        offsets[region] += segment->length;
+    }
+    fputs("};\n\n", out);
+
+    uint8_t* flash = gatherRegion(map, IMAGE_REGION_FLASH);
+    uint8_t* data = gatherRegion(map, IMAGE_REGION_DATA);
+    if (!flash || !data) {
+        free(flash);
+        free(data);
+        return false;
+    }
+
+    if (compress) {
+        writeCompressedFlash(out, flash, regionSize(map, IMAGE_REGION_FLASH));
+    } else {
+        fputs("const uint8_t imageFlash[IMAGE_FLASH_SIZE + 1] PROGMEM = {\n", out);
+        writeBytes(out, flash, regionSize(map, IMAGE_REGION_FLASH));
+        fputs("};\n\n", out);
+    }
+
+    fputs("uint8_t imageData[IMAGE_DATA_SIZE + 1] = {\n", out);
+    writeBytes(out, data, regionSize(map, IMAGE_REGION_DATA));
+    fputs("};\n\n", out);
+
+    fputs("uint8_t imageBss[IMAGE_BSS_SIZE + 1];\n", out);
+    free(flash);
+    free(data);
+    return !ferror(out);
+}
+
+
+/**
+ * Writes the read-only region as independently compressed pages, along with where each page starts. A page which
+ * doesn't get any smaller is stored as it is, which the host can tell from its length.
+ * @param out
+ * @param flash
+ * @param length
+ */
+void writeCompressedFlash(FILE* out, const uint8_t* flash, uint32_t length)
+{
+    uint32_t numPages = (length + IMAGE_PAGE_SIZE - 1) / IMAGE_PAGE_SIZE;
+    uint8_t* compressed = malloc(numPages * lz_max_compressed_size(IMAGE_PAGE_SIZE) + 1);
+    uint32_t* pageOffsets = malloc((numPages + 1) * sizeof(uint32_t));
+    if (!compressed || !pageOffsets) {
+        free(compressed);
+        free(pageOffsets);
+        fputs("#error Out of memory while compressing the image\n", out);
+        return;
+    }
+
+    uint32_t compressedLength = 0;
+    for (uint32_t page = 0; page < numPages; page++) {
+        uint32_t start = page * IMAGE_PAGE_SIZE;
+        uint16_t pageLength = (uint16_t) (((length - start) < IMAGE_PAGE_SIZE) ? (length - start) : IMAGE_PAGE_SIZE);
+        pageOffsets[page] = compressedLength;
+
+        uint16_t packedLength = LZ_compress(&flash[start], pageLength, &compressed[compressedLength]);
+        if (packedLength >= pageLength) {
+            memcpy(&compressed[compressedLength], &flash[start], pageLength);
+            packedLength = pageLength;
+        }
+        compressedLength += packedLength;
+    }
+    pageOffsets[numPages] = compressedLength;
+
+    fputs("#define IMAGE_COMPRESSED\n", out);
+    fprintf(out, "#define IMAGE_NUM_PAGES %luUL\n", (unsigned long) numPages);
+    fprintf(out, "#define IMAGE_COMPRESSED_SIZE %luUL\n\n", (unsigned long) compressedLength);
+
+    fputs("const uint32_t imagePageOffsets[IMAGE_NUM_PAGES + 1] PROGMEM = {\n", out);
+    for (uint32_t page = 0; page <= numPages; page++) {
+        fprintf(out, ((page % 8) == 0) ? "        0x%08lxUL," : " 0x%08lxUL,", (unsigned long) pageOffsets[page]);
+        if (((page % 8) == 7) || (page == numPages)) {
+            fputc('\n', out);
+        }
+    }
+    fputs("};\n\n", out);
+
+    fputs("const uint8_t imageFlash[IMAGE_COMPRESSED_SIZE + 1] PROGMEM = {\n", out);
+    writeBytes(out, compressed, compressedLength);
+    fputs("};\n\n", out);
+
+    free(compressed);
+    free(pageOffsets);
+}
+
+
+/**
+ * Returns the content of every segment in the given region, in segment order, in one newly allocated buffer. Returns
+ * NULL if there isn't enough memory.
+ * @param map
+ * @param region
+ * @return
+ */
+uint8_t* gatherRegion(const VM_memoryMap* map, uint8_t region)
+{
+    uint8_t* bytes = malloc(regionSize(map, region) + 1);
+    if (bytes == NULL) {
+        return NULL;
+    }
+
+    uint32_t length = 0;
+    for (uint32_t i = 0; i < map->numSegments; i++) {
+        const runtimeSegment* segment = &map->segments[i];
+        if (segmentRegion(segment) == region) {
+            memcpy(&bytes[length], segment->content, segment->length);
+            length += segment->length;
+        }
+    }
+    return bytes;
+}
+
+
+/**
+ * Writes the given bytes followed by the spare byte, as the body of an array initialiser.
+ * @param out
+ * @param bytes
+ * @param length
+ */
+void writeBytes(FILE* out, const uint8_t* bytes, uint32_t length)
+{
+    uint32_t column = 0;
+    for (uint32_t i = 0; i < length; i++) {
+        fprintf(out, (column == 0) ? "        0x%02x," : " 0x%02x,", bytes[i]);
+        if (++column == BYTES_PER_LINE) {
+            fputc('\n', out);
+            column = 0;
+        }
+    }
+
+    // The spare byte, which keeps the array from being empty
+    fputs((column == 0) ? "        0x00\n" : " 0x00\n", out);
+}
+
+
+/**
+ * Adds up the lengths of the segments in the given region.
+ * @param map
+ * @param region
+ * @return
+ */
+uint32_t regionSize(const VM_memoryMap* map, uint8_t region)
+{
+    uint32_t size = 0;
+    for (uint32_t i = 0; i < map->numSegments; i++) {
+        if (segmentRegion(&map->segments[i]) == region) {
+            size += map->segments[i].length;
+        }
+    }
+    return size;
+}
@@ -0,0 +1,309 @@
+#include "pager.h"
+#include <stdlib.h>
+#include <string.h>
+#if !__has_include(<avr/version.h>)
+#include <stdio.h>
+#endif // !__has_include(<avr/version.h>)
+
+
+// PRIVATE FUNCTION DECLARATIONS
+pagerFrame* findFrame(VM_pager* pager, uint32_t page);
+bool writeBack(VM_pager* pager, pagerFrame* frame);
+uint16_t pageLength(VM_pager* pager, uint32_t page);
+#if !__has_include(<avr/version.h>)
+bool readFile(void* backing, uint32_t offset, uint8_t* buffer, uint16_t length);
+bool writeFile(void* backing, uint32_t offset, const uint8_t* buffer, uint16_t length);
+#endif // !__has_include(<avr/version.h>)
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Sets up a paged region of `size` bytes at `baseAddress`, split into pages of `pageSize` bytes (a power of two), of
+ * which `numFrames` can be resident at once. Returns false if the parameters are invalid or there isn't enough memory.
+ * @param pager
+ * @param baseAddress
+ * @param size
+ * @param pageSize
+ * @param numFrames
+ * @param backing
+ * @param readBacking
+ * @param writeBacking
+ * @return
+ */
+bool Pager_init(VM_pager* pager, uint32_t baseAddress, uint32_t size, uint16_t pageSize, uint16_t numFrames,
+                void* backing, bool (*readBacking)(void* backing, uint32_t offset, uint8_t* buffer, uint16_t length),
+                bool (*writeBacking)(void* backing, uint32_t offset, const uint8_t* buffer, uint16_t length))
+{
+    memset(pager, 0, sizeof(VM_pager));
+    if ((size == 0) || (pageSize == 0) || (pageSize & (pageSize - 1)) || (numFrames == 0)) {
+        return false;
+    }
+
+    pager->baseAddress = baseAddress;
+    pager->size = size;
+    pager->pageSize = pageSize;
+    while ((1UL << pager->pageShift) < pageSize) {
+        pager->pageShift++;
+    }
+    pager->numFrames = numFrames;
+    pager->backing = backing;
+    pager->readBacking = readBacking;
+    pager->writeBacking = writeBacking;
+
+    pager->frames = malloc(numFrames * sizeof(pagerFrame));
+    pager->order = malloc(numFrames * sizeof(uint16_t));
+    pager->frameData = malloc((size_t) numFrames * pageSize);
+    if (!pager->frames || !pager->order || !pager->frameData) {
+        Pager_free(pager);
+        return false;
+    }
+
+    for (uint16_t i = 0; i < numFrames; i++) {
+        pager->frames[i].page = PAGER_NO_PAGE;
+        pager->frames[i].dirty = false;
+        pager->frames[i].data = &pager->frameData[(size_t) i * pageSize];
+        pager->order[i] = i;
+    }
+    return true;
+}
+
+
+#if !__has_include(<avr/version.h>)
+/**
+ * Sets up a paged region (see Pager_init) backed by the file `filename`, which is created if it doesn't exist. Any
+ * part of the region beyond the end of the file reads as zeroes until it is written back.
+ * @param pager
+ * @param filename
+ * @param baseAddress
+ * @param size
+ * @param pageSize
+ * @param numFrames
+ * @return
+ */
+bool Pager_initFile(VM_pager* pager, const char* filename, uint32_t baseAddress, uint32_t size, uint16_t pageSize,
+                    uint16_t numFrames)
+{
+    FILE* file = fopen(filename, "r+b");
+    if (file == NULL) {
+        file = fopen(filename, "w+b");
+    }
+    if (file == NULL) {
+        memset(pager, 0, sizeof(VM_pager));
+        return false;
+    }
+
+    if (!Pager_init(pager, baseAddress, size, pageSize, numFrames, file, readFile, writeFile)) {
+        fclose(file);
+        return false;
+    }
+    pager->ownsFile = true;
+    return true;
+}
+#endif // !__has_include(<avr/version.h>)
+
+
+/**
+ * Returns a pointer to the resident copy of the byte at virtual address `addr`, bringing its page in if necessary. If
+ * `forWriting` is set, the page is marked dirty. The pointer is only valid until the next call. Returns NULL if the
+ * address isn't in the region, or its page couldn't be read.
+ * @param pager
+ * @param addr
+ * @param forWriting
+ * @return
+ */
+uint8_t* Pager_getByte(VM_pager* pager, uint32_t addr, bool forWriting)
+{
+    if (!pager_contains(pager, addr)) {
+        return NULL;
+    }
+
+    uint32_t offset = addr - pager->baseAddress;
+    pagerFrame* frame = findFrame(pager, offset >> pager->pageShift);
+    if (frame == NULL) {
+        return NULL;
+    }
+
+    frame->dirty |= forWriting;
+    return &frame->data[offset & (pager->pageSize - 1)];
+}
+
+
+/**
+ * Writes every dirty page back to the backing storage. Returns false if any of them couldn't be written.
+ * @param pager
+ * @return
+ */
+bool Pager_flush(VM_pager* pager)
+{
+    bool flushed = true;
+    for (uint16_t i = 0; i < pager->numFrames; i++) {
+        flushed = writeBack(pager, &pager->frames[i]) && flushed;
+    }
+
+#if !__has_include(<avr/version.h>)
+    if (pager->ownsFile && (fflush((FILE*) pager->backing) != 0)) {
+        flushed = false;
+    }
+#endif // !__has_include(<avr/version.h>)
+    return flushed;
+}
+
+
+/**
+ * Writes back every dirty page, and frees the frames. Closes the backing file if it was opened by Pager_initFile.
+ * @param pager
+ */
+void Pager_free(VM_pager* pager)
+{
+    if (pager->frames) {
+        Pager_flush(pager);
+    }
+
+#if !__has_include(<avr/version.h>)
+    if (pager->ownsFile) {
+        fclose((FILE*) pager->backing);
+    }
+#endif // !__has_include(<avr/version.h>)
+
+    free(pager->frames);
+    free(pager->order);
+    free(pager->frameData);
+    pager->frames = NULL;
+    pager->order = NULL;
+    pager->frameData = NULL;
+    pager->ownsFile = false;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Returns the frame holding `page`, making it the most recently used. If the page isn't resident, the least recently
+ * used frame is written back if it's dirty, and the page is read into it. Returns NULL if that fails.
+ * @param pager
+ * @param page
+ * @return
+ */
+pagerFrame* findFrame(VM_pager* pager, uint32_t page)
+{
+    // Most accesses are to the same page as the last one
+    pagerFrame* frame = &pager->frames[pager->order[0]];
+    if (frame->page == page) {
+        pager->hits++;
+        return frame;
+    }
+
+    uint16_t position = 1;
+    while ((position < pager->numFrames) && (pager->frames[pager->order[position]].page != page)) {
+        position++;
+    }
+
+    if (position < pager->numFrames) {
+        pager->hits++;
+    } else {
+        // Not resident, so evict the least recently used page
+        pager->misses++;
+        position = pager->numFrames - 1;
+        frame = &pager->frames[pager->order[position]];
+        if (!writeBack(pager, frame)) {
+            return NULL;
+        }
+
+        frame->page = PAGER_NO_PAGE;
+        if (!pager->readBacking(pager->backing, page << pager->pageShift, frame->data, pageLength(pager, page))) {
+            return NULL;
+        }
+        frame->page = page;
+    }
+
+    // Move it to the front
+    uint16_t index = pager->order[position];
+    memmove(&pager->order[1], &pager->order[0], position * sizeof(uint16_t));
+    pager->order[0] = index;
+    return &pager->frames[index];
+}
+
+
+/**
+ * Writes the given frame back to the backing storage if it's dirty. Returns false if that fails, in which case the
+ * frame stays dirty.
+ * @param pager
+ * @param frame
+ * @return
+ */
+bool writeBack(VM_pager* pager, pagerFrame* frame)
+{
+    if (!frame->dirty || (frame->page == PAGER_NO_PAGE)) {
+        return true;
+    }
+
+    if (!pager->writeBacking(pager->backing, frame->page << pager->pageShift, frame->data,
+                             pageLength(pager, frame->page))) {
+        return false;
+    }
+    frame->dirty = false;
+    pager->writeBacks++;
+    return true;
+}
+
+
+/**
+ * Returns the length of the given page, which is less than the page size for the last page of a region whose size
+ * isn't a whole number of pages.
+ * @param pager
+ * @param page
+ * @return
+ */
+uint16_t pageLength(VM_pager* pager, uint32_t page)
+{
+    uint32_t remaining = pager->size - (page << pager->pageShift);
+    return (remaining < pager->pageSize) ? (uint16_t) remaining : pager->pageSize;
+}
+
+
+#if !__has_include(<avr/version.h>)
+/**
+ * Reads part of a backing file. Anything beyond the end of the file reads as zeroes.
+ * @param backing
+ * @param offset
+ * @param buffer
+ * @param length
+ * @return
+ */
+bool readFile(void* backing, uint32_t offset, uint8_t* buffer, uint16_t length)
+{
+    FILE* file = (FILE*) backing;
+    if (fseek(file, (long) offset, SEEK_SET) != 0) {
+        return false;
+    }
+
+    size_t numRead = fread(buffer, 1, length, file);
+    if (ferror(file)) {
+        clearerr(file);
+        return false;
+    }
+    memset(&buffer[numRead], 0, length - numRead);
+    return true;
+}
+
+
+/**
+ * Writes part of a backing file, extending it if necessary.
+ * @param backing
+ * @param offset
+ * @param buffer
+ * @param length
+ * @return
+ */
+bool writeFile(void* backing, uint32_t offset, const uint8_t* buffer, uint16_t length)
+{
+    FILE* file = (FILE*) backing;
+    if (fseek(file, (long) offset, SEEK_SET) != 0) {
+        return false;
+    }
+    return fwrite(buffer, 1, length, file) == length;
+}
+#endif // !__has_include(<avr/version.h>)
@@ -0,0 +1,72 @@
+/*
+ * Paged guest memory: a region of the guest's address space which lives in backing storage (a file on the desktop,
+ * standing in for SPI flash or an SD card on a microcontroller), of which only a few pages are resident at a time.
+ *
+ * The resident pages are held in `numFrames` frames, and when a page which isn't resident is touched, the least
+ * recently used frame is reused for it. A frame which has been written to is dirty, and is written back to the
+ * backing storage before being reused, or by Pager_flush. The hit, miss and write-back counters show how well a given
+ * number of frames suits a program.
+ *
+ * The backing storage is accessed through `readBacking` and `writeBacking`, which transfer `length` bytes at `offset`
+ * bytes into the region, and return false if they fail. Pager_initFile provides these for a file.
+*/
+
+#ifndef PAGER_H
+#define PAGER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PAGER_DEFAULT_PAGE_SIZE 256
+#define PAGER_DEFAULT_NUM_FRAMES 8
+
+// The page number of a frame which doesn't hold a page
+#define PAGER_NO_PAGE UINT32_MAX
+
+// Whether a paged region contains the given virtual address
+#define pager_contains(pager, addr) (((uint32_t) (addr) - (pager)->baseAddress) < (pager)->size)
+
+
+typedef struct pagerFrame {
+    uint32_t page;
+    bool dirty;
+    uint8_t* data;
+} pagerFrame;
+
+
+/**
+ * A paged region of `size` bytes starting at `baseAddress`. `order` holds the index of every frame, most recently used
+ * first.
+ */
+typedef struct VM_pager {
+    uint32_t baseAddress;
+    uint32_t size;
+    uint16_t pageSize;
+    uint8_t pageShift;
+    uint16_t numFrames;
+    pagerFrame* frames;
+    uint16_t* order;
+    uint8_t* frameData;
+    void* backing;
+    bool (*readBacking)(void* backing, uint32_t offset, uint8_t* buffer, uint16_t length);
+    bool (*writeBacking)(void* backing, uint32_t offset, const uint8_t* buffer, uint16_t length);
+    bool ownsFile; // Set if the backing is a file opened by Pager_initFile
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t writeBacks;
+} VM_pager;
+
+
+bool Pager_init(VM_pager* pager, uint32_t baseAddress, uint32_t size, uint16_t pageSize, uint16_t numFrames,
+                void* backing, bool (*readBacking)(void* backing, uint32_t offset, uint8_t* buffer, uint16_t length),
+                bool (*writeBacking)(void* backing, uint32_t offset, const uint8_t* buffer, uint16_t length));
+#if !__has_include(<avr/version.h>)
+bool Pager_initFile(VM_pager* pager, const char* filename, uint32_t baseAddress, uint32_t size, uint16_t pageSize,
+                    uint16_t numFrames);
+#endif // !__has_include(<avr/version.h>)
+uint8_t* Pager_getByte(VM_pager* pager, uint32_t addr, bool forWriting);
+bool Pager_flush(VM_pager* pager);
+void Pager_free(VM_pager* pager);
+
+
+#endif // PAGER_H
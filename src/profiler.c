@@ -0,0 +1,607 @@
+#include "profiler.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define PROFILER_INITIAL_NODES 256
+#define PROFILER_INITIAL_STACK 64
+
+
+// What the callgrind output is gathered into: the cost of a function itself, or of its calls to another
+typedef struct functionCost {
+    uint32_t function;
+    uint64_t instructions;
+} functionCost;
+
+typedef struct callCost {
+    uint32_t caller;
+    uint32_t callee;
+    uint64_t calls;
+    uint64_t instructions; // Inclusive of everything the callee called in turn
+} callCost;
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+void profilerBranched(VM_instance* vm, uint32_t from, uint32_t to, VM_branchKind kind);
+void chargeInstructions(VM_profiler* profiler, uint64_t instructionCount);
+uint64_t* inclusiveInstructions(const VM_profiler* profiler);
+int compareFunctionCosts(const void* a, const void* b);
+int compareCallCosts(const void* a, const void* b);
+uint32_t findChild(VM_profiler* profiler, uint32_t parent, uint32_t function);
+uint32_t addNode(VM_profiler* profiler, uint32_t parent, uint32_t function);
+bool growChildren(VM_profiler* profiler);
+uint32_t childSlot(uint32_t parent, uint32_t function, uint32_t capacity);
+void pushFrame(VM_profiler* profiler, uint32_t function, uint32_t returnAddress);
+void popToFrame(VM_profiler* profiler, uint32_t returnAddress);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Sets up an empty profile, which will take a sample every `samplePeriod` instructions (or
+ * PROFILER_DEFAULT_SAMPLE_PERIOD if it's 0), and name functions from `symbols`, which may be NULL. The symbols must
+ * outlive the profiler. Returns false if there isn't the memory for it.
+ * @param profiler
+ * @param symbols
+ * @param samplePeriod
+ * @return
+ */
+bool Profiler_init(VM_profiler* profiler, const VM_symbolTable* symbols, uint64_t samplePeriod)
+{
+    profiler->symbols = symbols;
+    profiler->samplePeriod = (samplePeriod > 0) ? samplePeriod : PROFILER_DEFAULT_SAMPLE_PERIOD;
+    profiler->nextSample = profiler->samplePeriod;
+    profiler->lastBranch = 0;
+    profiler->numNodes = 0;
+    profiler->nodeCapacity = PROFILER_INITIAL_NODES;
+    profiler->childCapacity = PROFILER_INITIAL_NODES * 2;
+    profiler->depth = 0;
+    profiler->stackCapacity = PROFILER_INITIAL_STACK;
+    profiler->outOfMemory = false;
+
+    profiler->nodes = malloc(profiler->nodeCapacity * sizeof(VM_profileNode));
+    profiler->children = calloc(profiler->childCapacity, sizeof(uint32_t));
+    profiler->stack = malloc(profiler->stackCapacity * sizeof(VM_profileFrame));
+    if (!profiler->nodes || !profiler->children || !profiler->stack) {
+        Profiler_free(profiler);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Starts profiling `vm`, by taking over its `branched` hook. Its call stack is taken to start in the function it is in
+ * now, and the first sample is taken `samplePeriod` instructions from now.
+ * @param profiler
+ * @param vm
+ */
+void Profiler_attach(VM_profiler* profiler, VM_instance* vm)
+{
+    uint32_t function = vm_program_counter(vm);
+    const VM_symbol* symbol = profiler->symbols ? ElfLoader_findSymbol(profiler->symbols, function) : NULL;
+    if (symbol) {
+        function = symbol->address;
+    }
+
+    profiler->depth = 0;
+    pushFrame(profiler, function, PROFILER_INTERRUPT_FRAME);
+    profiler->nextSample = vm->instructionCount + profiler->samplePeriod;
+    profiler->lastBranch = vm->instructionCount;
+
+    vm->branchInstrumentation = profiler;
+    vm->branched = profilerBranched;
+}
+
+
+/**
+ * Stops profiling `vm`, charging the instructions and any samples since its last branch to the function it is in.
+ * @param profiler
+ * @param vm
+ */
+void Profiler_detach(VM_profiler* profiler, VM_instance* vm)
+{
+    chargeInstructions(profiler, vm->instructionCount);
+    vm->branched = NULL;
+    vm->branchInstrumentation = NULL;
+}
+
+
+/**
+ * Returns the number of samples taken, over every function.
+ * @param profiler
+ * @return
+ */
+uint64_t Profiler_totalSamples(const VM_profiler* profiler)
+{
+    uint64_t total = 0;
+    for (uint32_t node = 0; node < profiler->numNodes; node++) {
+        total += profiler->nodes[node].samples;
+    }
+    return total;
+}
+
+
+/**
+ * Returns the name of the function at `function`: the symbol it lies in, or else its address, written into `buffer`.
+ * @param profiler
+ * @param function
+ * @param buffer
+ * @param bufferSize
+ * @return
+ */
+const char* Profiler_functionName(const VM_profiler* profiler, uint32_t function, char* buffer, size_t bufferSize)
+{
+    const VM_symbol* symbol = profiler->symbols ? ElfLoader_findSymbol(profiler->symbols, function) : NULL;
+    if (symbol && (symbol->name[0] != '\0')) {
+        return symbol->name;
+    }
+    snprintf(buffer, bufferSize, "0x%08lx", (unsigned long) function);
+    return buffer;
+}
+
+
+/**
+ * Writes the samples to `file` as folded stacks: for every chain of calls which was sampled, the names of the
+ * functions from the outermost in, separated by semicolons, then the number of samples. Returns false if it couldn't
+ * be written.
+ * @param profiler
+ * @param file
+ * @return
+ */
+bool Profiler_writeFolded(const VM_profiler* profiler, FILE* file)
+{
+    uint32_t maxDepth = 0;
+    for (uint32_t node = 0; node < profiler->numNodes; node++) {
+        if (profiler->nodes[node].depth > maxDepth) {
+            maxDepth = profiler->nodes[node].depth;
+        }
+    }
+    uint32_t* path = malloc(((size_t) maxDepth + 1) * sizeof(uint32_t));
+    if (!path) {
+        return false;
+    }
+
+    for (uint32_t node = 0; node < profiler->numNodes; node++) {
+        if (profiler->nodes[node].samples == 0) {
+            continue;
+        }
+
+        // Walk up to the root, then print back down from it
+        uint32_t length = 0;
+        for (uint32_t caller = node; caller != PROFILER_NO_NODE; caller = profiler->nodes[caller].parent) {
+            path[length++] = caller;
+        }
+        while (length > 0) {
+            char address[16];
+            fprintf(file, "%s%c", Profiler_functionName(profiler, profiler->nodes[path[length - 1]].function, address,
+                                                        sizeof(address)), (length > 1) ? ';' : ' ');
+            length--;
+        }
+        fprintf(file, "%llu\n", (unsigned long long) profiler->nodes[node].samples);
+    }
+
+    free(path);
+    return !ferror(file);
+}
+
+
+/**
+ * Writes the samples to the file `filename` as folded stacks (see Profiler_writeFolded). Returns false if it couldn't
+ * be written.
+ * @param profiler
+ * @param filename
+ * @return
+ */
+bool Profiler_saveFolded(const VM_profiler* profiler, const char* filename)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        return false;
+    }
+
+    bool written = Profiler_writeFolded(profiler, file);
+    return (fclose(file) == 0) && written;
+}
+
+
+/**
+ * Writes the exact counts to `file` in the callgrind format: for each function, the instructions it executed itself,
+ * then for each function it called, how many times and the instructions executed in those calls, inclusive of what
+ * they called in turn. Every count is for the function as a whole, whichever chain of calls reached it. Functions are
+ * located by address, and `command` (which may be NULL) names what was profiled. Returns false if it couldn't be
+ * written.
+ * @param profiler
+ * @param file
+ * @param command
+ * @return
+ */
+bool Profiler_writeCallgrind(const VM_profiler* profiler, FILE* file, const char* command)
+{
+    // Gather the nodes up by function, and by caller and callee
+    uint64_t* inclusive = inclusiveInstructions(profiler);
+    functionCost* functions = malloc(((size_t) profiler->numNodes + 1) * sizeof(functionCost));
+    callCost* calls = malloc(((size_t) profiler->numNodes + 1) * sizeof(callCost));
+    if (!inclusive || !functions || !calls) {
+        free(inclusive);
+        free(functions);
+        free(calls);
+        return false;
+    }
+
+    uint64_t total = 0;
+    uint32_t numCalls = 0;
+    for (uint32_t node = 0; node < profiler->numNodes; node++) {
+        const VM_profileNode* profileNode = &(profiler->nodes[node]);
+        functions[node].function = profileNode->function;
+        functions[node].instructions = profileNode->instructions;
+        total += profileNode->instructions;
+        if (profileNode->parent != PROFILER_NO_NODE) {
+            calls[numCalls].caller = profiler->nodes[profileNode->parent].function;
+            calls[numCalls].callee = profileNode->function;
+            calls[numCalls].calls = profileNode->calls;
+            calls[numCalls].instructions = inclusive[node];
+            numCalls++;
+        }
+    }
+    free(inclusive);
+    qsort(functions, profiler->numNodes, sizeof(functionCost), compareFunctionCosts);
+    qsort(calls, numCalls, sizeof(callCost), compareCallCosts);
+
+    fprintf(file, "# callgrind format\nversion: 1\ncreator: ARMTinyVM\n");
+    if (command) {
+        fprintf(file, "cmd: %s\n", command);
+    }
+    fprintf(file, "positions: instr\nevents: Instructions\nsummary: %llu\n", (unsigned long long) total);
+
+    uint32_t call = 0;
+    for (uint32_t first = 0; first < profiler->numNodes; ) {
+        uint32_t function = functions[first].function;
+        uint64_t instructions = 0;
+        for (; (first < profiler->numNodes) && (functions[first].function == function); first++) {
+            instructions += functions[first].instructions;
+        }
+
+        char name[16];
+        fprintf(file, "\nfn=%s\n0x%08lx %llu\n", Profiler_functionName(profiler, function, name, sizeof(name)),
+                (unsigned long) function, (unsigned long long) instructions);
+
+        while ((call < numCalls) && (calls[call].caller == function)) {
+            callCost cost = calls[call++];
+            while ((call < numCalls) && (calls[call].caller == function) && (calls[call].callee == cost.callee)) {
+                cost.calls += calls[call].calls;
+                cost.instructions += calls[call].instructions;
+                call++;
+            }
+            fprintf(file, "cfn=%s\ncalls=%llu 0x%08lx\n0x%08lx %llu\n",
+                    Profiler_functionName(profiler, cost.callee, name, sizeof(name)), (unsigned long long) cost.calls,
+                    (unsigned long) cost.callee, (unsigned long) function, (unsigned long long) cost.instructions);
+        }
+    }
+
+    free(functions);
+    free(calls);
+    return !ferror(file);
+}
+
+
+/**
+ * Writes the exact counts to the file `filename` in the callgrind format (see Profiler_writeCallgrind). Returns false
+ * if it couldn't be written.
+ * @param profiler
+ * @param filename
+ * @param command
+ * @return
+ */
+bool Profiler_saveCallgrind(const VM_profiler* profiler, const char* filename, const char* command)
+{
+    FILE* file = fopen(filename, "w");
+    if (!file) {
+        return false;
+    }
+
+    bool written = Profiler_writeCallgrind(profiler, file, command);
+    return (fclose(file) == 0) && written;
+}
+
+
+/**
+ * Frees the call tree and stack of `profiler`. It must have been detached from its VM first.
+ * @param profiler
+ */
+void Profiler_free(VM_profiler* profiler)
+{
+    free(profiler->nodes);
+    free(profiler->children);
+    free(profiler->stack);
+    profiler->nodes = NULL;
+    profiler->children = NULL;
+    profiler->stack = NULL;
+    profiler->numNodes = 0;
+    profiler->depth = 0;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * The `branched` hook: charges the instructions and samples since the last branch, which all belong to the function
+ * on top of the stack, then follows the branch if it was a call or a return.
+ * @param vm
+ * @param from
+ * @param to
+ * @param kind
+ */
+void profilerBranched(VM_instance* vm, uint32_t from, uint32_t to, VM_branchKind kind)
+{
+    VM_profiler* profiler = (VM_profiler*) vm->branchInstrumentation;
+    chargeInstructions(profiler, vm->instructionCount);
+
+    switch (kind) {
+        case VM_BRANCH_CALL:
+            // BL is two instructions, and `from` is the second
+            pushFrame(profiler, to, from + 2);
+            break;
+        case VM_BRANCH_RETURN:
+        case VM_BRANCH_INDIRECT:
+            popToFrame(profiler, to);
+            break;
+        case VM_BRANCH_INTERRUPT:
+            pushFrame(profiler, to, PROFILER_INTERRUPT_FRAME);
+            break;
+        case VM_BRANCH_INTERRUPT_RETURN:
+            popToFrame(profiler, PROFILER_INTERRUPT_FRAME);
+            break;
+        default:
+            break;
+    }
+}
+
+
+/**
+ * Charges the instructions since the last branch, up to `instructionCount`, and every sample point among them, to the
+ * function on top of the stack.
+ * @param profiler
+ * @param instructionCount
+ */
+void chargeInstructions(VM_profiler* profiler, uint64_t instructionCount)
+{
+    if (profiler->depth == 0) {
+        return;
+    }
+
+    VM_profileNode* node = &(profiler->nodes[profiler->stack[profiler->depth - 1].node]);
+    node->instructions += instructionCount - profiler->lastBranch;
+    profiler->lastBranch = instructionCount;
+    if (instructionCount >= profiler->nextSample) {
+        uint64_t samples = ((instructionCount - profiler->nextSample) / profiler->samplePeriod) + 1;
+        node->samples += samples;
+        profiler->nextSample += samples * profiler->samplePeriod;
+    }
+}
+
+
+/**
+ * Returns the instructions executed in each node and everything it called, or NULL if there isn't the memory. A node
+ * is always added after its parent, so adding each node's total into its parent's, from the last node back, gives
+ * every node its total before it is added in turn.
+ * @param profiler
+ * @return
+ */
+uint64_t* inclusiveInstructions(const VM_profiler* profiler)
+{
+    uint64_t* inclusive = malloc(((size_t) profiler->numNodes + 1) * sizeof(uint64_t));
+    if (!inclusive) {
+        return NULL;
+    }
+
+    for (uint32_t node = 0; node < profiler->numNodes; node++) {
+        inclusive[node] = profiler->nodes[node].instructions;
+    }
+    for (uint32_t node = profiler->numNodes; node > 0; node--) {
+        uint32_t parent = profiler->nodes[node - 1].parent;
+        if (parent != PROFILER_NO_NODE) {
+            inclusive[parent] += inclusive[node - 1];
+        }
+    }
+    return inclusive;
+}
+
+
+/**
+ * Orders function costs by function, for qsort.
+ * @param a
+ * @param b
+ * @return
+ */
+int compareFunctionCosts(const void* a, const void* b)
+{
+    uint32_t first = ((const functionCost*) a)->function;
+    uint32_t second = ((const functionCost*) b)->function;
+    return (first > second) - (first < second);
+}
+
+
+/**
+ * Orders call costs by caller, then callee, for qsort.
+ * @param a
+ * @param b
+ * @return
+ */
+int compareCallCosts(const void* a, const void* b)
+{
+    const callCost* first = (const callCost*) a;
+    const callCost* second = (const callCost*) b;
+    if (first->caller != second->caller) {
+        return (first->caller > second->caller) - (first->caller < second->caller);
+    }
+    return (first->callee > second->callee) - (first->callee < second->callee);
+}
+
+
+/**
+ * Returns the node for a call to `function` from the node `parent`, adding it to the tree if it's the first. Returns
+ * PROFILER_NO_NODE if there isn't the memory to add it.
+ * @param profiler
+ * @param parent
+ * @param function
+ * @return
+ */
+uint32_t findChild(VM_profiler* profiler, uint32_t parent, uint32_t function)
+{
+    uint32_t mask = profiler->childCapacity - 1;
+    for (uint32_t slot = childSlot(parent, function, profiler->childCapacity); ; slot = (slot + 1) & mask) {
+        uint32_t entry = profiler->children[slot];
+        if (entry == 0) {
+            return addNode(profiler, parent, function);
+        }
+        VM_profileNode* node = &(profiler->nodes[entry - 1]);
+        if ((node->parent == parent) && (node->function == function)) {
+            return entry - 1;
+        }
+    }
+}
+
+
+/**
+ * Adds a node for a call to `function` from `parent`, which mustn't be in the tree already, growing the tree if need
+ * be. Returns PROFILER_NO_NODE if it can't.
+ * @param profiler
+ * @param parent
+ * @param function
+ * @return
+ */
+uint32_t addNode(VM_profiler* profiler, uint32_t parent, uint32_t function)
+{
+    if (profiler->numNodes == profiler->nodeCapacity) {
+        VM_profileNode* nodes = realloc(profiler->nodes, (size_t) profiler->nodeCapacity * 2 * sizeof(VM_profileNode));
+        if (!nodes) {
+            return PROFILER_NO_NODE;
+        }
+        profiler->nodes = nodes;
+        profiler->nodeCapacity *= 2;
+    }
+    // Keep the hash table at most half full
+    if ((profiler->numNodes + 1) * 2 > profiler->childCapacity) {
+        if (!growChildren(profiler)) {
+            return PROFILER_NO_NODE;
+        }
+    }
+
+    uint32_t index = profiler->numNodes++;
+    VM_profileNode* node = &(profiler->nodes[index]);
+    node->function = function;
+    node->parent = parent;
+    node->depth = (parent == PROFILER_NO_NODE) ? 0 : profiler->nodes[parent].depth + 1;
+    node->samples = 0;
+    node->instructions = 0;
+    node->calls = 0;
+
+    uint32_t mask = profiler->childCapacity - 1;
+    uint32_t slot = childSlot(parent, function, profiler->childCapacity);
+    while (profiler->children[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    profiler->children[slot] = index + 1;
+    return index;
+}
+
+
+/**
+ * Doubles the size of the hash table of children, and puts every node back into it.
+ * @param profiler
+ * @return
+ */
+bool growChildren(VM_profiler* profiler)
+{
+    uint32_t capacity = profiler->childCapacity * 2;
+    uint32_t* children = calloc(capacity, sizeof(uint32_t));
+    if (!children) {
+        return false;
+    }
+
+    for (uint32_t index = 0; index < profiler->numNodes; index++) {
+        VM_profileNode* node = &(profiler->nodes[index]);
+        uint32_t slot = childSlot(node->parent, node->function, capacity);
+        while (children[slot] != 0) {
+            slot = (slot + 1) & (capacity - 1);
+        }
+        children[slot] = index + 1;
+    }
+
+    free(profiler->children);
+    profiler->children = children;
+    profiler->childCapacity = capacity;
+    return true;
+}
+
+
+/**
+ * Returns where to start looking in a hash table of `capacity` slots for the child of `parent` at `function`.
+ * @param parent
+ * @param function
+ * @param capacity
+ * @return
+ */
+uint32_t childSlot(uint32_t parent, uint32_t function, uint32_t capacity)
+{
+    uint32_t hash = (parent * 0x9E3779B1UL) ^ (function * 0x85EBCA77UL);
+    return (hash ^ (hash >> 15)) & (capacity - 1);
+}
+
+
+/**
+ * Pushes a frame for a call to `function` from the function on top of the stack, which will return to
+ * `returnAddress`. Once the memory has run out, nothing more is pushed.
+ * @param profiler
+ * @param function
+ * @param returnAddress
+ */
+void pushFrame(VM_profiler* profiler, uint32_t function, uint32_t returnAddress)
+{
+    if (profiler->outOfMemory) {
+        return;
+    }
+
+    if (profiler->depth == profiler->stackCapacity) {
+        VM_profileFrame* stack = realloc(profiler->stack,
+                                         (size_t) profiler->stackCapacity * 2 * sizeof(VM_profileFrame));
+        if (!stack) {
+            profiler->outOfMemory = true;
+            return;
+        }
+        profiler->stack = stack;
+        profiler->stackCapacity *= 2;
+    }
+
+    uint32_t parent = (profiler->depth > 0) ? profiler->stack[profiler->depth - 1].node : PROFILER_NO_NODE;
+    uint32_t node = findChild(profiler, parent, function);
+    if (node == PROFILER_NO_NODE) {
+        profiler->outOfMemory = true;
+        return;
+    }
+
+    profiler->nodes[node].calls++;
+    profiler->stack[profiler->depth].node = node;
+    profiler->stack[profiler->depth].returnAddress = returnAddress;
+    profiler->depth++;
+}
+
+
+/**
+ * Pops the frames down to and including the innermost one which returns to `returnAddress`. If there isn't one, the
+ * branch wasn't a return after all, and the stack is left as it is. The outermost frame is never popped.
+ * @param profiler
+ * @param returnAddress
+ */
+void popToFrame(VM_profiler* profiler, uint32_t returnAddress)
+{
+    for (uint32_t frame = profiler->depth; frame > 1; frame--) {
+        if (profiler->stack[frame - 1].returnAddress == returnAddress) {
+            profiler->depth = frame - 1;
+            return;
+        }
+    }
+}
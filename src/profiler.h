@@ -0,0 +1,88 @@
+/*
+ * A profiler for programs running on the VM, which records which function the VM is in every `samplePeriod`
+ * instructions, along with the chain of calls which led there, and writes them out as the "folded" stacks taken by
+ * flame graph tools (one line per call stack, "main;parse;readByte 1234"). It also counts exactly how many
+ * instructions each function executes, itself and in what it calls, and how often each function calls each other,
+ * which can be written in the callgrind format for KCachegrind and the like.
+ *
+ * The call stacks are followed through the VM's `branched` hook, so nothing is done for instructions other than
+ * branches: a shadow stack is pushed by BL and by taking an interrupt, and popped by whichever return goes back to the
+ * address a frame will return to (BX LR, POP {PC}, or a BX or MOV through another register). A return which doesn't
+ * match any frame, such as a longjmp, leaves the stack as it is. Tail calls made with B aren't seen, so their time is
+ * charged to the function which made them.
+ *
+ * Between two branches the VM stays in one function, so rather than being interrupted every `samplePeriod`
+ * instructions, the profiler charges every sample point which has been passed to the function on top of the stack
+ * when the next branch comes; the counts are exactly those an interrupting profiler would have taken. The exact
+ * counts are kept the same way, by charging every instruction since the last branch to that function. Instructions
+ * the host skips over while the VM is idle (see VM_setDeadline) are charged to the function which was waiting.
+ *
+ * Functions are named from the symbol table of the ELF (see ElfLoader_loadSymbols), or by address if they have none.
+ * A profiler follows one VM at a time.
+*/
+
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include "ARMTinyVM.h"
+#include "elfloader.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define PROFILER_DEFAULT_SAMPLE_PERIOD 1000
+#define PROFILER_NO_NODE 0xFFFFFFFF
+
+// The return address given to a frame pushed by an interrupt, which only an interrupt return pops
+#define PROFILER_INTERRUPT_FRAME VM_EXCEPTION_RETURN
+
+
+/**
+ * A function, as reached by one particular chain of calls: each node of the call tree is a call from its parent.
+ */
+typedef struct VM_profileNode {
+    uint32_t function; // The address of the function, without the Thumb bit
+    uint32_t parent;   // The node which called it, or PROFILER_NO_NODE for the root
+    uint32_t depth;    // The number of calls between the root and this node
+    uint64_t samples;
+    uint64_t instructions; // Executed in the function itself, not counting what it called
+    uint64_t calls;
+} VM_profileNode;
+
+
+typedef struct VM_profileFrame {
+    uint32_t node;
+    uint32_t returnAddress;
+} VM_profileFrame;
+
+
+typedef struct VM_profiler {
+    const VM_symbolTable* symbols;
+    uint64_t samplePeriod;
+    uint64_t nextSample; // The instruction count at which the next sample is due
+    uint64_t lastBranch; // The instruction count at the last branch, up to which instructions have been charged
+    VM_profileNode* nodes;
+    uint32_t numNodes;
+    uint32_t nodeCapacity;
+    uint32_t* children; // An open-addressed hash table finding a node from its parent and function, holding index + 1
+    uint32_t childCapacity; // A power of two
+    VM_profileFrame* stack;
+    uint32_t depth;
+    uint32_t stackCapacity;
+    bool outOfMemory; // Set if the tree or the stack couldn't grow, after which calls are no longer followed
+} VM_profiler;
+
+
+bool Profiler_init(VM_profiler* profiler, const VM_symbolTable* symbols, uint64_t samplePeriod);
+void Profiler_attach(VM_profiler* profiler, VM_instance* vm);
+void Profiler_detach(VM_profiler* profiler, VM_instance* vm);
+uint64_t Profiler_totalSamples(const VM_profiler* profiler);
+const char* Profiler_functionName(const VM_profiler* profiler, uint32_t function, char* buffer, size_t bufferSize);
+bool Profiler_writeFolded(const VM_profiler* profiler, FILE* file);
+bool Profiler_saveFolded(const VM_profiler* profiler, const char* filename);
+bool Profiler_writeCallgrind(const VM_profiler* profiler, FILE* file, const char* command);
+bool Profiler_saveCallgrind(const VM_profiler* profiler, const char* filename, const char* command);
+void Profiler_free(VM_profiler* profiler);
+
+
+#endif // PROFILER_H
@@ -0,0 +1,530 @@
+#include "replay.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+void recordEvent(VM_recorder* recorder, uint8_t type, uint64_t instructionCount);
+void recordVarint(VM_recorder* recorder, uint64_t value);
+bool replayByte(VM_replayer* replayer, uint8_t* value);
+bool replayVarint(VM_replayer* replayer, uint64_t* value);
+void replayNextEvent(VM_replayer* replayer, VM_instance* vm);
+bool replayMemory(VM_replayer* replayer);
+bool replaySoftwareInterrupt(VM_replayer* replayer, VM_instance* vm, uint8_t number, VM_swiResult* result);
+void replayDiverged(VM_replayer* replayer, VM_instance* vm);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Starts recording `vm`, which must have been created by Host_newVM(host), to a new log at `filename`. If the VM has
+ * an interrupt controller, the interrupts it takes are recorded too. Returns false if the file couldn't be created.
+ * @param recorder
+ * @param host
+ * @param vm
+ * @param filename
+ * @return
+ */
+bool Recorder_start(VM_recorder* recorder, VM_host* host, VM_instance* vm, const char* filename)
+{
+    recorder->file = fopen(filename, "wb");
+    if (!recorder->file) {
+        return false;
+    }
+
+    replayHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, REPLAY_MAGIC, sizeof(header.magic));
+    header.version = REPLAY_VERSION;
+    header.instructionCount = vm->instructionCount;
+    if (vm->interrupts) {
+        header.flags |= REPLAY_FLAG_INTERRUPTS;
+        header.vectorTable = vm->interrupts->vectorTable;
+        vm->interrupts->interruptTaken = &Recorder_interruptTaken;
+    }
+
+    if (fwrite(&header, sizeof(header), 1, recorder->file) != 1) {
+        fclose(recorder->file);
+        return false;
+    }
+
+    recorder->host = host;
+    recorder->lastEventCount = vm->instructionCount;
+    host->recorder = recorder;
+    return true;
+}
+
+
+/**
+ * Called by the host just before it handles a software interrupt, to remember the state it may change.
+ * @param recorder
+ * @param vm
+ * @param exitCode
+ */
+void Recorder_beginSoftwareInterrupt(VM_recorder* recorder, VM_instance* vm, int32_t exitCode)
+{
+    memcpy(recorder->registersBefore, vm->registers, sizeof(recorder->registersBefore));
+    recorder->countBefore = vm->instructionCount;
+    recorder->exitCodeBefore = exitCode;
+}
+
+
+/**
+ * Called by the host once it has handled software interrupt `number`, to log what it changed.
+ * @param recorder
+ * @param vm
+ * @param number
+ * @param exitCode
+ * @param result
+ */
+void Recorder_endSoftwareInterrupt(VM_recorder* recorder, VM_instance* vm, uint8_t number, int32_t exitCode,
+                                   VM_swiResult result)
+{
+    uint32_t changedRegisters = 0;
+    for (uint8_t i = 0; i < 16; i++) {
+        if (vm->registers[i] != recorder->registersBefore[i]) {
+            changedRegisters |= 1UL << i;
+        }
+    }
+
+    uint8_t flags = 0;
+    flags |= vm->finished ? REPLAY_SWI_FINISHED : 0;
+    flags |= (exitCode != recorder->exitCodeBefore) ? REPLAY_SWI_EXIT_CODE : 0;
+    flags |= (vm->instructionCount != recorder->countBefore) ? REPLAY_SWI_COUNT : 0;
+    flags |= (result == SWI_PENDING) ? REPLAY_SWI_WAITING : 0;
+
+    recordEvent(recorder, REPLAY_EVENT_SWI, recorder->countBefore);
+    fputc(number, recorder->file);
+    fputc(flags, recorder->file);
+    recordVarint(recorder, changedRegisters);
+    for (uint8_t i = 0; i < 16; i++) {
+        if (changedRegisters & (1UL << i)) {
+            recordVarint(recorder, vm->registers[i]);
+        }
+    }
+    if (flags & REPLAY_SWI_EXIT_CODE) {
+        recordVarint(recorder, (uint32_t) exitCode);
+    }
+    if (flags & REPLAY_SWI_COUNT) {
+        recordVarint(recorder, vm->instructionCount - recorder->countBefore);
+    }
+}
+
+
+/**
+ * Called by the host when it has written `length` bytes of guest memory at `addr`.
+ * @param recorder
+ * @param vm
+ * @param addr
+ * @param bytes
+ * @param length
+ */
+void Recorder_memoryWritten(VM_recorder* recorder, VM_instance* vm, uint32_t addr, const uint8_t* bytes,
+                            uint32_t length)
+{
+    if (length == 0) {
+        return;
+    }
+
+    recordEvent(recorder, REPLAY_EVENT_MEMORY, vm->instructionCount);
+    recordVarint(recorder, addr);
+    recordVarint(recorder, length);
+    fwrite(bytes, 1, length, recorder->file);
+}
+
+
+/**
+ * Called by the host when the guest has read `value` from an address which isn't ordinary memory.
+ * @param recorder
+ * @param vm
+ * @param addr
+ * @param value
+ */
+void Recorder_mmioRead(VM_recorder* recorder, VM_instance* vm, uint32_t addr, uint8_t value)
+{
+    recordEvent(recorder, REPLAY_EVENT_MMIO_READ, vm->instructionCount);
+    recordVarint(recorder, addr);
+    fputc(value, recorder->file);
+}
+
+
+/**
+ * Installed as the `interruptTaken` hook of the VM's interrupt controller by Recorder_start.
+ * @param vm
+ * @param number
+ */
+void Recorder_interruptTaken(VM_instance* vm, uint8_t number)
+{
+    VM_recorder* recorder = ((VM_host*) vm->context)->recorder;
+    if (recorder) {
+        recordEvent(recorder, REPLAY_EVENT_INTERRUPT, vm->instructionCount);
+        fputc(number, recorder->file);
+    }
+}
+
+
+/**
+ * Stops recording and closes the log. Returns false if any of it couldn't be written.
+ * @param recorder
+ * @return
+ */
+bool Recorder_stop(VM_recorder* recorder)
+{
+    recorder->host->recorder = NULL;
+    bool success = !ferror(recorder->file);
+    return (fclose(recorder->file) == 0) && success;
+}
+
+
+/**
+ * Starts replaying the log at `filename` into `vm`, which must be in the same state (memory included) as the VM it was
+ * recorded from was when recording started: typically it has just been created by Host_newVM(host), or restored from a
+ * snapshot. The VM's callbacks and interrupt controller are replaced by `replayer`'s, so it must stay where it is until
+ * the replay is finished. Returns false if the log couldn't be read or doesn't start where the VM is.
+ * @param replayer
+ * @param host
+ * @param vm
+ * @param filename
+ * @return
+ */
+bool Replay_start(VM_replayer* replayer, VM_host* host, VM_instance* vm, const char* filename)
+{
+    replayer->log = NULL;
+    FILE* file = fopen(filename, "rb");
+    if (!file) {
+        return false;
+    }
+
+    long length = -1;
+    if (fseek(file, 0, SEEK_END) == 0) {
+        length = ftell(file);
+    }
+    if ((length < (long) sizeof(replayHeader)) || (fseek(file, 0, SEEK_SET) != 0)) {
+        fclose(file);
+        return false;
+    }
+
+    replayer->log = malloc((size_t) length);
+    bool readAll = replayer->log && (fread(replayer->log, 1, (size_t) length, file) == (size_t) length);
+    fclose(file);
+    if (!readAll) {
+        Replay_free(replayer);
+        return false;
+    }
+
+    replayHeader header;
+    memcpy(&header, replayer->log, sizeof(header));
+    if ((memcmp(header.magic, REPLAY_MAGIC, sizeof(header.magic)) != 0) || (header.version != REPLAY_VERSION) ||
+        (header.instructionCount != vm->instructionCount)) {
+        Replay_free(replayer);
+        return false;
+    }
+
+    replayer->host = host;
+    replayer->length = (size_t) length;
+    replayer->position = sizeof(header);
+    replayer->nextCount = header.instructionCount;
+    replayer->diverged = false;
+
+    vm->readByte = &Replay_readByte;
+    vm->writeByte = &Replay_writeByte;
+    vm->softwareInterrupt = &Replay_softwareInterrupt;
+    vm->deadlineReached = &Replay_deadlineReached;
+    vm->context = replayer;
+    vm->interrupts = NULL;
+    if (header.flags & REPLAY_FLAG_INTERRUPTS) {
+        VM_initInterruptController(&(replayer->interrupts), header.vectorTable);
+        vm->interrupts = &(replayer->interrupts);
+    }
+
+    replayNextEvent(replayer, vm);
+    return true;
+}
+
+
+/**
+ * Reads a byte from the guest's memory, or from the log if it isn't ordinary memory.
+ * @param vm
+ * @param addr
+ * @return
+ */
+uint8_t Replay_readByte(VM_instance* vm, uint32_t addr)
+{
+    VM_replayer* replayer = (VM_replayer*) vm->context;
+    uint8_t* bytePtr = Host_getVirtualMemoryByte(replayer->host, addr, NULL);
+    if (bytePtr != NULL) {
+        return *bytePtr;
+    }
+
+    uint64_t recordedAddr;
+    uint8_t value;
+    if ((replayer->nextType != REPLAY_EVENT_MMIO_READ) || (replayer->nextCount != vm->instructionCount) ||
+        !replayVarint(replayer, &recordedAddr) || (recordedAddr != addr) || !replayByte(replayer, &value)) {
+        replayDiverged(replayer, vm);
+        return 0xFF;
+    }
+
+    replayNextEvent(replayer, vm);
+    return value;
+}
+
+
+/**
+ * Writes a byte to the guest's memory. Writes to anything else are dropped, since their effects are in the log.
+ * @param vm
+ * @param addr
+ * @param value
+ */
+void Replay_writeByte(VM_instance* vm, uint32_t addr, uint8_t value)
+{
+    VM_replayer* replayer = (VM_replayer*) vm->context;
+    bool byteWritable;
+    uint8_t* bytePtr = Host_getVirtualMemoryByte(replayer->host, addr, &byteWritable);
+    if ((bytePtr != NULL) && byteWritable) {
+        *bytePtr = value;
+    }
+}
+
+
+/**
+ * Repeats what the host did for this software interrupt: any writes to guest memory, then the changes to the VM.
+ * @param vm
+ * @param number
+ * @return
+ */
+VM_swiResult Replay_softwareInterrupt(VM_instance* vm, uint8_t number)
+{
+    VM_replayer* replayer = (VM_replayer*) vm->context;
+    while ((replayer->nextType == REPLAY_EVENT_MEMORY) && (replayer->nextCount == vm->instructionCount)) {
+        if (!replayMemory(replayer)) {
+            replayDiverged(replayer, vm);
+            return SWI_COMPLETE;
+        }
+        replayNextEvent(replayer, vm);
+    }
+
+    VM_swiResult result;
+    if ((replayer->nextType != REPLAY_EVENT_SWI) || (replayer->nextCount != vm->instructionCount) ||
+        !replaySoftwareInterrupt(replayer, vm, number, &result)) {
+        replayDiverged(replayer, vm);
+        return SWI_COMPLETE;
+    }
+
+    replayNextEvent(replayer, vm);
+    return result;
+}
+
+
+/**
+ * Called when the VM reaches the instruction count of the next event. Takes the interrupt if that event is one; any
+ * other event should have been used up by the time it is reached.
+ * @param vm
+ */
+void Replay_deadlineReached(VM_instance* vm)
+{
+    VM_replayer* replayer = (VM_replayer*) vm->context;
+    uint8_t number;
+    if ((replayer->nextType == REPLAY_EVENT_INTERRUPT) && (replayer->nextCount == vm->instructionCount) &&
+        replayByte(replayer, &number)) {
+        VM_takeInterrupt(vm, number);
+        replayNextEvent(replayer, vm);
+    } else if (replayer->nextCount <= vm->instructionCount) {
+        replayDiverged(replayer, vm);
+    } else {
+        VM_setDeadline(vm, replayer->nextCount);
+    }
+}
+
+
+/**
+ * Frees the copy of the log held by `replayer`.
+ * @param replayer
+ */
+void Replay_free(VM_replayer* replayer)
+{
+    free(replayer->log);
+    replayer->log = NULL;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Writes the start of an event which happened at `instructionCount`.
+ * @param recorder
+ * @param type
+ * @param instructionCount
+ */
+void recordEvent(VM_recorder* recorder, uint8_t type, uint64_t instructionCount)
+{
+    fputc(type, recorder->file);
+    recordVarint(recorder, instructionCount - recorder->lastEventCount);
+    recorder->lastEventCount = instructionCount;
+}
+
+
+/**
+ * Writes `value` as an unsigned LEB128 varint: 7 bits per byte, least significant first, with the top bit set on all
+ * but the last byte.
+ * @param recorder
+ * @param value
+ */
+void recordVarint(VM_recorder* recorder, uint64_t value)
+{
+    while (value >= 0x80) {
+        fputc((int) ((value & 0x7F) | 0x80), recorder->file);
+        value >>= 7;
+    }
+    fputc((int) value, recorder->file);
+}
+
+
+/**
+ * Reads the next byte of the log. Returns false at the end of the log.
+ * @param replayer
+ * @param value
+ * @return
+ */
+bool replayByte(VM_replayer* replayer, uint8_t* value)
+{
+    if (replayer->position >= replayer->length) {
+        return false;
+    }
+    *value = replayer->log[replayer->position++];
+    return true;
+}
+
+
+/**
+ * Reads a varint written by recordVarint. Returns false if the log ends part way through.
+ * @param replayer
+ * @param value
+ * @return
+ */
+bool replayVarint(VM_replayer* replayer, uint64_t* value)
+{
+    *value = 0;
+    for (uint8_t shift = 0; shift < 64; shift += 7) {
+        uint8_t byte;
+        if (!replayByte(replayer, &byte)) {
+            return false;
+        }
+        *value |= ((uint64_t) (byte & 0x7F)) << shift;
+        if (!(byte & 0x80)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+
+/**
+ * Reads the type and instruction count of the next event, and sets the VM's deadline to that count, so that
+ * interrupts are taken at the right time and events the VM never asks for are noticed.
+ * @param replayer
+ * @param vm
+ */
+void replayNextEvent(VM_replayer* replayer, VM_instance* vm)
+{
+    uint64_t delta;
+    if (!replayByte(replayer, &(replayer->nextType)) || !replayVarint(replayer, &delta)) {
+        replayer->nextType = REPLAY_EVENT_END;
+        replayer->nextCount = VM_NO_DEADLINE;
+    } else {
+        replayer->nextCount += delta;
+    }
+    VM_setDeadline(vm, replayer->nextCount);
+}
+
+
+/**
+ * Copies the bytes of a REPLAY_EVENT_MEMORY into the guest's memory. Returns false if the event is malformed or
+ * doesn't fit the guest's memory.
+ * @param replayer
+ * @return
+ */
+bool replayMemory(VM_replayer* replayer)
+{
+    uint64_t addr;
+    uint64_t length;
+    if (!replayVarint(replayer, &addr) || !replayVarint(replayer, &length) ||
+        (length > replayer->length - replayer->position)) {
+        return false;
+    }
+
+    for (uint64_t i = 0; i < length; i++) {
+        bool byteWritable;
+        uint8_t* bytePtr = Host_getVirtualMemoryByte(replayer->host, (uint32_t) (addr + i), &byteWritable);
+        if (!bytePtr || !byteWritable) {
+            return false;
+        }
+        *bytePtr = replayer->log[replayer->position++];
+    }
+    return true;
+}
+
+
+/**
+ * Applies the payload of a REPLAY_EVENT_SWI to the VM and host, and sets `result` to what the host returned. Returns
+ * false if the event is malformed or was for a different software interrupt.
+ * @param replayer
+ * @param vm
+ * @param number
+ * @param result
+ * @return
+ */
+bool replaySoftwareInterrupt(VM_replayer* replayer, VM_instance* vm, uint8_t number, VM_swiResult* result)
+{
+    uint8_t recordedNumber;
+    uint8_t flags;
+    uint64_t changedRegisters;
+    if (!replayByte(replayer, &recordedNumber) || (recordedNumber != number) || !replayByte(replayer, &flags) ||
+        !replayVarint(replayer, &changedRegisters)) {
+        return false;
+    }
+
+    for (uint8_t i = 0; i < 16; i++) {
+        uint64_t value;
+        if (changedRegisters & (1UL << i)) {
+            if (!replayVarint(replayer, &value)) {
+                return false;
+            }
+            vm->registers[i] = (uint32_t) value;
+        }
+    }
+
+    uint64_t value;
+    if (flags & REPLAY_SWI_EXIT_CODE) {
+        if (!replayVarint(replayer, &value)) {
+            return false;
+        }
+        replayer->host->exitCode = (int32_t) (uint32_t) value;
+    }
+    if (flags & REPLAY_SWI_COUNT) {
+        if (!replayVarint(replayer, &value)) {
+            return false;
+        }
+        vm->instructionCount += value;
+    }
+
+    if (flags & REPLAY_SWI_FINISHED) {
+        vm->finished = true;
+    }
+    *result = (flags & REPLAY_SWI_WAITING) ? SWI_PENDING : SWI_COMPLETE;
+    return true;
+}
+
+
+/**
+ * Marks the replay as no longer following the log, and stops the VM.
+ * @param replayer
+ * @param vm
+ */
+void replayDiverged(VM_replayer* replayer, VM_instance* vm)
+{
+    replayer->diverged = true;
+    vm->finished = true;
+}
@@ -0,0 +1,116 @@
+/*
+ * Deterministic record and replay of a guest's run.
+ *
+ * The VM itself is deterministic, so the only things which need recording are its interactions with the host: the
+ * effects of each software interrupt on the registers, exit code and instruction count; the guest memory written by
+ * the host (e.g. by a read system call); reads of memory-mapped devices (and of unmapped memory); and the points at
+ * which interrupts were taken. Every event is keyed by the instruction count at which it happened.
+ *
+ * The log is append-only: a replayHeader, followed by events. Each event is a type byte, then the number of
+ * instructions since the previous event as a varint (LEB128), then a payload which depends on the type:
+ *   REPLAY_EVENT_SWI:       number byte, flags byte, varint mask of changed registers, varint value of each changed
+ *                           register, then a varint exit code if REPLAY_SWI_EXIT_CODE and a varint instruction count
+ *                           increase if REPLAY_SWI_COUNT
+ *   REPLAY_EVENT_MEMORY:    varint address, varint length, the bytes
+ *   REPLAY_EVENT_MMIO_READ: varint address, the byte read
+ *   REPLAY_EVENT_INTERRUPT: interrupt number byte
+ *
+ * Replaying runs the guest against the same starting memory with the log standing in for the host, so nothing else is
+ * touched: no files are read or written, no timers run, and the guest runs at full speed. If the guest asks for
+ * something which doesn't match the log, the replay is marked as diverged and the VM is finished.
+ *
+ * Asynchronous I/O is not used while recording, so that every event is logged from the thread running the VM.
+*/
+
+#ifndef REPLAY_H
+#define REPLAY_H
+
+#include "ARMTinyVM.h"
+#include "host.h"
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define REPLAY_MAGIC "ATVMRPLY"
+#define REPLAY_VERSION 1
+
+// Bits of replayHeader.flags
+#define REPLAY_FLAG_INTERRUPTS 0x1
+
+// Event types
+#define REPLAY_EVENT_SWI 1
+#define REPLAY_EVENT_MEMORY 2
+#define REPLAY_EVENT_MMIO_READ 3
+#define REPLAY_EVENT_INTERRUPT 4
+#define REPLAY_EVENT_END 0xFF // Never written; marks the end of the log while replaying
+
+// Bits of the flags byte of a REPLAY_EVENT_SWI
+#define REPLAY_SWI_FINISHED 0x1
+#define REPLAY_SWI_EXIT_CODE 0x2
+#define REPLAY_SWI_COUNT 0x4
+#define REPLAY_SWI_WAITING 0x8
+
+
+/**
+ * The start of a log. `vectorTable` is only meaningful if REPLAY_FLAG_INTERRUPTS is set.
+ */
+typedef struct replayHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t flags;
+    uint32_t vectorTable;
+    uint32_t reserved;
+    uint64_t instructionCount;
+} replayHeader;
+
+
+/**
+ * Records the run of one VM created by Host_newVM. The state from before the software interrupt being handled is kept
+ * so that only what it changed is logged.
+ */
+typedef struct VM_recorder {
+    FILE* file;
+    VM_host* host;
+    uint64_t lastEventCount;
+    uint32_t registersBefore[16];
+    uint64_t countBefore;
+    int32_t exitCodeBefore;
+} VM_recorder;
+
+
+/**
+ * Replays a log into one VM. The whole log is read into memory first. `nextType` and `nextCount` describe the event
+ * at `position`, whose payload hasn't been read yet.
+ */
+typedef struct VM_replayer {
+    VM_host* host;
+    uint8_t* log;
+    size_t length;
+    size_t position;
+    uint8_t nextType;
+    uint64_t nextCount;
+    bool diverged;
+    VM_interruptController interrupts;
+} VM_replayer;
+
+
+bool Recorder_start(VM_recorder* recorder, VM_host* host, VM_instance* vm, const char* filename);
+void Recorder_beginSoftwareInterrupt(VM_recorder* recorder, VM_instance* vm, int32_t exitCode);
+void Recorder_endSoftwareInterrupt(VM_recorder* recorder, VM_instance* vm, uint8_t number, int32_t exitCode,
+                                   VM_swiResult result);
+void Recorder_memoryWritten(VM_recorder* recorder, VM_instance* vm, uint32_t addr, const uint8_t* bytes,
+                            uint32_t length);
+void Recorder_mmioRead(VM_recorder* recorder, VM_instance* vm, uint32_t addr, uint8_t value);
+void Recorder_interruptTaken(VM_instance* vm, uint8_t number);
+bool Recorder_stop(VM_recorder* recorder);
+
+bool Replay_start(VM_replayer* replayer, VM_host* host, VM_instance* vm, const char* filename);
+uint8_t Replay_readByte(VM_instance* vm, uint32_t addr);
+void Replay_writeByte(VM_instance* vm, uint32_t addr, uint8_t value);
+VM_swiResult Replay_softwareInterrupt(VM_instance* vm, uint8_t number);
+void Replay_deadlineReached(VM_instance* vm);
+void Replay_free(VM_replayer* replayer);
+
+
+#endif // REPLAY_H
@@ -0,0 +1,401 @@
+#include "reverse.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+bool takeCheckpoint(VM_timeline* timeline, VM_instance* vm);
+void restoreCheckpoint(VM_timeline* timeline, VM_instance* vm, checkpoint* saved);
+void dropOldestCheckpoint(VM_timeline* timeline);
+void releasePage(checkpointPage* page);
+int64_t lastCheckpointAtOrBefore(VM_timeline* timeline, uint64_t instructionCount);
+void runUntil(VM_instance* vm, uint64_t instructionCount);
+void adaptInterval(VM_timeline* timeline, uint64_t checkpointTime);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Sets up an empty timeline for a VM running in `host`. If the VM is being replayed, `replayer` must be the replayer
+ * in use, so that its position is checkpointed; otherwise it should be NULL. If `maxCheckpoints` is 0, a default is
+ * used. The host's memory must not be rearranged afterwards. Returns false if memory couldn't be allocated.
+ * @param timeline
+ * @param host
+ * @param replayer
+ * @param maxCheckpoints
+ * @return
+ */
+bool Reverse_init(VM_timeline* timeline, VM_host* host, VM_replayer* replayer, uint32_t maxCheckpoints)
+{
+    timeline->host = host;
+    timeline->replayer = replayer;
+    timeline->numCheckpoints = 0;
+    timeline->maxCheckpoints = (maxCheckpoints == 0) ? REVERSE_DEFAULT_MAX_CHECKPOINTS : maxCheckpoints;
+    timeline->interval = REVERSE_MIN_INTERVAL;
+    timeline->executionTime = 0;
+    timeline->executed = 0;
+
+    timeline->numPages = 0;
+    for (uint32_t i = 0; i < host->numAllocatedSegments; i++) {
+        if (host->segments[i].writable) {
+            timeline->numPages += (host->segments[i].length + REVERSE_PAGE_SIZE - 1) / REVERSE_PAGE_SIZE;
+        }
+    }
+
+    timeline->memoryPages = malloc((timeline->numPages + 1) * sizeof(uint8_t*));
+    timeline->pageLengths = malloc((timeline->numPages + 1) * sizeof(uint16_t));
+    timeline->checkpoints = malloc(timeline->maxCheckpoints * sizeof(checkpoint));
+    if (!timeline->memoryPages || !timeline->pageLengths || !timeline->checkpoints) {
+        Reverse_free(timeline);
+        return false;
+    }
+
+    uint32_t page = 0;
+    for (uint32_t i = 0; i < host->numAllocatedSegments; i++) {
+        runtimeSegment* segment = &(host->segments[i]);
+        for (uint32_t start = 0; segment->writable && (start < segment->length); start += REVERSE_PAGE_SIZE) {
+            uint32_t length = segment->length - start;
+            timeline->memoryPages[page] = &(segment->content[start]);
+            timeline->pageLengths[page] = (uint16_t) ((length > REVERSE_PAGE_SIZE) ? REVERSE_PAGE_SIZE : length);
+            page++;
+        }
+    }
+
+    return true;
+}
+
+
+/**
+ * Runs `vm` forwards for up to `maxInstructions` instructions, as VM_executeNInstructions does, taking checkpoints
+ * along the way. Returns the number of instructions executed.
+ * @param timeline
+ * @param vm
+ * @param maxInstructions
+ * @return
+ */
+uint32_t Reverse_run(VM_timeline* timeline, VM_instance* vm, uint32_t maxInstructions)
+{
+    uint64_t start = vm->instructionCount;
+    uint64_t end = start + maxInstructions;
+
+    while ((vm->instructionCount < end) && !vm->finished && !vm->waiting) {
+        uint64_t nextCheckpoint = 0;
+        if (timeline->numCheckpoints > 0) {
+            nextCheckpoint = timeline->checkpoints[timeline->numCheckpoints - 1].instructionCount + timeline->interval;
+        }
+
+        if (vm->instructionCount >= nextCheckpoint) {
+            uint64_t checkpointStart = SysTick_hostTime();
+            if (!takeCheckpoint(timeline, vm)) {
+                // Carry on without it; the VM can still be reversed as far as the checkpoints before
+                nextCheckpoint = vm->instructionCount + timeline->interval;
+            } else {
+                adaptInterval(timeline, SysTick_hostTime() - checkpointStart);
+                nextCheckpoint = vm->instructionCount + timeline->interval;
+            }
+        }
+
+        uint64_t stop = (nextCheckpoint < end) ? nextCheckpoint : end;
+        uint64_t executionStart = SysTick_hostTime();
+        timeline->executed += VM_executeNInstructions(vm, (uint32_t) (stop - vm->instructionCount));
+        timeline->executionTime += SysTick_hostTime() - executionStart;
+    }
+
+    return (vm->instructionCount - start < maxInstructions) ? (uint32_t) (vm->instructionCount - start)
+                                                             : maxInstructions;
+}
+
+
+/**
+ * Takes `vm` back by `numInstructions` instructions, by restoring the last checkpoint before that point and
+ * re-executing up to it. Returns false, leaving the VM alone, if there's no checkpoint that old.
+ * @param timeline
+ * @param vm
+ * @param numInstructions
+ * @return
+ */
+bool Reverse_step(VM_timeline* timeline, VM_instance* vm, uint64_t numInstructions)
+{
+    if (numInstructions > vm->instructionCount) {
+        return false;
+    }
+
+    uint64_t target = vm->instructionCount - numInstructions;
+    int64_t index = lastCheckpointAtOrBefore(timeline, target);
+    if (index < 0) {
+        return false;
+    }
+
+    restoreCheckpoint(timeline, vm, &(timeline->checkpoints[index]));
+    runUntil(vm, target);
+    return true;
+}
+
+
+/**
+ * Takes `vm` back to the last point before now at which `stopAt(vm, context)` returned true, checking before every
+ * instruction. The checkpoint intervals are searched from the latest backwards, re-executing each one. Returns false
+ * if no such point is found in the history that is held, in which case the VM is left where it was.
+ * @param timeline
+ * @param vm
+ * @param stopAt
+ * @param context
+ * @return
+ */
+bool Reverse_continue(VM_timeline* timeline, VM_instance* vm, bool (*stopAt)(VM_instance* vm, void* context),
+                      void* context)
+{
+    uint64_t now = vm->instructionCount;
+    uint64_t end = now;
+    int64_t index = (now > 0) ? lastCheckpointAtOrBefore(timeline, now - 1) : -1;
+
+    for (; index >= 0; index--) {
+        checkpoint* saved = &(timeline->checkpoints[index]);
+        restoreCheckpoint(timeline, vm, saved);
+
+        // Find the last stopping point in this interval
+        bool found = false;
+        uint64_t stopCount = 0;
+        while (vm->instructionCount < end) {
+            if (stopAt(vm, context)) {
+                found = true;
+                stopCount = vm->instructionCount;
+            }
+            if (vm->finished || vm->waiting) {
+                break;
+            }
+            VM_executeNInstructions(vm, 1);
+        }
+
+        if (found) {
+            restoreCheckpoint(timeline, vm, saved);
+            runUntil(vm, stopCount);
+            return true;
+        }
+        end = saved->instructionCount;
+    }
+
+    // Nothing found, so go back to where we started
+    index = lastCheckpointAtOrBefore(timeline, now);
+    if (index >= 0) {
+        restoreCheckpoint(timeline, vm, &(timeline->checkpoints[index]));
+        runUntil(vm, now);
+    }
+    return false;
+}
+
+
+/**
+ * Frees all of the checkpoints held by `timeline`.
+ * @param timeline
+ */
+void Reverse_free(VM_timeline* timeline)
+{
+    while (timeline->checkpoints && (timeline->numCheckpoints > 0)) {
+        dropOldestCheckpoint(timeline);
+    }
+
+    free(timeline->checkpoints);
+    free(timeline->memoryPages);
+    free(timeline->pageLengths);
+    timeline->checkpoints = NULL;
+    timeline->memoryPages = NULL;
+    timeline->pageLengths = NULL;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Adds a checkpoint of the current state to the end of the timeline, dropping the oldest if it is full. Pages which
+ * haven't changed since the previous checkpoint are shared with it. Returns false if memory couldn't be allocated.
+ * @param timeline
+ * @param vm
+ * @return
+ */
+bool takeCheckpoint(VM_timeline* timeline, VM_instance* vm)
+{
+    checkpoint* previous = (timeline->numCheckpoints > 0) ? &(timeline->checkpoints[timeline->numCheckpoints - 1])
+                                                          : NULL;
+    checkpointPage** pages = malloc((timeline->numPages + 1) * sizeof(checkpointPage*));
+    if (!pages) {
+        return false;
+    }
+
+    for (uint32_t i = 0; i < timeline->numPages; i++) {
+        uint16_t length = timeline->pageLengths[i];
+        if (previous && (memcmp(previous->pages[i]->data, timeline->memoryPages[i], length) == 0)) {
+            pages[i] = previous->pages[i];
+            pages[i]->references++;
+            continue;
+        }
+
+        pages[i] = malloc(sizeof(checkpointPage));
+        if (!pages[i]) {
+            while (i > 0) {
+                releasePage(pages[--i]);
+            }
+            free(pages);
+            return false;
+        }
+        pages[i]->references = 1;
+        memcpy(pages[i]->data, timeline->memoryPages[i], length);
+    }
+
+    if (timeline->numCheckpoints == timeline->maxCheckpoints) {
+        dropOldestCheckpoint(timeline);
+    }
+
+    checkpoint* saved = &(timeline->checkpoints[timeline->numCheckpoints++]);
+    saved->instructionCount = vm->instructionCount;
+    memcpy(saved->registers, vm->registers, sizeof(saved->registers));
+    saved->cpsr = vm->cpsr;
+    saved->finished = vm->finished;
+    saved->waiting = vm->waiting;
+    saved->deadline = vm->deadline;
+    saved->latchedInterrupts = vm->interrupts ? vm->interrupts->latched : 0;
+    saved->exitCode = timeline->host->exitCode;
+    saved->reachedWarmStart = timeline->host->reachedWarmStart;
+    if (timeline->host->sysTick) {
+        saved->sysTick = *(timeline->host->sysTick);
+    }
+    if (timeline->replayer) {
+        saved->replayPosition = timeline->replayer->position;
+        saved->replayNextType = timeline->replayer->nextType;
+        saved->replayNextCount = timeline->replayer->nextCount;
+        saved->replayDiverged = timeline->replayer->diverged;
+    }
+    saved->pages = pages;
+    return true;
+}
+
+
+/**
+ * Puts the VM, host and replayer back into the state held by `saved`.
+ * @param timeline
+ * @param vm
+ * @param saved
+ */
+void restoreCheckpoint(VM_timeline* timeline, VM_instance* vm, checkpoint* saved)
+{
+    for (uint32_t i = 0; i < timeline->numPages; i++) {
+        memcpy(timeline->memoryPages[i], saved->pages[i]->data, timeline->pageLengths[i]);
+    }
+
+    vm->instructionCount = saved->instructionCount;
+    memcpy(vm->registers, saved->registers, sizeof(vm->registers));
+    vm->cpsr = saved->cpsr;
+    vm->finished = saved->finished;
+    vm->waiting = saved->waiting;
+    VM_setDeadline(vm, saved->deadline);
+    if (vm->interrupts) {
+        vm->interrupts->latched = saved->latchedInterrupts;
+    }
+    timeline->host->exitCode = saved->exitCode;
+    timeline->host->reachedWarmStart = saved->reachedWarmStart;
+    if (timeline->host->sysTick) {
+        *(timeline->host->sysTick) = saved->sysTick;
+    }
+    if (timeline->replayer) {
+        timeline->replayer->position = saved->replayPosition;
+        timeline->replayer->nextType = saved->replayNextType;
+        timeline->replayer->nextCount = saved->replayNextCount;
+        timeline->replayer->diverged = saved->replayDiverged;
+    }
+}
+
+
+/**
+ * Removes the oldest checkpoint, freeing any pages which no other checkpoint shares.
+ * @param timeline
+ */
+void dropOldestCheckpoint(VM_timeline* timeline)
+{
+    checkpoint* oldest = &(timeline->checkpoints[0]);
+    for (uint32_t i = 0; i < timeline->numPages; i++) {
+        releasePage(oldest->pages[i]);
+    }
+    free(oldest->pages);
+
+    timeline->numCheckpoints--;
+    memmove(&(timeline->checkpoints[0]), &(timeline->checkpoints[1]), timeline->numCheckpoints * sizeof(checkpoint));
+}
+
+
+/**
+ * Gives up one reference to `page`, freeing it if that was the last.
+ * @param page
+ */
+void releasePage(checkpointPage* page)
+{
+    if (--(page->references) == 0) {
+        free(page);
+    }
+}
+
+
+/**
+ * Returns the index of the latest checkpoint taken at or before `instructionCount`, or -1 if there isn't one.
+ * @param timeline
+ * @param instructionCount
+ * @return
+ */
+int64_t lastCheckpointAtOrBefore(VM_timeline* timeline, uint64_t instructionCount)
+{
+    int64_t low = 0;
+    int64_t high = (int64_t) timeline->numCheckpoints - 1;
+    int64_t found = -1;
+    while (low <= high) {
+        int64_t middle = (low + high) / 2;
+        if (timeline->checkpoints[middle].instructionCount <= instructionCount) {
+            found = middle;
+            low = middle + 1;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return found;
+}
+
+
+/**
+ * Runs the VM forwards until its instruction count reaches `instructionCount`, or it stops.
+ * @param vm
+ * @param instructionCount
+ */
+void runUntil(VM_instance* vm, uint64_t instructionCount)
+{
+    while ((vm->instructionCount < instructionCount) && !vm->finished && !vm->waiting) {
+        uint64_t remaining = instructionCount - vm->instructionCount;
+        VM_executeNInstructions(vm, (remaining > UINT32_MAX) ? UINT32_MAX : (uint32_t) remaining);
+    }
+}
+
+
+/**
+ * Sets the next checkpoint interval so that a checkpoint which took `checkpointTime` nanoseconds costs about
+ * REVERSE_OVERHEAD_PERCENT of the time spent executing.
+ * @param timeline
+ * @param checkpointTime
+ */
+void adaptInterval(VM_timeline* timeline, uint64_t checkpointTime)
+{
+    if ((timeline->executionTime > 0) && (timeline->executed > 0)) {
+        double timePerInstruction = (double) timeline->executionTime / (double) timeline->executed;
+        double interval = (100.0 * (double) checkpointTime) / (REVERSE_OVERHEAD_PERCENT * timePerInstruction);
+
+        // Move half way there, to smooth out noise in the timing
+        interval = ((double) timeline->interval + interval) / 2;
+        if (interval < REVERSE_MIN_INTERVAL) {
+            interval = REVERSE_MIN_INTERVAL;
+        } else if (interval > REVERSE_MAX_INTERVAL) {
+            interval = REVERSE_MAX_INTERVAL;
+        }
+        timeline->interval = (uint64_t) interval;
+    }
+    timeline->executionTime = 0;
+    timeline->executed = 0;
+}
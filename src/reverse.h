@@ -0,0 +1,93 @@
+/*
+ * Reverse execution: stepping a guest backwards, or running it backwards to the last point where some condition held.
+ *
+ * While the guest runs forwards under Reverse_run, checkpoints of its state are kept in memory every `interval`
+ * instructions. Going backwards restores the last checkpoint before the target and re-executes from there, which
+ * depends on the guest being deterministic. A guest which talks to the host should therefore be reversed while it is
+ * being replayed (see replay.h), since the replayer's position in the log is checkpointed too and nothing is done
+ * twice; a live host would repeat its I/O.
+ *
+ * Checkpoints are copy-on-write: memory is split into REVERSE_PAGE_SIZE pages, and a page which hasn't changed since
+ * the previous checkpoint is shared with it rather than copied, so each checkpoint only costs the memory the guest
+ * wrote to. The interval adapts so that taking checkpoints costs about REVERSE_OVERHEAD_PERCENT of the time spent
+ * executing, but never exceeds REVERSE_MAX_INTERVAL, which bounds the re-execution needed to step back any distance.
+ * Once `maxCheckpoints` are held, the oldest is dropped.
+*/
+
+#ifndef REVERSE_H
+#define REVERSE_H
+
+#include "ARMTinyVM.h"
+#include "host.h"
+#include "replay.h"
+#include "systick.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define REVERSE_PAGE_SIZE 1024
+#define REVERSE_MIN_INTERVAL 10000
+#define REVERSE_MAX_INTERVAL 1000000
+#define REVERSE_OVERHEAD_PERCENT 2
+#define REVERSE_DEFAULT_MAX_CHECKPOINTS 256
+
+
+/**
+ * A copy of one page of guest memory, shared by every checkpoint in which the page had this content.
+ */
+typedef struct checkpointPage {
+    uint32_t references;
+    uint8_t data[REVERSE_PAGE_SIZE];
+} checkpointPage;
+
+
+/**
+ * The state of the VM, host and replayer at one instruction count, and the content of every writable page.
+ */
+typedef struct checkpoint {
+    uint64_t instructionCount;
+    uint32_t registers[16];
+    uint32_t cpsr;
+    bool finished;
+    bool waiting;
+    uint64_t deadline;
+    uint32_t latchedInterrupts;
+    int32_t exitCode;
+    bool reachedWarmStart;
+    VM_sysTick sysTick;
+    size_t replayPosition;
+    uint8_t replayNextType;
+    uint64_t replayNextCount;
+    bool replayDiverged;
+    checkpointPage** pages;
+} checkpoint;
+
+
+/**
+ * The checkpoints of one VM, oldest first. `memoryPages` and `pageLengths` describe where each page of the host's
+ * writable memory lives, in the same order as the pages of each checkpoint.
+ */
+typedef struct VM_timeline {
+    VM_host* host;
+    VM_replayer* replayer;
+    uint32_t numPages;
+    uint8_t** memoryPages;
+    uint16_t* pageLengths;
+    checkpoint* checkpoints;
+    uint32_t numCheckpoints;
+    uint32_t maxCheckpoints;
+    uint64_t interval;
+    uint64_t executionTime; // Host nanoseconds spent executing since the last checkpoint
+    uint64_t executed; // Instructions executed in that time
+} VM_timeline;
+
+
+bool Reverse_init(VM_timeline* timeline, VM_host* host, VM_replayer* replayer, uint32_t maxCheckpoints);
+uint32_t Reverse_run(VM_timeline* timeline, VM_instance* vm, uint32_t maxInstructions);
+bool Reverse_step(VM_timeline* timeline, VM_instance* vm, uint64_t numInstructions);
+bool Reverse_continue(VM_timeline* timeline, VM_instance* vm, bool (*stopAt)(VM_instance* vm, void* context),
+                      void* context);
+void Reverse_free(VM_timeline* timeline);
+
+
+#endif // REVERSE_H
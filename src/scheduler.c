@@ -0,0 +1,298 @@
+#include "scheduler.h"
+#include <stdlib.h>
+#include <string.h>
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+void* schedulerWorkerMain(void* arg);
+void enqueueTask(VM_scheduler* scheduler, VM_task* task);
+VM_task* dequeueNextTask(VM_scheduler* scheduler);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Sets up a scheduler which will run its VMs on `numThreads` host threads, each for `quantum` instructions at a time
+ * (SCHEDULER_DEFAULT_QUANTUM if 0). The threads aren't created until Scheduler_start. Priority 0 is the highest, and
+ * by default each priority gets twice the share of the one below it.
+ * @param scheduler
+ * @param numThreads
+ * @param quantum
+ * @return
+ */
+bool Scheduler_init(VM_scheduler* scheduler, uint32_t numThreads, uint32_t quantum)
+{
+    memset(scheduler, 0, sizeof(VM_scheduler));
+    scheduler->quantum = (quantum == 0) ? SCHEDULER_DEFAULT_QUANTUM : quantum;
+    scheduler->numThreads = (numThreads == 0) ? 1 : numThreads;
+
+    for (uint8_t p = 0; p < SCHEDULER_NUM_PRIORITIES; p++) {
+        scheduler->weights[p] = 1UL << (SCHEDULER_NUM_PRIORITIES - 1 - p);
+        scheduler->credits[p] = scheduler->weights[p];
+    }
+
+    scheduler->threads = calloc(scheduler->numThreads, sizeof(pthread_t));
+    if (!scheduler->threads) {
+        return false;
+    }
+
+    pthread_mutex_init(&(scheduler->lock), NULL);
+    pthread_cond_init(&(scheduler->workAvailable), NULL);
+    pthread_cond_init(&(scheduler->allFinished), NULL);
+    return true;
+}
+
+
+/**
+ * Sets how many quanta a priority may have in each round before lower priorities get their turn. A weight of 0 is
+ * treated as 1.
+ * @param scheduler
+ * @param priority
+ * @param weight
+ */
+void Scheduler_setWeight(VM_scheduler* scheduler, uint8_t priority, uint32_t weight)
+{
+    if (priority >= SCHEDULER_NUM_PRIORITIES) {
+        return;
+    }
+
+    pthread_mutex_lock(&(scheduler->lock));
+    scheduler->weights[priority] = (weight == 0) ? 1 : weight;
+    pthread_mutex_unlock(&(scheduler->lock));
+}
+
+
+/**
+ * Fills in `task` for `vm` and adds it to the back of the run queue for `priority`. `userData`, `onFinished` and
+ * `onResume` should be set beforehand. May be called before or after the scheduler has been started, from any thread.
+ * If the VM is already waiting, it is parked straight away.
+ * @param scheduler
+ * @param task
+ * @param vm
+ * @param priority
+ */
+void Scheduler_add(VM_scheduler* scheduler, VM_task* task, VM_instance* vm, uint8_t priority)
+{
+    task->vm = vm;
+    task->priority = (priority < SCHEDULER_NUM_PRIORITIES) ? priority : (SCHEDULER_NUM_PRIORITIES - 1);
+    task->wakePending = false;
+    task->resuming = false;
+    task->instructionsExecuted = 0;
+    task->quantaRun = 0;
+    task->scheduler = scheduler;
+    task->next = NULL;
+
+    if (vm->finished) {
+        // Nothing to run, but still report it as finished
+        task->state = TASK_FINISHED;
+        if (task->onFinished) {
+            task->onFinished(task);
+        }
+        return;
+    }
+
+    pthread_mutex_lock(&(scheduler->lock));
+    scheduler->numUnfinishedTasks++;
+    if (vm->waiting) {
+        task->state = TASK_WAITING;
+    } else {
+        enqueueTask(scheduler, task);
+        pthread_cond_signal(&(scheduler->workAvailable));
+    }
+    pthread_mutex_unlock(&(scheduler->lock));
+}
+
+
+/**
+ * Creates the worker threads. Returns false if they couldn't all be created.
+ * @param scheduler
+ * @return
+ */
+bool Scheduler_start(VM_scheduler* scheduler)
+{
+    for (uint32_t i = 0; i < scheduler->numThreads; i++) {
+        if (pthread_create(&(scheduler->threads[i]), NULL, schedulerWorkerMain, scheduler) != 0) {
+            scheduler->numThreads = i;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+/**
+ * Lets a parked task run again, once the host has finished whatever it was waiting for. If the task is still in the
+ * middle of its quantum, it will be put straight back in the run queue instead of being parked. Safe to call from any
+ * thread.
+ * @param task
+ */
+void Scheduler_wake(VM_task* task)
+{
+    VM_scheduler* scheduler = task->scheduler;
+
+    pthread_mutex_lock(&(scheduler->lock));
+    if (task->state == TASK_WAITING) {
+        task->vm->waiting = false;
+        task->resuming = true;
+        enqueueTask(scheduler, task);
+        pthread_cond_signal(&(scheduler->workAvailable));
+    } else if (task->state == TASK_RUNNING) {
+        task->wakePending = true;
+    }
+    pthread_mutex_unlock(&(scheduler->lock));
+}
+
+
+/**
+ * Blocks until every task added so far has finished.
+ * @param scheduler
+ */
+void Scheduler_waitUntilFinished(VM_scheduler* scheduler)
+{
+    pthread_mutex_lock(&(scheduler->lock));
+    while (scheduler->numUnfinishedTasks > 0) {
+        pthread_cond_wait(&(scheduler->allFinished), &(scheduler->lock));
+    }
+    pthread_mutex_unlock(&(scheduler->lock));
+}
+
+
+/**
+ * Stops the worker threads once they finish their current quanta, and frees the scheduler. Tasks which haven't
+ * finished are left as they are, and could be added to another scheduler.
+ * @param scheduler
+ */
+void Scheduler_free(VM_scheduler* scheduler)
+{
+    pthread_mutex_lock(&(scheduler->lock));
+    scheduler->stopping = true;
+    pthread_cond_broadcast(&(scheduler->workAvailable));
+    pthread_mutex_unlock(&(scheduler->lock));
+
+    for (uint32_t i = 0; i < scheduler->numThreads; i++) {
+        pthread_join(scheduler->threads[i], NULL);
+    }
+    free(scheduler->threads);
+    scheduler->threads = NULL;
+
+    pthread_cond_destroy(&(scheduler->allFinished));
+    pthread_cond_destroy(&(scheduler->workAvailable));
+    pthread_mutex_destroy(&(scheduler->lock));
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Repeatedly takes the next task from the run queues, runs it for a quantum, and then puts it back, parks it, or
+ * retires it depending on the state of its VM.
+ * @param arg
+ * @return
+ */
+void* schedulerWorkerMain(void* arg)
+{
+    VM_scheduler* scheduler = (VM_scheduler*) arg;
+
+    pthread_mutex_lock(&(scheduler->lock));
+    while (!scheduler->stopping) {
+        VM_task* task = dequeueNextTask(scheduler);
+        if (!task) {
+            pthread_cond_wait(&(scheduler->workAvailable), &(scheduler->lock));
+            continue;
+        }
+
+        // Run the VM without holding the lock
+        task->state = TASK_RUNNING;
+        bool resuming = task->resuming;
+        task->resuming = false;
+        pthread_mutex_unlock(&(scheduler->lock));
+        if (resuming && task->onResume) {
+            task->onResume(task);
+        }
+        uint32_t executed = VM_executeNInstructions(task->vm, scheduler->quantum);
+        pthread_mutex_lock(&(scheduler->lock));
+
+        task->instructionsExecuted += executed;
+        task->quantaRun++;
+
+        if (task->vm->finished) {
+            task->state = TASK_FINISHED;
+            if (task->onFinished) {
+                pthread_mutex_unlock(&(scheduler->lock));
+                task->onFinished(task);
+                pthread_mutex_lock(&(scheduler->lock));
+            }
+
+            if (--scheduler->numUnfinishedTasks == 0) {
+                pthread_cond_broadcast(&(scheduler->allFinished));
+            }
+        } else if (task->vm->waiting && !task->wakePending) {
+            // Park it until Scheduler_wake is called
+            task->state = TASK_WAITING;
+        } else {
+            // Either its quantum ran out, or it was woken before it could be parked
+            task->resuming = task->wakePending;
+            task->vm->waiting = false;
+            task->wakePending = false;
+            enqueueTask(scheduler, task);
+        }
+    }
+    pthread_mutex_unlock(&(scheduler->lock));
+
+    return NULL;
+}
+
+
+/**
+ * Adds a task to the back of the run queue for its priority. Must be called with the lock held.
+ * @param scheduler
+ * @param task
+ */
+void enqueueTask(VM_scheduler* scheduler, VM_task* task)
+{
+    task->state = TASK_READY;
+    task->next = NULL;
+
+    if (scheduler->queueTails[task->priority]) {
+        scheduler->queueTails[task->priority]->next = task;
+    } else {
+        scheduler->queueHeads[task->priority] = task;
+    }
+    scheduler->queueTails[task->priority] = task;
+}
+
+
+/**
+ * Takes the task at the front of the highest priority queue which still has credit left in this round. Once every
+ * non-empty queue has used up its credit, a new round starts. Returns NULL if all of the queues are empty. Must be
+ * called with the lock held.
+ * @param scheduler
+ * @return
+ */
+VM_task* dequeueNextTask(VM_scheduler* scheduler)
+{
+    for (uint8_t round = 0; round < 2; round++) {
+        for (uint8_t p = 0; p < SCHEDULER_NUM_PRIORITIES; p++) {
+            VM_task* task = scheduler->queueHeads[p];
+            if (task && (scheduler->credits[p] > 0)) {
+                scheduler->credits[p]--;
+                scheduler->queueHeads[p] = task->next;
+                if (!scheduler->queueHeads[p]) {
+                    scheduler->queueTails[p] = NULL;
+                }
+                task->next = NULL;
+                return task;
+            }
+        }
+
+        // Nothing was found with credit left, so start a new round
+        for (uint8_t p = 0; p < SCHEDULER_NUM_PRIORITIES; p++) {
+            scheduler->credits[p] = scheduler->weights[p];
+        }
+    }
+
+    return NULL;
+}
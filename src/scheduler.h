@@ -0,0 +1,77 @@
+/*
+ * A cooperative, time-sliced scheduler which runs any number of VMs on a fixed pool of host threads. Each VM runs for
+ * a quantum of instructions and then goes to the back of the run queue for its priority. A VM whose host sets
+ * `waiting` (for example in a software interrupt) is parked, and only runs again once Scheduler_wake is called.
+ *
+ * Priorities are served by weighted round robin: in each round, priority p gets up to `weights[p]` quanta before
+ * lower priorities are considered, and every non-empty priority gets at least one quantum per round, so no VM starves.
+*/
+
+#ifndef SCHEDULER_H
+#define SCHEDULER_H
+
+#include "ARMTinyVM.h"
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+
+#define SCHEDULER_NUM_PRIORITIES 4
+#define SCHEDULER_DEFAULT_QUANTUM 10000
+
+
+typedef enum VM_taskState {
+    TASK_READY,
+    TASK_RUNNING,
+    TASK_WAITING,
+    TASK_FINISHED
+} VM_taskState;
+
+
+/**
+ * A VM being run by the scheduler. The storage belongs to the caller, and must stay valid until the task finishes.
+ * `onFinished`, if not NULL, is called from a worker thread once the VM has finished. `onResume`, if not NULL, is
+ * called from the worker thread about to run the VM after Scheduler_wake, so that the host can finish the software
+ * interrupt it was waiting on (see Host_resumed) on the thread which runs the VM rather than the one which woke it.
+ */
+typedef struct VM_task {
+    VM_instance* vm;
+    uint8_t priority;
+    VM_taskState state;
+    bool wakePending;
+    bool resuming; // Set once woken, until onResume has been called
+    uint64_t instructionsExecuted;
+    uint64_t quantaRun;
+    void* userData;
+    void (*onFinished)(struct VM_task* task);
+    void (*onResume)(struct VM_task* task);
+    struct VM_scheduler* scheduler;
+    struct VM_task* next;
+} VM_task;
+
+
+typedef struct VM_scheduler {
+    pthread_mutex_t lock;
+    pthread_cond_t workAvailable;
+    pthread_cond_t allFinished;
+    VM_task* queueHeads[SCHEDULER_NUM_PRIORITIES];
+    VM_task* queueTails[SCHEDULER_NUM_PRIORITIES];
+    uint32_t weights[SCHEDULER_NUM_PRIORITIES];
+    uint32_t credits[SCHEDULER_NUM_PRIORITIES];
+    uint32_t quantum;
+    uint32_t numUnfinishedTasks;
+    bool stopping;
+    pthread_t* threads;
+    uint32_t numThreads;
+} VM_scheduler;
+
+
+bool Scheduler_init(VM_scheduler* scheduler, uint32_t numThreads, uint32_t quantum);
+void Scheduler_setWeight(VM_scheduler* scheduler, uint8_t priority, uint32_t weight);
+void Scheduler_add(VM_scheduler* scheduler, VM_task* task, VM_instance* vm, uint8_t priority);
+bool Scheduler_start(VM_scheduler* scheduler);
+void Scheduler_wake(VM_task* task);
+void Scheduler_waitUntilFinished(VM_scheduler* scheduler);
+void Scheduler_free(VM_scheduler* scheduler);
+
+
+#endif // SCHEDULER_H
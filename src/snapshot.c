@@ -0,0 +1,358 @@
+#define _DEFAULT_SOURCE
+#include "snapshot.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif // _WIN32
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+bool pageIsZero(const uint8_t* page, uint32_t length);
+uint32_t pagesInSegment(uint32_t length);
+bool restoreSegment(int fd, uint64_t fileSize, snapshotSegment* description, runtimeSegment* segment);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Saves the state of `vm`, which must be running in `host`, to `filename`. Returns false if the file couldn't be
+ * written.
+ * @param host
+ * @param vm
+ * @param filename
+ * @return
+ */
+bool Snapshot_save(VM_host* host, VM_instance* vm, const char* filename)
+{
+    static const uint8_t zeroPage[SNAPSHOT_PAGE_SIZE] = {0};
+
+    snapshotHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    header.version = SNAPSHOT_VERSION;
+    header.pageSize = SNAPSHOT_PAGE_SIZE;
+    memcpy(header.registers, vm->registers, sizeof(header.registers));
+    header.cpsr = vm->cpsr;
+    header.flags = (vm->finished ? SNAPSHOT_FLAG_FINISHED : 0) | (vm->waiting ? SNAPSHOT_FLAG_WAITING : 0);
+    header.instructionCount = vm->instructionCount;
+    header.exitCode = host->exitCode;
+    header.entryAddress = host->entryAddress;
+    header.numSegments = host->numAllocatedSegments;
+
+    // Lay the file out: the header, the segment descriptions, every page table, and then the pages themselves,
+    // starting at the first page boundary
+    snapshotSegment* segments = malloc(((size_t) header.numSegments + 1) * sizeof(snapshotSegment));
+    uint64_t** pageTables = calloc((size_t) header.numSegments + 1, sizeof(uint64_t*));
+    if (!segments || !pageTables) {
+        free(segments);
+        free(pageTables);
+        return false;
+    }
+
+    uint64_t offset = sizeof(snapshotHeader) + (header.numSegments * sizeof(snapshotSegment));
+    for (uint32_t i = 0; i < header.numSegments; i++) {
+        segments[i].virtualStartAddress = host->segments[i].virtualStartAddress;
+        segments[i].length = host->segments[i].length;
+        segments[i].writable = host->segments[i].writable;
+        segments[i].numPages = pagesInSegment(segments[i].length);
+        segments[i].pageTableOffset = offset;
+        offset += segments[i].numPages * sizeof(uint64_t);
+    }
+    uint64_t dataStart = ((offset + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE) * SNAPSHOT_PAGE_SIZE;
+
+    offset = dataStart;
+    bool success = true;
+    for (uint32_t i = 0; i < header.numSegments; i++) {
+        pageTables[i] = malloc((segments[i].numPages + 1) * sizeof(uint64_t));
+        if (!pageTables[i]) {
+            success = false;
+            segments[i].numPages = 0;
+            continue;
+        }
+
+        for (uint32_t page = 0; page < segments[i].numPages; page++) {
+            uint32_t start = page * SNAPSHOT_PAGE_SIZE;
+            uint32_t length = segments[i].length - start;
+            length = (length > SNAPSHOT_PAGE_SIZE) ? SNAPSHOT_PAGE_SIZE : length;
+            if (pageIsZero(&(host->segments[i].content[start]), length)) {
+                pageTables[i][page] = 0;
+            } else {
+                pageTables[i][page] = offset;
+                offset += SNAPSHOT_PAGE_SIZE;
+            }
+        }
+    }
+
+    FILE* file = success ? fopen(filename, "wb") : NULL;
+    if (file) {
+        success = (fwrite(&header, sizeof(header), 1, file) == 1) &&
+                  (fwrite(segments, sizeof(snapshotSegment), header.numSegments, file) == header.numSegments);
+        offset = sizeof(snapshotHeader) + (header.numSegments * sizeof(snapshotSegment));
+        for (uint32_t i = 0; success && (i < header.numSegments); i++) {
+            success = fwrite(pageTables[i], sizeof(uint64_t), segments[i].numPages, file) == segments[i].numPages;
+            offset += segments[i].numPages * sizeof(uint64_t);
+        }
+        success = success && (fwrite(zeroPage, 1, dataStart - offset, file) == dataStart - offset);
+
+        // The pages go in the same order as their offsets were handed out
+        for (uint32_t i = 0; success && (i < header.numSegments); i++) {
+            for (uint32_t page = 0; success && (page < segments[i].numPages); page++) {
+                if (pageTables[i][page] != 0) {
+                    uint32_t start = page * SNAPSHOT_PAGE_SIZE;
+                    uint32_t length = segments[i].length - start;
+                    length = (length > SNAPSHOT_PAGE_SIZE) ? SNAPSHOT_PAGE_SIZE : length;
+                    success = (fwrite(&(host->segments[i].content[start]), 1, length, file) == length) &&
+                              (fwrite(zeroPage, 1, SNAPSHOT_PAGE_SIZE - length, file) == SNAPSHOT_PAGE_SIZE - length);
+                }
+            }
+        }
+
+        success = (fclose(file) == 0) && success;
+    } else {
+        success = false;
+    }
+
+    for (uint32_t i = 0; i < header.numSegments; i++) {
+        free(pageTables[i]);
+    }
+    free(pageTables);
+    free(segments);
+    return success;
+}
+
+
+/**
+ * Sets up `host` and `vm` from the snapshot in `filename`, which is mapped copy-on-write rather than read. The VM gets
+ * the host's default callbacks, as from Host_newVM. Returns false if the file can't be read or isn't a valid
+ * snapshot, in which case `host` is left empty (and should still be freed).
+ * @param host
+ * @param vm
+ * @param filename
+ * @param verbose
+ * @return
+ */
+bool Snapshot_restore(VM_host* host, VM_instance* vm, const char* filename, bool verbose)
+{
+    Host_initEmpty(host, verbose);
+
+#ifdef _WIN32
+    (void) vm;
+    (void) filename;
+    return false;
+#else
+    host->memoryMapped = true;
+
+    int fd = open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return false;
+    }
+
+    struct stat fileInfo;
+    snapshotHeader header;
+    snapshotSegment* segments = NULL;
+    bool success = (fstat(fd, &fileInfo) == 0) &&
+                   (pread(fd, &header, sizeof(header), 0) == sizeof(header)) &&
+                   (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) == 0) &&
+                   (header.version == SNAPSHOT_VERSION) &&
+                   (header.pageSize == SNAPSHOT_PAGE_SIZE) &&
+                   ((uint64_t) header.numSegments * sizeof(snapshotSegment) <= (uint64_t) fileInfo.st_size);
+    if (success) {
+        size_t tableSize = header.numSegments * sizeof(snapshotSegment);
+        segments = malloc(tableSize + sizeof(snapshotSegment));
+        host->segments = calloc((size_t) header.numSegments + 1, sizeof(runtimeSegment));
+        success = segments && host->segments &&
+                  (pread(fd, segments, tableSize, sizeof(header)) == (ssize_t) tableSize);
+    }
+
+    for (uint32_t i = 0; success && (i < header.numSegments); i++) {
+        // Even if it failed, the segment may need unmapping
+        success = restoreSegment(fd, (uint64_t) fileInfo.st_size, &(segments[i]), &(host->segments[i]));
+        host->numAllocatedSegments++;
+    }
+    close(fd);
+    free(segments);
+
+    if (!success) {
+        Host_free(host);
+        return false;
+    }
+
+    host->entryAddress = header.entryAddress;
+    host->exitCode = header.exitCode;
+
+    *vm = Host_newVM(host);
+    memcpy(vm->registers, header.registers, sizeof(vm->registers));
+    vm->cpsr = header.cpsr;
+    vm->finished = header.flags & SNAPSHOT_FLAG_FINISHED;
+    vm->waiting = header.flags & SNAPSHOT_FLAG_WAITING;
+    vm->instructionCount = header.instructionCount;
+    return true;
+#endif // _WIN32
+}
+
+
+/**
+ * Runs `vm` until it reaches the end of its start-up code, and saves a warm-start snapshot there. The end is marked
+ * either by the program executing `swi #2` (SWI_WARM_START), or by it reaching `stopAddress`, if that isn't 0.
+ * Returns false if the program finished, or ran for `maxInstructions`, first, or if the snapshot couldn't be saved.
+ * The VM can carry on running afterwards.
+ * @param host
+ * @param vm
+ * @param filename
+ * @param stopAddress
+ * @param maxInstructions
+ * @return
+ */
+bool Snapshot_saveWarmStart(VM_host* host, VM_instance* vm, const char* filename, uint32_t stopAddress,
+                            uint64_t maxInstructions)
+{
+    host->stopAtWarmStart = true;
+    host->reachedWarmStart = false;
+
+    uint64_t executed = 0;
+    bool reachedAddress = false;
+    while (!vm->finished && !vm->waiting && (executed < maxInstructions)) {
+        if (stopAddress != 0) {
+            // The address has to be checked between every instruction, but this only happens once per program
+            if ((vm_program_counter(vm) & 0xFFFFFFFE) == (stopAddress & 0xFFFFFFFE)) {
+                reachedAddress = true;
+                break;
+            }
+            VM_executeSingleInstruction(vm);
+            executed++;
+        } else {
+            uint64_t remaining = maxInstructions - executed;
+            executed += VM_executeNInstructions(vm, (remaining > 0x10000) ? 0x10000 : (uint32_t) remaining);
+        }
+    }
+
+    host->stopAtWarmStart = false;
+    if (host->reachedWarmStart) {
+        // The VM is waiting at the marker, but a restored VM should carry straight on
+        host->reachedWarmStart = false;
+        vm->waiting = false;
+    } else if (!reachedAddress) {
+        return false;
+    }
+
+    return Snapshot_save(host, vm, filename);
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Returns whether the first `length` bytes of `page` are all zero.
+ * @param page
+ * @param length
+ * @return
+ */
+bool pageIsZero(const uint8_t* page, uint32_t length)
+{
+    uint64_t combined = 0;
+    uint32_t i = 0;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, &(page[i]), sizeof(word));
+        combined |= word;
+    }
+    for (; i < length; i++) {
+        combined |= page[i];
+    }
+    return combined == 0;
+}
+
+
+/**
+ * Returns the number of snapshot pages needed to hold `length` bytes.
+ * @param length
+ * @return
+ */
+uint32_t pagesInSegment(uint32_t length)
+{
+    return (uint32_t) (((uint64_t) length + SNAPSHOT_PAGE_SIZE - 1) / SNAPSHOT_PAGE_SIZE);
+}
+
+
+#ifndef _WIN32
+/**
+ * Maps one segment of the snapshot in `fd`: zeroed anonymous memory, with each run of stored pages mapped over the
+ * top of it. If the host's page size doesn't match the snapshot's, the pages are read instead.
+ * @param fd
+ * @param fileSize
+ * @param description
+ * @param segment
+ * @return
+ */
+bool restoreSegment(int fd, uint64_t fileSize, snapshotSegment* description, runtimeSegment* segment)
+{
+    segment->virtualStartAddress = description->virtualStartAddress;
+    segment->length = description->length;
+    segment->writable = description->writable;
+    segment->content = NULL;
+
+    if ((description->numPages != pagesInSegment(description->length)) || (description->length == 0)) {
+        return description->length == 0;
+    }
+
+    size_t tableSize = description->numPages * sizeof(uint64_t);
+    uint64_t* pageTable = malloc(tableSize);
+    if (!pageTable || (pread(fd, pageTable, tableSize, (off_t) description->pageTableOffset) != (ssize_t) tableSize)) {
+        free(pageTable);
+        return false;
+    }
+
+    size_t mappedLength = (size_t) description->numPages * SNAPSHOT_PAGE_SIZE;
+    uint8_t* content = mmap(NULL, mappedLength, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (content == MAP_FAILED) {
+        free(pageTable);
+        return false;
+    }
+    segment->content = content;
+
+    bool canMap = sysconf(_SC_PAGESIZE) == SNAPSHOT_PAGE_SIZE;
+    bool success = true;
+    for (uint32_t page = 0; success && (page < description->numPages);) {
+        uint64_t offset = pageTable[page];
+        if (offset == 0) {
+            page++;
+            continue;
+        }
+
+        // Find a run of pages which are next to each other in the file too
+        uint32_t runLength = 1;
+        while ((page + runLength < description->numPages) &&
+               (pageTable[page + runLength] == offset + ((uint64_t) runLength * SNAPSHOT_PAGE_SIZE))) {
+            runLength++;
+        }
+
+        size_t length = (size_t) runLength * SNAPSHOT_PAGE_SIZE;
+        if ((offset % SNAPSHOT_PAGE_SIZE != 0) || (offset + length > fileSize)) {
+            success = false;
+        } else if (canMap) {
+            success = mmap(&(content[(size_t) page * SNAPSHOT_PAGE_SIZE]), length, PROT_READ | PROT_WRITE,
+                           MAP_PRIVATE | MAP_FIXED, fd, (off_t) offset) != MAP_FAILED;
+        } else {
+            success = pread(fd, &(content[(size_t) page * SNAPSHOT_PAGE_SIZE]), length, (off_t) offset) ==
+                      (ssize_t) length;
+        }
+        page += runLength;
+    }
+    free(pageTable);
+
+    // Nothing should ever write to a read-only segment, so make sure of it
+    if (success && !segment->writable) {
+        mprotect(content, mappedLength, PROT_READ);
+    }
+    return success;
+}
+#endif // _WIN32
@@ -0,0 +1,70 @@
+/*
+ * Saving the complete state of a running guest to a file, and restoring it later, possibly in another process.
+ *
+ * A snapshot holds the VM's registers, CPSR, flags and instruction count, the host's exit code and entry address, and
+ * the contents of every memory segment (read-only ones included, so that the file stands alone). Memory is stored in
+ * SNAPSHOT_PAGE_SIZE pages at page-aligned offsets in the file, and pages which are entirely zero aren't stored at
+ * all, so restoring is just a matter of mapping the file's pages over zeroed memory. Pages are mapped copy-on-write,
+ * so any number of VMs can be restored from one file without changing it.
+ *
+ * The format is native-endian, and is versioned by SNAPSHOT_VERSION. Interrupt controllers and timers aren't saved.
+ *
+ * A warm-start snapshot is one taken once a program has finished its start-up code, so that later runs can skip it:
+ * every VM restored from the snapshot carries on from that point.
+*/
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "ARMTinyVM.h"
+#include "host.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SNAPSHOT_MAGIC "ATVMSNAP"
+#define SNAPSHOT_VERSION 1
+#define SNAPSHOT_PAGE_SIZE 4096
+
+// Bits of snapshotHeader.flags
+#define SNAPSHOT_FLAG_FINISHED 0x1
+#define SNAPSHOT_FLAG_WAITING 0x2
+
+
+/**
+ * The start of a snapshot file. It is followed by `numSegments` snapshotSegments, then their page tables.
+ */
+typedef struct snapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t pageSize;
+    uint32_t registers[16];
+    uint32_t cpsr;
+    uint32_t flags;
+    uint64_t instructionCount;
+    int32_t exitCode;
+    uint32_t entryAddress;
+    uint32_t numSegments;
+    uint32_t reserved;
+} snapshotHeader;
+
+
+/**
+ * Describes one memory segment. Its page table is an array of `numPages` file offsets, one for each page of the
+ * segment, where 0 means that the page is all zeroes.
+ */
+typedef struct snapshotSegment {
+    uint32_t virtualStartAddress;
+    uint32_t length;
+    uint32_t writable;
+    uint32_t numPages;
+    uint64_t pageTableOffset;
+} snapshotSegment;
+
+
+bool Snapshot_save(VM_host* host, VM_instance* vm, const char* filename);
+bool Snapshot_restore(VM_host* host, VM_instance* vm, const char* filename, bool verbose);
+bool Snapshot_saveWarmStart(VM_host* host, VM_instance* vm, const char* filename, uint32_t stopAddress,
+                            uint64_t maxInstructions);
+
+
+#endif // SNAPSHOT_H
@@ -0,0 +1,254 @@
+#define _POSIX_C_SOURCE 200809L
+#include "systick.h"
+#include <time.h>
+
+
+// PRIVATE FUNCTION DECLARATIONS
+
+uint64_t sysTickNow(VM_sysTick* sysTick, VM_instance* vm);
+uint64_t sysTickLength(VM_sysTick* sysTick);
+uint32_t sysTickCurrentValue(VM_sysTick* sysTick, VM_instance* vm);
+void sysTickStart(VM_sysTick* sysTick, VM_instance* vm, uint32_t value);
+void sysTickSchedule(VM_sysTick* sysTick, VM_instance* vm);
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Sets up a disabled timer. `tickNanoseconds` is only used with SYSTICK_CLOCK_HOST_TIME. When the timer expires with
+ * TICKINT set, `interruptNumber` is raised on the VM's interrupt controller, if it has one.
+ * @param sysTick
+ * @param clock
+ * @param tickNanoseconds
+ * @param interruptNumber
+ */
+void SysTick_init(VM_sysTick* sysTick, VM_sysTickClock clock, uint64_t tickNanoseconds, uint8_t interruptNumber)
+{
+    sysTick->clock = clock;
+    sysTick->tickNanoseconds = (tickNanoseconds == 0) ? 1 : tickNanoseconds;
+    sysTick->interruptNumber = interruptNumber;
+    sysTick->control = 0;
+    sysTick->reload = 0;
+    sysTick->current = 0;
+    sysTick->nextExpiry = 0;
+}
+
+
+/**
+ * Reads one byte of the timer's registers, `offset` bytes from SYSTICK_BASE. As on real hardware, reading the byte
+ * holding COUNTFLAG clears it.
+ * @param sysTick
+ * @param vm
+ * @param offset
+ * @return
+ */
+uint8_t SysTick_readByte(VM_sysTick* sysTick, VM_instance* vm, uint32_t offset)
+{
+    uint32_t value;
+    switch (offset & ~3UL) {
+        case SYSTICK_CSR:
+            value = sysTick->control;
+            if ((offset & 3) == 2) {
+                sysTick->control &= ~SYSTICK_CSR_COUNTFLAG;
+            }
+            break;
+        case SYSTICK_RVR:
+            value = sysTick->reload;
+            break;
+        case SYSTICK_CVR:
+            value = sysTickCurrentValue(sysTick, vm);
+            break;
+        default:
+            // No reference clock, and no calibration value
+            value = 0x80000000;
+            break;
+    }
+
+    return (uint8_t) (value >> (8 * (offset & 3)));
+}
+
+
+/**
+ * Writes one byte of the timer's registers, `offset` bytes from SYSTICK_BASE. Writing any part of the current value
+ * register clears it, along with COUNTFLAG.
+ * @param sysTick
+ * @param vm
+ * @param offset
+ * @param value
+ */
+void SysTick_writeByte(VM_sysTick* sysTick, VM_instance* vm, uint32_t offset, uint8_t value)
+{
+    uint8_t shift = 8 * (offset & 3);
+    uint32_t byteMask = 0xFFUL << shift;
+    uint32_t byteValue = ((uint32_t) value) << shift;
+
+    switch (offset & ~3UL) {
+        case SYSTICK_CSR: {
+            bool wasEnabled = sysTick->control & SYSTICK_CSR_ENABLE;
+            if (wasEnabled) {
+                // Remember where the counter got to, in case this disables it
+                sysTick->current = sysTickCurrentValue(sysTick, vm);
+            }
+
+            uint32_t control = (sysTick->control & ~byteMask) | byteValue;
+            sysTick->control = (control & (SYSTICK_CSR_ENABLE | SYSTICK_CSR_TICKINT | SYSTICK_CSR_CLKSOURCE)) |
+                               (sysTick->control & SYSTICK_CSR_COUNTFLAG);
+            if (!wasEnabled && (sysTick->control & SYSTICK_CSR_ENABLE)) {
+                sysTickStart(sysTick, vm, sysTick->current);
+            }
+            break;
+        }
+        case SYSTICK_RVR: {
+            bool wasRunning = SysTick_running(sysTick);
+            sysTick->reload = ((sysTick->reload & ~byteMask) | byteValue) & 0x00FFFFFF;
+            if (!wasRunning && SysTick_running(sysTick)) {
+                sysTickStart(sysTick, vm, 0);
+            }
+            break;
+        }
+        case SYSTICK_CVR:
+            sysTick->current = 0;
+            sysTick->control &= ~SYSTICK_CSR_COUNTFLAG;
+            if (sysTick->control & SYSTICK_CSR_ENABLE) {
+                sysTickStart(sysTick, vm, 0);
+            }
+            break;
+        default:
+            // The calibration register is read-only
+            break;
+    }
+
+    sysTickSchedule(sysTick, vm);
+}
+
+
+/**
+ * Brings the timer up to date: if it has expired, sets COUNTFLAG, raises its interrupt if enabled, and reloads. Any
+ * expiries which were missed (possible with host time) are merged into one. Then sets the VM's deadline for the next
+ * time this should be called. Meant to be called from the VM's `deadlineReached`.
+ * @param sysTick
+ * @param vm
+ */
+void SysTick_update(VM_sysTick* sysTick, VM_instance* vm)
+{
+    uint64_t now = sysTickNow(sysTick, vm);
+    if (SysTick_running(sysTick) && (now >= sysTick->nextExpiry)) {
+        sysTick->control |= SYSTICK_CSR_COUNTFLAG;
+        if ((sysTick->control & SYSTICK_CSR_TICKINT) && vm->interrupts) {
+            VM_raiseInterrupt(vm->interrupts, sysTick->interruptNumber);
+        }
+
+        uint64_t period = ((uint64_t) sysTick->reload + 1) * sysTickLength(sysTick);
+        uint64_t missed = (now - sysTick->nextExpiry) / period;
+        sysTick->nextExpiry += (missed + 1) * period;
+    }
+
+    sysTickSchedule(sysTick, vm);
+}
+
+
+/**
+ * Returns whether the timer will ever expire, i.e. it is enabled with a non-zero reload value.
+ * @param sysTick
+ * @return
+ */
+bool SysTick_running(VM_sysTick* sysTick)
+{
+    return (sysTick->control & SYSTICK_CSR_ENABLE) && (sysTick->reload != 0);
+}
+
+
+/**
+ * Returns the host's monotonic time in nanoseconds.
+ * @return
+ */
+uint64_t SysTick_hostTime(void)
+{
+    struct timespec now;
+#ifdef _WIN32
+    timespec_get(&now, TIME_UTC);
+#else
+    clock_gettime(CLOCK_MONOTONIC, &now);
+#endif // _WIN32
+    return ((uint64_t) now.tv_sec * 1000000000ULL) + (uint64_t) now.tv_nsec;
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+/**
+ * Returns the current time as seen by the timer's clock.
+ * @param sysTick
+ * @param vm
+ * @return
+ */
+uint64_t sysTickNow(VM_sysTick* sysTick, VM_instance* vm)
+{
+    return (sysTick->clock == SYSTICK_CLOCK_INSTRUCTIONS) ? vm->instructionCount : SysTick_hostTime();
+}
+
+
+/**
+ * Returns the length of one tick, in the units of the timer's clock.
+ * @param sysTick
+ * @return
+ */
+uint64_t sysTickLength(VM_sysTick* sysTick)
+{
+    return (sysTick->clock == SYSTICK_CLOCK_INSTRUCTIONS) ? 1 : sysTick->tickNanoseconds;
+}
+
+
+/**
+ * Works out the value of the counter, which is only stored while the timer is disabled.
+ * @param sysTick
+ * @param vm
+ * @return
+ */
+uint32_t sysTickCurrentValue(VM_sysTick* sysTick, VM_instance* vm)
+{
+    if (!SysTick_running(sysTick)) {
+        return sysTick->current;
+    }
+
+    uint64_t now = sysTickNow(sysTick, vm);
+    if (now >= sysTick->nextExpiry) {
+        return 0;
+    }
+
+    uint64_t tickLength = sysTickLength(sysTick);
+    uint64_t ticksLeft = (sysTick->nextExpiry - now + tickLength - 1) / tickLength;
+    return (ticksLeft > sysTick->reload) ? sysTick->reload : (uint32_t) ticksLeft;
+}
+
+
+/**
+ * Starts counting down from `value`. A value of 0 is reloaded on the next tick, as on real hardware.
+ * @param sysTick
+ * @param vm
+ * @param value
+ */
+void sysTickStart(VM_sysTick* sysTick, VM_instance* vm, uint32_t value)
+{
+    uint64_t ticks = (value == 0) ? ((uint64_t) sysTick->reload + 1) : value;
+    sysTick->nextExpiry = sysTickNow(sysTick, vm) + (ticks * sysTickLength(sysTick));
+}
+
+
+/**
+ * Sets the VM's deadline for the next time the timer needs to be looked at.
+ * @param sysTick
+ * @param vm
+ */
+void sysTickSchedule(VM_sysTick* sysTick, VM_instance* vm)
+{
+    if (!SysTick_running(sysTick)) {
+        VM_setDeadline(vm, VM_NO_DEADLINE);
+    } else if (sysTick->clock == SYSTICK_CLOCK_INSTRUCTIONS) {
+        VM_setDeadline(vm, sysTick->nextExpiry);
+    } else {
+        VM_setDeadline(vm, vm->instructionCount + SYSTICK_HOST_POLL_INSTRUCTIONS);
+    }
+}
@@ -0,0 +1,65 @@
+/*
+ * A virtual SysTick timer, laid out like the one on Cortex-M parts: a 24-bit counter which counts down from the reload
+ * value, sets COUNTFLAG and (optionally) raises an interrupt each time it reaches zero. It can be clocked by the
+ * guest's instruction count, which makes it deterministic, or by host time.
+ *
+ * The timer never needs checking on every instruction. With the instruction clock, the next expiry is set as the VM's
+ * deadline; with the host clock, the deadline is used to look at the host time every SYSTICK_HOST_POLL_INSTRUCTIONS.
+*/
+
+#ifndef SYSTICK_H
+#define SYSTICK_H
+
+#include "ARMTinyVM.h"
+#include <stdint.h>
+#include <stdbool.h>
+
+#define SYSTICK_BASE 0xE000E010
+#define SYSTICK_SIZE 0x10
+
+// Register offsets from SYSTICK_BASE
+#define SYSTICK_CSR 0x0
+#define SYSTICK_RVR 0x4
+#define SYSTICK_CVR 0x8
+#define SYSTICK_CALIB 0xC
+
+// Bits of the control and status register
+#define SYSTICK_CSR_ENABLE 0x00000001
+#define SYSTICK_CSR_TICKINT 0x00000002
+#define SYSTICK_CSR_CLKSOURCE 0x00000004
+#define SYSTICK_CSR_COUNTFLAG 0x00010000
+
+#define SYSTICK_DEFAULT_INTERRUPT 15
+#define SYSTICK_HOST_POLL_INSTRUCTIONS 1000
+
+
+typedef enum VM_sysTickClock {
+    SYSTICK_CLOCK_INSTRUCTIONS, // One tick per instruction executed
+    SYSTICK_CLOCK_HOST_TIME     // One tick every `tickNanoseconds` of host time
+} VM_sysTickClock;
+
+
+/**
+ * The state of one timer. `nextExpiry` is measured in instructions or host nanoseconds, depending on the clock.
+ * `current` only holds the counter value while the timer is disabled.
+ */
+typedef struct VM_sysTick {
+    VM_sysTickClock clock;
+    uint64_t tickNanoseconds;
+    uint8_t interruptNumber;
+    uint32_t control;
+    uint32_t reload;
+    uint32_t current;
+    uint64_t nextExpiry;
+} VM_sysTick;
+
+
+void SysTick_init(VM_sysTick* sysTick, VM_sysTickClock clock, uint64_t tickNanoseconds, uint8_t interruptNumber);
+uint8_t SysTick_readByte(VM_sysTick* sysTick, VM_instance* vm, uint32_t offset);
+void SysTick_writeByte(VM_sysTick* sysTick, VM_instance* vm, uint32_t offset, uint8_t value);
+void SysTick_update(VM_sysTick* sysTick, VM_instance* vm);
+bool SysTick_running(VM_sysTick* sysTick);
+uint64_t SysTick_hostTime(void);
+
+
+#endif // SYSTICK_H
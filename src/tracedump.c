@@ -0,0 +1,88 @@
+/*
+ * Binary trace decoder: prints a trace recorded by the VM (see bintrace.h) as the instruction trace would have, one
+ * instruction per line with its mnemonic and the registers it changed.
+ *
+ * Usage: ARMTinyVM_tracedump trace.bin
+ *
+ * A gap in the instruction count (where older chunks were dropped from the ring, or the trace was restarted) is marked
+ * with the count the trace resumes from, and anything other than an instruction moving the PC (such as the host
+ * changing it in between instructions) is marked as a jump.
+*/
+
+#include "bintrace.h"
+#include "disasm.h"
+#include <stdio.h>
+#include <inttypes.h>
+
+#define MAX_MNEMONIC_LENGTH 64
+
+
+// FUNCTION DECLARATIONS
+int main(int argc, char* argv[]);
+void printEntry(const binTraceEntry* entry);
+
+
+// FUNCTION DEFINITIONS
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s trace.bin\n", argv[0]);
+        return 1;
+    }
+
+    VM_binaryTraceReader reader;
+    if (!BinTrace_openReader(&reader, argv[1])) {
+        fprintf(stderr, "Unable to read the trace %s\n", argv[1]);
+        return 1;
+    }
+
+    binTraceEntry entry;
+    uint64_t nextInstruction = 0;
+    while (BinTrace_read(&reader, &entry)) {
+        if (entry.instructionCount != nextInstruction) {
+            printf("<Instruction %" PRIu64 ">\n", entry.instructionCount);
+        }
+        if (entry.jumped) {
+            printf("<Jump to 0x%08lx>\n", (unsigned long) entry.address);
+        }
+        printEntry(&entry);
+        nextInstruction = entry.instructionCount + 1;
+    }
+
+    bool corrupt = reader.corrupt;
+    BinTrace_closeReader(&reader);
+    if (corrupt) {
+        fprintf(stderr, "The trace %s is corrupt\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}
+
+
+/**
+ * Prints one instruction of the trace, followed by the registers it changed and the new CPSR if it changed that.
+ * @param entry
+ */
+void printEntry(const binTraceEntry* entry)
+{
+    static const char* const registerNames[16] = {"r0", "r1", "r2", "r3", "r4", "r5", "r6", "r7",
+                                                  "r8", "r9", "r10", "r11", "r12", "sp", "lr", "pc"};
+
+    char mnemonic[MAX_MNEMONIC_LENGTH];
+    uint8_t format = Disasm_instruction(entry->instruction, entry->address, mnemonic, sizeof(mnemonic));
+    printf("0x%04x@0x%08lx : I%02u : %s", entry->instruction, (unsigned long) entry->address, format, mnemonic);
+
+    const char* separator = " (";
+    for (uint8_t i = 0; i < 16; i++) {
+        if (entry->changedRegisters & (1U << i)) {
+            printf("%s%s := %lu", separator, registerNames[i], (unsigned long) entry->registers[i]);
+            separator = ", ";
+        }
+    }
+    if (entry->flagsChanged) {
+        printf("%scpsr := 0x%08lx", separator, (unsigned long) entry->cpsr);
+        separator = ", ";
+    }
+    printf("%s\n", (separator[0] == ',') ? ")" : "");
+}
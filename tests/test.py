@@ -4,7 +4,7 @@ import os.path
 import sys
 from glob import glob
 import re
-from typing import Optional
+from typing import Optional, Tuple
 from argparse import ArgumentParser
 
 
@@ -14,6 +14,8 @@ def main():
                         help="Directories to run tests from. Leaving empty defaults to ./instructions and ./lib")
     parser.add_argument("-p", "--preserve", action="store_true", help="If -p is set, then the .o and .elf files won't "
                                                                       "be deleted after a successful test")
+    parser.add_argument("-a", "--avr", action="store_true", help="If -a is set, then the VM is also rebuilt with "
+                                                                 "avr-gcc for each test, with the test hard-coded")
     args = parser.parse_args()
 
     # Compile start.s and lib.s fresh, so any changes are used
@@ -61,8 +63,19 @@ def main():
         return_code_vm_wsl = subprocess.run(["../cmake-build-debug-for-wsl/ARMTinyVM", elf_filename_full.replace(".elf", ".sim.elf")]).returncode
 
         # Finally, we have to do the dirty work of recompiling the virtual machine with avr-gcc, since it can't read
-        # files so we have to rewrite and recompile it every time with the program hardcoded. We then run it via
-        # QEMU.
+        # files so we have to rewrite and recompile it every time with the program hardcoded. Running it needs an AVR
+        # simulator which can report the exit code, so for now this only checks that it builds.
+        if args.avr:
+            for size_profile in (False, True):
+                profile_name = "SIZE" if size_profile else "DEFAULT"
+                avr_filename = recompile_vm_for_avr(elf_filename_full.replace(".elf", ".sim.elf"), size_profile)
+                if avr_filename:
+                    flash, ram = get_avr_sizes(avr_filename)
+                    print(f"TEST SUCCESS (AVR BUILD, {profile_name}): {test_filename_full} -> flash {flash} bytes, "
+                          f"RAM {ram} bytes", file=sys.stderr)
+                else:
+                    print(f"TEST FAILED (AVR BUILD, {profile_name}): {test_filename_full}", file=sys.stderr)
+                    full_success = False
 
         # Does the result match what we wanted?
         if return_code_direct_simulation == expected_result:
@@ -113,14 +126,37 @@ def get_test_expected_result(filename: str) -> Optional[int]:
         return int(number.group(0))
 
 
-def recompile_vm_for_avr(test_filename: str):
+def recompile_vm_for_avr(test_filename: str, size_profile: bool = False) -> Optional[str]:
     """
     Reads the .elf at `test_filename` and recompiles the whole virtual machine, hard-coded to execute that code from
-    that particular ELF.
+    that particular ELF. If `size_profile` is set, the VM core is built with ARMTINYVM_SIZE_PROFILE. Returns the
+    filename of the AVR executable, or None if it couldn't be built.
     :param test_filename:
+    :param size_profile:
     :return:
     """
-    # Firstly, we have to modify ../src/avr_program.txt to contain a description of the program
+    # Firstly, we have to regenerate ../src/avr_image.h to contain the program
+    if subprocess.run(["../cmake-build-debug-for-wsl/ARMTinyVM_mkimage", test_filename, "../src/avr_image.h"]).returncode != 0:
+        return None
+
+    # Then build the VM around it
+    avr_filename = test_filename.replace(".sim.elf", ".size.avr.elf" if size_profile else ".avr.elf")
+    profile_flags = ["-DARMTINYVM_SIZE_PROFILE"] if size_profile else []
+    result = subprocess.run(["avr-gcc", "-mmcu=atmega2560", "-Os", "-ffunction-sections", "-Wl,--gc-sections",
+                             *profile_flags, "-I../src", "-o", avr_filename, "../src/main_avr.c", "../src/ARMTinyVM.c",
+                             "../src/lz.c"])
+    return avr_filename if result.returncode == 0 else None
+
+
+def get_avr_sizes(avr_filename: str) -> Tuple[int, int]:
+    """
+    Returns how much flash and RAM the AVR executable at `avr_filename` takes up, not counting the stack and heap.
+    :param avr_filename:
+    :return:
+    """
+    output = subprocess.run(["avr-size", avr_filename], capture_output=True, text=True).stdout
+    text, data, bss = (int(field) for field in output.splitlines()[1].split()[:3])
+    return text + data, data + bss
 
 
 if __name__ == "__main__":
@@ -0,0 +1,295 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include "guest.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <elf.h>
+
+#define TEXT_OFFSET 0x100
+
+// PRIVATE FUNCTION DECLARATIONS
+void fillSectionHeader(Elf32_Shdr* section, uint32_t name, uint32_t type, uint32_t flags, uint32_t address,
+                       uint32_t offset, uint32_t size);
+
+
+static const uint16_t program[] = {
+        0x2000, // start: mov r0, #0
+        0x2118, //        mov r1, #0x18
+        0x0309, //        lsl r1, r1, #12 (GUEST_DATA_ADDRESS)
+        0x2210, //        mov r2, #16 (GUEST_INPUT_SIZE)
+        0x2703, //        mov r7, #3
+        0xDF00, //        swi #0 (read)
+        0x0006, //        lsl r6, r0, #0
+        0x24FA, //        mov r4, #250 (GUEST_ITERATIONS)
+        0xF000, // loop:  bl step
+        0xF805,
+        0x3C01, //        sub r4, #1
+        0xD1FB, //        bne loop
+        0x1C30, //        add r0, r6, #0
+        0x2701, //        mov r7, #1
+        0xDF00, //        swi #0 (exit)
+        0xB530, // step:  push {r4, r5, lr}
+        0x2318, //        mov r3, #0x18
+        0x031B, //        lsl r3, r3, #12
+        0x2540, //        mov r5, #64
+        0x2125, // inner: mov r1, #37
+        0x4361, //        mul r1, r4
+        0x1949, //        add r1, r1, r5
+        0x04C9, //        lsl r1, r1, #19
+        0x0CC9, //        lsr r1, r1, #19
+        0x0889, //        lsr r1, r1, #2
+        0x0089, //        lsl r1, r1, #2 (a word within GUEST_DATA_SIZE)
+        0x18C9, //        add r1, r1, r3
+        0x6808, //        ldr r0, [r1]
+        0x1900, //        add r0, r0, r4
+        0x4068, //        eor r0, r5
+        0x6008, //        str r0, [r1]
+        0x3D01, //        sub r5, #1
+        0xD1F1, //        bne inner
+        0xBD30, //        pop {r4, r5, pc}
+        0x2018, // handler: mov r0, #0x18
+        0x0300, //        lsl r0, r0, #12
+        0x6801, //        ldr r1, [r0]
+        0x3101, //        add r1, #1
+        0x6001, //        str r1, [r0]
+        0x4770, //        bx lr
+        0x8045, // GUEST_VECTOR_TABLE: handler
+        0x0000
+};
+
+static const char sectionNames[] = "\0.text\0.data\0.shstrtab";
+
+uint8_t Guest_flatMemory[GUEST_FLAT_MEMORY_SIZE];
+
+
+// PUBLIC FUNCTIONS
+
+
+/**
+ * Writes the guest program to `filename` as an ELF file, with its data zeroed. Returns false if the file couldn't be
+ * written.
+ * @param filename
+ * @return
+ */
+bool Guest_writeElf(const char* filename)
+{
+    static uint8_t data[GUEST_DATA_SIZE];
+
+    uint32_t textSize = sizeof(program);
+    uint32_t dataOffset = TEXT_OFFSET + textSize;
+    uint32_t namesOffset = dataOffset + GUEST_DATA_SIZE;
+    uint32_t sectionsOffset = (namesOffset + sizeof(sectionNames) + 3) & ~3UL;
+
+    Elf32_Ehdr header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.e_ident, ELFMAG, SELFMAG);
+    header.e_ident[EI_CLASS] = ELFCLASS32;
+    header.e_ident[EI_DATA] = ELFDATA2LSB;
+    header.e_ident[EI_VERSION] = EV_CURRENT;
+    header.e_type = ET_EXEC;
+    header.e_machine = EM_ARM;
+    header.e_version = EV_CURRENT;
+    header.e_entry = GUEST_TEXT_ADDRESS | 1;
+    header.e_shoff = sectionsOffset;
+    header.e_ehsize = sizeof(Elf32_Ehdr);
+    header.e_shentsize = sizeof(Elf32_Shdr);
+    header.e_shnum = 4;
+    header.e_shstrndx = 3;
+
+    Elf32_Shdr sections[4];
+    memset(sections, 0, sizeof(sections));
+    fillSectionHeader(&(sections[1]), 1, SHT_PROGBITS, SHF_ALLOC | SHF_EXECINSTR, GUEST_TEXT_ADDRESS, TEXT_OFFSET,
+                      textSize);
+    fillSectionHeader(&(sections[2]), 7, SHT_PROGBITS, SHF_ALLOC | SHF_WRITE, GUEST_DATA_ADDRESS, dataOffset,
+                      GUEST_DATA_SIZE);
+    fillSectionHeader(&(sections[3]), 13, SHT_STRTAB, 0, 0, namesOffset, sizeof(sectionNames));
+
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    static const uint8_t padding[TEXT_OFFSET] = {0};
+    bool success = (fwrite(&header, sizeof(header), 1, file) == 1) &&
+                   (fwrite(padding, TEXT_OFFSET - sizeof(header), 1, file) == 1) &&
+                   (fwrite(program, textSize, 1, file) == 1) &&
+                   (fwrite(data, GUEST_DATA_SIZE, 1, file) == 1) &&
+                   (fwrite(sectionNames, sizeof(sectionNames), 1, file) == 1) &&
+                   ((sectionsOffset == namesOffset + sizeof(sectionNames)) ||
+                    (fwrite(padding, sectionsOffset - namesOffset - sizeof(sectionNames), 1, file) == 1)) &&
+                   (fwrite(sections, sizeof(sections), 1, file) == 1);
+    return (fclose(file) == 0) && success;
+}
+
+
+/**
+ * Writes `input` to `filename` and makes it the process's standard input, so that what the guest reads is known, and
+ * it never waits for a terminal. Returns false if that couldn't be done.
+ * @param filename
+ * @param input
+ * @return
+ */
+bool Guest_redirectInput(const char* filename, const char* input)
+{
+    FILE* file = fopen(filename, "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = fputs(input, file) >= 0;
+    if ((fclose(file) != 0) || !written) {
+        return false;
+    }
+    return freopen(filename, "rb", stdin) != NULL;
+}
+
+
+/**
+ * Copies the guest's GUEST_DATA_SIZE bytes of data out of `host` into `data`. Returns false if any of it isn't mapped.
+ * @param host
+ * @param data
+ * @return
+ */
+bool Guest_readData(VM_host* host, uint8_t* data)
+{
+    for (uint32_t i = 0; i < GUEST_DATA_SIZE; i++) {
+        uint8_t* byte = Host_getVirtualMemoryByte(host, GUEST_DATA_ADDRESS + i, NULL);
+        if (!byte) {
+            return false;
+        }
+        data[i] = *byte;
+    }
+    return true;
+}
+
+
+/**
+ * Returns whether the VM running in `host` has the registers, instruction count and data expected, and has finished
+ * only if the expected VM had.
+ * @param host
+ * @param vm
+ * @param expected
+ * @param expectedData
+ * @return
+ */
+bool Guest_sameState(VM_host* host, VM_instance* vm, const VM_instance* expected, const uint8_t* expectedData)
+{
+    uint8_t data[GUEST_DATA_SIZE];
+    return (vm->finished == expected->finished) && (vm->instructionCount == expected->instructionCount) &&
+           (vm->cpsr == expected->cpsr) && (memcmp(vm->registers, expected->registers, sizeof(vm->registers)) == 0) &&
+           Guest_readData(host, data) && (memcmp(data, expectedData, GUEST_DATA_SIZE) == 0);
+}
+
+
+/**
+ * Creates a VM which runs from the flat memory, starting at `entryAddress`, with its stack at the top.
+ * @param entryAddress
+ * @return
+ */
+VM_instance Guest_newFlatVM(uint32_t entryAddress)
+{
+    return VM_new(Guest_flatReadByte, Guest_flatWriteByte, Guest_flatSoftwareInterrupt, GUEST_FLAT_MEMORY_SIZE,
+                  entryAddress);
+}
+
+
+/**
+ * Reads from the flat memory, where every address wraps around.
+ * @param vm
+ * @param addr
+ * @return
+ */
+uint8_t Guest_flatReadByte(VM_instance* vm, uint32_t addr)
+{
+    (void) vm;
+    return Guest_flatMemory[addr % GUEST_FLAT_MEMORY_SIZE];
+}
+
+
+/**
+ * Writes to the flat memory, where every address wraps around.
+ * @param vm
+ * @param addr
+ * @param value
+ */
+void Guest_flatWriteByte(VM_instance* vm, uint32_t addr, uint8_t value)
+{
+    (void) vm;
+    Guest_flatMemory[addr % GUEST_FLAT_MEMORY_SIZE] = value;
+}
+
+
+/**
+ * Any system call finishes a guest running from the flat memory.
+ * @param vm
+ * @param number
+ * @return
+ */
+VM_swiResult Guest_flatSoftwareInterrupt(VM_instance* vm, uint8_t number)
+{
+    (void) number;
+    vm->finished = true;
+    return SWI_COMPLETE;
+}
+
+
+/**
+ * Stores Thumb instructions (or any halfwords) little-endian at `address` in the flat memory.
+ * @param address
+ * @param halfwords
+ * @param numHalfwords
+ */
+void Guest_storeHalfwords(uint32_t address, const uint16_t* halfwords, size_t numHalfwords)
+{
+    for (size_t i = 0; i < numHalfwords; i++) {
+        Guest_flatMemory[(address + (2 * i)) % GUEST_FLAT_MEMORY_SIZE] = halfwords[i] & 0xFF;
+        Guest_flatMemory[(address + (2 * i) + 1) % GUEST_FLAT_MEMORY_SIZE] = halfwords[i] >> 8;
+    }
+}
+
+
+
+/**
+ * Waits for up to `timeoutMilliseconds` for `task` to reach `state`, for the tests which run guests on a scheduler.
+ * Returns false if it doesn't.
+ * @param scheduler
+ * @param task
+ * @param state
+ * @param timeoutMilliseconds
+ * @return
+ */
+bool Guest_waitForTask(VM_scheduler* scheduler, VM_task* task, VM_taskState state, uint32_t timeoutMilliseconds)
+{
+    for (uint32_t waited = 0; waited < timeoutMilliseconds; waited++) {
+        pthread_mutex_lock(&(scheduler->lock));
+        bool reached = (task->state == state);
+        pthread_mutex_unlock(&(scheduler->lock));
+        if (reached) {
+            return true;
+        }
+        Guest_sleep(1);
+    }
+    return false;
+}
+
+
+void Guest_sleep(uint32_t milliseconds)
+{
+    struct timespec sleepTime = {.tv_sec = milliseconds / 1000, .tv_nsec = (long) (milliseconds % 1000) * 1000000L};
+    nanosleep(&sleepTime, NULL);
+}
+
+
+// PRIVATE FUNCTIONS
+
+
+void fillSectionHeader(Elf32_Shdr* section, uint32_t name, uint32_t type, uint32_t flags, uint32_t address,
+                       uint32_t offset, uint32_t size)
+{
+    section->sh_name = name;
+    section->sh_type = type;
+    section->sh_flags = flags;
+    section->sh_addr = address;
+    section->sh_offset = offset;
+    section->sh_size = size;
+    section->sh_addralign = 4;
+}
@@ -0,0 +1,49 @@
+/*
+ * A small guest program for the unit tests which need a whole host (snapshots, recording and replay, reverse execution,
+ * binary traces), written out as an ELF file so that it's loaded the same way as a real one.
+ *
+ * The guest reads up to GUEST_INPUT_SIZE bytes from standard input into the start of its data, then GUEST_ITERATIONS
+ * times calls a function which reads, changes and writes back 64 words spread across the data. It exits with the
+ * number of bytes it read. Its handler for interrupt 0, at GUEST_HANDLER_ADDRESS in the vector table at
+ * GUEST_VECTOR_TABLE, adds one to the first word of the data.
+ *
+ * The tests which run raw Thumb code through VM_new rather than a whole host share a flat memory of
+ * GUEST_FLAT_MEMORY_SIZE bytes instead, in which every address wraps around and any system call finishes the guest.
+*/
+
+#ifndef GUEST_H
+#define GUEST_H
+
+#include "host.h"
+#include "scheduler.h"
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+#define GUEST_TEXT_ADDRESS 0x8000
+#define GUEST_DATA_ADDRESS 0x18000
+#define GUEST_DATA_SIZE 0x2000
+#define GUEST_HANDLER_ADDRESS 0x8044
+#define GUEST_VECTOR_TABLE 0x8050
+#define GUEST_INPUT_SIZE 16
+#define GUEST_ITERATIONS 250
+#define GUEST_FLAT_MEMORY_SIZE 0x10000
+
+
+bool Guest_writeElf(const char* filename);
+bool Guest_redirectInput(const char* filename, const char* input);
+bool Guest_readData(VM_host* host, uint8_t* data);
+bool Guest_sameState(VM_host* host, VM_instance* vm, const VM_instance* expected, const uint8_t* expectedData);
+
+extern uint8_t Guest_flatMemory[GUEST_FLAT_MEMORY_SIZE];
+VM_instance Guest_newFlatVM(uint32_t entryAddress);
+uint8_t Guest_flatReadByte(VM_instance* vm, uint32_t addr);
+void Guest_flatWriteByte(VM_instance* vm, uint32_t addr, uint8_t value);
+VM_swiResult Guest_flatSoftwareInterrupt(VM_instance* vm, uint8_t number);
+void Guest_storeHalfwords(uint32_t address, const uint16_t* halfwords, size_t numHalfwords);
+
+bool Guest_waitForTask(VM_scheduler* scheduler, VM_task* task, VM_taskState state, uint32_t timeoutMilliseconds);
+void Guest_sleep(uint32_t milliseconds);
+
+
+#endif // GUEST_H
@@ -0,0 +1,136 @@
+/*
+ * Checks that a read which would block is finished on the I/O thread. The guest (see guest.h) is run by a scheduler
+ * with its standard input an empty pipe, so its first system call is left pending and the task is parked. Only once
+ * the pipe has been written to must it be resumed, with what was written in its buffer (checked as it resumes, since
+ * the guest goes on to change its data) and the number of bytes in r0 (which it exits with).
+*/
+
+#include "host.h"
+#include "scheduler.h"
+#include "guest.h"
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define ELF_FILENAME "test_asyncio.elf"
+#define INPUT "async input"
+#define TIMEOUT_MS 2000
+
+// FUNCTION DECLARATIONS
+int main(void);
+int runGuest(VM_asyncIO* io, int inputFd);
+void wakeTask(VM_instance* vm, void* resumeContext);
+void resumeHost(VM_task* task);
+
+
+static uint8_t dataOnResume[GUEST_INPUT_SIZE];
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    VM_setTraceLevel(VM_TRACE_OFF);
+
+    int input[2];
+    VM_asyncIO io;
+    if (!Guest_writeElf(ELF_FILENAME) || (pipe(input) != 0) || (dup2(input[0], STDIN_FILENO) < 0) ||
+        !AsyncIO_init(&io)) {
+        fprintf(stderr, "FAILED: couldn't set up the guest, its input and the I/O thread\n");
+        return 1;
+    }
+    close(input[0]);
+
+    int failures = runGuest(&io, input[1]);
+
+    AsyncIO_free(&io);
+    close(input[1]);
+    remove(ELF_FILENAME);
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Runs the guest until it's parked waiting for its input, then writes INPUT to `inputFd` and lets it finish. Returns
+ * the number of failures.
+ * @param io
+ * @param inputFd
+ * @return
+ */
+int runGuest(VM_asyncIO* io, int inputFd)
+{
+    VM_host host;
+    VM_scheduler scheduler;
+    if (!Host_loadElf(&host, ELF_FILENAME, false)) {
+        fprintf(stderr, "FAILED: couldn't load the guest\n");
+        return 1;
+    }
+    if (!Scheduler_init(&scheduler, 1, 0)) {
+        fprintf(stderr, "FAILED: couldn't set up the scheduler\n");
+        Host_free(&host);
+        return 1;
+    }
+
+    VM_instance vm = Host_newVM(&host);
+    VM_task task;
+    task.userData = NULL;
+    task.onFinished = NULL;
+    task.onResume = resumeHost;
+    Host_enableAsyncIO(&host, io, wakeTask, &task);
+    Scheduler_add(&scheduler, &task, &vm, 0);
+    Scheduler_start(&scheduler);
+
+    int failures = 0;
+    if (!Guest_waitForTask(&scheduler, &task, TASK_WAITING, TIMEOUT_MS) || vm.finished) {
+        fprintf(stderr, "FAILED: the guest wasn't parked waiting for its input\n");
+        failures++;
+    }
+    Guest_sleep(20);
+    if (vm.finished || (task.state != TASK_WAITING)) {
+        fprintf(stderr, "FAILED: the guest carried on before its input was written\n");
+        failures++;
+    }
+
+    if (write(inputFd, INPUT, strlen(INPUT)) != (ssize_t) strlen(INPUT)) {
+        fprintf(stderr, "FAILED: couldn't write the guest's input\n");
+        failures++;
+    } else if (!Guest_waitForTask(&scheduler, &task, TASK_FINISHED, TIMEOUT_MS)) {
+        fprintf(stderr, "FAILED: the guest didn't finish once its input was written\n");
+        failures++;
+    } else if ((host.exitCode != (int32_t) strlen(INPUT)) || (memcmp(dataOnResume, INPUT, strlen(INPUT)) != 0)) {
+        fprintf(stderr, "FAILED: the guest read %ld bytes, or not the ones written\n", (long) host.exitCode);
+        failures++;
+    }
+
+    // Let a guest which never finished go before its host is freed
+    Scheduler_free(&scheduler);
+    Host_free(&host);
+    return failures;
+}
+
+
+/**
+ * The host's resume callback, called on the I/O thread once the read has been done.
+ * @param vm
+ * @param resumeContext
+ */
+void wakeTask(VM_instance* vm, void* resumeContext)
+{
+    (void) vm;
+    Scheduler_wake((VM_task*) resumeContext);
+}
+
+
+/**
+ * Called on the worker thread before the woken task runs, to give the guest what was read, and keeps the start of its
+ * data as it is then.
+ * @param task
+ */
+void resumeHost(VM_task* task)
+{
+    Host_resumed(task->vm);
+    VM_host* host = (VM_host*) task->vm->context;
+    for (uint32_t i = 0; i < GUEST_INPUT_SIZE; i++) {
+        uint8_t* byte = Host_getVirtualMemoryByte(host, GUEST_DATA_ADDRESS + i, NULL);
+        dataOnResume[i] = byte ? *byte : 0;
+    }
+}
@@ -0,0 +1,204 @@
+/*
+ * Checks that binary traces round-trip: reading back a trace of the guest (see guest.h) gives the address, opcode,
+ * registers and CPSR of every instruction exactly as they were when it ran.
+ *
+ * The guest is first run on its own, recording its state after each instruction. It's then run again with a trace of
+ * small chunks, so that there are many of them: streamed to a file both uncompressed and compressed, and kept only in
+ * the ring and saved at the end, which must hold an unbroken run of the most recent instructions.
+*/
+
+#include "bintrace.h"
+#include "host.h"
+#include "guest.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define ELF_FILENAME "test_bintrace.elf"
+#define INPUT_FILENAME "test_bintrace.txt"
+#define TRACE_FILENAME "test_bintrace.bin"
+#define INPUT "bintrace"
+#define CHUNK_SIZE 4096
+#define NUM_CHUNKS 4
+#define MAX_INSTRUCTIONS 1000000
+
+// FUNCTION DECLARATIONS
+int main(void);
+bool runReference(void);
+bool runTraced(bool stream, bool compress);
+int checkTrace(const char* description, bool wholeRun);
+void recordEntry(VM_instance* vm, uint32_t address, uint16_t instruction);
+
+
+static binTraceEntry* expected = NULL;
+static uint32_t numExpected = 0;
+static uint32_t capacity = 0;
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    VM_setTraceLevel(VM_TRACE_OFF);
+    if (!Guest_writeElf(ELF_FILENAME) || !runReference()) {
+        fprintf(stderr, "FAILED: couldn't run the guest\n");
+        return 1;
+    }
+
+    int failures = 0;
+    if (runTraced(true, false)) {
+        failures += checkTrace("streamed", true);
+    } else {
+        fprintf(stderr, "FAILED: couldn't stream the trace\n");
+        failures++;
+    }
+    if (runTraced(true, true)) {
+        failures += checkTrace("streamed and compressed", true);
+    } else {
+        fprintf(stderr, "FAILED: couldn't stream the compressed trace\n");
+        failures++;
+    }
+    if (runTraced(false, true)) {
+        failures += checkTrace("saved from the ring", false);
+    } else {
+        fprintf(stderr, "FAILED: couldn't save the trace\n");
+        failures++;
+    }
+
+    free(expected);
+    remove(ELF_FILENAME);
+    remove(INPUT_FILENAME);
+    remove(TRACE_FILENAME);
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Runs the guest to the end, keeping its state after each instruction in `expected`.
+ * @return
+ */
+bool runReference(void)
+{
+    VM_host host;
+    if (!Guest_redirectInput(INPUT_FILENAME, INPUT) || !Host_loadElf(&host, ELF_FILENAME, false)) {
+        return false;
+    }
+    VM_instance vm = Host_newVM(&host);
+    vm.instructionExecuted = recordEntry;
+    VM_executeNInstructions(&vm, MAX_INSTRUCTIONS);
+    Host_free(&host);
+    return vm.finished && (numExpected == vm.instructionCount);
+}
+
+
+/**
+ * Runs the guest to the end with a binary trace, which is either streamed to TRACE_FILENAME or saved there at the
+ * end. Returns false if the trace couldn't be written.
+ * @param stream
+ * @param compress
+ * @return
+ */
+bool runTraced(bool stream, bool compress)
+{
+    VM_host host;
+    if (!Guest_redirectInput(INPUT_FILENAME, INPUT) || !Host_loadElf(&host, ELF_FILENAME, false)) {
+        return false;
+    }
+    VM_instance vm = Host_newVM(&host);
+
+    VM_binaryTrace trace;
+    if (!BinTrace_init(&trace, CHUNK_SIZE, NUM_CHUNKS)) {
+        Host_free(&host);
+        return false;
+    }
+    bool success = !stream || BinTrace_streamTo(&trace, TRACE_FILENAME, compress);
+    if (success) {
+        BinTrace_attach(&trace, &vm);
+        VM_executeNInstructions(&vm, MAX_INSTRUCTIONS);
+        success = BinTrace_stop(&trace) && (stream || BinTrace_save(&trace, TRACE_FILENAME, compress));
+    }
+    BinTrace_free(&trace);
+    Host_free(&host);
+    return success;
+}
+
+
+/**
+ * Reads back TRACE_FILENAME and compares it with `expected`. If `wholeRun` is set the trace must hold every
+ * instruction, and otherwise an unbroken run of them up to the last. Returns the number of failures.
+ * @param description
+ * @param wholeRun
+ * @return
+ */
+int checkTrace(const char* description, bool wholeRun)
+{
+    VM_binaryTraceReader reader;
+    if (!BinTrace_openReader(&reader, TRACE_FILENAME)) {
+        fprintf(stderr, "FAILED: couldn't read the trace %s\n", description);
+        return 1;
+    }
+
+    int failures = 0;
+    binTraceEntry entry;
+    uint64_t first = 0;
+    uint64_t last = 0;
+    while (BinTrace_read(&reader, &entry) && (failures == 0)) {
+        if (first == 0) {
+            first = entry.instructionCount;
+        } else if (entry.instructionCount != last + 1) {
+            fprintf(stderr, "FAILED: the trace %s skips from instruction %llu to %llu\n", description,
+                    (unsigned long long) last, (unsigned long long) entry.instructionCount);
+            failures++;
+            break;
+        }
+        last = entry.instructionCount;
+
+        const binTraceEntry* want = &(expected[(last > 0) ? last - 1 : 0]);
+        if ((last == 0) || (last > numExpected) || (entry.address != want->address) ||
+            (entry.instruction != want->instruction) || (entry.cpsr != want->cpsr) ||
+            (memcmp(entry.registers, want->registers, sizeof(entry.registers)) != 0)) {
+            fprintf(stderr, "FAILED: instruction %llu of the trace %s differs from the run\n",
+                    (unsigned long long) last, description);
+            failures++;
+        }
+    }
+    if (reader.corrupt) {
+        fprintf(stderr, "FAILED: the trace %s is corrupt\n", description);
+        failures++;
+    }
+    BinTrace_closeReader(&reader);
+
+    if ((failures == 0) && ((last != numExpected) || (wholeRun ? (first != 1) : (first <= 1)))) {
+        fprintf(stderr, "FAILED: the trace %s holds instructions %llu to %llu of %lu\n", description,
+                (unsigned long long) first, (unsigned long long) last, (unsigned long) numExpected);
+        failures++;
+    }
+    return failures;
+}
+
+
+/**
+ * Keeps the state of the VM after each instruction, as a trace entry.
+ * @param vm
+ * @param address
+ * @param instruction
+ */
+void recordEntry(VM_instance* vm, uint32_t address, uint16_t instruction)
+{
+    if (numExpected == capacity) {
+        capacity = capacity ? capacity * 2 : 65536;
+        binTraceEntry* grown = realloc(expected, capacity * sizeof(binTraceEntry));
+        if (!grown) {
+            vm->finished = true;
+            return;
+        }
+        expected = grown;
+    }
+
+    binTraceEntry* entry = &(expected[numExpected++]);
+    entry->instructionCount = vm->instructionCount;
+    entry->address = address;
+    entry->instruction = instruction;
+    memcpy(entry->registers, vm->registers, sizeof(entry->registers));
+    entry->cpsr = vm->cpsr;
+}
@@ -0,0 +1,125 @@
+/*
+ * Checks that interrupts are delivered and returned from, with handlers which return through POP {..., PC} as
+ * compiled handlers do, and through MOV pc, lr as hand-written ones may, rather than BX LR.
+ *
+ * The guest spins until its handler has counted five interrupts, then exits. It runs from the flat memory (see
+ * guest.h), with the vector table at VECTOR_TABLE and the counter at COUNTER.
+*/
+
+#include "ARMTinyVM.h"
+#include "guest.h"
+#include <stdio.h>
+#include <string.h>
+
+#define PROGRAM_START 0x100
+#define HANDLER_START 0x140
+#define VECTOR_TABLE 0x2000
+#define COUNTER 0x3000
+#define NUM_INTERRUPTS 5
+#define INTERRUPT_EVERY 50
+#define MAX_INSTRUCTIONS 100000
+
+// FUNCTION DECLARATIONS
+int main(void);
+int runGuest(const char* description, const uint16_t* handler, size_t handlerLength);
+
+
+static const uint16_t program[] = {
+        0x2455, // mov r4, #0x55 (which the handler also uses)
+        0x2130, // mov r1, #0x30
+        0x0209, // lsl r1, r1, #8
+        0x6808, // loop: ldr r0, [r1]
+        0x2805, // cmp r0, #5
+        0xD1FC, // bne loop
+        0x2701, // mov r7, #1
+        0xDF00  // swi #0
+};
+
+static const uint16_t popHandler[] = {
+        0xB510, // push {r4, lr}
+        0x2430, // mov r4, #0x30
+        0x0224, // lsl r4, r4, #8
+        0x6822, // ldr r2, [r4]
+        0x3201, // add r2, #1
+        0x6022, // str r2, [r4]
+        0xBD10  // pop {r4, pc}
+};
+
+// Clobbers r1, which the guest's loop needs back
+static const uint16_t movHandler[] = {
+        0x2130, // mov r1, #0x30
+        0x0209, // lsl r1, r1, #8
+        0x6808, // ldr r0, [r1]
+        0x3001, // add r0, #1
+        0x6008, // str r0, [r1]
+        0x2100, // mov r1, #0
+        0x46F7  // mov pc, lr
+};
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    int failures = runGuest("POP {..., PC}", popHandler, sizeof(popHandler) / sizeof(popHandler[0]));
+    failures += runGuest("MOV pc, lr", movHandler, sizeof(movHandler) / sizeof(movHandler[0]));
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Runs the guest with `handler` for interrupt 0, raising an interrupt every INTERRUPT_EVERY instructions. Returns the
+ * number of failures.
+ * @param description
+ * @param handler
+ * @param handlerLength
+ * @return
+ */
+int runGuest(const char* description, const uint16_t* handler, size_t handlerLength)
+{
+    memset(Guest_flatMemory, 0, sizeof(Guest_flatMemory));
+    Guest_storeHalfwords(PROGRAM_START, program, sizeof(program) / sizeof(program[0]));
+    Guest_storeHalfwords(HANDLER_START, handler, handlerLength);
+    uint16_t vector[2] = {(HANDLER_START | 1) & 0xFFFF, (HANDLER_START | 1) >> 16};
+    Guest_storeHalfwords(VECTOR_TABLE, vector, 2);
+
+    VM_interruptController controller;
+    VM_initInterruptController(&controller, VECTOR_TABLE);
+    VM_instance vm = Guest_newFlatVM(PROGRAM_START);
+    vm.interrupts = &controller;
+
+    uint32_t executed = 0;
+    uint8_t raised = 0;
+    while (!vm.finished && (executed < MAX_INSTRUCTIONS)) {
+        executed += VM_executeNInstructions(&vm, INTERRUPT_EVERY);
+        if (raised < NUM_INTERRUPTS) {
+            raised += VM_raiseInterrupt(&controller, 0);
+        }
+    }
+
+    int failures = 0;
+    if (!vm.finished) {
+        fprintf(stderr, "FAILED: the guest with a %s handler didn't finish\n", description);
+        failures++;
+    }
+    if (Guest_flatMemory[COUNTER] != NUM_INTERRUPTS) {
+        fprintf(stderr, "FAILED: the %s handler ran %u times, not %u\n", description, Guest_flatMemory[COUNTER],
+                NUM_INTERRUPTS);
+        failures++;
+    }
+    if (vm.registers[4] != 0x55) {
+        fprintf(stderr, "FAILED: r4 is 0x%lx after the %s handler\n", (unsigned long) vm.registers[4], description);
+        failures++;
+    }
+    if (vm_stack_pointer(&vm) != GUEST_FLAT_MEMORY_SIZE) {
+        fprintf(stderr, "FAILED: SP is 0x%lx after the %s handler, not back where it started\n",
+                (unsigned long) vm_stack_pointer(&vm), description);
+        failures++;
+    }
+    if (vm.cpsr & VM_CPSR_IRQ_DISABLE) {
+        fprintf(stderr, "FAILED: interrupts are still disabled after the %s handler\n", description);
+        failures++;
+    }
+    return failures;
+}
+
@@ -0,0 +1,209 @@
+/*
+ * Checks that lockstep execution gives exactly the same results as running each lane on its own through
+ * VM_executeNInstructions.
+ *
+ * Each program is a random sequence of the instructions the vector kernels handle (formats 1 to 4), with conditional
+ * branches over single instructions scattered through it so that the lanes diverge and reconverge, ending in a system
+ * call. Every lane starts with different registers and flags. A second run attaches an instructionExecuted hook and a
+ * deadline, which the vector kernels would otherwise skip.
+*/
+
+#include "ARMTinyVM.h"
+#include "lockstep.h"
+#include "guest.h"
+#include <stdio.h>
+#include <string.h>
+
+#define PROGRAM_START 0x100
+#define PROGRAM_LENGTH 256
+#define NUM_PROGRAMS 200
+#define NUM_LANES 13
+#define MAX_INSTRUCTIONS 100000
+#define DEADLINE 100
+
+// FUNCTION DECLARATIONS
+int main(void);
+int checkProgram(uint32_t seed, bool hooked);
+void generateProgram(void);
+uint16_t randomInstruction(void);
+void initLane(VM_instance* vm);
+void countInstruction(VM_instance* vm, uint32_t address, uint16_t instruction);
+void recordDeadline(VM_instance* vm);
+uint32_t nextRandom(void);
+
+
+static uint32_t randomState;
+static uint64_t hookedInstructions;
+static uint64_t deadlineCount;
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    VM_setTraceLevel(VM_TRACE_OFF);
+
+    int failures = 0;
+    for (uint32_t seed = 1; seed <= NUM_PROGRAMS; seed++) {
+        failures += checkProgram(seed, false);
+        failures += checkProgram(seed, true);
+    }
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Runs the program generated from `seed` on NUM_LANES lanes, both in lockstep and one at a time, and compares them.
+ * If `hooked` is set, lane 0 also counts its instructions through instructionExecuted and has a deadline. Returns the
+ * number of failures.
+ * @param seed
+ * @param hooked
+ * @return
+ */
+int checkProgram(uint32_t seed, bool hooked)
+{
+    randomState = seed;
+    generateProgram();
+
+    VM_instance lanes[NUM_LANES];
+    VM_instance expected[NUM_LANES];
+    for (uint32_t lane = 0; lane < NUM_LANES; lane++) {
+        initLane(&(lanes[lane]));
+        expected[lane] = lanes[lane];
+    }
+    for (uint32_t lane = 0; lane < NUM_LANES; lane++) {
+        VM_executeNInstructions(&(expected[lane]), MAX_INSTRUCTIONS);
+    }
+
+    if (hooked) {
+        lanes[0].instructionExecuted = countInstruction;
+        lanes[0].deadlineReached = recordDeadline;
+        VM_setDeadline(&(lanes[0]), DEADLINE);
+        hookedInstructions = 0;
+        deadlineCount = 0;
+    }
+    VM_lockstep ls;
+    if (!Lockstep_init(&ls, lanes, NUM_LANES)) {
+        fprintf(stderr, "FAILED: couldn't allocate the lanes\n");
+        return 1;
+    }
+    Lockstep_executeNInstructions(&ls, MAX_INSTRUCTIONS);
+    Lockstep_free(&ls);
+
+    int failures = 0;
+    for (uint32_t lane = 0; lane < NUM_LANES; lane++) {
+        VM_instance* actual = &(lanes[lane]);
+        if (!actual->finished || (actual->instructionCount != expected[lane].instructionCount) ||
+            (actual->cpsr != expected[lane].cpsr) ||
+            (memcmp(actual->registers, expected[lane].registers, sizeof(actual->registers)) != 0)) {
+            fprintf(stderr, "FAILED: program %lu%s, lane %lu differs from running it on its own\n",
+                    (unsigned long) seed, hooked ? " (hooked)" : "", (unsigned long) lane);
+            failures++;
+        }
+    }
+    if (hooked && (hookedInstructions != lanes[0].instructionCount)) {
+        fprintf(stderr, "FAILED: program %lu, instructionExecuted was called %llu times for %llu instructions\n",
+                (unsigned long) seed, (unsigned long long) hookedInstructions,
+                (unsigned long long) lanes[0].instructionCount);
+        failures++;
+    }
+    if (hooked && (lanes[0].instructionCount >= DEADLINE) && (deadlineCount != DEADLINE)) {
+        fprintf(stderr, "FAILED: program %lu, the deadline was reached after %llu instructions, not %u\n",
+                (unsigned long) seed, (unsigned long long) deadlineCount, DEADLINE);
+        failures++;
+    }
+    return failures;
+}
+
+
+/**
+ * Fills the program area with PROGRAM_LENGTH random instructions followed by SWI #0, twice in case the last instruction
+ * branches over the first.
+ */
+void generateProgram(void)
+{
+    memset(Guest_flatMemory, 0, sizeof(Guest_flatMemory));
+    uint32_t address = PROGRAM_START;
+    for (uint32_t i = 0; i < PROGRAM_LENGTH; i++) {
+        uint16_t instruction = randomInstruction();
+        Guest_flatMemory[address++] = instruction & 0xFF;
+        Guest_flatMemory[address++] = instruction >> 8;
+    }
+    for (uint8_t i = 0; i < 2; i++) {
+        Guest_flatMemory[address++] = 0x00;
+        Guest_flatMemory[address++] = 0xDF;
+    }
+}
+
+
+/**
+ * Returns a random instruction from formats 1 to 4, or one time in eight a conditional branch over the next
+ * instruction. Only the low registers are used, so the PC and SP are left alone.
+ * @return
+ */
+uint16_t randomInstruction(void)
+{
+    uint32_t r = nextRandom();
+    switch (r % 8) {
+        case 0:
+            // B<cond> over the next instruction, for any condition but AL and NV
+            return (uint16_t) (0xD000 | ((((r >> 8) % 14)) << 8));
+        case 1:
+            // LSL/LSR/ASR Rd, Rs, #Offset5
+            return (uint16_t) ((((r >> 8) % 3) << 11) | (((r >> 12) & 0x7FF)));
+        case 2:
+            // ADD/SUB Rd, Rs, Rn or #Offset3
+            return (uint16_t) (0x1800 | ((r >> 8) & 0x7FF));
+        case 3:
+        case 4:
+            // MOV/CMP/ADD/SUB Rd, #Offset8
+            return (uint16_t) (0x2000 | ((r >> 8) & 0x1FFF));
+        default:
+            // ALU operations, including the shifts by a register which stay scalar
+            return (uint16_t) (0x4000 | ((r >> 8) & 0x3FF));
+    }
+}
+
+
+/**
+ * Creates a VM at the start of the program, with random low registers and flags.
+ * @param vm
+ */
+void initLane(VM_instance* vm)
+{
+    *vm = Guest_newFlatVM(PROGRAM_START);
+    for (uint8_t r = 0; r < 8; r++) {
+        // Mostly small values, so that shifts by a register are sometimes in range
+        vm->registers[r] = (nextRandom() & 1) ? (nextRandom() & 0x3F) : nextRandom();
+    }
+    vm->cpsr = nextRandom() & 0xF0000000UL;
+}
+
+
+
+void countInstruction(VM_instance* vm, uint32_t address, uint16_t instruction)
+{
+    (void) vm;
+    (void) address;
+    (void) instruction;
+    hookedInstructions++;
+}
+
+
+void recordDeadline(VM_instance* vm)
+{
+    deadlineCount = vm->instructionCount;
+}
+
+
+/**
+ * A xorshift generator, so that the programs are the same on every platform.
+ * @return
+ */
+uint32_t nextRandom(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
@@ -0,0 +1,124 @@
+/*
+ * Checks that LZ blocks round-trip: every block compresses to no more than lz_max_compressed_size, without writing past
+ * it, and decompresses back to exactly the original bytes.
+ *
+ * The blocks are every length up to LZ_MAX_BLOCK_SIZE, filled in several ways between incompressible and very
+ * repetitive, so that both the literal runs and the matches reach their longest.
+*/
+
+#include "lz.h"
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+
+#define NUM_ROUNDS 20
+#define NUM_FILLS 5
+#define GUARD_SIZE 16
+#define GUARD_BYTE 0xA5
+
+// FUNCTION DECLARATIONS
+int main(void);
+bool checkBlock(const uint8_t* block, uint16_t length);
+void fillBlock(uint8_t* block, uint16_t length, uint8_t fill);
+uint8_t readCompressed(uint32_t offset);
+uint32_t nextRandom(void);
+
+
+static uint8_t compressed[lz_max_compressed_size(LZ_MAX_BLOCK_SIZE) + GUARD_SIZE];
+static uint32_t randomState = 1;
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    int failures = 0;
+    uint8_t block[LZ_MAX_BLOCK_SIZE];
+    for (uint32_t round = 0; round < NUM_ROUNDS; round++) {
+        for (uint8_t fill = 0; fill < NUM_FILLS; fill++) {
+            for (uint16_t length = 1; length <= LZ_MAX_BLOCK_SIZE; length++) {
+                fillBlock(block, length, fill);
+                if (!checkBlock(block, length)) {
+                    fprintf(stderr, "FAILED: round %lu, fill %u, length %u\n", (unsigned long) round, fill, length);
+                    failures++;
+                }
+            }
+        }
+    }
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Compresses and decompresses one block, and returns whether it came back intact.
+ * @param block
+ * @param length
+ * @return
+ */
+bool checkBlock(const uint8_t* block, uint16_t length)
+{
+    memset(compressed, GUARD_BYTE, sizeof(compressed));
+    uint16_t compressedLength = LZ_compress(block, length, compressed);
+    if (compressedLength > lz_max_compressed_size(length)) {
+        fprintf(stderr, "%u bytes compressed to %u, more than the maximum of %u\n", length, compressedLength,
+                lz_max_compressed_size(length));
+        return false;
+    }
+    for (uint16_t i = lz_max_compressed_size(length); i < sizeof(compressed); i++) {
+        if (compressed[i] != GUARD_BYTE) {
+            fprintf(stderr, "Compressing %u bytes wrote past the end of the buffer\n", length);
+            return false;
+        }
+    }
+
+    uint8_t decompressed[LZ_MAX_BLOCK_SIZE];
+    uint16_t decompressedLength = LZ_decompress(readCompressed, 0, compressedLength, decompressed, length);
+    if ((decompressedLength != length) || (memcmp(decompressed, block, length) != 0)) {
+        fprintf(stderr, "%u bytes decompressed to %u different bytes\n", length, decompressedLength);
+        return false;
+    }
+    return true;
+}
+
+
+/**
+ * Fills a block with random bytes (0), bytes from a small alphabet (1), one repeated byte (2), a short repeated
+ * pattern with occasional changes (3), or random 16-bit values of which many repeat, like Thumb code (4).
+ * @param block
+ * @param length
+ * @param fill
+ */
+void fillBlock(uint8_t* block, uint16_t length, uint8_t fill)
+{
+    uint8_t value = (uint8_t) nextRandom();
+    uint8_t period = (uint8_t) (1 + (nextRandom() % 8));
+    for (uint16_t i = 0; i < length; i++) {
+        uint32_t r = nextRandom();
+        switch (fill) {
+            case 0: block[i] = (uint8_t) r; break;
+            case 1: block[i] = (uint8_t) (r % 4); break;
+            case 2: block[i] = value; break;
+            case 3: block[i] = ((r % 32) == 0) ? (uint8_t) r : (i >= period) ? block[i - period] : (uint8_t) r; break;
+            default: block[i] = (i & 1) ? block[i - 1] ^ (uint8_t) (r % 3) : (uint8_t) (0x20 + (r % 8)); break;
+        }
+    }
+}
+
+
+uint8_t readCompressed(uint32_t offset)
+{
+    return compressed[offset];
+}
+
+
+/**
+ * A xorshift generator, so that the blocks are the same on every platform.
+ * @return
+ */
+uint32_t nextRandom(void)
+{
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
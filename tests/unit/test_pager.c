@@ -0,0 +1,188 @@
+/*
+ * Checks the pager against backing storage held in memory: which frame is reused when a page is brought in (the least
+ * recently used), that a dirty page is written back before its frame is reused and by Pager_flush, that the short last
+ * page of a region is transferred at its real length, and the exact hit, miss and write-back counts.
+ *
+ * The region is NUM_PAGES - 1 whole pages and a short one, and only two of them can be resident at once. Every
+ * transfer to or from the backing storage is logged, and the log is compared with the transfers the sequence of
+ * accesses should cause.
+*/
+
+#include "pager.h"
+#include <stdio.h>
+#include <string.h>
+
+#define BASE_ADDRESS 0x20000000
+#define PAGE_SIZE 64
+#define NUM_PAGES 5
+#define LAST_PAGE_LENGTH 20
+#define REGION_SIZE (((NUM_PAGES - 1) * PAGE_SIZE) + LAST_PAGE_LENGTH)
+#define NUM_FRAMES 2
+#define MAX_TRANSFERS 32
+
+// FUNCTION DECLARATIONS
+int main(void);
+int touch(VM_pager* pager, uint32_t offset, bool forWriting, uint8_t value);
+bool readBacking(void* backing, uint32_t offset, uint8_t* buffer, uint16_t length);
+bool writeBacking(void* backing, uint32_t offset, const uint8_t* buffer, uint16_t length);
+uint8_t initialByte(uint32_t offset);
+
+
+typedef struct transfer {
+    bool write;
+    uint32_t offset;
+    uint16_t length;
+} transfer;
+
+static uint8_t storage[REGION_SIZE];
+static transfer transfers[MAX_TRANSFERS];
+static uint32_t numTransfers = 0;
+
+// What the accesses in main should make the pager do, in order
+static const transfer expectedTransfers[] = {
+        {false, 0 * PAGE_SIZE, PAGE_SIZE},        // Page 0 comes in
+        {false, 1 * PAGE_SIZE, PAGE_SIZE},        // Page 1 comes in, and is written to
+        {true, 1 * PAGE_SIZE, PAGE_SIZE},         // Page 0 was used since, so dirty page 1 goes out...
+        {false, 4 * PAGE_SIZE, LAST_PAGE_LENGTH}, // ... for the short page 4, which is written to
+        {false, 2 * PAGE_SIZE, PAGE_SIZE},        // Clean page 0 is reused for page 2 without being written
+        {true, 4 * PAGE_SIZE, LAST_PAGE_LENGTH},  // Page 4 goes out at its real length...
+        {false, 1 * PAGE_SIZE, PAGE_SIZE},        // ... for page 1 again, which is written to
+        {true, 1 * PAGE_SIZE, PAGE_SIZE}          // Pager_flush writes page 1, but not clean page 2
+};
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    for (uint32_t i = 0; i < REGION_SIZE; i++) {
+        storage[i] = initialByte(i);
+    }
+
+    VM_pager pager;
+    if (!Pager_init(&pager, BASE_ADDRESS, REGION_SIZE, PAGE_SIZE, NUM_FRAMES, storage, readBacking, writeBacking)) {
+        fprintf(stderr, "FAILED: couldn't set up the pager\n");
+        return 1;
+    }
+
+    int failures = 0;
+    failures += touch(&pager, 5, false, 0);
+    failures += touch(&pager, PAGE_SIZE + 10, true, 0xA1);
+    failures += touch(&pager, 6, false, 0);
+    failures += touch(&pager, (4 * PAGE_SIZE) + 3, false, 0);
+    failures += touch(&pager, REGION_SIZE - 1, true, 0xB2);
+    failures += touch(&pager, (2 * PAGE_SIZE) + 63, false, 0);
+    failures += touch(&pager, PAGE_SIZE + 10, false, 0);
+    failures += touch(&pager, PAGE_SIZE + 11, true, 0xC3);
+    if (Pager_getByte(&pager, BASE_ADDRESS + REGION_SIZE, false) != NULL) {
+        fprintf(stderr, "FAILED: the byte after the region was paged\n");
+        failures++;
+    }
+
+    if (!Pager_flush(&pager)) {
+        fprintf(stderr, "FAILED: couldn't flush the pager\n");
+        failures++;
+    }
+    if ((pager.hits != 3) || (pager.misses != 5) || (pager.writeBacks != 3)) {
+        fprintf(stderr, "FAILED: %llu hits, %llu misses and %llu write-backs, not 3, 5 and 3\n",
+                (unsigned long long) pager.hits, (unsigned long long) pager.misses,
+                (unsigned long long) pager.writeBacks);
+        failures++;
+    }
+
+    uint32_t numExpected = sizeof(expectedTransfers) / sizeof(expectedTransfers[0]);
+    for (uint32_t i = 0; (i < numTransfers) || (i < numExpected); i++) {
+        if ((i >= numTransfers) || (i >= numExpected) || (transfers[i].write != expectedTransfers[i].write) ||
+            (transfers[i].offset != expectedTransfers[i].offset) ||
+            (transfers[i].length != expectedTransfers[i].length)) {
+            fprintf(stderr, "FAILED: transfer %lu of %lu isn't the one expected of %lu\n", (unsigned long) i,
+                    (unsigned long) numTransfers, (unsigned long) numExpected);
+            failures++;
+            break;
+        }
+    }
+
+    for (uint32_t i = 0; i < REGION_SIZE; i++) {
+        uint8_t expected = initialByte(i);
+        if (i == PAGE_SIZE + 10) {
+            expected = 0xA1;
+        } else if (i == PAGE_SIZE + 11) {
+            expected = 0xC3;
+        } else if (i == REGION_SIZE - 1) {
+            expected = 0xB2;
+        }
+        if (storage[i] != expected) {
+            fprintf(stderr, "FAILED: byte %lu of the backing is 0x%02x, not 0x%02x\n", (unsigned long) i, storage[i],
+                    expected);
+            failures++;
+            break;
+        }
+    }
+
+    Pager_free(&pager);
+    if (pager.writeBacks != 3) {
+        fprintf(stderr, "FAILED: freeing the pager wrote back pages which were already clean\n");
+        failures++;
+    }
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Reads the byte at `offset` into the region, checking that it holds what was last written there, or writes `value`
+ * to it. Returns the number of failures.
+ * @param pager
+ * @param offset
+ * @param forWriting
+ * @param value
+ * @return
+ */
+int touch(VM_pager* pager, uint32_t offset, bool forWriting, uint8_t value)
+{
+    uint8_t* byte = Pager_getByte(pager, BASE_ADDRESS + offset, forWriting);
+    if (!byte) {
+        fprintf(stderr, "FAILED: couldn't page in byte %lu\n", (unsigned long) offset);
+        return 1;
+    }
+
+    if (forWriting) {
+        *byte = value;
+    } else if ((*byte != initialByte(offset)) && !((offset == PAGE_SIZE + 10) && (*byte == 0xA1))) {
+        fprintf(stderr, "FAILED: byte %lu reads as 0x%02x\n", (unsigned long) offset, *byte);
+        return 1;
+    }
+    return 0;
+}
+
+
+bool readBacking(void* backing, uint32_t offset, uint8_t* buffer, uint16_t length)
+{
+    if ((numTransfers == MAX_TRANSFERS) || ((uint32_t) offset + length > REGION_SIZE)) {
+        return false;
+    }
+    transfers[numTransfers++] = (transfer) {false, offset, length};
+    memcpy(buffer, &((uint8_t*) backing)[offset], length);
+    return true;
+}
+
+
+bool writeBacking(void* backing, uint32_t offset, const uint8_t* buffer, uint16_t length)
+{
+    if ((numTransfers == MAX_TRANSFERS) || ((uint32_t) offset + length > REGION_SIZE)) {
+        return false;
+    }
+    transfers[numTransfers++] = (transfer) {true, offset, length};
+    memcpy(&((uint8_t*) backing)[offset], buffer, length);
+    return true;
+}
+
+
+/**
+ * The backing storage starts out with a different value in each byte of a page, and in each page.
+ * @param offset
+ * @return
+ */
+uint8_t initialByte(uint32_t offset)
+{
+    return (uint8_t) ((offset * 7) + (offset / PAGE_SIZE));
+}
@@ -0,0 +1,80 @@
+/*
+ * Checks that the profiler follows calls which return with MOV pc, lr, as older compilers and hand-written assembly
+ * do. The PC mustn't keep the Thumb bit from LR, or the return address never matches the profiler's shadow stack and
+ * every call leaks a frame.
+ *
+ * The guest calls a function NUM_CALLS times and exits. It runs from the flat memory (see guest.h).
+*/
+
+#include "ARMTinyVM.h"
+#include "profiler.h"
+#include "guest.h"
+#include <stdio.h>
+#include <string.h>
+
+#define PROGRAM_START 0x100
+#define FUNCTION_START 0x110
+#define NUM_CALLS 100
+#define MAX_INSTRUCTIONS 100000
+
+// FUNCTION DECLARATIONS
+int main(void);
+
+
+static const uint16_t program[] = {
+        0x2400, // mov r4, #0
+        0x2564, // mov r5, #100 (NUM_CALLS)
+        0xF000, // loop: bl function
+        0xF804,
+        0x3D01, // sub r5, #1
+        0xD1FB, // bne loop
+        0x2701, // mov r7, #1
+        0xDF00, // swi #0
+        0x3401, // function: add r4, #1
+        0x46F7  // mov pc, lr
+};
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    VM_setTraceLevel(VM_TRACE_OFF);
+    memset(Guest_flatMemory, 0, sizeof(Guest_flatMemory));
+    Guest_storeHalfwords(PROGRAM_START, program, sizeof(program) / sizeof(program[0]));
+
+    VM_instance vm = Guest_newFlatVM(PROGRAM_START);
+    VM_profiler profiler;
+    if (!Profiler_init(&profiler, NULL, 0)) {
+        fprintf(stderr, "FAILED: couldn't start the profiler\n");
+        return 1;
+    }
+    Profiler_attach(&profiler, &vm);
+    VM_executeNInstructions(&vm, MAX_INSTRUCTIONS);
+    Profiler_detach(&profiler, &vm);
+
+    int failures = 0;
+    if (!vm.finished || (vm.registers[4] != NUM_CALLS)) {
+        fprintf(stderr, "FAILED: the guest made %lu calls, and %s\n", (unsigned long) vm.registers[4],
+                vm.finished ? "finished" : "didn't finish");
+        failures++;
+    }
+    if (profiler.depth != 1) {
+        fprintf(stderr, "FAILED: the profiler's stack is %lu frames deep at the end\n", (unsigned long) profiler.depth);
+        failures++;
+    }
+    uint64_t calls = 0;
+    for (uint32_t i = 0; i < profiler.numNodes; i++) {
+        if (profiler.nodes[i].function == FUNCTION_START) {
+            calls += profiler.nodes[i].calls;
+        }
+    }
+    if (calls != NUM_CALLS) {
+        fprintf(stderr, "FAILED: the profiler counted %llu calls, not %u\n", (unsigned long long) calls, NUM_CALLS);
+        failures++;
+    }
+
+    Profiler_free(&profiler);
+    return (failures == 0) ? 0 : 1;
+}
+
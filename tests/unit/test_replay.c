@@ -0,0 +1,143 @@
+/*
+ * Checks that a recording replays: the guest (see guest.h) is recorded while it reads its input and takes interrupts,
+ * then replayed with different input and no interrupts raised, and must still end up in exactly the same state,
+ * memory included, without the replay diverging.
+*/
+
+#include "replay.h"
+#include "host.h"
+#include "guest.h"
+#include <stdio.h>
+#include <string.h>
+
+#define ELF_FILENAME "test_replay.elf"
+#define INPUT_FILENAME "test_replay.txt"
+#define LOG_FILENAME "test_replay.log"
+#define RECORDED_INPUT "recorded input"
+#define REPLAYED_INPUT "other"
+#define INTERRUPT_EVERY 997
+#define NUM_INTERRUPTS 50
+#define MAX_INSTRUCTIONS 1000000
+
+// FUNCTION DECLARATIONS
+int main(void);
+bool record(void);
+int replay(void);
+
+
+static VM_instance recorded;
+static int32_t recordedExitCode;
+static uint8_t recordedData[GUEST_DATA_SIZE];
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    VM_setTraceLevel(VM_TRACE_OFF);
+
+    int failures = 0;
+    if (!Guest_writeElf(ELF_FILENAME) || !record()) {
+        fprintf(stderr, "FAILED: couldn't record the guest\n");
+        failures++;
+    } else {
+        failures += replay();
+    }
+
+    remove(ELF_FILENAME);
+    remove(INPUT_FILENAME);
+    remove(LOG_FILENAME);
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Runs the guest to the end while recording it, raising an interrupt every INTERRUPT_EVERY instructions, and keeps
+ * its final state.
+ * @return
+ */
+bool record(void)
+{
+    VM_host host;
+    if (!Guest_redirectInput(INPUT_FILENAME, RECORDED_INPUT) || !Host_loadElf(&host, ELF_FILENAME, false)) {
+        return false;
+    }
+    VM_interruptController controller;
+    VM_initInterruptController(&controller, GUEST_VECTOR_TABLE);
+    VM_instance vm = Host_newVM(&host);
+    vm.interrupts = &controller;
+
+    VM_recorder recorder;
+    if (!Recorder_start(&recorder, &host, &vm, LOG_FILENAME)) {
+        Host_free(&host);
+        return false;
+    }
+    for (uint32_t raised = 0; !vm.finished && (vm.instructionCount < MAX_INSTRUCTIONS); raised++) {
+        VM_executeNInstructions(&vm, INTERRUPT_EVERY);
+        if (raised < NUM_INTERRUPTS) {
+            VM_raiseInterrupt(&controller, 0);
+        }
+    }
+    bool success = Recorder_stop(&recorder) && vm.finished && Guest_readData(&host, recordedData);
+
+    recorded = vm;
+    recordedExitCode = host.exitCode;
+    Host_free(&host);
+    return success;
+}
+
+
+/**
+ * Replays the recording against different input, and compares the result with the recorded run. Returns the number
+ * of failures.
+ * @return
+ */
+int replay(void)
+{
+    VM_host host;
+    if (!Guest_redirectInput(INPUT_FILENAME, REPLAYED_INPUT) || !Host_loadElf(&host, ELF_FILENAME, false)) {
+        fprintf(stderr, "FAILED: couldn't load the guest to replay it\n");
+        return 1;
+    }
+    VM_instance vm = Host_newVM(&host);
+    VM_replayer replayer;
+    if (!Replay_start(&replayer, &host, &vm, LOG_FILENAME)) {
+        fprintf(stderr, "FAILED: couldn't read the recording\n");
+        Host_free(&host);
+        return 1;
+    }
+    while (!vm.finished && (vm.instructionCount < MAX_INSTRUCTIONS)) {
+        VM_executeNInstructions(&vm, MAX_INSTRUCTIONS);
+    }
+
+    int failures = 0;
+    uint8_t data[GUEST_DATA_SIZE];
+    if (replayer.diverged) {
+        fprintf(stderr, "FAILED: the replay diverged from the recording\n");
+        failures++;
+    }
+    if (!vm.finished || (vm.instructionCount != recorded.instructionCount) || (vm.cpsr != recorded.cpsr) ||
+        (memcmp(vm.registers, recorded.registers, sizeof(vm.registers)) != 0)) {
+        fprintf(stderr, "FAILED: the replay ended after %llu instructions at 0x%08lx, not %llu at 0x%08lx\n",
+                (unsigned long long) vm.instructionCount, (unsigned long) vm_program_counter(&vm),
+                (unsigned long long) recorded.instructionCount, (unsigned long) vm_program_counter(&recorded));
+        failures++;
+    }
+    if (host.exitCode != recordedExitCode) {
+        fprintf(stderr, "FAILED: the replay exited with %ld, not %ld\n", (long) host.exitCode,
+                (long) recordedExitCode);
+        failures++;
+    }
+    if (!Guest_readData(&host, data) || (memcmp(data, recordedData, GUEST_DATA_SIZE) != 0)) {
+        fprintf(stderr, "FAILED: the replay left different data in memory\n");
+        failures++;
+    }
+    if (recordedExitCode != (int32_t) strlen(RECORDED_INPUT)) {
+        fprintf(stderr, "FAILED: the recorded run read %ld bytes of its input\n", (long) recordedExitCode);
+        failures++;
+    }
+
+    Replay_free(&replayer);
+    Host_free(&host);
+    return failures;
+}
@@ -0,0 +1,191 @@
+/*
+ * Checks that reverse execution lands in exactly the state a fresh forward run had at the same point. The guest (see
+ * guest.h) is recorded while taking interrupts, keeping its state at a few instruction counts and the last time it
+ * entered its interrupt handler. The recording is then replayed to the end under a timeline, stepped back to each of
+ * those counts, and finally reverse-continued to the last interrupt, comparing registers and memory each time.
+*/
+
+#include "reverse.h"
+#include "replay.h"
+#include "host.h"
+#include "guest.h"
+#include <stdio.h>
+
+#define ELF_FILENAME "test_reverse.elf"
+#define INPUT_FILENAME "test_reverse.txt"
+#define LOG_FILENAME "test_reverse.log"
+#define INPUT "reverse"
+#define INTERRUPT_EVERY 4999
+#define NUM_INTERRUPTS 20
+#define NUM_TARGETS 5
+#define MAX_INSTRUCTIONS 1000000
+
+// FUNCTION DECLARATIONS
+int main(void);
+bool record(void);
+int reverse(void);
+void keepState(VM_instance* vm, uint32_t address, uint16_t instruction);
+bool atHandler(VM_instance* vm, void* context);
+
+
+// The points to step back to, latest first: each of these numbers of instructions from the start
+static const uint64_t targets[NUM_TARGETS] = {200001, 123457, 50000, 10001, 7};
+
+static VM_instance targetStates[NUM_TARGETS];
+static uint8_t targetData[NUM_TARGETS][GUEST_DATA_SIZE];
+static VM_instance lastInterrupt;
+static uint8_t lastInterruptData[GUEST_DATA_SIZE];
+static uint64_t finalCount;
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    VM_setTraceLevel(VM_TRACE_OFF);
+
+    int failures = 0;
+    if (!Guest_writeElf(ELF_FILENAME) || !record()) {
+        fprintf(stderr, "FAILED: couldn't record the guest\n");
+        failures++;
+    } else {
+        failures += reverse();
+    }
+
+    remove(ELF_FILENAME);
+    remove(INPUT_FILENAME);
+    remove(LOG_FILENAME);
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Runs the guest to the end while recording it, raising an interrupt every INTERRUPT_EVERY instructions, and keeps
+ * its state at each of the targets and after it last entered the interrupt handler.
+ * @return
+ */
+bool record(void)
+{
+    VM_host host;
+    if (!Guest_redirectInput(INPUT_FILENAME, INPUT) || !Host_loadElf(&host, ELF_FILENAME, false)) {
+        return false;
+    }
+    VM_interruptController controller;
+    VM_initInterruptController(&controller, GUEST_VECTOR_TABLE);
+    VM_instance vm = Host_newVM(&host);
+    vm.interrupts = &controller;
+    vm.instructionExecuted = keepState;
+
+    VM_recorder recorder;
+    if (!Recorder_start(&recorder, &host, &vm, LOG_FILENAME)) {
+        Host_free(&host);
+        return false;
+    }
+    for (uint32_t raised = 0; !vm.finished && (vm.instructionCount < MAX_INSTRUCTIONS); raised++) {
+        VM_executeNInstructions(&vm, INTERRUPT_EVERY);
+        if (raised < NUM_INTERRUPTS) {
+            VM_raiseInterrupt(&controller, 0);
+        }
+    }
+    bool success = Recorder_stop(&recorder) && vm.finished && (vm.instructionCount > targets[0]) &&
+                   (lastInterrupt.instructionCount > 0);
+    finalCount = vm.instructionCount;
+    Host_free(&host);
+    return success;
+}
+
+
+/**
+ * Replays the recording to the end under a timeline, then goes back to each of the points kept by record(), checking
+ * that the VM matches. Returns the number of failures.
+ * @return
+ */
+int reverse(void)
+{
+    VM_host host;
+    if (!Host_loadElf(&host, ELF_FILENAME, false)) {
+        fprintf(stderr, "FAILED: couldn't load the guest to replay it\n");
+        return 1;
+    }
+    VM_instance vm = Host_newVM(&host);
+    VM_replayer replayer;
+    if (!Replay_start(&replayer, &host, &vm, LOG_FILENAME)) {
+        fprintf(stderr, "FAILED: couldn't read the recording\n");
+        Host_free(&host);
+        return 1;
+    }
+    VM_timeline timeline;
+    if (!Reverse_init(&timeline, &host, &replayer, 0)) {
+        fprintf(stderr, "FAILED: couldn't set up the timeline\n");
+        Replay_free(&replayer);
+        Host_free(&host);
+        return 1;
+    }
+
+    int failures = 0;
+    Reverse_run(&timeline, &vm, MAX_INSTRUCTIONS);
+    if (!vm.finished || (vm.instructionCount != finalCount) || (timeline.numCheckpoints < 2)) {
+        fprintf(stderr, "FAILED: the replay ran for %llu instructions, not %llu, with %lu checkpoints\n",
+                (unsigned long long) vm.instructionCount, (unsigned long long) finalCount,
+                (unsigned long) timeline.numCheckpoints);
+        failures++;
+    }
+
+    for (uint32_t i = 0; (failures == 0) && (i < NUM_TARGETS); i++) {
+        if (!Reverse_step(&timeline, &vm, vm.instructionCount - targets[i]) ||
+            !Guest_sameState(&host, &vm, &(targetStates[i]), targetData[i])) {
+            fprintf(stderr, "FAILED: stepping back to instruction %llu ended at %llu, in a different state\n",
+                    (unsigned long long) targets[i], (unsigned long long) vm.instructionCount);
+            failures++;
+        }
+    }
+
+    // Run forwards to the end again, and then back to the last interrupt
+    Reverse_run(&timeline, &vm, MAX_INSTRUCTIONS);
+    if ((failures == 0) && (!Reverse_continue(&timeline, &vm, atHandler, NULL) ||
+                            !Guest_sameState(&host, &vm, &lastInterrupt, lastInterruptData))) {
+        fprintf(stderr, "FAILED: continuing back to the last interrupt ended at %llu, not %llu\n",
+                (unsigned long long) vm.instructionCount, (unsigned long long) lastInterrupt.instructionCount);
+        failures++;
+    }
+    if (replayer.diverged) {
+        fprintf(stderr, "FAILED: the replay diverged from the recording\n");
+        failures++;
+    }
+
+    Reverse_free(&timeline);
+    Replay_free(&replayer);
+    Host_free(&host);
+    return failures;
+}
+
+
+/**
+ * Called after every instruction of the recorded run, to keep its state at the targets and at the interrupt handler.
+ * @param vm
+ * @param address
+ * @param instruction
+ */
+void keepState(VM_instance* vm, uint32_t address, uint16_t instruction)
+{
+    (void) address;
+    (void) instruction;
+    VM_host* host = (VM_host*) vm->context;
+    for (uint32_t i = 0; i < NUM_TARGETS; i++) {
+        if (vm->instructionCount == targets[i]) {
+            targetStates[i] = *vm;
+            Guest_readData(host, targetData[i]);
+        }
+    }
+    if (atHandler(vm, NULL)) {
+        lastInterrupt = *vm;
+        Guest_readData(host, lastInterruptData);
+    }
+}
+
+
+bool atHandler(VM_instance* vm, void* context)
+{
+    (void) context;
+    return vm_program_counter(vm) == GUEST_HANDLER_ADDRESS;
+}
@@ -0,0 +1,252 @@
+/*
+ * Checks the scheduler on one worker thread, so that the order in which it runs quanta is fixed: tasks of the same
+ * priority take turns, a higher priority runs first and gets its weight's share, and a task whose software interrupt
+ * is pending is parked until Scheduler_wake, including when it's woken before the worker has parked it.
+ *
+ * The guests run from the flat memory (see guest.h). One counts down in a loop and exits; the other makes `swi #1`,
+ * which is left pending, and then exits.
+*/
+
+#include "scheduler.h"
+#include "guest.h"
+#include <stdio.h>
+#include <string.h>
+
+#define COUNT_START 0x100
+#define PARK_START 0x140
+#define SWI_PARK 1
+#define QUANTUM 10
+#define NUM_TASKS 3
+#define TIMEOUT_MS 2000
+
+// FUNCTION DECLARATIONS
+int main(void);
+int checkRoundRobin(void);
+int checkPriority(void);
+int checkParking(bool wakeWhileRunning);
+void addTask(VM_scheduler* scheduler, uint32_t index, uint32_t entryAddress, uint8_t priority);
+void recordFinish(VM_task* task);
+void recordFirst(VM_instance* vm, uint32_t address, uint16_t instruction);
+VM_swiResult softwareInterrupt(VM_instance* vm, uint8_t number);
+
+
+static const uint16_t countProgram[] = {
+        0x25C8, // mov r5, #200
+        0x3D01, // loop: sub r5, #1
+        0xD1FD, // bne loop
+        0x2701, // mov r7, #1
+        0xDF00  // swi #0
+};
+
+static const uint16_t parkProgram[] = {
+        0x2401, // mov r4, #1
+        0xDF01, // swi #1 (SWI_PARK)
+        0x2402, // mov r4, #2
+        0x2701, // mov r7, #1
+        0xDF00  // swi #0
+};
+
+static VM_instance vms[NUM_TASKS];
+static VM_task tasks[NUM_TASKS];
+static uint64_t quantaAtFirstFinish[NUM_TASKS];
+static VM_task* firstFinished;
+static VM_task* firstToRun;
+static bool wakeOnPark;
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    VM_setTraceLevel(VM_TRACE_OFF);
+    memset(Guest_flatMemory, 0, sizeof(Guest_flatMemory));
+    Guest_storeHalfwords(COUNT_START, countProgram, sizeof(countProgram) / sizeof(countProgram[0]));
+    Guest_storeHalfwords(PARK_START, parkProgram, sizeof(parkProgram) / sizeof(parkProgram[0]));
+
+    int failures = checkRoundRobin();
+    failures += checkPriority();
+    failures += checkParking(false);
+    failures += checkParking(true);
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Runs NUM_TASKS copies of the same program at the same priority. When the first of them finishes, the others must
+ * have had as many quanta, or (if they come after it in the queue) one fewer. Returns the number of failures.
+ * @return
+ */
+int checkRoundRobin(void)
+{
+    VM_scheduler scheduler;
+    if (!Scheduler_init(&scheduler, 1, QUANTUM)) {
+        fprintf(stderr, "FAILED: couldn't set up the scheduler\n");
+        return 1;
+    }
+    firstFinished = NULL;
+    for (uint32_t i = 0; i < NUM_TASKS; i++) {
+        addTask(&scheduler, i, COUNT_START, 1);
+    }
+    Scheduler_start(&scheduler);
+    Scheduler_waitUntilFinished(&scheduler);
+    Scheduler_free(&scheduler);
+
+    int failures = 0;
+    for (uint32_t i = 0; i < NUM_TASKS; i++) {
+        uint64_t quanta = quantaAtFirstFinish[i];
+        if (!vms[i].finished || (tasks[i].quantaRun != tasks[0].quantaRun) ||
+            (quanta > firstFinished->quantaRun) || (quanta + 1 < firstFinished->quantaRun)) {
+            fprintf(stderr, "FAILED: task %lu had run %llu quanta when the first finished after %llu\n",
+                    (unsigned long) i, (unsigned long long) quanta, (unsigned long long) firstFinished->quantaRun);
+            failures++;
+        }
+    }
+    return failures;
+}
+
+
+/**
+ * Adds a task at priority 2, then one at priority 0 with four times its weight, running the same program. The
+ * priority 0 task must run first, and by the time it finishes the other must have had about a quarter as many quanta:
+ * not starved, but no more than its share. The first round still uses the default weights, so allow for that.
+ * Returns the number of failures.
+ * @return
+ */
+int checkPriority(void)
+{
+    VM_scheduler scheduler;
+    if (!Scheduler_init(&scheduler, 1, QUANTUM)) {
+        fprintf(stderr, "FAILED: couldn't set up the scheduler\n");
+        return 1;
+    }
+    Scheduler_setWeight(&scheduler, 0, 4);
+    Scheduler_setWeight(&scheduler, 2, 1);
+    firstFinished = NULL;
+    firstToRun = NULL;
+    addTask(&scheduler, 0, COUNT_START, 2);
+    addTask(&scheduler, 1, COUNT_START, 0);
+    vms[0].instructionExecuted = recordFirst;
+    vms[1].instructionExecuted = recordFirst;
+    Scheduler_start(&scheduler);
+    Scheduler_waitUntilFinished(&scheduler);
+    Scheduler_free(&scheduler);
+
+    int failures = 0;
+    if ((firstToRun != &(tasks[1])) || (firstFinished != &(tasks[1]))) {
+        fprintf(stderr, "FAILED: the priority 0 task didn't run and finish first\n");
+        failures++;
+    }
+    uint64_t lowQuanta = quantaAtFirstFinish[0];
+    if ((lowQuanta == 0) || (lowQuanta * 4 > tasks[1].quantaRun + 8) || (lowQuanta * 4 + 8 < tasks[1].quantaRun)) {
+        fprintf(stderr, "FAILED: the priority 2 task had %llu quanta to the priority 0 task's %llu\n",
+                (unsigned long long) lowQuanta, (unsigned long long) tasks[1].quantaRun);
+        failures++;
+    }
+    return failures;
+}
+
+
+/**
+ * Runs the program which makes a pending software interrupt. Unless `wakeWhileRunning` is set, it must be parked, and
+ * stay parked until Scheduler_wake. If it is, the software interrupt wakes the task itself, while the worker still has
+ * it running, and it must carry on without being parked. Returns the number of failures.
+ * @param wakeWhileRunning
+ * @return
+ */
+int checkParking(bool wakeWhileRunning)
+{
+    const char* description = wakeWhileRunning ? "woken while running" : "woken once parked";
+    VM_scheduler scheduler;
+    if (!Scheduler_init(&scheduler, 1, QUANTUM)) {
+        fprintf(stderr, "FAILED: couldn't set up the scheduler\n");
+        return 1;
+    }
+    wakeOnPark = wakeWhileRunning;
+    addTask(&scheduler, 0, PARK_START, 1);
+    Scheduler_start(&scheduler);
+
+    int failures = 0;
+    if (!wakeWhileRunning) {
+        if (!Guest_waitForTask(&scheduler, &(tasks[0]), TASK_WAITING, TIMEOUT_MS)) {
+            fprintf(stderr, "FAILED: the task %s was never parked\n", description);
+            failures++;
+        }
+        uint64_t quanta = tasks[0].quantaRun;
+        Guest_sleep(20);
+        if ((tasks[0].quantaRun != quanta) || vms[0].finished || (vms[0].registers[4] != 1)) {
+            fprintf(stderr, "FAILED: the task %s ran while it was parked\n", description);
+            failures++;
+        }
+        Scheduler_wake(&(tasks[0]));
+    }
+    if (!Guest_waitForTask(&scheduler, &(tasks[0]), TASK_FINISHED, TIMEOUT_MS) || (vms[0].registers[4] != 2)) {
+        fprintf(stderr, "FAILED: the task %s didn't finish\n", description);
+        failures++;
+    }
+    Scheduler_free(&scheduler);
+    return failures;
+}
+
+
+/**
+ * Creates the VM for task `index`, starting at `entryAddress`, and adds it to the scheduler.
+ * @param scheduler
+ * @param index
+ * @param entryAddress
+ * @param priority
+ */
+void addTask(VM_scheduler* scheduler, uint32_t index, uint32_t entryAddress, uint8_t priority)
+{
+    vms[index] = Guest_newFlatVM(entryAddress);
+    vms[index].softwareInterrupt = softwareInterrupt;
+    vms[index].context = &(tasks[index]);
+    tasks[index].userData = NULL;
+    tasks[index].onFinished = recordFinish;
+    tasks[index].onResume = NULL;
+    Scheduler_add(scheduler, &(tasks[index]), &(vms[index]), priority);
+}
+
+
+/**
+ * Keeps how many quanta each task had had when the first of them finished. With one worker, nothing else is running.
+ * @param task
+ */
+void recordFinish(VM_task* task)
+{
+    if (!firstFinished) {
+        firstFinished = task;
+        for (uint32_t i = 0; i < NUM_TASKS; i++) {
+            quantaAtFirstFinish[i] = tasks[i].quantaRun;
+        }
+    }
+}
+
+
+void recordFirst(VM_instance* vm, uint32_t address, uint16_t instruction)
+{
+    (void) address;
+    (void) instruction;
+    if (!firstToRun) {
+        firstToRun = (VM_task*) vm->context;
+    }
+}
+
+
+/**
+ * `swi #1` is left pending, and with `wakeOnPark` set, the task is woken straight away, before the worker has seen it
+ * wait. Any other software interrupt finishes the guest.
+ * @param vm
+ * @param number
+ * @return
+ */
+VM_swiResult softwareInterrupt(VM_instance* vm, uint8_t number)
+{
+    if (number == SWI_PARK) {
+        if (wakeOnPark) {
+            Scheduler_wake((VM_task*) vm->context);
+        }
+        return SWI_PENDING;
+    }
+    vm->finished = true;
+    return SWI_COMPLETE;
+}
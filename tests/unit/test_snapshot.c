@@ -0,0 +1,132 @@
+/*
+ * Checks that snapshots round-trip: the guest (see guest.h) is saved part way through, and each VM restored from the
+ * snapshot must start in exactly the state it was saved in, memory included, and carry on to the same end as the
+ * original. The same goes for a warm-start snapshot taken when the guest first reaches its main loop.
+*/
+
+#include "snapshot.h"
+#include "host.h"
+#include "guest.h"
+#include <stdio.h>
+
+#define ELF_FILENAME "test_snapshot.elf"
+#define INPUT_FILENAME "test_snapshot.txt"
+#define SNAPSHOT_FILENAME "test_snapshot.snap"
+#define INPUT "snapshot"
+#define SAVE_AFTER 100000
+#define WARM_START_ADDRESS (GUEST_TEXT_ADDRESS + 0x10)
+#define NUM_RESTORES 2
+#define MAX_INSTRUCTIONS 1000000
+
+// FUNCTION DECLARATIONS
+int main(void);
+bool runOriginal(bool warmStart);
+int checkRestore(const char* description);
+
+
+static VM_instance saved;
+static uint8_t savedData[GUEST_DATA_SIZE];
+static int32_t savedExitCode;
+static VM_instance finished;
+static uint8_t finishedData[GUEST_DATA_SIZE];
+static int32_t finishedExitCode;
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    VM_setTraceLevel(VM_TRACE_OFF);
+    if (!Guest_writeElf(ELF_FILENAME)) {
+        fprintf(stderr, "FAILED: couldn't write the guest\n");
+        return 1;
+    }
+
+    int failures = 0;
+    if (runOriginal(false)) {
+        failures += checkRestore("part way through");
+    } else {
+        fprintf(stderr, "FAILED: couldn't save the snapshot\n");
+        failures++;
+    }
+    if (runOriginal(true)) {
+        failures += checkRestore("at the warm start");
+    } else {
+        fprintf(stderr, "FAILED: couldn't save the warm-start snapshot\n");
+        failures++;
+    }
+
+    remove(ELF_FILENAME);
+    remove(INPUT_FILENAME);
+    remove(SNAPSHOT_FILENAME);
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Runs the guest to the end, saving a snapshot either after SAVE_AFTER instructions or as a warm start at
+ * WARM_START_ADDRESS, and keeps its state at both points.
+ * @param warmStart
+ * @return
+ */
+bool runOriginal(bool warmStart)
+{
+    VM_host host;
+    if (!Guest_redirectInput(INPUT_FILENAME, INPUT) || !Host_loadElf(&host, ELF_FILENAME, false)) {
+        return false;
+    }
+    VM_instance vm = Host_newVM(&host);
+
+    bool success;
+    if (warmStart) {
+        success = Snapshot_saveWarmStart(&host, &vm, SNAPSHOT_FILENAME, WARM_START_ADDRESS, MAX_INSTRUCTIONS);
+    } else {
+        VM_executeNInstructions(&vm, SAVE_AFTER);
+        success = Snapshot_save(&host, &vm, SNAPSHOT_FILENAME);
+    }
+    saved = vm;
+    savedExitCode = host.exitCode;
+    success = success && Guest_readData(&host, savedData);
+
+    VM_executeNInstructions(&vm, MAX_INSTRUCTIONS);
+    finished = vm;
+    finishedExitCode = host.exitCode;
+    success = success && vm.finished && Guest_readData(&host, finishedData);
+    Host_free(&host);
+    return success;
+}
+
+
+/**
+ * Restores the snapshot NUM_RESTORES times, checking that each VM starts where the original was saved and finishes
+ * where it finished. Returns the number of failures.
+ * @param description
+ * @return
+ */
+int checkRestore(const char* description)
+{
+    int failures = 0;
+    for (uint32_t i = 0; i < NUM_RESTORES; i++) {
+        VM_host host;
+        VM_instance vm;
+        if (!Snapshot_restore(&host, &vm, SNAPSHOT_FILENAME, false)) {
+            fprintf(stderr, "FAILED: couldn't restore the snapshot taken %s\n", description);
+            Host_free(&host);
+            return failures + 1;
+        }
+
+        if (!Guest_sameState(&host, &vm, &saved, savedData) || (host.exitCode != savedExitCode)) {
+            fprintf(stderr, "FAILED: restore %lu of the snapshot taken %s isn't in the state it was saved in\n",
+                    (unsigned long) i, description);
+            failures++;
+        }
+        VM_executeNInstructions(&vm, MAX_INSTRUCTIONS);
+        if (!Guest_sameState(&host, &vm, &finished, finishedData) || (host.exitCode != finishedExitCode)) {
+            fprintf(stderr, "FAILED: restore %lu of the snapshot taken %s finished differently\n", (unsigned long) i,
+                    description);
+            failures++;
+        }
+        Host_free(&host);
+    }
+    return failures;
+}
@@ -0,0 +1,245 @@
+/*
+ * Checks the SysTick timer on the instruction clock, attached to a host: that its interrupt is raised at exactly the
+ * programmed count by the VM's deadline, with no callback per instruction, that each reload sets the deadline for the
+ * next expiry, and that `swi #1` moves the instruction count on to the next expiry so that the guest wakes to it.
+ *
+ * The guests run from the flat memory (see guest.h), using the host only for its software interrupts and deadline,
+ * and the test programs the timer's registers itself. One guest spins; the other waits with `swi #1`, then spins.
+ * Interrupt 0's handler returns straight away.
+*/
+
+#include "host.h"
+#include "systick.h"
+#include "guest.h"
+#include <stdio.h>
+#include <string.h>
+
+#define SPIN_START 0x100
+#define WAIT_START 0x120
+#define HANDLER_START 0x140
+#define VECTOR_TABLE 0x2000
+#define PERIOD 100
+#define NUM_PERIODS 3
+#define WAIT_PERIOD 1000
+#define MAX_EVENTS 8
+#define MAX_INSTRUCTIONS 100000
+
+// FUNCTION DECLARATIONS
+int main(void);
+int checkPeriodic(void);
+int checkWaitForInterrupt(void);
+VM_instance newVM(VM_host* host, VM_sysTick* sysTick, VM_interruptController* controller, uint32_t entryAddress);
+void writeRegister(VM_sysTick* sysTick, VM_instance* vm, uint32_t offset, uint32_t value);
+void recordDeadline(VM_instance* vm);
+void recordInterrupt(VM_instance* vm, uint8_t number);
+
+
+static const uint16_t spinProgram[] = {
+        0xE7FE  // loop: b loop
+};
+
+static const uint16_t waitProgram[] = {
+        0xDF01, // swi #1 (SWI_WAIT_FOR_INTERRUPT)
+        0xE7FE  // loop: b loop
+};
+
+static const uint16_t handler[] = {
+        0x4770  // bx lr
+};
+
+static uint64_t deadlines[MAX_EVENTS];
+static uint32_t numDeadlines;
+static uint64_t interrupts[MAX_EVENTS];
+static uint32_t numInterrupts;
+
+
+// FUNCTION DEFINITIONS
+
+int main(void)
+{
+    VM_setTraceLevel(VM_TRACE_OFF);
+    memset(Guest_flatMemory, 0, sizeof(Guest_flatMemory));
+    Guest_storeHalfwords(SPIN_START, spinProgram, sizeof(spinProgram) / sizeof(spinProgram[0]));
+    Guest_storeHalfwords(WAIT_START, waitProgram, sizeof(waitProgram) / sizeof(waitProgram[0]));
+    Guest_storeHalfwords(HANDLER_START, handler, sizeof(handler) / sizeof(handler[0]));
+    uint16_t vector[2] = {(HANDLER_START | 1) & 0xFFFF, (HANDLER_START | 1) >> 16};
+    Guest_storeHalfwords(VECTOR_TABLE, vector, 2);
+
+    int failures = checkPeriodic();
+    failures += checkWaitForInterrupt();
+    return (failures == 0) ? 0 : 1;
+}
+
+
+/**
+ * Starts the timer with a reload value of PERIOD - 1, so that it expires every PERIOD instructions, and runs the
+ * spinning guest for NUM_PERIODS periods and a bit, in runs which don't line up with them. The deadline must be
+ * reached exactly at each expiry and at no other time, with the interrupt taken straight after, and must be left set
+ * for the next expiry. Returns the number of failures.
+ * @return
+ */
+int checkPeriodic(void)
+{
+    VM_host host;
+    VM_sysTick sysTick;
+    VM_interruptController controller;
+    VM_instance vm = newVM(&host, &sysTick, &controller, SPIN_START);
+    writeRegister(&sysTick, &vm, SYSTICK_RVR, PERIOD - 1);
+    writeRegister(&sysTick, &vm, SYSTICK_CSR, SYSTICK_CSR_ENABLE | SYSTICK_CSR_TICKINT);
+
+    int failures = 0;
+    if (vm.deadline != PERIOD) {
+        fprintf(stderr, "FAILED: starting the timer set the deadline to %llu, not %u\n",
+                (unsigned long long) vm.deadline, PERIOD);
+        failures++;
+    }
+
+    while (!vm.finished && (vm.instructionCount < (NUM_PERIODS * PERIOD) + (PERIOD / 2))) {
+        VM_executeNInstructions(&vm, 37);
+    }
+
+    if ((numDeadlines != NUM_PERIODS) || (numInterrupts != NUM_PERIODS)) {
+        fprintf(stderr, "FAILED: the deadline was reached %lu times and the interrupt taken %lu times, not %u\n",
+                (unsigned long) numDeadlines, (unsigned long) numInterrupts, NUM_PERIODS);
+        return failures + 1;
+    }
+    for (uint32_t i = 0; i < NUM_PERIODS; i++) {
+        uint64_t expiry = (uint64_t) (i + 1) * PERIOD;
+        if (deadlines[i] != expiry) {
+            fprintf(stderr, "FAILED: expiry %lu reached the deadline at %llu, not %llu\n", (unsigned long) i,
+                    (unsigned long long) deadlines[i], (unsigned long long) expiry);
+            failures++;
+        }
+        if ((interrupts[i] < expiry) || (interrupts[i] > expiry + 1)) {
+            fprintf(stderr, "FAILED: expiry %lu's interrupt was taken at %llu, not straight after %llu\n",
+                    (unsigned long) i, (unsigned long long) interrupts[i], (unsigned long long) expiry);
+            failures++;
+        }
+    }
+
+    uint64_t nextExpiry = (NUM_PERIODS + 1) * PERIOD;
+    if ((sysTick.nextExpiry != nextExpiry) || (vm.deadline != nextExpiry)) {
+        fprintf(stderr, "FAILED: the reload left the expiry at %llu and the deadline at %llu, not %llu\n",
+                (unsigned long long) sysTick.nextExpiry, (unsigned long long) vm.deadline,
+                (unsigned long long) nextExpiry);
+        failures++;
+    }
+    if (!(SysTick_readByte(&sysTick, &vm, SYSTICK_CSR + 2) & (SYSTICK_CSR_COUNTFLAG >> 16))) {
+        fprintf(stderr, "FAILED: COUNTFLAG wasn't set by the expiries\n");
+        failures++;
+    }
+    if (vm.instructionExecuted) {
+        fprintf(stderr, "FAILED: the timer needed a callback on every instruction\n");
+        failures++;
+    }
+    Host_free(&host);
+    return failures;
+}
+
+
+/**
+ * Starts the timer with a period of WAIT_PERIOD and runs the guest which waits with `swi #1`. The instruction count
+ * must move on to the expiry rather than the guest spinning until it, and the interrupt must then be taken, once.
+ * Returns the number of failures.
+ * @return
+ */
+int checkWaitForInterrupt(void)
+{
+    VM_host host;
+    VM_sysTick sysTick;
+    VM_interruptController controller;
+    VM_instance vm = newVM(&host, &sysTick, &controller, WAIT_START);
+    writeRegister(&sysTick, &vm, SYSTICK_RVR, WAIT_PERIOD - 1);
+    writeRegister(&sysTick, &vm, SYSTICK_CSR, SYSTICK_CSR_ENABLE | SYSTICK_CSR_TICKINT);
+
+    uint32_t executed = 0;
+    uint32_t calls = 0;
+    while ((numInterrupts == 0) && (calls < MAX_INSTRUCTIONS)) {
+        executed += VM_executeNInstructions(&vm, 1);
+        calls++;
+    }
+
+    int failures = 0;
+    if ((numDeadlines != 1) || (deadlines[0] != WAIT_PERIOD) || (numInterrupts != 1) ||
+        (interrupts[0] > WAIT_PERIOD + 1)) {
+        fprintf(stderr, "FAILED: waiting reached the deadline %lu times and took the interrupt %lu times, not once "
+                "at %u\n", (unsigned long) numDeadlines, (unsigned long) numInterrupts, WAIT_PERIOD);
+        failures++;
+    }
+    if (calls > 4) {
+        fprintf(stderr, "FAILED: the guest ran %lu instructions in %lu steps waiting for the interrupt\n",
+                (unsigned long) executed, (unsigned long) calls);
+        failures++;
+    }
+    if (vm.finished) {
+        fprintf(stderr, "FAILED: waiting for the interrupt finished the guest\n");
+        failures++;
+    }
+    Host_free(&host);
+    return failures;
+}
+
+
+/**
+ * Creates a VM running from the flat memory at `entryAddress`, which uses `host` for its software interrupts and
+ * deadline, with `sysTick` attached on the instruction clock and raising interrupt 0 on `controller`.
+ * @param host
+ * @param sysTick
+ * @param controller
+ * @param entryAddress
+ * @return
+ */
+VM_instance newVM(VM_host* host, VM_sysTick* sysTick, VM_interruptController* controller, uint32_t entryAddress)
+{
+    Host_initEmpty(host, false);
+    SysTick_init(sysTick, SYSTICK_CLOCK_INSTRUCTIONS, 0, 0);
+    Host_attachSysTick(host, sysTick);
+    VM_initInterruptController(controller, VECTOR_TABLE);
+    controller->interruptTaken = recordInterrupt;
+
+    VM_instance vm = Guest_newFlatVM(entryAddress);
+    vm.context = host;
+    vm.softwareInterrupt = Host_softwareInterrupt;
+    vm.deadlineReached = recordDeadline;
+    vm.interrupts = controller;
+    numDeadlines = 0;
+    numInterrupts = 0;
+    return vm;
+}
+
+
+void writeRegister(VM_sysTick* sysTick, VM_instance* vm, uint32_t offset, uint32_t value)
+{
+    for (uint32_t i = 0; i < 4; i++) {
+        SysTick_writeByte(sysTick, vm, offset + i, (uint8_t) (value >> (8 * i)));
+    }
+}
+
+
+/**
+ * Keeps the instruction count each time the deadline is reached, before letting the host update the timer. A timer
+ * which left the deadline where it was would stop the VM getting any further, so after too many the guest is finished
+ * and the timer left alone.
+ * @param vm
+ */
+void recordDeadline(VM_instance* vm)
+{
+    if (numDeadlines < MAX_EVENTS) {
+        deadlines[numDeadlines] = vm->instructionCount;
+    }
+    if (++numDeadlines > MAX_INSTRUCTIONS) {
+        vm->finished = true;
+        return;
+    }
+    Host_deadlineReached(vm);
+}
+
+
+void recordInterrupt(VM_instance* vm, uint8_t number)
+{
+    (void) number;
+    if (numInterrupts < MAX_EVENTS) {
+        interrupts[numInterrupts] = vm->instructionCount;
+    }
+    numInterrupts++;
+}
@@ -0,0 +1,29 @@
+# Checks that ARMTinyVM_tracedump reproduces the VM's own instruction trace: both are made from the same run of ELF,
+# and must list the same instructions at the same addresses, in the same order. Run as
+#   cmake -DVM=ARMTinyVM -DTRACEDUMP=ARMTinyVM_tracedump -DELF=guest.elf -P tracedump.cmake
+# The ELF is also the guest's standard input, so that it never waits for a terminal.
+
+set(binaryTrace "${ELF}.bin")
+execute_process(COMMAND "${VM}" --trace instructions --binary-trace "${binaryTrace}" "${ELF}"
+                INPUT_FILE "${ELF}" OUTPUT_VARIABLE vmTrace RESULT_VARIABLE result)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "${VM} failed: ${result}")
+endif ()
+execute_process(COMMAND "${TRACEDUMP}" "${binaryTrace}" OUTPUT_VARIABLE dumpedTrace RESULT_VARIABLE result)
+file(REMOVE "${binaryTrace}")
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "${TRACEDUMP} failed: ${result}")
+endif ()
+
+# Each instruction starts "opcode@address : Iformat : ", after which the two describe its results a little differently
+set(instructionPattern "0x[0-9a-f]+@0x[0-9a-f]+ : I[0-9]+ : ")
+string(REGEX MATCHALL "${instructionPattern}" vmInstructions "${vmTrace}")
+string(REGEX MATCHALL "${instructionPattern}" dumpedInstructions "${dumpedTrace}")
+list(LENGTH vmInstructions numInstructions)
+if (numInstructions EQUAL 0)
+    message(FATAL_ERROR "The VM didn't trace any instructions")
+elseif (NOT vmInstructions STREQUAL dumpedInstructions)
+    list(LENGTH dumpedInstructions numDumped)
+    message(FATAL_ERROR "The VM traced ${numInstructions} instructions, but tracedump printed ${numDumped} others")
+endif ()
+message(STATUS "tracedump matched all ${numInstructions} instructions")
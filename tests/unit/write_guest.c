@@ -0,0 +1,27 @@
+/*
+ * Writes the unit tests' guest program (see guest.h) to an ELF file, for the tests which run it through the tools.
+ *
+ * Usage: write_guest file.elf
+*/
+
+#include "guest.h"
+#include <stdio.h>
+
+// FUNCTION DECLARATIONS
+int main(int argc, char* argv[]);
+
+
+// FUNCTION DEFINITIONS
+
+int main(int argc, char* argv[])
+{
+    if (argc != 2) {
+        fprintf(stderr, "Usage: %s file.elf\n", argv[0]);
+        return 1;
+    }
+    if (!Guest_writeElf(argv[1])) {
+        fprintf(stderr, "Unable to write %s\n", argv[1]);
+        return 1;
+    }
+    return 0;
+}